@@ -21,6 +21,7 @@
 #include <sys/socket.h>
 #endif // __OpenBSD__
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <net/if.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -28,13 +29,20 @@
 #include <resolv.h>
 #include <stdio.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <time.h>
 #include <signal.h>
 #include <regex.h>
 #include <pthread.h>
+#ifdef HAVE_MALLOC_TRIM
+#include <malloc.h>
+#endif // HAVE_MALLOC_TRIM
 
 #include <glib.h>
+#include <glib-unix.h>
 
 #ifdef HAVE_AVAHI
 #include <avahi-client/client.h>
@@ -53,6 +61,7 @@
 #include <ppd/ppd.h>
 
 #include "cups-notifier.h"
+#include "cups-browsed-dbus.h"
 
 // Attribute to mark a CUPS queue as created by us
 #define CUPS_BROWSED_MARK "cups-browsed"
@@ -68,10 +77,17 @@
 #define TIMEOUT_RETRY       10
 #define TIMEOUT_REMOVE      -1
 #define TIMEOUT_CHECK_LIST   2
+#define TIMEOUT_ASSIGNMENT 300
+#define TIMEOUT_REEVALUATE  30
+#define TIMEOUT_TASK       300 // Background tasks give up after this
+#define TIMEOUT_SHUTDOWN     2 // Wait for background tasks on shutdown
+#define TIMEOUT_PPD_GENERATION 60 // PPD generator process gets killed
 
 #define CUPS_DBUS_NAME "org.cups.cupsd.Notifier"
 #define CUPS_DBUS_PATH "/org/cups/cupsd/Notifier"
 #define CUPS_DBUS_INTERFACE "org.cups.cupsd.Notifier"
+#define CUPS_BROWSED_DBUS_NAME "org.cups.cupsbrowsed"
+#define CUPS_BROWSED_DBUS_PATH "/org/cups/cupsbrowsed"
 
 #define DEFAULT_CACHEDIR "/var/cache/cups"
 #define DEFAULT_LOGDIR "/var/log/cups"
@@ -80,6 +96,12 @@
 #define SAVE_OPTIONS_FILE "/cups-browsed-options-%s"
 #define DEBUG_LOG_FILE "/cups-browsed_log"
 #define DEBUG_LOG_FILE_2 "/cups-browsed_previous_logs"
+#define FLIGHT_RECORDER_FILE "/cups-browsed_flight_recorder"
+#define FLIGHT_RECORDER_SIZE 1024
+#define HTTP_POOL_SIZE 16
+#define HTTP_POOL_IDLE_TIMEOUT 30
+#define IDLE_CHECK_INTERVAL 30
+#define STARTUP_MAX_PHASES 16
 
 // Status of remote printer
 typedef enum printer_status_e
@@ -100,6 +122,15 @@ typedef struct ipp_discovery_s
   int family;
 } ipp_discovery_t;
 
+// Another DNS-SD service under which a printer got discovered, found to be
+// the same device through its UUID
+typedef struct printer_alias_s
+{
+  char *service_name;
+  char *type;
+  char *domain;
+} printer_alias_t;
+
 // Data structure for remote printers
 typedef struct remote_printer_s
 {
@@ -134,6 +165,23 @@ typedef struct remote_printer_s
   int timeouted;
   pthread_rwlock_t lock;
   int called;
+  int reevaluate;
+  printer_status_t recorded_status; // Last status in flight recorder
+  int ppd_options_time; // printer-config-change-time of the queue when
+                        // the PPD option settings were last recorded
+  int path_lost; // Network path in use went away, switch to another one
+  char *uuid; // UUID of the device, key in printer_uuids
+  int prattrs_full; // prattrs has all attributes, not only the ones
+                    // fetched for classification at discovery
+  size_t prattrs_size; // Encoded size of prattrs, for AttributesMemoryLimit
+  time_t prattrs_used; // Last time prattrs got used
+  int prattrs_evicted; // prattrs dropped to save memory, fetch them again
+  ipp_t *capabilities; // Capabilities from the last full set of
+                       // attributes, reported via D-Bus, also when
+                       // prattrs got dropped
+  cups_array_t *aliases; // Other services of the same device
+  gint64 rtt; // Smoothed round trip time of state queries in usec,
+              // 0: not measured yet
 } remote_printer_t;
 
 // Data structure for network interfaces
@@ -143,6 +191,15 @@ typedef struct netif_s
   http_addr_t broadcast;
 } netif_t;
 
+// Data structure for the interfaces and address families with which
+// we are connected to networks, to find out which ones go away on a
+// network change
+typedef struct netif_path_s
+{
+  char name[IF_NAMESIZE];
+  int family;
+} netif_path_t;
+
 // Data structures for browse allow/deny rules
 typedef enum browse_order_e
 {
@@ -209,6 +266,9 @@ typedef struct browsepoll_s
   // if anything has changed, and if not we know these printers are
   // still there.
   GList *printers; // of browsepoll_printer_t
+
+  // Did the first poll of this server complete?
+  gboolean polled;
 } browsepoll_t;
 
 // Data structure for destination list obtained with cupsEnumDests()
@@ -270,6 +330,21 @@ typedef enum load_balancing_type_e
   QUEUE_ON_SERVERS
 } load_balancing_type_t;
 
+// Which members of a cluster we try first when looking for a destination
+typedef enum member_preference_e
+{
+  MEMBER_PREFER_NONE,    // Cluster order only
+  MEMBER_PREFER_NEAREST  // Directly attached networks, then lowest RTT
+} member_preference_t;
+
+// How we choose between members which are equally near
+typedef enum member_tie_break_e
+{
+  MEMBER_TIE_ROUND_ROBIN,
+  MEMBER_TIE_ORDER,
+  MEMBER_TIE_RANDOM
+} member_tie_break_t;
+
 // Ways how inactivity for auto-shutdown is defined
 typedef enum autoshutdown_inactivity_type_e
 {
@@ -308,6 +383,33 @@ typedef struct media_col_s
   char *media_source,*media_type;
 } media_col_t;
 
+// media-col-database entry while merging the ones of the cluster members,
+// with the PPD names of source and type inline, empty if not supplied
+typedef struct media_col_key_s
+{
+  int x,y,top_margin,bottom_margin,left_margin,right_margin;
+  char media_source[32],media_type[32];
+} media_col_key_t;
+
+// job-presets-supported entry while merging the ones of the cluster
+// members
+typedef struct job_preset_key_s
+{
+  const char *name;
+  ipp_t      *preset;
+  size_t     order;
+} job_preset_key_t;
+
+// Flat vector of fixed-size values, for collecting the values of an
+// attribute of all cluster members and sorting and uniquing them in one go
+typedef struct merge_vector_s
+{
+  char   *values;       // Values, buffer or allocated
+  size_t size,          // Size of one value
+         count;         // Number of values
+  char   buffer[8192];  // Storage for the values of smaller clusters
+} merge_vector_t;
+
 typedef struct default_str_attribute_s
 {
   char* value;
@@ -353,12 +455,152 @@ typedef struct create_args_s
 {
   char* queue;
   char* uri;
+  char* host;
 } create_args_t;
 
+// Time source, timers and CUPS queue operations of the queue scheduler
+// (update_cups_queues(), recheck_timer() and the printer timeouts). The
+// simulation in test/sim-queue-scheduler.c replaces them to run the
+// scheduler on a virtual clock.
+typedef struct scheduler_s
+{
+  time_t (*now)(void);
+  guint (*timeout_add_seconds)(guint interval, GSourceFunc func,
+			       gpointer data);
+  gboolean (*source_remove)(guint id);
+  int (*create_queue)(create_args_t *arg); // Takes over arg on success
+  int (*remove_queue)(remote_printer_t *p); // 0: Retry at p->timeout
+} scheduler_t;
+
+// Open connection to a remote host, kept for reuse
+typedef struct http_pool_entry_s
+{
+  char host[HTTP_MAX_HOST];
+  int port;
+  http_encryption_t encryption;
+  http_t *http;
+  int in_use;
+  time_t last_used;
+} http_pool_entry_t;
+
+// Background work (queue creation, DNS-SD service resolving) running in
+// a detached thread. Registered, so that it can get cancelled and we can
+// wait for it on shutdown
+typedef struct task_s
+{
+  pthread_t id;
+  char *name;
+  void (*func)(void *);
+  void *arg;
+  int timeout; // Time limit in seconds, 0: none
+  time_t deadline; // Cancelled when checked after this time, 0: never
+  int cancelled;
+} task_t;
+
+// Helper process generating PPD files, so that several PPDs can get
+// generated in parallel and a generation which hangs or crashes does
+// not take the daemon with it
+typedef struct ppd_worker_s
+{
+  pid_t pid; // 0: not running
+  int fd;    // Our end of the socket pair to the process
+  int busy;
+} ppd_worker_t;
+
+// Step of the daemon's startup, timed to see what delays the creation
+// of the first queues
+typedef struct startup_phase_s
+{
+  const char *name;
+  gint64 start, end; // usec since startup, end 0 while running
+  int background;    // Runs in parallel to the main thread
+} startup_phase_t;
+
+// Requests in progress to a remote host and its token bucket for
+// limiting the request rate
+typedef struct host_load_s
+{
+  char *host;
+  int active;
+  double tokens;
+  gint64 last_refill;
+} host_load_t;
+
+// Job of a cluster queue which we have sent to one of the cluster's
+// members but which did not finish yet
+typedef struct job_assignment_s
+{
+  char *queue_name;    // Local queue (cluster) of the job
+  int  job_id;
+  char *dest_uri;      // URI of the member to which the job got assigned
+  time_t assigned;
+} job_assignment_t;
+
+// Settings from cups-browsed.conf which can be changed by re-reading the
+// configuration file (SIGHUP) without restarting cups-browsed
+typedef struct config_s
+{
+  // Settings which decide which printers we make available and how we
+  // name them
+  cups_array_t *browseallow;
+  gboolean browseallow_all;
+  gboolean browsedeny_all;
+  browse_order_t browse_order;
+  cups_array_t *browsefilter;
+  cups_array_t *clusters;
+  int AutoClustering;
+  unsigned int DNSSDBasedDeviceURIs;
+  unsigned int HttpCompression;
+  ip_based_uris_t IPBasedDeviceURIs;
+  local_queue_naming_t LocalQueueNamingRemoteCUPS;
+  local_queue_naming_t LocalQueueNamingIPPPrinter;
+  unsigned int OnlyUnsupportedByCUPS;
+  unsigned int CreateRemoteRawPrinterQueues;
+  unsigned int CreateRemoteCUPSPrinterQueues;
+  create_ipp_printer_queues_t CreateIPPPrinterQueues;
+
+  // Settings which do not influence the set of printers
+  unsigned int BrowseInterval;
+  unsigned int BrowseJitter;
+  unsigned int BrowseTimeout;
+  unsigned int HttpLocalTimeout;
+  unsigned int HttpRemoteTimeout;
+  unsigned int HttpMaxRetries;
+  unsigned int HttpMaxRequestsPerHost;
+  unsigned int HttpRequestRatePerHost;
+  unsigned int DebugLogFileSize;
+  int debug_stderr;
+  int debug_logfile;
+  unsigned int debug_categories;
+  int debug_trace_level;
+  unsigned int AttributesMemoryLimit;
+  unsigned int IdleMemoryTrimTimeout;
+  int PPDGeneratorWorkers;
+  unsigned int UseCUPSGeneratedPPDs;
+  unsigned int NewBrowsePollQueuesShared;
+  unsigned int AllowResharingRemoteCUPSPrinters;
+  unsigned int KeepGeneratedQueuesOnShutdown;
+  int NewIPPPrinterQueuesShared;
+  load_balancing_type_t LoadBalancingType;
+  member_preference_t ClusterMemberPreference;
+  member_tie_break_t ClusterMemberTieBreak;
+  int update_cups_queues_max_per_call;
+  int pause_between_cups_queue_updates;
+  unsigned int notify_lease_duration;
+  int FrequentNetifUpdate;
+  browse_options_update_t method;
+  int autoshutdown_timeout;
+  autoshutdown_inactivity_type_t autoshutdown_on;
+} config_t;
+
 cups_array_t *remote_printers;
+static GHashTable *printer_uuids; // UUID -> remote_printer_t
 static char *alt_config_file = NULL;
 static cups_array_t *command_line_config;
 static cups_array_t *netifs;
+static cups_array_t *netif_paths = NULL;
+static cups_array_t *netif_paths_lost = NULL;
+static guint netif_paths_lost_sourceid = 0;
 static cups_array_t *local_hostnames;
 static cups_array_t *browseallow;
 static gboolean browseallow_all = FALSE;
@@ -372,27 +614,59 @@ static browsepoll_t *local_printers_context = NULL;
 static gboolean inhibit_local_printers_update = FALSE;
 
 static CupsNotifier *cups_notifier = NULL;
+static CupsBrowsedPrinters *dbus_printers = NULL;
+static guint dbus_owner_id = 0;
 
 static GMainLoop *gmainloop = NULL;
 #ifdef HAVE_AVAHI
 static AvahiGLibPoll *glib_poll = NULL;
 static AvahiClient *client = NULL;
-static AvahiServiceBrowser *sb1 = NULL, *sb2 = NULL;
+// Data structure for DNS-SD service browsers, one per service type, and
+// per interface and address family if browsing is restricted to some
+// of them (BrowseInterfaces, BrowseAddressFamilies)
+typedef struct avahi_browser_s
+{
+  AvahiServiceBrowser *sb;
+  char *interface; // NULL: All interfaces
+  AvahiIfIndex ifindex;
+  AvahiProtocol protocol;
+  const char *type;
+  int pending; // Did not report ALL_FOR_NOW yet
+} avahi_browser_t;
+static cups_array_t *browsers = NULL;
 static int avahi_present = 0;
+// Number of browsers which did not report ALL_FOR_NOW yet
+static unsigned int browsers_pending = 0;
+static int browsers_started = 0;
+// Number of DNS-SD services currently being resolved
+static int resolves_pending = 0;
 #endif // HAVE_AVAHI
+// Are the unconfirmed printers from the previous session already
+// treated by check_unconfirmed_printers()?
+static int unconfirmed_checked = 0;
 static guint queues_timer_id = 0;
 static int browsesocket = -1;
 
 #define BROWSE_DNSSD (1<<0)
 static unsigned int BrowseLocalProtocols = 0;
 static unsigned int BrowseRemoteProtocols = BROWSE_DNSSD;
+#define BROWSE_IPV4 (1<<0)
+#define BROWSE_IPV6 (1<<1)
+static unsigned int BrowseAddressFamilies = BROWSE_IPV4 | BROWSE_IPV6;
+static cups_array_t *BrowseInterfaces = NULL; // NULL: All interfaces
 static unsigned int BrowseInterval = 60;
+static unsigned int BrowseJitter = 10;
+static GRand *jitter_rand = NULL;
 static unsigned int BrowseTimeout = 300;
 static uint16_t BrowsePort = 631;
 static browsepoll_t **BrowsePoll = NULL;
 static unsigned int NewBrowsePollQueuesShared = 0;
 static unsigned int AllowResharingRemoteCUPSPrinters = 0;
 static unsigned int DebugLogFileSize = 300;
+static unsigned int AttributesMemoryLimit = 0;
+static unsigned int IdleMemoryTrimTimeout = 0;
+static time_t last_activity = 0;
+static int idle_mode = 0;
 static size_t NumBrowsePoll = 0;
 static guint update_netifs_sourceid = 0;
 static char local_server_str[1024];
@@ -402,7 +676,33 @@ static int update_count = 0;
 static unsigned int HttpLocalTimeout = 5;
 static unsigned int HttpRemoteTimeout = 10;
 static unsigned int HttpMaxRetries = 5;
+static unsigned int HttpMaxRequestsPerHost = 4;
+static unsigned int HttpRequestRatePerHost = 10;
+static cups_array_t *host_loads = NULL;
+static cups_array_t *http_pool = NULL;
+static pthread_mutex_t http_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t host_load_lock = PTHREAD_MUTEX_INITIALIZER;
+static cups_array_t *tasks = NULL;
+static pthread_mutex_t tasks_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tasks_cond = PTHREAD_COND_INITIALIZER;
+static int tasks_stopped = 0;
+static int PPDGeneratorWorkers = -1; // -1: Number of CPUs
+static ppd_worker_t *ppd_workers = NULL;
+static int num_ppd_workers = 0;
+static pthread_mutex_t ppd_workers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ppd_workers_cond = PTHREAD_COND_INITIALIZER;
+static char ppd_worker_program[1024] = "";
+static gint64 startup_time = 0;
+static gint64 first_queue_time = 0;
+static startup_phase_t startup_phases[STARTUP_MAX_PHASES];
+static int num_startup_phases = 0;
+static pthread_mutex_t startup_lock = PTHREAD_MUTEX_INITIALIZER;
 static unsigned int DNSSDBasedDeviceURIs = 1;
+static unsigned int HttpCompression = 1;
+static size_t http_responses = 0;
+static size_t http_responses_compressed = 0;
+static size_t http_bytes_received = 0;
+static size_t http_bytes_decoded = 0;
 static ip_based_uris_t IPBasedDeviceURIs = IP_BASED_URIS_NO;
 #ifdef NAMING_MAKE_MODEL
 static local_queue_naming_t LocalQueueNamingRemoteCUPS =
@@ -441,7 +741,10 @@ static unsigned int KeepGeneratedQueuesOnShutdown = 0;
 static int NewIPPPrinterQueuesShared = 0;
 static int AutoClustering = 1;
 static cups_array_t *clusters;
+static cups_array_t *job_assignments = NULL;
 static load_balancing_type_t LoadBalancingType = QUEUE_ON_CLIENT;
+static member_preference_t ClusterMemberPreference = MEMBER_PREFER_NONE;
+static member_tie_break_t ClusterMemberTieBreak = MEMBER_TIE_ROUND_ROBIN;
 static char *DefaultOptions = NULL;
 static int update_cups_queues_max_per_call = 10;
 static int pause_between_cups_queue_updates = 1;
@@ -462,11 +765,58 @@ static int FrequentNetifUpdate = 1;
 static int FrequentNetifUpdate = 0;
 #endif
 static browse_options_update_t method = NONE;
+static config_t default_config;
+static int reevaluating_config = 0;
+static guint reevaluate_timer_id = 0;
 
 static int debug_stderr = 0;
 static int debug_logfile = 0;
 static FILE *lfp = NULL;
 
+// Categories of debug log messages, selected with DebugLogCategories.
+// Each section of this file sets DEBUG_CATEGORY to the category of its
+// messages.
+#define DEBUG_GENERAL   (1<<0)
+#define DEBUG_DISCOVERY (1<<1)
+#define DEBUG_QUEUE     (1<<2)
+#define DEBUG_CLUSTER   (1<<3)
+#define DEBUG_DISPATCH  (1<<4)
+#define DEBUG_POLL      (1<<5)
+#define DEBUG_ALL       (DEBUG_GENERAL | DEBUG_DISCOVERY | DEBUG_QUEUE | \
+			 DEBUG_CLUSTER | DEBUG_DISPATCH | DEBUG_POLL)
+#define DEBUG_CATEGORY  DEBUG_GENERAL
+static unsigned int debug_categories = DEBUG_ALL;
+// Log messages of the trace level (DebugLogLevel Trace)?
+static int debug_trace_level = 1;
+
+// Check whether logging is on before doing anything else, so that with
+// logging turned off no lock is taken and the arguments of the calls
+// are not evaluated. Trace messages (very verbose, from loops over all
+// printers or attributes) can be removed completely at compile time
+// (configure --disable-debug-trace).
+#define debug_enabled(category)				\
+  ((debug_stderr || debug_logfile) && (debug_categories & (category)))
+#define debug_printf(...)				\
+  do							\
+  {							\
+    if (debug_enabled(DEBUG_CATEGORY))			\
+      debug_log_printf(__VA_ARGS__);			\
+  }							\
+  while (0)
+#ifdef DEBUG_TRACE
+#define debug_trace_enabled(category)			\
+  (debug_trace_level && debug_enabled(category))
+#else
+#define debug_trace_enabled(category) 0
+#endif // DEBUG_TRACE
+#define debug_trace(...)				\
+  do							\
+  {							\
+    if (debug_trace_enabled(DEBUG_CATEGORY))		\
+      debug_log_printf(__VA_ARGS__);			\
+  }							\
+  while (0)
+
 static char cachedir[1024];
 static char logdir[1024];
 static char local_default_printer_file[2048];
@@ -509,6 +859,25 @@ pthread_rwlock_t update_lock = PTHREAD_RWLOCK_INITIALIZER;
 
 
 static void recheck_timer (void);
+static gboolean recheck_timer_idle (gpointer unused);
+static time_t scheduler_time (void);
+static int create_queue_task (create_args_t *arg);
+static int remove_cups_queue (remote_printer_t *p);
+static scheduler_t scheduler =
+{
+  scheduler_time,
+  g_timeout_add_seconds,
+  g_source_remove,
+  create_queue_task,
+  remove_cups_queue
+};
+static gboolean reconcile_lost_netifs (gpointer unused);
+static void ppd_workers_abort (void);
+static void startup_first_queue (const char *queue_name);
+#ifdef HAVE_AVAHI
+static void avahi_browser_free_all (void);
+static gboolean avahi_browser_update (gpointer unused);
+#endif // HAVE_AVAHI
 static void browse_poll_create_subscription (browsepoll_t *context,
 					     http_t *http);
 static gboolean browse_poll_get_notifications (browsepoll_t *context,
@@ -525,17 +894,29 @@ static remote_printer_t
 				   const char *domain,
 				   const char *interface,
 				   int family,
+				   const char *uuid,
 				   void *txt);
 
 
+// Turn on logging into the debug log file. On a reload other threads
+// can be logging, so lfp only gets changed with loglock held
 static void
 start_debug_logging()
 {
+  int failed;
+
+  pthread_rwlock_wrlock(&loglock);
+  debug_logfile = 1;
   if (debug_log_file[0] == '\0')
+  {
+    pthread_rwlock_unlock(&loglock);
     return;
+  }
   if (lfp == NULL)
     lfp = fopen(debug_log_file, "a+");
-  if (lfp == NULL)
+  failed = (lfp == NULL);
+  pthread_rwlock_unlock(&loglock);
+  if (failed)
   {
     fprintf(stderr, "cups-browsed: ERROR: Failed creating debug log file %s\n",
       debug_log_file);
@@ -547,10 +928,12 @@ start_debug_logging()
 static void
 stop_debug_logging()
 {
+  pthread_rwlock_wrlock(&loglock);
   debug_logfile = 0;
   if (lfp)
     fclose(lfp);
   lfp = NULL;
+  pthread_rwlock_unlock(&loglock);
 }
 
 
@@ -595,7 +978,7 @@ copyToFile(FILE **fp1,
 
 
 static void
-debug_printf(const char *format, ...)
+debug_log_printf(const char *format, ...)
 {
   pthread_rwlock_wrlock(&loglock);
   if (debug_stderr || debug_logfile)
@@ -645,6 +1028,8 @@ debug_printf(const char *format, ...)
 static void
 debug_log_out(char *log)
 {
+  if (!debug_stderr && !debug_logfile)
+    return;
   pthread_rwlock_wrlock(&loglock);
   if (debug_stderr || debug_logfile)
   {
@@ -670,6 +1055,203 @@ debug_log_out(char *log)
 }
 
 
+//
+// Flight recorder: An always-on ring buffer of compact binary event
+// records (discovery, status transitions, queue creation/removal,
+// dispatch decisions, timeouts). Recording an event does not take a
+// lock and does not format anything, so it is cheap enough to be done
+// also when debug logging is off. The records are only formatted when
+// the buffer gets dumped, on SIGQUIT or on a crash, by a writer which
+// uses only async-signal-safe functions.
+//
+
+typedef enum flight_event_e {
+  FLIGHT_NONE = 0,
+  FLIGHT_DISCOVERED,		// Remote printer discovered
+  FLIGHT_DISAPPEARED,		// Remote printer disappeared
+  FLIGHT_STATUS,		// Status change of a printer entry (value)
+  FLIGHT_QUEUE_CREATE,		// Creation of a CUPS queue started
+  FLIGHT_QUEUE_CREATED,		// CUPS queue created/modified
+  FLIGHT_QUEUE_FAILED,		// CUPS queue creation failed
+  FLIGHT_QUEUE_REMOVED,		// CUPS queue removed
+  FLIGHT_DISPATCH,		// Job (value) sent to destination (detail)
+  FLIGHT_ALL_BUSY,		// All destinations busy for job (value)
+  FLIGHT_NO_DEST,		// No destination found for job (value)
+  FLIGHT_TIMEOUT,		// HTTP timeout (value: timeouts in a row)
+  FLIGHT_CONFIG_RELOAD,		// Configuration re-read (value: removed)
+  FLIGHT_STARTUP,		// Startup phase (name) done (value: msec)
+  FLIGHT_SHUTDOWN		// cups-browsed is shutting down
+} flight_event_t;
+
+static const char * const flight_event_names[] =
+{
+  "none",
+  "discovered",
+  "disappeared",
+  "status",
+  "queue-create",
+  "queue-created",
+  "queue-failed",
+  "queue-removed",
+  "dispatch",
+  "all-busy",
+  "no-dest",
+  "timeout",
+  "config-reload",
+  "startup",
+  "shutdown"
+};
+
+typedef struct flight_record_s
+{
+  unsigned long seq;		// Sequence number, 0 while being written
+  time_t        time;
+  int           event;
+  int           value;
+  char          name[48];	// Queue name
+  char          detail[96];	// URI or other detail
+} flight_record_t;
+
+static flight_record_t flight_recorder[FLIGHT_RECORDER_SIZE];
+static unsigned long flight_recorder_seq = 0;
+static char flight_recorder_file[2048];
+
+static void
+flight_record(flight_event_t event,
+	      const char *name,
+	      const char *detail,
+	      int value)
+{
+  unsigned long seq;
+  flight_record_t *r;
+
+  // Claim a slot, writers on other threads get different ones
+  seq = __atomic_add_fetch(&flight_recorder_seq, 1, __ATOMIC_RELAXED);
+  r = &flight_recorder[seq % FLIGHT_RECORDER_SIZE];
+
+  // Mark the record incomplete while we fill it, so that a dump
+  // happening meanwhile skips it
+  __atomic_store_n(&r->seq, 0, __ATOMIC_RELEASE);
+  r->time = time(NULL);
+  r->event = event;
+  r->value = value;
+  r->name[0] = '\0';
+  if (name)
+    strncat(r->name, name, sizeof(r->name) - 1);
+  r->detail[0] = '\0';
+  if (detail)
+    strncat(r->detail, detail, sizeof(r->detail) - 1);
+  __atomic_store_n(&r->seq, seq, __ATOMIC_RELEASE);
+}
+
+
+// Async-signal-safe output helpers for the dump, no stdio, no malloc
+
+static void
+flight_write_str(int fd,
+		 const char *str)
+{
+  size_t len = 0;
+
+  while (str[len])
+    len ++;
+  while (len > 0)
+  {
+    ssize_t n = write(fd, str, len);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+	continue;
+      return;
+    }
+    str += n;
+    len -= n;
+  }
+}
+
+
+static void
+flight_write_num(int fd,
+		 long num)
+{
+  char buf[32], *ptr = buf + sizeof(buf) - 1;
+  int negative = (num < 0);
+  unsigned long n = negative ? -(unsigned long)num : (unsigned long)num;
+
+  *ptr = '\0';
+  do
+  {
+    *--ptr = '0' + n % 10;
+    n /= 10;
+  }
+  while (n);
+  if (negative)
+    *--ptr = '-';
+  flight_write_str(fd, ptr);
+}
+
+
+static void
+flight_recorder_dump(int fd)
+{
+  unsigned long last, seq, i;
+  flight_record_t r;
+
+  last = __atomic_load_n(&flight_recorder_seq, __ATOMIC_ACQUIRE);
+  flight_write_str(fd, "cups-browsed flight recorder, ");
+  flight_write_num(fd, (long)last);
+  flight_write_str(fd, " events recorded, the last ones follow\n");
+  for (i = (last > FLIGHT_RECORDER_SIZE ? last - FLIGHT_RECORDER_SIZE + 1 :
+	    1);
+       i <= last; i ++)
+  {
+    flight_record_t *slot = &flight_recorder[i % FLIGHT_RECORDER_SIZE];
+
+    // Copy the record and skip it if it got (re-)written meanwhile
+    seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if (seq != i)
+      continue;
+    memcpy(&r, slot, sizeof(r));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+      continue;
+    r.name[sizeof(r.name) - 1] = '\0';
+    r.detail[sizeof(r.detail) - 1] = '\0';
+
+    flight_write_num(fd, (long)r.seq);
+    flight_write_str(fd, " ");
+    flight_write_num(fd, (long)r.time);
+    flight_write_str(fd, " ");
+    flight_write_str(fd, (r.event > FLIGHT_NONE && r.event <= FLIGHT_SHUTDOWN ?
+			  flight_event_names[r.event] : "unknown"));
+    flight_write_str(fd, " ");
+    flight_write_str(fd, r.name[0] ? r.name : "-");
+    flight_write_str(fd, " ");
+    flight_write_str(fd, r.detail[0] ? r.detail : "-");
+    flight_write_str(fd, " ");
+    flight_write_num(fd, r.value);
+    flight_write_str(fd, "\n");
+  }
+}
+
+
+// Dump the flight recorder into its file in the log directory, called
+// from signal handlers
+static void
+flight_recorder_dump_file(void)
+{
+  int fd;
+
+  if (flight_recorder_file[0] == '\0')
+    return;
+  if ((fd = open(flight_recorder_file, O_WRONLY | O_CREAT | O_TRUNC,
+		 0600)) < 0)
+    return;
+  flight_recorder_dump(fd);
+  close(fd);
+}
+
+
 //
 // 'create_media_size()' - Create a media-size value.
 //
@@ -708,75 +1290,6 @@ create_media_range(int x_dim_min_width,
 }
 
 
-static void *
-copy_media_size(void *size,
-		void *user_data)
-{
-  media_size_t *data = (media_size_t *)size;
-  media_size_t *copy;
-
-  copy = (media_size_t *)calloc(1, sizeof(media_size_t));
-  if (copy)
-  {
-    copy->x = data->x;
-    copy->y = data->y;
-  }
-  return (copy);
-}
-
-
-static void *
-copy_range_size(void *range,
-		void* user_data)
-{
-  pagesize_range_t *data = (pagesize_range_t *)range;
-  pagesize_range_t *copy;
-
-  copy = (pagesize_range_t *)calloc(1, sizeof(pagesize_range_t));
-  if (copy)
-  {
-    copy->x_dim_min = data->x_dim_min;
-    copy->x_dim_max = data->x_dim_max;
-    copy->y_dim_min = data->y_dim_min;
-    copy->y_dim_max = data->y_dim_max;
-  }
-  return (copy);
-}
-
-
-static void *
-copy_media(void *media,
-	   void *user_data)
-{
-  media_col_t *data = (media_col_t *)media;
-  media_col_t *copy;
-
-  copy = (media_col_t *)calloc(1, sizeof(media_col_t));
-  if (copy)
-  {
-    copy->x = data->x;
-    copy->y = data->y;
-    copy->left_margin=data->left_margin;
-    copy->right_margin=data->right_margin;
-    copy->top_margin=data->top_margin;
-    copy->bottom_margin=data->bottom_margin;
-    copy->media_source = NULL;
-    copy->media_type = NULL;
-    if (data->media_source != NULL)
-    {
-      copy->media_source = (char *)malloc(sizeof(char)*32);
-      strcpy(copy->media_source, data->media_source);
-    }
-    if (data->media_type != NULL)
-    {
-      copy->media_type = (char *)malloc(sizeof(char)*32);;
-      strcpy(copy->media_type, data->media_type);
-    }
-  }
-  return (copy);
-}
-
-
 //
 // 'create_media_col()' - Create a media-col value.
 //
@@ -815,28 +1328,6 @@ create_media_col(int  width,
 }
 
 
-static int
-compare_mediasize(void *media_a, void *media_b,
-		  void *user_data)
-{
-  media_size_t  *a = (media_size_t *)media_a;
-  media_size_t  *b = (media_size_t *)media_b;
-
-  if (a->x < b->x)
-    return (-1);
-  else if (a->x > b->x)
-    return (1);
-  else
-  {
-    if (a->y == b->y)
-      return (0);
-    else if (a->y < b->y)
-      return (-1);
-    return (1);
-  }
-}
-
-
 static int
 compare_int(int a,
 	    int b)
@@ -850,83 +1341,53 @@ compare_int(int a,
 
 
 static int
-compare_rangesize(void *range_a,void *range_b,
-		  void *user_data)
+compare_mediasize(const void *media_a,
+		  const void *media_b)
 {
-  pagesize_range_t *a = (pagesize_range_t *)range_a;
-  pagesize_range_t *b = (pagesize_range_t *)range_b;
+  const media_size_t *a = (const media_size_t *)media_a;
+  const media_size_t *b = (const media_size_t *)media_b;
   int value;
 
-  if ((value = compare_int(a->x_dim_min, b->x_dim_min)) == 0)
-  {
-    if ((value = compare_int(a->x_dim_max, b->x_dim_max)) == 0)
-    {
-      if ((value = compare_int(a->y_dim_min, b->y_dim_min)) == 0)
-      {
-        if ((value = compare_int(a->y_dim_max, b->y_dim_max)) == 0)
-          return (0);
-      }
-    }
-  }
+  if ((value = compare_int(a->x, b->x)) == 0)
+    value = compare_int(a->y, b->y);
   return (value);
 }
 
 
 static int
-compare_media(void *media_a,
-	      void *media_b,
-	      void *user_data)
+compare_rangesize(const void *range_a,
+		  const void *range_b)
 {
-  media_col_t  *a = (media_col_t *)media_a;
-  media_col_t  *b = (media_col_t *)media_b;
+  const pagesize_range_t *a = (const pagesize_range_t *)range_a;
+  const pagesize_range_t *b = (const pagesize_range_t *)range_b;
   int value;
 
-  if ((value = compare_int(a->x, b->x)) == 0)
-  {
-    if ((value = compare_int(a->y, b->y)) == 0)
-    {
-      if ((value = compare_int(a->top_margin, b->top_margin)) == 0)
-      {
-        if ((value = compare_int(a->bottom_margin, b->bottom_margin)) == 0)
-	{
-          if ((value = compare_int(a->right_margin, b->right_margin)) == 0)
-	  {
-            if ((value = compare_int(a->left_margin, b->left_margin)) == 0)
-	    {
-              if (a->media_source == NULL && b->media_source == NULL)
-	      {
-                if (a->media_type == NULL && b->media_type == NULL)
-                  return (0);
-                if (a->media_type == NULL)
-                  return (-1);
-                if (b->media_type == NULL)
-                  return (1);
-                return (strcmp(a->media_type, b->media_type));
-              }
-              if (a->media_source == NULL)
-                return (-1);
-              if (b->media_source == NULL)
-                return (1);
-              if (!strcmp(a->media_source, b->media_source))
-	      {
-                if (a->media_type == NULL && b->media_type == NULL)
-                  return (0);
-                if (a->media_type == NULL)
-                  return (-1);
-                if (b->media_type==NULL)
-                  return (1);
-                return (strcmp(a->media_type,
-			       b->media_type));
-              }
-              else
-                return (strcmp(a->media_source,
-			       b->media_source));
-            }
-          }
-        }
-      }
-    }
-  }
+  if ((value = compare_int(a->x_dim_min, b->x_dim_min)) == 0 &&
+      (value = compare_int(a->x_dim_max, b->x_dim_max)) == 0 &&
+      (value = compare_int(a->y_dim_min, b->y_dim_min)) == 0)
+    value = compare_int(a->y_dim_max, b->y_dim_max);
+  return (value);
+}
+
+
+static int
+compare_media(const void *media_a,
+	      const void *media_b)
+{
+  const media_col_key_t *a = (const media_col_key_t *)media_a;
+  const media_col_key_t *b = (const media_col_key_t *)media_b;
+  int value;
+
+  // Sources and types are stored inline, not supplied ones are empty and
+  // sort first
+  if ((value = compare_int(a->x, b->x)) == 0 &&
+      (value = compare_int(a->y, b->y)) == 0 &&
+      (value = compare_int(a->top_margin, b->top_margin)) == 0 &&
+      (value = compare_int(a->bottom_margin, b->bottom_margin)) == 0 &&
+      (value = compare_int(a->right_margin, b->right_margin)) == 0 &&
+      (value = compare_int(a->left_margin, b->left_margin)) == 0 &&
+      (value = strcmp(a->media_source, b->media_source)) == 0)
+    value = strcmp(a->media_type, b->media_type);
   return (value);
 }
 
@@ -1071,13 +1532,83 @@ password_callback (const char *prompt,
 }
 
 
+// Connect to host, with a short timeout. If connect_time is given, it
+// gets the time which the connection setup (TCP and, for encrypted
+// connections, TLS handshake) took in usec, without the name lookup
+static http_t *
+http_connect_timed(const char *host,
+		   int port,
+		   http_encryption_t encryption,
+		   gint64 *connect_time)
+{
+  http_t *http;
+  gint64 start;
+
+  if (connect_time)
+    *connect_time = 0;
+  // Without a timeout httpConnect2() only looks up the host
+  if ((http = httpConnect2(host, port, NULL, AF_UNSPEC, encryption, 1, 0,
+			   NULL)) == NULL)
+    return (NULL);
+  start = g_get_monotonic_time();
+  if (httpReconnect2(http, 3000, NULL))
+  {
+    httpClose(http);
+    return (NULL);
+  }
+  if (connect_time)
+    *connect_time = g_get_monotonic_time() - start;
+  // Let the server compress its responses, libcups decompresses them
+  // transparently when reading
+  if (HttpCompression)
+    httpSetDefaultField(http, HTTP_FIELD_ACCEPT_ENCODING,
+			"deflate, gzip, identity");
+  return (http);
+}
+
+
 static http_t *
 httpConnectEncryptShortTimeout(const char *host,
 			       int port,
 			       http_encryption_t encryption)
 {
-  return (httpConnect2(host, port, NULL, AF_UNSPEC, encryption, 1, 3000,
-                       NULL));
+  return (http_connect_timed(host, port, encryption, NULL));
+}
+
+
+// Count the bytes which we have received for an IPP response and which
+// we have saved by compression
+static void
+http_account_response(http_t *http,
+		      ipp_t *response)
+{
+  const char *coding, *length;
+  size_t decoded, received;
+
+  if (!http || !response)
+    return;
+
+  decoded = ippLength(response);
+  coding = httpGetField(http, HTTP_FIELD_CONTENT_ENCODING);
+  length = httpGetField(http, HTTP_FIELD_CONTENT_LENGTH);
+  __atomic_add_fetch(&http_responses, 1, __ATOMIC_RELAXED);
+  if (!coding || !coding[0] || !strcasecmp(coding, "identity"))
+  {
+    __atomic_add_fetch(&http_bytes_received, decoded, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&http_bytes_decoded, decoded, __ATOMIC_RELAXED);
+    return;
+  }
+
+  // A chunked response has no Content-Length, then we do not know how
+  // many bytes went over the wire
+  __atomic_add_fetch(&http_responses_compressed, 1, __ATOMIC_RELAXED);
+  if (!length || (received = strtoul(length, NULL, 10)) == 0)
+    return;
+  __atomic_add_fetch(&http_bytes_received, received, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&http_bytes_decoded, decoded, __ATOMIC_RELAXED);
+  debug_printf("Received %s-compressed IPP response: %zu bytes for %zu bytes of IPP data. Total: %zu of %zu responses compressed, %zu bytes received for %zu bytes of IPP data.\n",
+	       coding, received, decoded, http_responses_compressed,
+	       http_responses, http_bytes_received, http_bytes_decoded);
 }
 
 
@@ -1085,7 +1616,11 @@ static int
 http_timeout_cb(http_t *http,
 		void *user_data)
 {
+  char host[256];
+
   debug_printf("HTTP timeout! (consider increasing HttpLocalTimeout/HttpRemoteTimeout value)\n");
+  flight_record(FLIGHT_TIMEOUT, NULL, httpGetHostname(http, host, sizeof(host)),
+		0);
   timeout_reached = 1;
   return (0);
 }
@@ -1123,106 +1658,1602 @@ http_connect_local (void)
 }
 
 
+// Give a connection obtained by http_pool_get() back, closing it if it
+// is not reusable (after errors) or not in the pool
 static void
-pwg_ppdize_name(const char *ipp,      // I - IPP keyword
-                char       *name,     // I - Name buffer
-		size_t     namesize)  // I - Size of name buffer
+http_pool_put(http_t *http,
+	      int reusable)
 {
-  char  *ptr,       // Pointer into name buffer
-        *end;       // End of name buffer
+  http_pool_entry_t *e;
 
-  *name = (char)toupper(*ipp++);
+  if (!http)
+    return;
 
-  for (ptr = name + 1, end = name + namesize - 1; *ipp && ptr < end;)
+  pthread_mutex_lock(&http_pool_lock);
+  for (e = cupsArrayFirst(http_pool); e; e = cupsArrayNext(http_pool))
+    if (e->http == http)
+      break;
+  if (e && reusable)
   {
-    if (*ipp == '-' &&
-	((ipp[1] >= 'A' && ipp[1] <= 'Z') ||
-	 (ipp[1] >= 'a' && ipp[1] <= 'z')))
-    {
-      ipp ++;
-      *ptr++ = (char)toupper(*ipp++ & 255);
-    }
-    else
-      *ptr++ = *ipp++;
+    e->in_use = 0;
+    e->last_used = time(NULL);
+    pthread_mutex_unlock(&http_pool_lock);
+    return;
   }
-
-  *ptr = '\0';
+  if (e)
+  {
+    cupsArrayRemove(http_pool, e);
+    free(e);
+  }
+  pthread_mutex_unlock(&http_pool_lock);
+  httpClose(http);
 }
 
 
-static void
-add_mimetype_attributes(char *cluster_name,
-			ipp_t **merged_attributes)
+// Get a connection to a remote host from the pool of open connections,
+// or open a new one. Connections are kept open for some time after use,
+// so that repeated requests to the same destination, especially via
+// IPPS, do not need a new TCP connection and TLS handshake each time.
+// If connect_time is given, it gets the time which setting up a new
+// connection took in usec, 0 if an already open connection got
+// returned.
+static http_t *
+http_pool_get(const char *host,
+	      int port,
+	      http_encryption_t encryption,
+	      gint64 *connect_time)
 {
-  int                  count, i;
-  remote_printer_t     *p;
-  const char           *str;
-  char                 *q;
-  cups_array_t         *list;
-  ipp_attribute_t      *attr;
-  int                  num_value, attr_no;
-  char* attributes[] =
-  {
-    "document-format-supported"
-  };
+  http_pool_entry_t *e;
+  http_t *http = NULL;
+  time_t now = time(NULL);
 
-  for (attr_no = 0; attr_no < 1; attr_no++)
+  if (connect_time)
+    *connect_time = 0;
+  pthread_mutex_lock(&http_pool_lock);
+  if (!http_pool)
+    http_pool = cupsArrayNew(NULL, NULL);
+  for (e = cupsArrayFirst(http_pool); e; e = cupsArrayNext(http_pool))
   {
-    if ((list = cupsArrayNew3((cups_array_func_t)strcasecmp, NULL, NULL, 0,
-			      (cups_acopy_func_t)strdup,
-			      (cups_afree_func_t)free)) == NULL)
-      return;
+    if (e->in_use)
+      continue;
+    if (now - e->last_used > HTTP_POOL_IDLE_TIMEOUT)
+    {
+      // Most probably closed by the peer already
+      cupsArrayRemove(http_pool, e);
+      httpClose(e->http);
+      free(e);
+      continue;
+    }
+    if (!http && e->port == port && e->encryption == encryption &&
+	!strcasecmp(e->host, host))
+    {
+      e->in_use = 1;
+      http = e->http;
+    }
+  }
+  pthread_mutex_unlock(&http_pool_lock);
 
-    num_value = 0;
-    for (p = (remote_printer_t *)cupsArrayFirst(remote_printers);
-	 p; p = (remote_printer_t *)cupsArrayNext(remote_printers))
+  if (http)
+  {
+    // Data or EOF on an idle connection means that the peer has closed it
+    if (!httpWait(http, 0) || !httpReconnect2(http, 3000, NULL))
     {
-      if (strcmp(cluster_name, p->queue_name))
-        continue;
-      if (p->status == STATUS_DISAPPEARED || p->status == STATUS_UNCONFIRMED ||
-	  p->status ==  STATUS_TO_BE_RELEASED)
-        continue;
-      if ((attr = ippFindAttribute(p->prattrs, attributes[attr_no],
-				   IPP_TAG_MIMETYPE)) != NULL)
+      debug_printf("Reusing connection to %s:%d.\n", host, port);
+      return (http);
+    }
+    http_pool_put(http, 0);
+  }
+
+  if ((http = http_connect_timed(host, port, encryption, connect_time)) ==
+      NULL)
+    return (NULL);
+
+  pthread_mutex_lock(&http_pool_lock);
+  if (cupsArrayCount(http_pool) < HTTP_POOL_SIZE &&
+      (e = (http_pool_entry_t *)calloc(1, sizeof(http_pool_entry_t))) !=
+      NULL)
+  {
+    strncpy(e->host, host, sizeof(e->host) - 1);
+    e->port = port;
+    e->encryption = encryption;
+    e->http = http;
+    e->in_use = 1;
+    cupsArrayAdd(http_pool, e);
+  }
+  pthread_mutex_unlock(&http_pool_lock);
+
+  return (http);
+}
+
+
+// Close the pooled connections which are not in use
+static int
+http_pool_close_unused(void)
+{
+  http_pool_entry_t *e;
+  int num_closed = 0;
+
+  pthread_mutex_lock(&http_pool_lock);
+  for (e = cupsArrayFirst(http_pool); e; e = cupsArrayNext(http_pool))
+    if (!e->in_use)
+    {
+      cupsArrayRemove(http_pool, e);
+      httpClose(e->http);
+      free(e);
+      num_closed ++;
+    }
+  pthread_mutex_unlock(&http_pool_lock);
+
+  return (num_closed);
+}
+
+
+static void
+http_pool_close_all(void)
+{
+  http_pool_entry_t *e;
+
+  pthread_mutex_lock(&http_pool_lock);
+  while ((e = cupsArrayFirst(http_pool)) != NULL)
+  {
+    cupsArrayRemove(http_pool, e);
+    httpClose(e->http);
+    free(e);
+  }
+  pthread_mutex_unlock(&http_pool_lock);
+}
+
+
+// Abort the requests in progress on pooled connections, so that the
+// threads waiting for responses do not wait for the HTTP timeout
+static void
+http_pool_abort(void)
+{
+  http_pool_entry_t *e;
+
+  pthread_mutex_lock(&http_pool_lock);
+  for (e = cupsArrayFirst(http_pool); e; e = cupsArrayNext(http_pool))
+    if (e->in_use)
+    {
+      debug_printf("Aborting request in progress to %s:%d.\n",
+		   e->host, e->port);
+      shutdown(httpGetFd(e->http), SHUT_RDWR);
+    }
+  pthread_mutex_unlock(&http_pool_lock);
+}
+
+
+static void *
+task_run(void *data)
+{
+  task_t *t = (task_t *)data;
+
+  pthread_mutex_lock(&tasks_lock);
+  t->id = pthread_self();
+  pthread_mutex_unlock(&tasks_lock);
+
+  (t->func)(t->arg);
+
+  pthread_mutex_lock(&tasks_lock);
+  cupsArrayRemove(tasks, t);
+  pthread_cond_broadcast(&tasks_cond);
+  pthread_mutex_unlock(&tasks_lock);
+  free(t->name);
+  free(t);
+
+  return (NULL);
+}
+
+
+// Run func(arg) in a new detached thread. Tasks check task_cancelled()
+// before each step which can take long and give up when it returns
+// true: on shutdown or when the task runs for more than timeout
+// seconds. Returns 0 if the thread could not be created, then the
+// caller still owns arg
+static int
+task_start(const char *name,
+	   void (*func)(void *),
+	   void *arg,
+	   int timeout)
+{
+  task_t *t;
+  pthread_t id;
+  int attempts = 0;
+
+  if ((t = (task_t *)calloc(1, sizeof(task_t))) == NULL)
+    return (0);
+  t->name = strdup(name);
+  t->func = func;
+  t->arg = arg;
+  t->timeout = (timeout > 0 ? timeout : 0);
+  t->deadline = (timeout > 0 ? time(NULL) + timeout : 0);
+
+  pthread_mutex_lock(&tasks_lock);
+  if (!tasks)
+    tasks = cupsArrayNew(NULL, NULL);
+  t->cancelled = tasks_stopped;
+  cupsArrayAdd(tasks, t);
+  pthread_mutex_unlock(&tasks_lock);
+
+  while (pthread_create(&id, NULL, task_run, t))
+  {
+    if (++ attempts >= 5)
+    {
+      debug_printf("Could not create new thread for %s even after many attempts.\n",
+		   name);
+      pthread_mutex_lock(&tasks_lock);
+      cupsArrayRemove(tasks, t);
+      pthread_mutex_unlock(&tasks_lock);
+      free(t->name);
+      free(t);
+      return (0);
+    }
+    debug_printf("Unable to create a new thread, retrying!\n");
+  }
+  pthread_detach(id);
+
+  return (1);
+}
+
+
+// Should the calling task stop? Outside of tasks (in the main thread)
+// only on shutdown
+static int
+task_cancelled(void)
+{
+  task_t *t;
+  int cancelled = terminating;
+  pthread_t self = pthread_self();
+
+  pthread_mutex_lock(&tasks_lock);
+  for (t = cupsArrayFirst(tasks); t; t = cupsArrayNext(tasks))
+    if (pthread_equal(t->id, self))
+    {
+      if (!t->cancelled && t->deadline && time(NULL) > t->deadline)
       {
-	count = ippGetCount(attr);
-	for (i = 0; i < count; i ++)
-	{ 
-	  str = ippGetString(attr, i, NULL);
-	  if (!cupsArrayFind(list, (void *)str))
-	  {
-	    cupsArrayAdd(list, (void *)str);
-	    num_value++;
-	  }
-	}
+	debug_printf("Task %s exceeded its time limit of %d seconds, giving up.\n",
+		     t->name, t->timeout);
+	t->cancelled = 1;
+      }
+      cancelled |= t->cancelled;
+      break;
+    }
+  pthread_mutex_unlock(&tasks_lock);
+
+  return (cancelled);
+}
+
+
+// Let the time limit of the calling task start now, for tasks which
+// had to wait for their turn before doing the actual work
+static void
+task_restart_deadline(void)
+{
+  task_t *t;
+  pthread_t self = pthread_self();
+
+  pthread_mutex_lock(&tasks_lock);
+  for (t = cupsArrayFirst(tasks); t; t = cupsArrayNext(tasks))
+    if (pthread_equal(t->id, self))
+    {
+      if (t->timeout > 0)
+	t->deadline = time(NULL) + t->timeout;
+      break;
+    }
+  pthread_mutex_unlock(&tasks_lock);
+}
+
+
+// Cancel all tasks, abort their network requests, and wait up to
+// timeout seconds for them to finish. Returns the number of tasks
+// which are still running
+static int
+tasks_stop(int timeout)
+{
+  task_t *t;
+  struct timespec until;
+  int num_tasks;
+
+  pthread_mutex_lock(&tasks_lock);
+  tasks_stopped = 1;
+  for (t = cupsArrayFirst(tasks); t; t = cupsArrayNext(tasks))
+    t->cancelled = 1;
+  num_tasks = cupsArrayCount(tasks);
+  pthread_mutex_unlock(&tasks_lock);
+
+  if (num_tasks == 0)
+    return (0);
+  debug_printf("Cancelling %d background tasks ...\n", num_tasks);
+  http_pool_abort();
+  ppd_workers_abort();
+
+  clock_gettime(CLOCK_REALTIME, &until);
+  until.tv_sec += timeout;
+  pthread_mutex_lock(&tasks_lock);
+  while (cupsArrayCount(tasks) > 0 &&
+	 pthread_cond_timedwait(&tasks_cond, &tasks_lock, &until) == 0);
+  num_tasks = cupsArrayCount(tasks);
+  for (t = cupsArrayFirst(tasks); t; t = cupsArrayNext(tasks))
+    debug_printf("Task %s still running after %d seconds, not waiting for it.\n",
+		 t->name, timeout);
+  pthread_mutex_unlock(&tasks_lock);
+
+  return (num_tasks);
+}
+
+
+//
+// Generating PPD files in helper processes
+//
+
+static ssize_t
+ppd_worker_read(void *context,
+		ipp_uchar_t *buffer,
+		size_t bytes)
+{
+  int fd = *(int *)context;
+  ssize_t n;
+
+  while ((n = recv(fd, buffer, bytes, 0)) < 0 && errno == EINTR);
+  return (n);
+}
+
+
+static ssize_t
+ppd_worker_write(void *context,
+		 ipp_uchar_t *buffer,
+		 size_t bytes)
+{
+  int fd = *(int *)context;
+  ssize_t n;
+  size_t total = 0;
+
+  while (total < bytes)
+  {
+    if ((n = send(fd, buffer + total, bytes - total, MSG_NOSIGNAL)) < 0)
+    {
+      if (errno == EINTR)
+	continue;
+      return (-1);
+    }
+    total += n;
+  }
+  return ((ssize_t)total);
+}
+
+
+// Main loop of a PPD generator process (cups-browsed --ppd-worker FD):
+// Read the generation parameters and the printer's attributes as two
+// IPP messages from fd, generate the PPD, and answer with an IPP
+// message with the result, until the daemon closes the connection
+static int
+ppd_worker_main(int fd)
+{
+  ipp_t *params, *attrs, *result, *col;
+  ipp_attribute_t *attr;
+  cups_array_t *conflicts, *sizes;
+  cups_size_t size;
+  const char *str;
+  char ppdname[1024], msg[1024], *default_pagesize;
+  int i, count, ok;
+
+  signal(SIGPIPE, SIG_IGN);
+
+  for (;;)
+  {
+    params = ippNew();
+    attrs = ippNew();
+    if (ippReadIO(&fd, (ipp_iocb_t)ppd_worker_read, 1, NULL, params) !=
+	IPP_STATE_DATA ||
+	ippReadIO(&fd, (ipp_iocb_t)ppd_worker_read, 1, NULL, attrs) !=
+	IPP_STATE_DATA)
+    {
+      ippDelete(params);
+      ippDelete(attrs);
+      break;
+    }
+
+    conflicts = NULL;
+    if ((attr = ippFindAttribute(params, "conflicts", IPP_TAG_TEXT)) != NULL)
+    {
+      conflicts = cupsArrayNew3((cups_array_func_t)strcasecmp, NULL, NULL, 0,
+				(cups_acopy_func_t)strdup,
+				(cups_afree_func_t)free);
+      for (i = 0, count = ippGetCount(attr); i < count; i ++)
+	cupsArrayAdd(conflicts, (void *)ippGetString(attr, i, NULL));
+    }
+    sizes = NULL;
+    if ((attr = ippFindAttribute(params, "sizes",
+				 IPP_TAG_BEGIN_COLLECTION)) != NULL)
+    {
+      sizes = cupsArrayNew3((cups_array_func_t)pwg_compare_sizes,
+			    NULL, NULL, 0,
+			    (cups_acopy_func_t)pwg_copy_size,
+			    (cups_afree_func_t)free);
+      for (i = 0, count = ippGetCount(attr); i < count; i ++)
+      {
+	col = ippGetCollection(attr, i);
+	memset(&size, 0, sizeof(size));
+	if ((str = ippGetString(ippFindAttribute(col, "media", IPP_TAG_TEXT),
+				0, NULL)) != NULL)
+	  strncpy(size.media, str, sizeof(size.media) - 1);
+	size.width = ippGetInteger(ippFindAttribute(col, "width",
+						    IPP_TAG_INTEGER), 0);
+	size.length = ippGetInteger(ippFindAttribute(col, "length",
+						     IPP_TAG_INTEGER), 0);
+	size.bottom = ippGetInteger(ippFindAttribute(col, "bottom",
+						     IPP_TAG_INTEGER), 0);
+	size.left = ippGetInteger(ippFindAttribute(col, "left",
+						   IPP_TAG_INTEGER), 0);
+	size.right = ippGetInteger(ippFindAttribute(col, "right",
+						    IPP_TAG_INTEGER), 0);
+	size.top = ippGetInteger(ippFindAttribute(col, "top",
+						  IPP_TAG_INTEGER), 0);
+	cupsArrayAdd(sizes, &size);
       }
     }
-    if (num_value != 0)
+    default_pagesize = NULL;
+    if ((str = ippGetString(ippFindAttribute(params, "default-pagesize",
+					     IPP_TAG_TEXT), 0, NULL)) != NULL)
+      default_pagesize = strdup(str);
+
+    errno = 0;
+    msg[0] = '\0';
+    ok = ppdCreatePPDFromIPP2(ppdname, sizeof(ppdname), attrs,
+			      ippGetString(ippFindAttribute(params,
+							    "make-model",
+							    IPP_TAG_TEXT),
+					   0, NULL),
+			      ippGetString(ippFindAttribute(params, "pdl",
+							    IPP_TAG_TEXT),
+					   0, NULL),
+			      ippGetInteger(ippFindAttribute(params, "color",
+							     IPP_TAG_INTEGER),
+					    0),
+			      ippGetInteger(ippFindAttribute(params, "duplex",
+							     IPP_TAG_INTEGER),
+					    0),
+			      conflicts, sizes, default_pagesize,
+			      ippGetString(ippFindAttribute(params,
+							    "default-color",
+							    IPP_TAG_TEXT),
+					   0, NULL),
+			      msg, sizeof(msg)) != NULL;
+
+    result = ippNew();
+    ippAddBoolean(result, IPP_TAG_PRINTER, "status", (char)ok);
+    ippAddInteger(result, IPP_TAG_PRINTER, IPP_TAG_INTEGER, "errno",
+		  (ok ? 0 : errno));
+    if (ok)
+      ippAddString(result, IPP_TAG_PRINTER, IPP_TAG_TEXT, "ppd-file", NULL,
+		   ppdname);
+    if (msg[0])
+      ippAddString(result, IPP_TAG_PRINTER, IPP_TAG_TEXT, "message", NULL,
+		   msg);
+    ok = (ippWriteIO(&fd, (ipp_iocb_t)ppd_worker_write, 1, NULL, result) ==
+	  IPP_STATE_DATA);
+
+    ippDelete(result);
+    ippDelete(params);
+    ippDelete(attrs);
+    cupsArrayDelete(conflicts);
+    cupsArrayDelete(sizes);
+    free(default_pagesize);
+    if (!ok)
+      break;
+  }
+
+  close(fd);
+  return (0);
+}
+
+
+// Start a PPD generator process for the slot w, called with
+// ppd_workers_lock held
+static int
+ppd_worker_spawn(ppd_worker_t *w)
+{
+  int fds[2], fd, max_fd;
+  pid_t pid;
+  char fdstr[16];
+  char *argv[] = { "cups-browsed", "--ppd-worker", fdstr, NULL };
+  struct timeval timeout = { TIMEOUT_PPD_GENERATION, 0 };
+
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds))
+  {
+    debug_printf("Could not create socket for PPD generator process: %s\n",
+		 strerror(errno));
+    return (0);
+  }
+  snprintf(fdstr, sizeof(fdstr), "%d", fds[1]);
+  if ((max_fd = (int)sysconf(_SC_OPEN_MAX)) <= 0 || max_fd > 65536)
+    max_fd = 65536;
+
+  if ((pid = fork()) == 0)
+  {
+    // Only async-signal-safe calls until exec, other threads of the
+    // daemon could hold locks which we have inherited
+    for (fd = 3; fd < max_fd; fd ++)
+      if (fd != fds[1])
+	close(fd);
+    fcntl(fds[1], F_SETFD, 0);
+    execv(ppd_worker_program, argv);
+    _exit(127);
+  }
+  close(fds[1]);
+  if (pid < 0)
+  {
+    debug_printf("Could not start PPD generator process: %s\n",
+		 strerror(errno));
+    close(fds[0]);
+    return (0);
+  }
+
+  setsockopt(fds[0], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fds[0], SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  w->pid = pid;
+  w->fd = fds[0];
+  w->busy = 0;
+  debug_printf("Started PPD generator process %d.\n", (int)pid);
+
+  return (1);
+}
+
+
+// Kill a PPD generator process which failed us, the slot gets a new
+// process when used the next time. Returns 0 if the process could not
+// even get executed, then we better stop using them. Called with
+// ppd_workers_lock held
+static int
+ppd_worker_kill(ppd_worker_t *w)
+{
+  int status = 0;
+
+  if (w->pid <= 0)
+    return (1);
+  kill(w->pid, SIGKILL);
+  while (waitpid(w->pid, &status, 0) < 0 && errno == EINTR);
+  close(w->fd);
+  if (WIFSIGNALED(status) && WTERMSIG(status) != SIGKILL)
+    debug_printf("PPD generator process %d crashed with signal %d.\n",
+		 (int)w->pid, WTERMSIG(status));
+  w->pid = 0;
+  w->fd = -1;
+
+  return (!WIFEXITED(status) || WEXITSTATUS(status) != 127);
+}
+
+
+// Start the PPD generator processes as configured by
+// PPDGeneratorWorkers
+static void
+ppd_workers_start(const char *argv0)
+{
+  ssize_t len;
+  int i, n;
+
+  if ((n = PPDGeneratorWorkers) < 0)
+  {
+    if ((n = (int)sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+      n = 1;
+    else if (n > 8)
+      n = 8;
+  }
+  if (n == 0)
+    return;
+
+  // We run ourselves with --ppd-worker, exec() after fork() so that the
+  // processes do not inherit the state of our threads
+  if ((len = readlink("/proc/self/exe", ppd_worker_program,
+		      sizeof(ppd_worker_program) - 1)) > 0)
+    ppd_worker_program[len] = '\0';
+  else if (argv0 && strchr(argv0, '/'))
+    strncpy(ppd_worker_program, argv0, sizeof(ppd_worker_program) - 1);
+  else
+  {
+    debug_printf("Could not determine our own executable, generating PPDs in the daemon.\n");
+    return;
+  }
+
+  pthread_mutex_lock(&ppd_workers_lock);
+  ppd_workers = (ppd_worker_t *)calloc(n, sizeof(ppd_worker_t));
+  for (i = 0; ppd_workers && i < n; i ++)
+  {
+    ppd_workers[i].fd = -1;
+    ppd_worker_spawn(&ppd_workers[i]);
+  }
+  if (ppd_workers)
+    num_ppd_workers = n;
+  pthread_mutex_unlock(&ppd_workers_lock);
+  debug_printf("Generating PPDs with %d helper processes.\n",
+	       num_ppd_workers);
+}
+
+
+// Abort the PPD generations in progress, so that the waiting threads
+// do not wait for TIMEOUT_PPD_GENERATION
+static void
+ppd_workers_abort(void)
+{
+  int i;
+
+  pthread_mutex_lock(&ppd_workers_lock);
+  for (i = 0; i < num_ppd_workers; i ++)
+    if (ppd_workers[i].busy && ppd_workers[i].pid > 0)
+      shutdown(ppd_workers[i].fd, SHUT_RDWR);
+  pthread_mutex_unlock(&ppd_workers_lock);
+}
+
+
+static void
+ppd_workers_stop(void)
+{
+  int i;
+
+  pthread_mutex_lock(&ppd_workers_lock);
+  for (i = 0; i < num_ppd_workers; i ++)
+    if (ppd_workers[i].pid > 0)
+    {
+      if (ppd_workers[i].busy)
+      {
+	// Still used by a task which did not finish on shutdown, let
+	// it see the connection fail
+	shutdown(ppd_workers[i].fd, SHUT_RDWR);
+	continue;
+      }
+      ppd_worker_kill(&ppd_workers[i]);
+    }
+  pthread_mutex_unlock(&ppd_workers_lock);
+}
+
+
+// Add the parameters for ppdCreatePPDFromIPP2() to a request to a PPD
+// generator process
+static ipp_t *
+ppd_worker_request(const char *make_model,
+		   const char *pdl,
+		   int color,
+		   int duplex,
+		   cups_array_t *conflicts,
+		   cups_array_t *sizes,
+		   const char *default_pagesize,
+		   const char *default_color)
+{
+  ipp_t *params = ippNew(), *col;
+  ipp_attribute_t *attr;
+  cups_size_t *size;
+  char *conflict;
+  int i;
+
+  if (make_model)
+    ippAddString(params, IPP_TAG_PRINTER, IPP_TAG_TEXT, "make-model", NULL,
+		 make_model);
+  if (pdl)
+    ippAddString(params, IPP_TAG_PRINTER, IPP_TAG_TEXT, "pdl", NULL, pdl);
+  ippAddInteger(params, IPP_TAG_PRINTER, IPP_TAG_INTEGER, "color", color);
+  ippAddInteger(params, IPP_TAG_PRINTER, IPP_TAG_INTEGER, "duplex", duplex);
+  if (default_pagesize)
+    ippAddString(params, IPP_TAG_PRINTER, IPP_TAG_TEXT, "default-pagesize",
+		 NULL, default_pagesize);
+  if (default_color)
+    ippAddString(params, IPP_TAG_PRINTER, IPP_TAG_TEXT, "default-color",
+		 NULL, default_color);
+  if (cupsArrayCount(conflicts) > 0)
+  {
+    attr = ippAddStrings(params, IPP_TAG_PRINTER, IPP_TAG_TEXT, "conflicts",
+			 cupsArrayCount(conflicts), NULL, NULL);
+    for (i = 0, conflict = cupsArrayFirst(conflicts); conflict;
+	 i ++, conflict = cupsArrayNext(conflicts))
+      ippSetString(params, &attr, i, conflict);
+  }
+  if (cupsArrayCount(sizes) > 0)
+  {
+    attr = ippAddCollections(params, IPP_TAG_PRINTER, "sizes",
+			     cupsArrayCount(sizes), NULL);
+    for (i = 0, size = cupsArrayFirst(sizes); size;
+	 i ++, size = cupsArrayNext(sizes))
+    {
+      col = ippNew();
+      ippAddString(col, IPP_TAG_PRINTER, IPP_TAG_TEXT, "media", NULL,
+		   size->media);
+      ippAddInteger(col, IPP_TAG_PRINTER, IPP_TAG_INTEGER, "width",
+		    size->width);
+      ippAddInteger(col, IPP_TAG_PRINTER, IPP_TAG_INTEGER, "length",
+		    size->length);
+      ippAddInteger(col, IPP_TAG_PRINTER, IPP_TAG_INTEGER, "bottom",
+		    size->bottom);
+      ippAddInteger(col, IPP_TAG_PRINTER, IPP_TAG_INTEGER, "left",
+		    size->left);
+      ippAddInteger(col, IPP_TAG_PRINTER, IPP_TAG_INTEGER, "right",
+		    size->right);
+      ippAddInteger(col, IPP_TAG_PRINTER, IPP_TAG_INTEGER, "top",
+		    size->top);
+      ippSetCollection(params, &attr, i, col);
+      ippDelete(col);
+    }
+  }
+
+  return (params);
+}
+
+
+// Generate a PPD file like ppdCreatePPDFromIPP2() does, in one of the
+// PPD generator processes if we have them. Called with the write lock
+// on "lock" held, which gets released while waiting for a free process
+// and while the process works, so that other queues get created
+// meanwhile, the caller has to check whether its printer is still
+// there. Without processes the PPD gets
+// generated right here
+static int
+generate_ppd(char *ppdname,
+	     size_t ppdname_size,
+	     ipp_t *attrs,
+	     const char *make_model,
+	     const char *pdl,
+	     int color,
+	     int duplex,
+	     cups_array_t *conflicts,
+	     cups_array_t *sizes,
+	     char *default_pagesize,
+	     const char *default_color,
+	     char *msg,
+	     size_t msg_size)
+{
+  ppd_worker_t *w = NULL;
+  ipp_t *params, *result, *attrs_copy = NULL;
+  ipp_attribute_t *attr;
+  char *make_model_copy = NULL, *pdl_copy = NULL;
+  int i, fd, ok = 0, err = 0, sent, usable, released = 0;
+
+  pthread_mutex_lock(&ppd_workers_lock);
+  while (num_ppd_workers > 0 && !w)
+  {
+    for (i = 0; i < num_ppd_workers; i ++)
+      if (!ppd_workers[i].busy)
+      {
+	w = &ppd_workers[i];
+	break;
+      }
+    if (!w)
+    {
+      if (!released)
+      {
+	// All processes are busy, do not block the others while we wait
+	// for one. The printer's attributes and strings can change
+	// meanwhile, so we work on copies of them
+	pthread_mutex_unlock(&ppd_workers_lock);
+	if ((attrs_copy = ippNew()) != NULL)
+	  ippCopyAttributes(attrs_copy, attrs, 0, NULL, NULL);
+	attrs = attrs_copy;
+	make_model = make_model_copy =
+	  (make_model ? strdup(make_model) : NULL);
+	pdl = pdl_copy = (pdl ? strdup(pdl) : NULL);
+	released = 1;
+	pthread_rwlock_unlock(&lock);
+	pthread_mutex_lock(&ppd_workers_lock);
+	continue;
+      }
+      pthread_cond_wait(&ppd_workers_cond, &ppd_workers_lock);
+    }
+  }
+  if (w && w->pid <= 0 && !ppd_worker_spawn(w))
+    w = NULL;
+  if (w)
+  {
+    w->busy = 1;
+    fd = w->fd;
+  }
+  pthread_mutex_unlock(&ppd_workers_lock);
+
+  if (!w)
+  {
+    if (released)
+      pthread_rwlock_wrlock(&lock);
+    errno = 0;
+    ok = (attrs &&
+	  ppdCreatePPDFromIPP2(ppdname, ppdname_size, attrs, make_model,
+			       pdl, color, duplex, conflicts, sizes,
+			       default_pagesize, default_color,
+			       msg, msg_size) != NULL);
+    err = errno;
+    ippDelete(attrs_copy);
+    free(make_model_copy);
+    free(pdl_copy);
+    errno = err;
+    return (ok);
+  }
+
+  // Send the request while we still hold the lock (or have our copy),
+  // it references the printer's attributes
+  params = ppd_worker_request(make_model, pdl, color, duplex, conflicts,
+			      sizes, default_pagesize, default_color);
+  sent = 0;
+  if (attrs)
+  {
+    ippSetState(attrs, IPP_STATE_IDLE);
+    sent = (ippWriteIO(&fd, (ipp_iocb_t)ppd_worker_write, 1, NULL,
+		       params) == IPP_STATE_DATA &&
+	    ippWriteIO(&fd, (ipp_iocb_t)ppd_worker_write, 1, NULL,
+		       attrs) == IPP_STATE_DATA);
+  }
+  ippDelete(params);
+
+  if (!released)
+    pthread_rwlock_unlock(&lock);
+  result = ippNew();
+  if (sent &&
+      ippReadIO(&fd, (ipp_iocb_t)ppd_worker_read, 1, NULL, result) ==
+      IPP_STATE_DATA)
+  {
+    ok = ippGetBoolean(ippFindAttribute(result, "status", IPP_TAG_BOOLEAN),
+		       0);
+    err = ippGetInteger(ippFindAttribute(result, "errno", IPP_TAG_INTEGER),
+			0);
+    snprintf(ppdname, ppdname_size, "%s",
+	     ((attr = ippFindAttribute(result, "ppd-file",
+				       IPP_TAG_TEXT)) != NULL ?
+	      ippGetString(attr, 0, NULL) : ""));
+    snprintf(msg, msg_size, "%s",
+	     ((attr = ippFindAttribute(result, "message",
+				       IPP_TAG_TEXT)) != NULL ?
+	      ippGetString(attr, 0, NULL) : ""));
+    ippDelete(result);
+
+    pthread_mutex_lock(&ppd_workers_lock);
+    w->busy = 0;
+    pthread_cond_signal(&ppd_workers_cond);
+    pthread_mutex_unlock(&ppd_workers_lock);
+    pthread_rwlock_wrlock(&lock);
+    ippDelete(attrs_copy);
+    free(make_model_copy);
+    free(pdl_copy);
+    errno = err;
+    return (ok && ppdname[0]);
+  }
+  ippDelete(result);
+
+  // The process crashed, hangs, or we got cancelled
+  debug_printf("PPD generator process %d failed, stopping it.\n",
+	       (int)w->pid);
+  snprintf(msg, msg_size, "PPD generator process failed");
+  pthread_mutex_lock(&ppd_workers_lock);
+  usable = ppd_worker_kill(w);
+  w->busy = 0;
+  if (!usable)
+  {
+    debug_printf("Could not execute %s as PPD generator, generating PPDs in the daemon.\n",
+		 ppd_worker_program);
+    num_ppd_workers = 0;
+    pthread_cond_broadcast(&ppd_workers_cond);
+  }
+  else
+    pthread_cond_signal(&ppd_workers_cond);
+  pthread_mutex_unlock(&ppd_workers_lock);
+  pthread_rwlock_wrlock(&lock);
+
+  errno = 0;
+  if (!usable)
+    ok = generate_ppd(ppdname, ppdname_size, attrs, make_model, pdl,
+		      color, duplex, conflicts, sizes, default_pagesize,
+		      default_color, msg, msg_size);
+  err = errno;
+  ippDelete(attrs_copy);
+  free(make_model_copy);
+  free(pdl_copy);
+  errno = err;
+  return (ok);
+}
+
+
+// Get attributes of a remote printer, like cfGetPrinterAttributes()
+// but through a pooled connection of our own, so that the (often
+// large) response can get compressed and gets accounted
+//
+// If rtt is given, it gets the time of setting up the connection to
+// the printer in usec, which is about one network round trip (plus the
+// TLS handshake for IPPS), without the DNS-SD resolution and host name
+// lookup. 0 if an already open connection got used, the duration of
+// the request itself depends mainly on the printer's response time.
+static ipp_t *
+get_remote_printer_attributes(const char *uri,
+			      const char * const *pattrs,
+			      int pattrs_size,
+			      int debug,
+			      gint64 *rtt)
+{
+  char scheme[32], userpass[256], host[HTTP_MAX_HOST],
+       resource[HTTP_MAX_URI], *resolved_uri = NULL;
+  int port;
+  http_t *http;
+  ipp_t *response;
+  gint64 connect_time;
+
+  if (rtt)
+    *rtt = 0;
+  if (task_cancelled())
+    return (NULL);
+
+  // DNS-SD-service-name-based URI
+  if (strstr(uri, "._tcp"))
+  {
+    if ((resolved_uri = cfResolveURI(uri)) == NULL)
+      return (cfGetPrinterAttributes(uri, pattrs, pattrs_size, NULL, 0,
+				     debug));
+  }
+
+  if (httpSeparateURI(HTTP_URI_CODING_ALL,
+		      (resolved_uri ? resolved_uri : uri),
+		      scheme, sizeof(scheme), userpass, sizeof(userpass),
+		      host, sizeof(host), &port,
+		      resource, sizeof(resource)) < HTTP_URI_STATUS_OK ||
+      (http = http_pool_get(host, port,
+			    (!strcasecmp(scheme, "ipps") ?
+			     HTTP_ENCRYPT_ALWAYS :
+			     HTTP_ENCRYPT_IF_REQUESTED),
+			    &connect_time)) == NULL)
+  {
+    free(resolved_uri);
+    return (cfGetPrinterAttributes(uri, pattrs, pattrs_size, NULL, 0,
+				   debug));
+  }
+  httpSetTimeout(http, HttpRemoteTimeout, http_timeout_cb, NULL);
+
+  response = cfGetPrinterAttributes2(http,
+				     (resolved_uri ? resolved_uri : uri),
+				     pattrs, pattrs_size, NULL, 0, debug);
+  if (rtt && response)
+    *rtt = connect_time;
+  http_account_response(http, response);
+
+  http_pool_put(http, response != NULL);
+  free(resolved_uri);
+  return (response);
+}
+
+
+static int
+host_load_cmp(void *va, void *vb, void *data)
+{
+  return (strcasecmp(((host_load_t *)va)->host, ((host_load_t *)vb)->host));
+}
+
+
+// Find or create the load record of a remote host, call with
+// host_load_lock held
+static host_load_t *
+host_load_get(const char *host)
+{
+  host_load_t key, *h;
+
+  key.host = (char *)host;
+  if ((h = cupsArrayFind(host_loads, &key)) != NULL)
+    return (h);
+  if ((h = (host_load_t *)calloc(1, sizeof(host_load_t))) == NULL)
+    return (NULL);
+  h->host = strdup(host);
+  h->tokens = HttpRequestRatePerHost;
+  h->last_refill = g_get_monotonic_time();
+  cupsArrayAdd(host_loads, h);
+  return (h);
+}
+
+
+// Take a slot for a request to the given remote host. Returns 0 if the
+// host has already HttpMaxRequestsPerHost requests in progress or is
+// out of its rate (HttpRequestRatePerHost, with a burst of one second's
+// worth of requests), then the caller should try again later. With
+// force the slot is always taken (for requests which cannot wait),
+// counting against the limits for the others.
+static int
+host_request_start(const char *host,
+		   int force)
+{
+  host_load_t *h;
+  gint64 now;
+
+  if (!host || !host[0])
+    return (1);
+
+  pthread_mutex_lock(&host_load_lock);
+  if (!host_loads)
+    host_loads = cupsArrayNew(host_load_cmp, NULL);
+  if ((h = host_load_get(host)) == NULL)
+  {
+    pthread_mutex_unlock(&host_load_lock);
+    return (1);
+  }
+
+  // Refill the token bucket
+  now = g_get_monotonic_time();
+  if (HttpRequestRatePerHost > 0)
+  {
+    h->tokens += (double)(now - h->last_refill) * HttpRequestRatePerHost /
+      G_USEC_PER_SEC;
+    if (h->tokens > HttpRequestRatePerHost)
+      h->tokens = HttpRequestRatePerHost;
+  }
+  h->last_refill = now;
+
+  if (!force &&
+      ((HttpMaxRequestsPerHost > 0 && h->active >= HttpMaxRequestsPerHost) ||
+       (HttpRequestRatePerHost > 0 && h->tokens < 1.0)))
+  {
+    debug_printf("Deferring request to %s, %d requests in progress, rate limit %s.\n",
+		 host, h->active,
+		 (HttpRequestRatePerHost > 0 && h->tokens < 1.0 ? "reached" :
+		  "not reached"));
+    pthread_mutex_unlock(&host_load_lock);
+    return (0);
+  }
+
+  h->active ++;
+  if (HttpRequestRatePerHost > 0)
+    h->tokens -= 1.0;
+  pthread_mutex_unlock(&host_load_lock);
+  return (1);
+}
+
+
+// Wait until the given remote host has a token in its bucket
+// (HttpRequestRatePerHost), for callers which will take their slot
+// with force later, when they cannot wait any more. The token is not
+// taken, the later forced request takes it. Returns 0 if the calling
+// task got cancelled meanwhile
+static int
+host_request_wait(const char *host)
+{
+  host_load_t *h;
+  gint64 now, wait;
+
+  if (!host || !host[0])
+    return (1);
+
+  for (;;)
+  {
+    pthread_mutex_lock(&host_load_lock);
+    if (HttpRequestRatePerHost <= 0 || !host_loads ||
+	(h = host_load_get(host)) == NULL)
+    {
+      pthread_mutex_unlock(&host_load_lock);
+      return (1);
+    }
+    now = g_get_monotonic_time();
+    h->tokens += (double)(now - h->last_refill) * HttpRequestRatePerHost /
+      G_USEC_PER_SEC;
+    if (h->tokens > HttpRequestRatePerHost)
+      h->tokens = HttpRequestRatePerHost;
+    h->last_refill = now;
+    if (h->tokens >= 1.0)
     {
-      char    *values[num_value];
-      for (q = (char *)cupsArrayFirst(list),i=0;
-	   q;
-	   q = (char *)cupsArrayNext(list),i++)
+      pthread_mutex_unlock(&host_load_lock);
+      return (1);
+    }
+    wait = (gint64)((1.0 - h->tokens) * G_USEC_PER_SEC /
+		    HttpRequestRatePerHost) + 1;
+    pthread_mutex_unlock(&host_load_lock);
+    debug_printf("Waiting %ld msec for the request rate limit of %s.\n",
+		 (long)(wait / 1000), host);
+    g_usleep(wait);
+    if (task_cancelled())
+      return (0);
+  }
+}
+
+
+// Give back the slot taken by host_request_start()
+static void
+host_request_done(const char *host)
+{
+  host_load_t key, *h;
+
+  if (!host || !host[0])
+    return;
+
+  pthread_mutex_lock(&host_load_lock);
+  key.host = (char *)host;
+  if (host_loads && (h = cupsArrayFind(host_loads, &key)) != NULL &&
+      h->active > 0)
+    h->active --;
+  pthread_mutex_unlock(&host_load_lock);
+}
+
+
+// Attributes which we need to decide whether we set up a queue for a
+// discovered printer. The full set, often hundreds of KB because of
+// media-col-database, is only fetched when the queue gets created
+static const char * const classification_attrs[] =
+{
+  "printer-make-and-model",
+  "document-format-supported",
+  "ipp-versions-supported",
+  "pwg-raster-document-resolution-supported",
+  "urf-supported",
+  "pclm-compression-method-preferred"
+};
+
+
+// Attributes kept in the capabilities of a printer
+static const char * const capability_attrs[] =
+{
+  "document-format-supported",
+  "media-supported",
+  "sides-supported",
+  "print-color-mode-supported"
+};
+
+
+// ippCopyAttributes() callback selecting the capabilities
+static int
+capability_attr_filter(void *context,
+		       ipp_t *dst,
+		       ipp_attribute_t *attr)
+{
+  const char *name = ippGetName(attr);
+  int i;
+
+  if (!name)
+    return (0);
+  for (i = 0;
+       i < (int)(sizeof(capability_attrs) / sizeof(capability_attrs[0]));
+       i ++)
+    if (!strcmp(name, capability_attrs[i]))
+      return (1);
+  return (0);
+}
+
+
+// Replace the attributes of a printer, keeping track of their size
+// for AttributesMemoryLimit
+static void
+set_printer_attributes(remote_printer_t *p,
+		       ipp_t *attrs,
+		       int full)
+{
+  // A full set of attributes updates the capabilities, they stay when
+  // the attributes get dropped
+  if (attrs && full && p->prattrs != attrs)
+  {
+    ippDelete(p->capabilities);
+    if ((p->capabilities = ippNew()) != NULL)
+      ippCopyAttributes(p->capabilities, attrs, 0, capability_attr_filter,
+			NULL);
+  }
+  if (p->prattrs && p->prattrs != attrs)
+    ippDelete(p->prattrs);
+  p->prattrs = attrs;
+  p->prattrs_full = (attrs ? full : 0);
+  p->prattrs_size = (attrs ? ippLength(attrs) : 0);
+  p->prattrs_used = time(NULL);
+  p->prattrs_evicted = 0;
+}
+
+
+// Make sure that we have all attributes of the printer and not only
+// the classification set
+static int
+get_full_printer_attributes(remote_printer_t *p)
+{
+  ipp_t *response;
+
+  if (p->prattrs && p->prattrs_full)
+  {
+    p->prattrs_used = time(NULL);
+    return (1);
+  }
+  if (!p->uri || !p->uri[0])
+    return (0);
+
+  if (p->prattrs_evicted)
+    debug_printf("Fetching the attributes of %s again, they were dropped to stay within AttributesMemoryLimit.\n",
+		 p->uri);
+  host_request_start(p->host, 1);
+  response = get_remote_printer_attributes(p->uri, NULL, 0, 1, NULL);
+  host_request_done(p->host);
+  debug_log_out(cf_get_printer_attributes_log);
+  if (response == NULL)
+    return (0);
+  set_printer_attributes(p, response, 1);
+  return (1);
+}
+
+
+static int
+prattrs_used_cmp(remote_printer_t *a,
+		 remote_printer_t *b,
+		 void *data)
+{
+  if (a->prattrs_used != b->prattrs_used)
+    return (a->prattrs_used < b->prattrs_used ? -1 : 1);
+  return (a < b ? -1 : (a > b ? 1 : 0));
+}
+
+
+// After the queue of a printer is set up its attributes are only
+// needed for merging them with the ones of other cluster members and
+// for choosing the document format and resolution of jobs sent to it.
+// If we hold more than limit bytes of them, drop the least recently
+// used ones of printers which are not part of a cluster,
+// get_full_printer_attributes() fetches them again when needed.
+// Returns the number of bytes still held. Must be called with lock held
+static size_t
+drop_printer_attributes(size_t limit)
+{
+  remote_printer_t *p, *q;
+  cups_array_t *candidates;
+  size_t total = 0;
+  int num_evicted = 0, clustered;
+
+  candidates = cupsArrayNew((cups_array_func_t)prattrs_used_cmp, NULL);
+  for (p = (remote_printer_t *)cupsArrayFirst(remote_printers);
+       p; p = (remote_printer_t *)cupsArrayNext(remote_printers))
+  {
+    if (!p->prattrs)
+      continue;
+    total += p->prattrs_size;
+    if (p->status == STATUS_CONFIRMED && p->slave_of == NULL && !p->called)
+      cupsArrayAdd(candidates, p);
+  }
+
+  for (p = (remote_printer_t *)cupsArrayFirst(candidates);
+       p && total > limit; p = (remote_printer_t *)cupsArrayNext(candidates))
+  {
+    clustered = 0;
+    for (q = (remote_printer_t *)cupsArrayFirst(remote_printers);
+	 q; q = (remote_printer_t *)cupsArrayNext(remote_printers))
+      if (q->slave_of == p)
       {
-        values[i]=malloc(sizeof(char) * (strlen(q) + 1));
-        snprintf(values[i], strlen(q) + 1, "%s", q);
+	clustered = 1;
+	break;
       }
-      ippAddStrings(*merged_attributes, IPP_TAG_PRINTER,IPP_TAG_MIMETYPE,
-		    attributes[attr_no], num_value, NULL,
-		    (const char * const *)values);
+    if (clustered)
+      continue;
+    debug_printf("Dropping the attributes of %s (%zu bytes, last used %ld seconds ago) to save memory.\n",
+		 p->uri, p->prattrs_size, (long)(time(NULL) - p->prattrs_used));
+    total -= p->prattrs_size;
+    set_printer_attributes(p, NULL, 0);
+    p->prattrs_evicted = 1;
+    num_evicted ++;
+  }
+  cupsArrayDelete(candidates);
+
+  if (num_evicted)
+    debug_printf("Dropped the attributes of %d printers, %zu KBytes of printer attributes held in memory now.\n",
+		 num_evicted, total / 1024);
+
+  return (total);
+}
+
+
+// Something happened which makes us work: a printer appeared,
+// disappeared, or changed, or a job got started or finished. Can be
+// called from any thread
+static void
+note_activity(void)
+{
+  __atomic_store_n(&last_activity, time(NULL), __ATOMIC_RELAXED);
+  if (__atomic_exchange_n(&idle_mode, 0, __ATOMIC_RELAXED))
+    debug_printf("Leaving idle mode.\n");
+}
+
+
+// When nothing happened for IdleMemoryTrimTimeout seconds, release
+// what we can easily get back when we need it again: the idle
+// connections to remote hosts, the records of hosts without requests
+// in progress, and, if the memory for printer attributes is limited
+// (AttributesMemoryLimit), the attributes of the printers which are
+// not part of a cluster. Then give the free memory back to the system, the heap is
+// fragmented by the many short-lived resolver and queue creation
+// threads. Everything gets re-fetched on demand, so there is nothing
+// to do when leaving idle mode.
+static gboolean
+idle_check(gpointer user_data)
+{
+  remote_printer_t *p;
+  host_load_t *h;
+  size_t attrs_size;
+  int num_closed, num_hosts = 0;
+  time_t now = time(NULL);
+
+  (void)user_data;
+
+  if (terminating || in_shutdown)
+    return (FALSE);
+  if (IdleMemoryTrimTimeout == 0 ||
+      __atomic_load_n(&idle_mode, __ATOMIC_RELAXED) ||
+      now - __atomic_load_n(&last_activity, __ATOMIC_RELAXED) <
+      (time_t)IdleMemoryTrimTimeout)
+    return (TRUE);
+#ifdef HAVE_AVAHI
+  if (__atomic_load_n(&resolves_pending, __ATOMIC_ACQUIRE) > 0)
+    return (TRUE);
+#endif // HAVE_AVAHI
+
+  // Queues being created or updated hold the lock, do not wait for
+  // them, we are not idle then anyway
+  if (pthread_rwlock_trywrlock(&lock) != 0)
+    return (TRUE);
+  for (p = (remote_printer_t *)cupsArrayFirst(remote_printers);
+       p; p = (remote_printer_t *)cupsArrayNext(remote_printers))
+    if (p->status != STATUS_CONFIRMED || p->called)
+      break;
+  if (p)
+  {
+    // Work is scheduled, wait for it to be done
+    pthread_rwlock_unlock(&lock);
+    return (TRUE);
+  }
+  // Dropping the attributes costs re-fetching them on the next job,
+  // only worth it where memory is tight
+  attrs_size = drop_printer_attributes(AttributesMemoryLimit > 0 ? 0 :
+				       (size_t)-1);
+  pthread_rwlock_unlock(&lock);
+
+  num_closed = http_pool_close_unused();
+
+  pthread_mutex_lock(&host_load_lock);
+  for (h = cupsArrayFirst(host_loads); h; h = cupsArrayNext(host_loads))
+    if (h->active == 0)
+    {
+      cupsArrayRemove(host_loads, h);
+      free(h->host);
+      free(h);
+      num_hosts ++;
+    }
+  pthread_mutex_unlock(&host_load_lock);
+
+#ifdef HAVE_MALLOC_TRIM
+  malloc_trim(0);
+#endif // HAVE_MALLOC_TRIM
+
+  __atomic_store_n(&idle_mode, 1, __ATOMIC_RELAXED);
+  debug_printf("Nothing happened for %u seconds, entering idle mode: closed %d connections, dropped %d host records, %zu KBytes of printer attributes kept.\n",
+	       IdleMemoryTrimTimeout, num_closed, num_hosts, attrs_size / 1024);
+
+  return (TRUE);
+}
+
+
+//
+// Merging the capabilities of the members of a cluster
+//
+
+#undef DEBUG_CATEGORY
+#define DEBUG_CATEGORY DEBUG_CLUSTER
+
+
+static void
+pwg_ppdize_name(const char *ipp,      // I - IPP keyword
+                char       *name,     // I - Name buffer
+		size_t     namesize)  // I - Size of name buffer
+{
+  char  *ptr,       // Pointer into name buffer
+        *end;       // End of name buffer
+
+  *name = (char)toupper(*ipp++);
+
+  for (ptr = name + 1, end = name + namesize - 1; *ipp && ptr < end;)
+  {
+    if (*ipp == '-' &&
+	((ipp[1] >= 'A' && ipp[1] <= 'Z') ||
+	 (ipp[1] >= 'a' && ipp[1] <= 'z')))
+    {
+      ipp ++;
+      *ptr++ = (char)toupper(*ipp++ & 255);
+    }
+    else
+      *ptr++ = *ipp++;
+  }
+
+  *ptr = '\0';
+}
+
+
+// merge_vector_init - Prepares a vector for count values of the given size,
+//                     smaller ones go into the buffer of the vector itself
+static int
+merge_vector_init(merge_vector_t *v,
+		  size_t size,
+		  size_t count)
+{
+  v->size = size;
+  v->count = 0;
+  if (size * count <= sizeof(v->buffer))
+    v->values = v->buffer;
+  else if ((v->values = (char *)malloc(size * count)) == NULL)
+    return (0);
+  return (1);
+}
+
+
+#define merge_vector_add(v) \
+  ((void *)((v)->values + (v)->size * (v)->count ++))
+#define merge_vector_value(v, i) \
+  ((void *)((v)->values + (v)->size * (i)))
+
+
+// merge_vector_unique - Sorts the values and drops the duplicates, returns
+//                       the number of values left
+static size_t
+merge_vector_unique(merge_vector_t *v,
+		    int (*compare)(const void *, const void *))
+{
+  size_t i, n;
+
+  if (v->count < 2)
+    return (v->count);
+  qsort(v->values, v->count, v->size, compare);
+  for (i = 1, n = 1; i < v->count; i ++)
+    if ((*compare)(merge_vector_value(v, n - 1), merge_vector_value(v, i)))
+    {
+      if (i != n)
+	memcpy(merge_vector_value(v, n), merge_vector_value(v, i), v->size);
+      n ++;
+    }
+  return (v->count = n);
+}
+
+
+static void
+merge_vector_free(merge_vector_t *v)
+{
+  if (v->values != v->buffer)
+    free(v->values);
+  v->values = NULL;
+}
+
+
+// get_cluster_member_attributes - Finds the attribute in all the active
+//                                 members of the cluster, attrs needs space
+//                                 for all remote printers. Returns the
+//                                 number of members having the attribute,
+//                                 the total number of values in num_values
+static int
+get_cluster_member_attributes(const char *cluster_name,
+			      const char *name,
+			      ipp_tag_t value_tag,
+			      ipp_attribute_t **attrs,
+			      size_t *num_values)
+{
+  remote_printer_t *p;
+  ipp_attribute_t  *attr;
+  int              num_attrs = 0;
+
+  *num_values = 0;
+  for (p = (remote_printer_t *)cupsArrayFirst(remote_printers);
+       p; p = (remote_printer_t *)cupsArrayNext(remote_printers))
+  {
+    if (strcmp(cluster_name, p->queue_name))
+      continue;
+    if (p->status == STATUS_DISAPPEARED || p->status == STATUS_UNCONFIRMED ||
+	p->status == STATUS_TO_BE_RELEASED)
+      continue;
+    if ((attr = ippFindAttribute(p->prattrs, name, value_tag)) != NULL)
+    {
+      attrs[num_attrs ++] = attr;
+      *num_values += ippGetCount(attr);
+    }
+  }
+  return (num_attrs);
+}
+
+
+static int
+compare_merge_string(const void *a,
+		     const void *b)
+{
+  return (strcasecmp(*(const char * const *)a, *(const char * const *)b));
+}
+
+
+static int
+compare_merge_int(const void *a,
+		  const void *b)
+{
+  return (compare_int(*(const int *)a, *(const int *)b));
+}
+
+
+static int
+compare_merge_resolution(const void *a,
+			 const void *b)
+{
+  return (cfCompareResolutions((void *)a, (void *)b, NULL));
+}
+
+
+// add_string_attributes - Adds the union of the string values of the
+//                         attributes of the cluster members. The strings
+//                         are not copied, they stay owned by the members'
+//                         attributes until ippAddStrings() copies them
+static void
+add_string_attributes(const char *cluster_name,
+		      ipp_t *merged_attributes,
+		      const char * const *attributes,
+		      int num_attributes,
+		      ipp_tag_t find_tag,
+		      ipp_tag_t value_tag)
+{
+  int             attr_no, num_attrs, i, j, count;
+  size_t          num_values;
+  const char      *str;
+  ipp_attribute_t *attrs[cupsArrayCount(remote_printers) + 1];
+  merge_vector_t  list;
+
+  for (attr_no = 0; attr_no < num_attributes; attr_no ++)
+  {
+    if ((num_attrs = get_cluster_member_attributes(cluster_name,
+						   attributes[attr_no],
+						   find_tag, attrs,
+						   &num_values)) == 0)
+      continue;
+    if (!merge_vector_init(&list, sizeof(const char *), num_values))
+      return;
+
+    for (i = 0; i < num_attrs; i ++)
+      for (j = 0, count = ippGetCount(attrs[i]); j < count; j ++)
+	if ((str = ippGetString(attrs[i], j, NULL)) != NULL)
+	  *(const char **)merge_vector_add(&list) = str;
+
+    if (merge_vector_unique(&list, compare_merge_string))
+      ippAddStrings(merged_attributes, IPP_TAG_PRINTER, value_tag,
+		    attributes[attr_no], (int)list.count, NULL,
+		    (const char * const *)list.values);
+    merge_vector_free(&list);
+  }
+}
 
-      for (int k = 0; k < i; k++)
-      {
-        free(values[k]);
-        values[k] = NULL;
-      }
-    }
-    cupsArrayDelete(list);
-    list = NULL;
+
+// add_integer_attributes - Adds the union of the integer or enum values of
+//                          the attributes of the cluster members
+static void
+add_integer_attributes(const char *cluster_name,
+		       ipp_t *merged_attributes,
+		       const char * const *attributes,
+		       int num_attributes,
+		       ipp_tag_t value_tag)
+{
+  int             attr_no, num_attrs, i, j, count;
+  size_t          num_values;
+  ipp_attribute_t *attrs[cupsArrayCount(remote_printers) + 1];
+  merge_vector_t  list;
+
+  for (attr_no = 0; attr_no < num_attributes; attr_no ++)
+  {
+    if ((num_attrs = get_cluster_member_attributes(cluster_name,
+						   attributes[attr_no],
+						   value_tag, attrs,
+						   &num_values)) == 0)
+      continue;
+    if (!merge_vector_init(&list, sizeof(int), num_values))
+      return;
+
+    for (i = 0; i < num_attrs; i ++)
+      for (j = 0, count = ippGetCount(attrs[i]); j < count; j ++)
+	*(int *)merge_vector_add(&list) = ippGetInteger(attrs[i], j);
+
+    if (merge_vector_unique(&list, compare_merge_int))
+      ippAddIntegers(merged_attributes, IPP_TAG_PRINTER, value_tag,
+		     attributes[attr_no], (int)list.count,
+		     (const int *)list.values);
+    merge_vector_free(&list);
   }
 }
 
 
+static void
+add_mimetype_attributes(char *cluster_name,
+			ipp_t **merged_attributes)
+{
+  static const char * const attributes[] =
+  {
+    "document-format-supported"
+  };
+
+  add_string_attributes(cluster_name, *merged_attributes, attributes, 1,
+			IPP_TAG_MIMETYPE, IPP_TAG_MIMETYPE);
+}
+
+
 // add_tagzero_attributes - Adds attribute to the merged_attribute variable for
 //                          the cluster. This function adds attribute with value
 //                          tag IPP_TAG_ZERO
@@ -1230,14 +3261,7 @@ static void
 add_tagzero_attributes(char* cluster_name,
 		       ipp_t **merged_attributes)
 {
-  int                  count, i;
-  remote_printer_t     *p;
-  const char           *str;
-  char                 *q;
-  cups_array_t         *list;
-  ipp_attribute_t      *attr;
-  int                  num_value, attr_no;
-  char* attributes[] =
+  static const char * const attributes[] =
   {
     "media-supported",
     "output-bin-supported",
@@ -1246,65 +3270,8 @@ add_tagzero_attributes(char* cluster_name,
     "print-scaling-supported"
   };
 
-  for (attr_no = 0; attr_no < 5; attr_no++)
-  {
-    // Cups Array to store the values for the attribute
-    if ((list = cupsArrayNew3((cups_array_func_t)strcasecmp, NULL, NULL, 0,
-			      (cups_acopy_func_t)strdup,
-			      (cups_afree_func_t)free)) == NULL)
-      return ;
-
-    num_value = 0;
-    // Iterating over all the printers in the cluster
-    for (p = (remote_printer_t *)cupsArrayFirst(remote_printers);
-	 p; p = (remote_printer_t *)cupsArrayNext(remote_printers))
-    {
-      if (strcmp(cluster_name, p->queue_name))
-	continue;
-      if (p->status == STATUS_DISAPPEARED || p->status == STATUS_UNCONFIRMED ||
-	  p->status ==  STATUS_TO_BE_RELEASED)
-	continue;
-      if ((attr = ippFindAttribute(p->prattrs, attributes[attr_no],
-				   IPP_TAG_ZERO)) != NULL)
-      {
-	count = ippGetCount(attr);
-	for(i = 0; i < count; i ++)
-	{
-	  // Pick next format from attribute
-	  str = ippGetString(attr, i, NULL);
-	  // Add format to list, skip duplicates
-	  if (!cupsArrayFind(list, (void *)str))
-	  {
-	    cupsArrayAdd(list, (void *)str);
-	    num_value ++;
-	  }
-	}
-      }
-    }
-    if (num_value != 0)
-    {
-      char    *values[num_value];
-      // Transferring attributes value from cups Array to char* array
-      for (q = (char *)cupsArrayFirst(list), i = 0; q;
-           q = (char *)cupsArrayNext(list), i ++)
-      {
-        values[i] = malloc(sizeof(char) * (strlen(q) + 1));
-        snprintf(values[i], strlen(q) + 1, "%s", q);
-      }
-      ippAddStrings(*merged_attributes, IPP_TAG_PRINTER,
-                    IPP_TAG_KEYWORD, attributes[attr_no],
-                    num_value, NULL,
-                    (const char * const *)values);
-
-      for (int k = 0; k < i; k++)
-      {
-        free(values[k]);
-        values[k] = NULL;
-      }
-    }
-    cupsArrayDelete(list);
-    list = NULL;
-  }
+  add_string_attributes(cluster_name, *merged_attributes, attributes, 5,
+			IPP_TAG_ZERO, IPP_TAG_KEYWORD);
 }
 
 // add_keyword_attributes - Adds attributes to the merged_attribute variable for
@@ -1314,14 +3281,7 @@ static void
 add_keyword_attributes(char* cluster_name,
 		       ipp_t **merged_attributes)
 {
-  int                  count, i;
-  remote_printer_t     *p;
-  const char           *str;
-  char                 *q;
-  cups_array_t         *list;
-  ipp_attribute_t      *attr;
-  int                  num_value, attr_no;
-  char* attributes[] =
+  static const char * const attributes[] =
   {
     "output-mode-supported",
     "urf-supported",
@@ -1332,60 +3292,8 @@ add_keyword_attributes(char* cluster_name,
     "sides-supported"
   };
 
-  for (attr_no = 0; attr_no < 7; attr_no ++)
-  {
-    if ((list = cupsArrayNew3((cups_array_func_t)strcasecmp, NULL, NULL, 0,
-			      (cups_acopy_func_t)strdup,
-			      (cups_afree_func_t)free)) == NULL)
-      return;
-
-    num_value = 0;
-    for (p = (remote_printer_t *)cupsArrayFirst(remote_printers);
-         p; p = (remote_printer_t *)cupsArrayNext(remote_printers))
-    {
-      if (strcmp(cluster_name, p->queue_name))
-        continue;
-      if (p->status == STATUS_DISAPPEARED || p->status == STATUS_UNCONFIRMED ||
-	  p->status == STATUS_TO_BE_RELEASED)
-        continue;
-      if ((attr = ippFindAttribute(p->prattrs, attributes[attr_no],
-				   IPP_TAG_KEYWORD)) != NULL)
-      {
-        count = ippGetCount(attr);
-        for (i = 0; i < count; i++)
-	{
-          str = ippGetString(attr, i, NULL);
-          if (!cupsArrayFind(list, (void *)str))
-	  {
-            cupsArrayAdd(list, (void *)str);
-            num_value ++;
-          }
-        }
-      }
-    }
-    if (num_value != 0)
-    {
-      char    *values[num_value];
-      for (q = (char *)cupsArrayFirst(list), i=0;
-	   q;
-	   q = (char *)cupsArrayNext(list), i ++)
-      {
-        values[i] = malloc(sizeof(char) * (strlen(q) + 1));
-        snprintf(values[i], strlen(q) + 1, "%s", q);
-      }
-      ippAddStrings(*merged_attributes, IPP_TAG_PRINTER, IPP_TAG_KEYWORD,
-		    attributes[attr_no], num_value, NULL,
-		    (const char * const *)values);
-
-      for (int k = 0; k < i; k++)
-      {
-        free(values[k]);
-        values[k] = NULL;
-      }
-    }
-    cupsArrayDelete(list);
-    list = NULL;
-  }
+  add_string_attributes(cluster_name, *merged_attributes, attributes, 7,
+			IPP_TAG_KEYWORD, IPP_TAG_KEYWORD);
 }
 
 
@@ -1396,71 +3304,16 @@ static void
 add_enum_attributes(char* cluster_name,
 		    ipp_t **merged_attributes)
 {
-  int                  count, i, value;
-  remote_printer_t     *p;
-  char                 *str = NULL;
-  char                 *q;
-  cups_array_t         *list;
-  ipp_attribute_t      *attr;
-  int                  num_value, attr_no;
-  char* attributes[] = {
-                         "finishings-supported",
-                         "print-quality-supported",
-                         "finishing-template",
-                         "finishings-col-database"
-                       };
-
-  for (attr_no = 0; attr_no < 4; attr_no ++)
-  {
-    if ((list = cupsArrayNew3((cups_array_func_t)strcasecmp, NULL, NULL, 0,
-			      (cups_acopy_func_t)strdup,
-			      (cups_afree_func_t)free)) == NULL)
-      return ;
-    str = malloc(sizeof(char) * 10);
-    num_value = 0;
-    for (p = (remote_printer_t *)cupsArrayFirst(remote_printers);
-         p; p = (remote_printer_t *)cupsArrayNext(remote_printers))
-    {
-      if (strcmp(cluster_name, p->queue_name))
-        continue;
-      if (p->status == STATUS_DISAPPEARED || p->status == STATUS_UNCONFIRMED ||
-	  p->status == STATUS_TO_BE_RELEASED)
-        continue;
-      if ((attr = ippFindAttribute(p->prattrs,attributes[attr_no],
-				   IPP_TAG_ENUM)) != NULL)
-      {
-        count = ippGetCount(attr);
-        for (i = 0; i < count; i ++)
-	{
-          value = ippGetInteger(attr, i);
-          sprintf(str,"%d",value);
-          if (!cupsArrayFind(list, (void *)str))
-	  {
-            cupsArrayAdd(list, (void *)str);
-            num_value++;
-          }
-        }
-      }
-    }
-
-    if (num_value != 0)
-    {
-      int   values[num_value];
-      for (q = (char *)cupsArrayFirst(list), i = 0; q;
-           q = (char *)cupsArrayNext(list), i++)
-        values[i] = atoi(q);
-      ippAddIntegers(*merged_attributes, IPP_TAG_PRINTER,IPP_TAG_ENUM,
-		     attributes[attr_no], num_value,values);
-    }
+  static const char * const attributes[] =
+  {
+    "finishings-supported",
+    "print-quality-supported",
+    "finishing-template",
+    "finishings-col-database"
+  };
 
-    if (str != NULL)
-    {
-      free(str);
-      str = NULL;
-    }
-    cupsArrayDelete(list);
-    list = NULL;
-  }
+  add_integer_attributes(cluster_name, *merged_attributes, attributes, 4,
+			 IPP_TAG_ENUM);
 }
 
 
@@ -1470,14 +3323,7 @@ static void
 add_margin_attributes(char* cluster_name,
 		      ipp_t **merged_attributes)
 {
-  int                  count, i, value;
-  remote_printer_t     *p;
-  char                 *str;
-  char                 *q;
-  cups_array_t         *list;
-  ipp_attribute_t      *attr;
-  int                  num_value, attr_no;
-  char* attributes[] =
+  static const char * const attributes[] =
   {
     "media-bottom-margin-supported",
     "media-left-margin-supported",
@@ -1485,57 +3331,8 @@ add_margin_attributes(char* cluster_name,
     "media-right-margin-supported"
   };
 
-  for (attr_no = 0; attr_no < 4; attr_no++)
-  {
-    if ((list = cupsArrayNew3((cups_array_func_t)strcasecmp, NULL, NULL, 0,
-			      (cups_acopy_func_t)strdup,
-			      (cups_afree_func_t)free)) == NULL)
-      return ;
-    str = malloc(sizeof(char)*10);
-    num_value = 0;
-    for (p = (remote_printer_t *)cupsArrayFirst(remote_printers);
-         p; p = (remote_printer_t *)cupsArrayNext(remote_printers))
-    {
-      if (strcmp(cluster_name, p->queue_name))
-        continue;
-      if (p->status == STATUS_DISAPPEARED || p->status == STATUS_UNCONFIRMED ||
-	  p->status ==  STATUS_TO_BE_RELEASED)
-        continue;
-      if ((attr = ippFindAttribute(p->prattrs,attributes[attr_no],
-				   IPP_TAG_INTEGER)) != NULL)
-      {
-        count = ippGetCount(attr);
-        for (i = 0; i < count; i++)
-	{
-          value = ippGetInteger(attr, i);
-          sprintf(str,"%d",value);
-          if (!cupsArrayFind(list, (void *)str))
-	  {
-            cupsArrayAdd(list, (void *)str);
-            num_value++;
-          }
-        }
-      }
-    }
-
-    if (num_value != 0)
-    {
-      int   values[num_value];
-      for (q = (char *)cupsArrayFirst(list),i=0; q;
-           q = (char *)cupsArrayNext(list),i++)
-        values[i] = atoi(q);
-      ippAddIntegers(*merged_attributes, IPP_TAG_PRINTER,IPP_TAG_INTEGER,
-		     attributes[attr_no], num_value,values);
-    }
-
-    if (str != NULL)
-    {
-      free(str);
-      str = NULL;
-    }
-    cupsArrayDelete(list);
-    list = NULL;
-  }
+  add_integer_attributes(cluster_name, *merged_attributes, attributes, 4,
+			 IPP_TAG_INTEGER);
 }
 
 
@@ -1545,63 +3342,58 @@ static void
 add_resolution_attributes(char* cluster_name,
 			  ipp_t **merged_attributes)
 {
-  int                  count, i;
-  remote_printer_t     *p;
-  ipp_attribute_t      *attr;
-  int                  num_resolution, attr_no;
-  cups_array_t         *res_array;
-  cf_res_t             *res, *resolution;
-  char* attributes[] = {
-                         "printer-resolution-supported",
-                         "pwg-raster-document-resolution-supported",
-                         "pclm-source-resolution-supported"
-                       };
+  int                  num_attrs, i, j, count, attr_no;
+  size_t               num_values;
+  ipp_res_t            units;
+  cf_res_t             *res;
+  ipp_attribute_t      *attrs[cupsArrayCount(remote_printers) + 1];
+  merge_vector_t       res_array;
+  static const char * const attributes[] =
+  {
+    "printer-resolution-supported",
+    "pwg-raster-document-resolution-supported",
+    "pclm-source-resolution-supported"
+  };
 
   for (attr_no = 0; attr_no < 3; attr_no ++)
   {
-    res_array = NULL;
-    res_array = cfNewResolutionArray();
-    num_resolution = 0;
-    for (p = (remote_printer_t *)cupsArrayFirst(remote_printers);
-	 p; p = (remote_printer_t *)cupsArrayNext(remote_printers))
-    {
-      if (strcmp(cluster_name, p->queue_name))
-	continue;
-      if (p->status == STATUS_DISAPPEARED || p->status == STATUS_UNCONFIRMED ||
-	  p->status == STATUS_TO_BE_RELEASED)
-	continue;
-      if ((attr = ippFindAttribute(p->prattrs, attributes[attr_no],
-				   IPP_TAG_RESOLUTION)) != NULL)
+    if ((num_attrs = get_cluster_member_attributes(cluster_name,
+						   attributes[attr_no],
+						   IPP_TAG_RESOLUTION, attrs,
+						   &num_values)) == 0)
+      continue;
+    if (!merge_vector_init(&res_array, sizeof(cf_res_t), num_values))
+      return;
+
+    for (i = 0; i < num_attrs; i ++)
+      for (j = 0, count = ippGetCount(attrs[i]); j < count; j ++)
       {
-        for (i = 0, count = ippGetCount(attr); i < count; i ++)
+	res = (cf_res_t *)merge_vector_add(&res_array);
+	res->x = ippGetResolution(attrs[i], j, &res->y, &units);
+	// We merge in DPI, convert as cfIPPResToResolution() does
+	if (units == IPP_RES_PER_CM)
 	{
-          if ((res = cfIPPResToResolution(attr, i)) != NULL)
-	  {
-	    if (cupsArrayFind(res_array, res) == NULL)
-	    {
-	      cupsArrayAdd(res_array, res);
-	      num_resolution ++;
-	    }
-	    cfFreeResolution(res, NULL);
-	  }
+	  res->x = (int)(res->x * 2.54);
+	  res->y = (int)(res->y * 2.54);
 	}
+	if (res->x <= 0 || res->y <= 0)
+	  res_array.count --;
       }
-    }
-    if (num_resolution)
+
+    if (merge_vector_unique(&res_array, compare_merge_resolution))
     {
-      int xres[num_resolution], yres[num_resolution];
-      for (i = 0, resolution = cupsArrayFirst(res_array); resolution;
-	   i ++, resolution = cupsArrayNext(res_array))
+      int xres[res_array.count], yres[res_array.count];
+      for (i = 0; i < (int)res_array.count; i ++)
       {
-	xres[i] = resolution->x;
-	yres[i] = resolution->y;
+	res = (cf_res_t *)merge_vector_value(&res_array, i);
+	xres[i] = res->x;
+	yres[i] = res->y;
       }
       ippAddResolutions(*merged_attributes, IPP_TAG_PRINTER,
-			attributes[attr_no], num_resolution,
+			attributes[attr_no], (int)res_array.count,
 			IPP_RES_PER_INCH, xres, yres);
     }
-    cupsArrayDelete(res_array);
-    res_array = NULL;
+    merge_vector_free(&res_array);
   }
 }
 
@@ -1612,116 +3404,86 @@ static void
 add_mediasize_attributes(char* cluster_name,
 			 ipp_t **merged_attributes)
 {
-  int                  count, i = 0;
-  remote_printer_t     *p;
-  ipp_attribute_t      *attr, *media_size_supported, *x_dim, *y_dim;
-  int                  num_sizes, attr_no, num_ranges;
+  int                  num_attrs, i, j, count;
+  size_t               num_values;
+  ipp_attribute_t      *attrs[cupsArrayCount(remote_printers) + 1],
+                       *media_size_supported, *x_dim, *y_dim;
   ipp_t                *media_size;
-  cups_array_t         *sizes, *size_ranges;
-  media_size_t         *temp, *media_s;
-  pagesize_range_t     *temp_range = NULL, *range = NULL;
-  char* attributes[] = {
-                         "media-size-supported",
-                       };
-
-  sizes = cupsArrayNew3((cups_array_func_t)compare_mediasize, NULL, NULL, 0,
-			(cups_acopy_func_t)copy_media_size,
-			(cups_afree_func_t)free);
-  size_ranges = cupsArrayNew3((cups_array_func_t)compare_rangesize, NULL, NULL,
-			      0,
-			      (cups_acopy_func_t)copy_range_size,
-			      (cups_afree_func_t)free);
-  temp = (media_size_t *)malloc(sizeof(media_size_t));
-  temp_range = (pagesize_range_t *)malloc(sizeof(pagesize_range_t));
-  for (attr_no = 0; attr_no < 1; attr_no ++)
-  {
-    num_sizes = 0;
-    num_ranges = 0;
-    for (p = (remote_printer_t *)cupsArrayFirst(remote_printers);
-	 p; p = (remote_printer_t *)cupsArrayNext(remote_printers))
+  merge_vector_t       sizes, size_ranges;
+  media_size_t         *media_s;
+  pagesize_range_t     *range;
+
+  if ((num_attrs = get_cluster_member_attributes(cluster_name,
+						 "media-size-supported",
+						 IPP_TAG_BEGIN_COLLECTION,
+						 attrs, &num_values)) == 0)
+    return;
+  if (!merge_vector_init(&sizes, sizeof(media_size_t), num_values))
+    return;
+  if (!merge_vector_init(&size_ranges, sizeof(pagesize_range_t), num_values))
+  {
+    merge_vector_free(&sizes);
+    return;
+  }
+
+  for (i = 0; i < num_attrs; i ++)
+    for (j = 0, count = ippGetCount(attrs[i]); j < count; j ++)
     {
-      if (strcmp(cluster_name, p->queue_name))
-        continue;
-      if (p->status == STATUS_DISAPPEARED || p->status == STATUS_UNCONFIRMED ||
-	  p->status == STATUS_TO_BE_RELEASED)
-        continue;
-      if ((attr = ippFindAttribute(p->prattrs, attributes[attr_no],
-				   IPP_TAG_BEGIN_COLLECTION)) != NULL)
+      media_size = ippGetCollection(attrs[i], j);
+      x_dim = ippFindAttribute(media_size, "x-dimension", IPP_TAG_ZERO);
+      y_dim = ippFindAttribute(media_size, "y-dimension", IPP_TAG_ZERO);
+      if (ippGetValueTag(x_dim) == IPP_TAG_RANGE ||
+	  ippGetValueTag(y_dim) == IPP_TAG_RANGE)
       {
-        for (i = 0, count = ippGetCount(attr); i < count; i ++)
-	{
-          media_size  = ippGetCollection(attr, i);
-          x_dim = ippFindAttribute(media_size, "x-dimension", IPP_TAG_ZERO);
-          y_dim = ippFindAttribute(media_size, "y-dimension", IPP_TAG_ZERO);
-          if (ippGetValueTag(x_dim) == IPP_TAG_RANGE ||
-	      ippGetValueTag(y_dim) == IPP_TAG_RANGE)
-	  {
-            if (ippGetValueTag(x_dim) == IPP_TAG_RANGE)
-              temp_range->x_dim_min = ippGetRange(x_dim, 0,
-						  &temp_range->x_dim_max);
-            else
-              temp_range->x_dim_min = temp_range->x_dim_max =
-		ippGetInteger(x_dim, 0);
-
-            if (ippGetValueTag(y_dim) == IPP_TAG_RANGE)
-              temp_range->y_dim_min = ippGetRange(y_dim, 0,
-						  &temp_range->y_dim_max);
-            else
-              temp_range->y_dim_min = temp_range->y_dim_max =
-		ippGetInteger(y_dim, 0);
-            if (!cupsArrayFind(size_ranges, temp_range))
-	    {
-              cupsArrayAdd(size_ranges, temp_range);
-              num_ranges++;
-            }
-          }
-	  else
-	  {
-            temp->x = ippGetInteger(x_dim, 0);
-            temp->y = ippGetInteger(y_dim, 0);
-            if (!cupsArrayFind(sizes, temp))
-	    {
-              cupsArrayAdd(sizes, temp);
-              num_sizes++;
-            }
-          }
-        }
+	range = (pagesize_range_t *)merge_vector_add(&size_ranges);
+	if (ippGetValueTag(x_dim) == IPP_TAG_RANGE)
+	  range->x_dim_min = ippGetRange(x_dim, 0, &range->x_dim_max);
+	else
+	  range->x_dim_min = range->x_dim_max = ippGetInteger(x_dim, 0);
+
+	if (ippGetValueTag(y_dim) == IPP_TAG_RANGE)
+	  range->y_dim_min = ippGetRange(y_dim, 0, &range->y_dim_max);
+	else
+	  range->y_dim_min = range->y_dim_max = ippGetInteger(y_dim, 0);
+      }
+      else
+      {
+	media_s = (media_size_t *)merge_vector_add(&sizes);
+	media_s->x = ippGetInteger(x_dim, 0);
+	media_s->y = ippGetInteger(y_dim, 0);
       }
     }
+
+  merge_vector_unique(&sizes, compare_mediasize);
+  merge_vector_unique(&size_ranges, compare_rangesize);
+  if (sizes.count + size_ranges.count > 0)
+  {
     media_size_supported =
-      ippAddCollections(*merged_attributes,
-			IPP_TAG_PRINTER, attributes[attr_no],
-			num_sizes+num_ranges, NULL);
-    if (num_sizes)
+      ippAddCollections(*merged_attributes, IPP_TAG_PRINTER,
+			"media-size-supported",
+			(int)(sizes.count + size_ranges.count), NULL);
+    for (i = 0; i < (int)sizes.count; i ++)
     {
-      for (i = 0, media_s = cupsArrayFirst(sizes);
-	   media_s; i ++, media_s = cupsArrayNext(sizes))
-      {
-        ipp_t *size = create_media_size(media_s->x, media_s->y);
-        ippSetCollection(*merged_attributes, &media_size_supported, i, size);
-        ippDelete(size);
-      }
+      media_s = (media_size_t *)merge_vector_value(&sizes, i);
+      ipp_t *size = create_media_size(media_s->x, media_s->y);
+      ippSetCollection(*merged_attributes, &media_size_supported, i, size);
+      ippDelete(size);
     }
-    if (num_ranges)
+    for (j = 0; j < (int)size_ranges.count; i ++, j ++)
     {
-      for (range = cupsArrayFirst(size_ranges); range;
-	   i++, range = cupsArrayNext(size_ranges))
-      {
-        ipp_t *size_range = create_media_range(range->x_dim_min,
-					       range->x_dim_max,
-					       range->y_dim_min,
-					       range->y_dim_max);
-        ippSetCollection(*merged_attributes, &media_size_supported, i,
-			 size_range);
-        ippDelete(size_range);
-      }
+      range = (pagesize_range_t *)merge_vector_value(&size_ranges, j);
+      ipp_t *size_range = create_media_range(range->x_dim_min,
+					     range->x_dim_max,
+					     range->y_dim_min,
+					     range->y_dim_max);
+      ippSetCollection(*merged_attributes, &media_size_supported, i,
+		       size_range);
+      ippDelete(size_range);
     }
   }
 
-  free(temp);
-  free(temp_range);
-  cupsArrayDelete(sizes);
-  cupsArrayDelete(size_ranges);
+  merge_vector_free(&sizes);
+  merge_vector_free(&size_ranges);
 }
 
 
@@ -1731,217 +3493,193 @@ static void
 add_mediadatabase_attributes(char* cluster_name,
 			     ipp_t **merged_attributes)
 {
-  int                  count, i;
-  remote_printer_t     *p;
-  ipp_attribute_t      *attr, *media_attr;
-  int                  num_database, attr_no;
-  cups_array_t         *media_database;
-  media_col_t          *temp, *media_data;
-  ipp_t                *media_col,
-                       *media_size, *current_media;
-  ipp_attribute_t      *media_col_database;
-  char                 media_source[32], media_type[32];
-  char* attributes[] = {
-                         "media-col-database",
-                       };
-  temp = (media_col_t *)malloc(sizeof(media_col_t));
-  media_database = cupsArrayNew3((cups_array_func_t)compare_media,
-				 NULL, NULL, 0,
-				 (cups_acopy_func_t)copy_media,
-				 (cups_afree_func_t)free);
-  for (attr_no = 0; attr_no < 1; attr_no ++)
-  {
-    num_database = 0;
-    for (p = (remote_printer_t *)cupsArrayFirst(remote_printers);
-         p; p = (remote_printer_t *)cupsArrayNext(remote_printers))
-    {
-      if (strcmp(cluster_name, p->queue_name))
-        continue;
-      if (p->status == STATUS_DISAPPEARED || p->status == STATUS_UNCONFIRMED ||
-	  p->status == STATUS_TO_BE_RELEASED)
-        continue;
-      if ((attr = ippFindAttribute(p->prattrs, attributes[attr_no],
-				   IPP_TAG_BEGIN_COLLECTION)) != NULL)
-      {
-        for (i = 0, count = ippGetCount(attr); i < count; i ++)
-	{
-          media_col = ippGetCollection(attr, i);
-          media_size =
-	    ippGetCollection(ippFindAttribute(media_col,
-					      "media-size",
-					      IPP_TAG_BEGIN_COLLECTION), 0);
-          temp->x = ippGetInteger(ippFindAttribute(media_size, "x-dimension",
-						   IPP_TAG_ZERO),0);
-          temp->y = ippGetInteger(ippFindAttribute(media_size, "y-dimension",
-						   IPP_TAG_ZERO),0);
-          temp->top_margin =
-	    ippGetInteger(ippFindAttribute(media_col,
-					   "media-top-margin",
-					   IPP_TAG_INTEGER),
-			  0);
-          temp->bottom_margin =
-	    ippGetInteger(ippFindAttribute(media_col,
-					   "media-bottom-margin",
-					   IPP_TAG_INTEGER),
-			  0);
-          temp->left_margin =
-	    ippGetInteger(ippFindAttribute(media_col,
-					   "media-left-margin",
-					   IPP_TAG_INTEGER),
-			  0);
-          temp->right_margin =
-	    ippGetInteger(ippFindAttribute(media_col,
-					   "media-right-margin",
-					   IPP_TAG_INTEGER),
-			  0);
-          media_type[0] = '\0';
-          media_source[0] = '\0';
-          temp->media_source = NULL;
-          temp->media_type = NULL;          
-          if ((media_attr = ippFindAttribute(media_col,
-					     "media-type",
-					     IPP_TAG_KEYWORD)) != NULL)
-            pwg_ppdize_name(ippGetString(media_attr, 0, NULL), media_type,
-			    sizeof(media_type));
-          if (strlen(media_type) > 1)
-	  {
-            temp->media_type = (char*)malloc(sizeof(char) * 32);
-            strcpy(temp->media_type, media_type);
-          }
-          if ((media_attr = ippFindAttribute(media_col, "media-source",
-					     IPP_TAG_KEYWORD)) != NULL)
-	  {
-            pwg_ppdize_name(ippGetString(media_attr, 0, NULL), media_source,
-			    sizeof(media_source));
-          }
-          if(strlen(media_source) > 1)
-	  {
-            temp->media_source = (char*)malloc(sizeof(char) * 32);
-            strcpy(temp->media_source, media_source);
-          }
+  int                  num_attrs, i, j, count;
+  size_t               num_values;
+  ipp_attribute_t      *attrs[cupsArrayCount(remote_printers) + 1],
+                       *media_attr, *media_col_database;
+  merge_vector_t       media_database;
+  media_col_key_t      *media_data;
+  ipp_t                *media_col, *media_size, *current_media;
+
+  if ((num_attrs = get_cluster_member_attributes(cluster_name,
+						 "media-col-database",
+						 IPP_TAG_BEGIN_COLLECTION,
+						 attrs, &num_values)) == 0)
+    return;
+  if (!merge_vector_init(&media_database, sizeof(media_col_key_t),
+			 num_values))
+    return;
 
-          if (!cupsArrayFind(media_database, temp))
-	  {
-            cupsArrayAdd(media_database, temp);
-            num_database ++;
-          }
-        }
-      }
-    }
+  for (i = 0; i < num_attrs; i ++)
+    for (j = 0, count = ippGetCount(attrs[i]); j < count; j ++)
+    {
+      media_col = ippGetCollection(attrs[i], j);
+      media_data = (media_col_key_t *)merge_vector_add(&media_database);
+      media_size =
+	ippGetCollection(ippFindAttribute(media_col, "media-size",
+					  IPP_TAG_BEGIN_COLLECTION), 0);
+      media_data->x = ippGetInteger(ippFindAttribute(media_size,
+						     "x-dimension",
+						     IPP_TAG_ZERO), 0);
+      media_data->y = ippGetInteger(ippFindAttribute(media_size,
+						     "y-dimension",
+						     IPP_TAG_ZERO), 0);
+      media_data->top_margin =
+	ippGetInteger(ippFindAttribute(media_col, "media-top-margin",
+				       IPP_TAG_INTEGER), 0);
+      media_data->bottom_margin =
+	ippGetInteger(ippFindAttribute(media_col, "media-bottom-margin",
+				       IPP_TAG_INTEGER), 0);
+      media_data->left_margin =
+	ippGetInteger(ippFindAttribute(media_col, "media-left-margin",
+				       IPP_TAG_INTEGER), 0);
+      media_data->right_margin =
+	ippGetInteger(ippFindAttribute(media_col, "media-right-margin",
+				       IPP_TAG_INTEGER), 0);
+      media_data->media_type[0] = '\0';
+      media_data->media_source[0] = '\0';
+      if ((media_attr = ippFindAttribute(media_col, "media-type",
+					 IPP_TAG_KEYWORD)) != NULL)
+	pwg_ppdize_name(ippGetString(media_attr, 0, NULL),
+			media_data->media_type,
+			sizeof(media_data->media_type));
+      if (strlen(media_data->media_type) <= 1)
+	media_data->media_type[0] = '\0';
+      if ((media_attr = ippFindAttribute(media_col, "media-source",
+					 IPP_TAG_KEYWORD)) != NULL)
+	pwg_ppdize_name(ippGetString(media_attr, 0, NULL),
+			media_data->media_source,
+			sizeof(media_data->media_source));
+      if (strlen(media_data->media_source) <= 1)
+	media_data->media_source[0] = '\0';
+    }
+
+  if (merge_vector_unique(&media_database, compare_media))
+  {
+    media_col_database = ippAddCollections(*merged_attributes,
+					   IPP_TAG_PRINTER,
+					   "media-col-database",
+					   (int)media_database.count, NULL);
+    for (i = 0; i < (int)media_database.count; i ++)
+    {
+      media_data = (media_col_key_t *)merge_vector_value(&media_database, i);
+      current_media =
+	create_media_col(media_data->x, media_data->y,
+			 media_data->left_margin,
+			 media_data->right_margin,
+			 media_data->top_margin,
+			 media_data->bottom_margin,
+			 (media_data->media_source[0] ?
+			  media_data->media_source : NULL),
+			 (media_data->media_type[0] ?
+			  media_data->media_type : NULL));
+      ippSetCollection(*merged_attributes, &media_col_database, i,
+		       current_media);
+      ippDelete(current_media);
+    }
+  }
+
+  merge_vector_free(&media_database);
+}
 
-    if (num_database != 0)
-    {
-      media_col_database = ippAddCollections(*merged_attributes,
-					     IPP_TAG_PRINTER,
-					     attributes[attr_no],
-					     num_database, NULL);
-      for (i = 0, media_data = cupsArrayFirst(media_database); media_data;
-           i ++, media_data = cupsArrayNext(media_database))
-      {
-        current_media = create_media_col(media_data->x, media_data->y,
-					 media_data->left_margin,
-					 media_data->right_margin,
-					 media_data->top_margin,
-					 media_data->bottom_margin,
-					 media_data->media_source,
-					 media_data->media_type);
-        ippSetCollection(*merged_attributes, &media_col_database, i,
-			 current_media);
-        ippDelete(current_media);
-      }
-    }
-  }
 
-  free(temp);
-  cupsArrayDelete(media_database);
+static int
+compare_job_preset_order(const void *preset_a,
+			 const void *preset_b)
+{
+  const job_preset_key_t *a = (const job_preset_key_t *)preset_a;
+  const job_preset_key_t *b = (const job_preset_key_t *)preset_b;
+
+  return (a->order < b->order ? -1 : (a->order > b->order ? 1 : 0));
+}
+
+
+// Presets of equal name are ordered by appearance, to keep the first one
+// when dropping the duplicates
+static int
+compare_job_preset_name(const void *preset_a,
+			const void *preset_b)
+{
+  const job_preset_key_t *a = (const job_preset_key_t *)preset_a;
+  const job_preset_key_t *b = (const job_preset_key_t *)preset_b;
+  int value;
+
+  if ((value = strcasecmp(a->name, b->name)) == 0)
+    value = compare_job_preset_order(preset_a, preset_b);
+  return (value);
 }
 
 
-// add_jobpresets_attribute - Adds presets attributes for the cluster
+// add_jobpresets_attribute - Adds presets attributes for the cluster, the
+//                            first preset of each name in the order of the
+//                            members
 static void
 add_jobpresets_attribute(char* cluster_name,
 			 ipp_t ** merged_attributes)
 {
-  int                  count, i, num_preset = 0, preset_no = 0;
-  remote_printer_t     *p;
-  cups_array_t         *list, *added_presets;
-  ipp_t                *preset;
-  ipp_attribute_t      *attr;
-  const char           *preset_name;
-  ipp_attribute_t      *preset_attribute;
-
-  if ((list = cupsArrayNew3((cups_array_func_t)strcasecmp, NULL, NULL, 0,
-			    (cups_acopy_func_t)strdup,
-			    (cups_afree_func_t)free)) == NULL)
-    return;
-
-  if ((added_presets = cupsArrayNew3((cups_array_func_t)strcasecmp,
-				     NULL, NULL, 0,
-				     (cups_acopy_func_t)strdup,
-				     (cups_afree_func_t)free)) == NULL)
+  int                  num_attrs, i, j, count;
+  size_t               num_values, n;
+  ipp_attribute_t      *attrs[cupsArrayCount(remote_printers) + 1],
+                       *preset_attribute;
+  merge_vector_t       presets;
+  job_preset_key_t     *preset, *last;
+
+  if ((num_attrs = get_cluster_member_attributes(cluster_name,
+						 "job-presets-supported",
+						 IPP_TAG_BEGIN_COLLECTION,
+						 attrs, &num_values)) == 0)
     return;
-
-  for (p = (remote_printer_t *)cupsArrayFirst(remote_printers);
-       p; p = (remote_printer_t *)cupsArrayNext(remote_printers))
-  {
-    if (strcmp(cluster_name, p->queue_name))
-      continue;
-    if (p->status == STATUS_DISAPPEARED || p->status == STATUS_UNCONFIRMED ||
-	p->status == STATUS_TO_BE_RELEASED)
-      continue;
-    if ((attr = ippFindAttribute(p->prattrs, "job-presets-supported",
-				 IPP_TAG_BEGIN_COLLECTION)) != NULL)
-    {
-      for (i = 0, count = ippGetCount(attr); i < count; i ++)
-      {
-        preset = ippGetCollection(attr, i);
-        preset_name = ippGetString(ippFindAttribute(preset, "preset-name",
-						    IPP_TAG_ZERO), 0, NULL);
-        if (!cupsArrayFind(list, (void *)preset_name))
-	{
-          cupsArrayAdd(list, (void *)preset_name);
-          num_preset++;
-        }
-      }
-    }
-  }
-
-  if (num_preset == 0)
-  {
-    cupsArrayDelete(list);
-    cupsArrayDelete(added_presets);
+  if (!merge_vector_init(&presets, sizeof(job_preset_key_t), num_values))
     return;
-  }
 
-  preset_attribute = ippAddCollections(*merged_attributes, IPP_TAG_PRINTER,
-				       "job-presets-supported", num_preset,
-				       NULL);
+  for (i = 0; i < num_attrs; i ++)
+    for (j = 0, count = ippGetCount(attrs[i]); j < count; j ++)
+    {
+      preset = (job_preset_key_t *)merge_vector_add(&presets);
+      preset->preset = ippGetCollection(attrs[i], j);
+      preset->name =
+	ippGetString(ippFindAttribute(preset->preset, "preset-name",
+				      IPP_TAG_ZERO), 0, NULL);
+      preset->order = presets.count;
+      if (preset->name == NULL)
+	presets.count --;
+    }
 
-  for (p = (remote_printer_t *)cupsArrayFirst(remote_printers);
-       p; p = (remote_printer_t *)cupsArrayNext(remote_printers))
+  if (presets.count > 1)
   {
-    if ((attr = ippFindAttribute(p->prattrs, "job-presets-supported",
-				 IPP_TAG_BEGIN_COLLECTION)) != NULL)
+    // Drop the later presets of a name, then restore the order
+    qsort(presets.values, presets.count, presets.size,
+	  compare_job_preset_name);
+    for (i = 1, n = 1; i < (int)presets.count; i ++)
     {
-      for (i = 0, count = ippGetCount(attr); i < count; i ++)
+      last = (job_preset_key_t *)merge_vector_value(&presets, n - 1);
+      preset = (job_preset_key_t *)merge_vector_value(&presets, i);
+      if (strcasecmp(last->name, preset->name))
       {
-        preset = ippGetCollection(attr, i);
-        preset_name = ippGetString(ippFindAttribute(preset, "preset-name",
-						    IPP_TAG_ZERO), 0, NULL);
-        if (!cupsArrayFind(added_presets, (void *)preset_name))
-	{
-          cupsArrayAdd(added_presets, (void *)preset_name);
-          ippSetCollection(*merged_attributes, &preset_attribute, i, preset);
-          preset_no++;
-        }
-	else
-          continue;
+	if ((size_t)i != n)
+	  memcpy(last + 1, preset, presets.size);
+	n ++;
       }
     }
+    presets.count = n;
+    qsort(presets.values, presets.count, presets.size,
+	  compare_job_preset_order);
+  }
+
+  if (presets.count > 0)
+  {
+    preset_attribute = ippAddCollections(*merged_attributes, IPP_TAG_PRINTER,
+					 "job-presets-supported",
+					 (int)presets.count, NULL);
+    for (i = 0; i < (int)presets.count; i ++)
+    {
+      preset = (job_preset_key_t *)merge_vector_value(&presets, i);
+      ippSetCollection(*merged_attributes, &preset_attribute, i,
+		       preset->preset);
+    }
   }
 
-  cupsArrayDelete(list);
-  cupsArrayDelete(added_presets);
+  merge_vector_free(&presets);
 }
 
 
@@ -2881,8 +4619,10 @@ get_cluster_attributes(char* cluster_name)
   add_mediasize_attributes(cluster_name, &merged_attributes);
   add_mediadatabase_attributes(cluster_name, &merged_attributes);
   add_jobpresets_attribute(cluster_name, &merged_attributes);
-  attr = ippFirstAttribute(merged_attributes);
   // Printing merged attributes
+  if (!debug_trace_enabled(DEBUG_CATEGORY))
+    return (merged_attributes);
+  attr = ippFirstAttribute(merged_attributes);
   debug_printf("Merged attributes for the cluster %s : \n", cluster_name);
   while (attr)
   {
@@ -3719,6 +5459,14 @@ remove_bad_chars(const char *str_orig, // I - Original string
 }
 
 
+//
+// Local CUPS queues and their handling
+//
+
+#undef DEBUG_CATEGORY
+#define DEBUG_CATEGORY DEBUG_QUEUE
+
+
 static local_printer_t *
 new_local_printer (const char *device_uri,
 		   const char *uuid,
@@ -3736,7 +5484,7 @@ static void
 free_local_printer (gpointer data)
 {
   local_printer_t *printer = data;
-  debug_printf("free_local_printer() in THREAD %ld\n", pthread_self());
+  debug_trace("free_local_printer() in THREAD %ld\n", pthread_self());
   free (printer->device_uri);
   if (printer->uuid) free (printer->uuid);
   free (printer);
@@ -3758,8 +5506,8 @@ local_printer_is_same_device (gpointer key,
           *ldomain = NULL;         // pointers into lhost for components 
   int     lport = 0;               // Local printer: URI's port number
 
-  debug_printf("local_printer_is_same_device() in THREAD %ld\n",
-	       pthread_self());
+  debug_trace("local_printer_is_same_device() in THREAD %ld\n",
+	      pthread_self());
   if (!lprinter || !lprinter->device_uri || !p)
     return (0);
   // Separate the local printer's URI into their components
@@ -3812,7 +5560,7 @@ local_printer_has_uuid (gpointer key,
   local_printer_t *printer = value;
   char            *uuid = user_data;
 
-  debug_printf("local_printer_has_uuid() in THREAD %ld\n", pthread_self());
+  debug_trace("local_printer_has_uuid() in THREAD %ld\n", pthread_self());
   return (printer != NULL && printer->uuid != NULL && uuid != NULL &&
 	  g_str_equal(printer->uuid, uuid));
 }
@@ -3826,8 +5574,8 @@ local_printer_service_name_matches (gpointer key,
   char *queue_name = key;
   char *service_name = user_data;
   char *p;
-  debug_printf("local_printer_service_name_matches() in THREAD %ld\n",
-	       pthread_self());
+  debug_trace("local_printer_service_name_matches() in THREAD %ld\n",
+	      pthread_self());
   p = remove_bad_chars(service_name, 2);
   if (p && strncasecmp(p, queue_name, 63) == 0)
   {
@@ -4119,7 +5867,7 @@ check_jobs ()
 static gboolean
 autoshutdown_execute (gpointer data)
 {
-  debug_printf("autoshutdown_execute() in THREAD %ld\n", pthread_self());
+  debug_trace("autoshutdown_execute() in THREAD %ld\n", pthread_self());
   // Are we still in auto shutdown mode and are we still without queues or
   // jobs
   if (autoshutdown &&
@@ -4222,17 +5970,76 @@ renew_subscription (int id)
 }
 
 
+// Random numbers for spreading out periodic tasks, so that many clients
+// started at the same time (for example after a power outage) do not
+// hit the servers in synchronized waves. The generator is seeded by
+// host name and machine ID, so each client gets its own, but
+// reproducible sequence.
+static GRand *
+jitter_get_rand(void)
+{
+  char hostname[256], machine_id[64] = "";
+  FILE *fp;
+
+  if (jitter_rand == NULL)
+  {
+    if (gethostname(hostname, sizeof(hostname)) != 0)
+      hostname[0] = '\0';
+    hostname[sizeof(hostname) - 1] = '\0';
+    if ((fp = fopen("/etc/machine-id", "r")) != NULL)
+    {
+      if (!fgets(machine_id, sizeof(machine_id), fp))
+	machine_id[0] = '\0';
+      fclose(fp);
+    }
+    jitter_rand = g_rand_new_with_seed(g_str_hash(hostname) * 31 +
+				       g_str_hash(machine_id));
+  }
+  return (jitter_rand);
+}
+
+
+// Timer interval in milliseconds, randomly deviating by up to
+// BrowseJitter percent
+static guint
+jittered_msecs(guint secs)
+{
+  gint32 range = (gint32)(secs * 10 * BrowseJitter);
+
+  if (range <= 0)
+    return (secs * 1000);
+  return (secs * 1000 +
+	  g_rand_int_range(jitter_get_rand(), -range, range + 1));
+}
+
+
+// Initial delay in milliseconds for periodic tasks, anywhere within
+// their interval, so that clients started at the same time spread over
+// the whole interval right from the first cycle
+static guint
+jittered_offset_msecs(guint secs)
+{
+  if (BrowseJitter == 0 || secs == 0)
+    return (0);
+  return (g_rand_int_range(jitter_get_rand(), 0, (gint32)(secs * 1000)));
+}
+
+
 static gboolean
 renew_subscription_timeout (gpointer userdata)
 {
   int *subscription_id = userdata;
 
-  debug_printf("renew_subscription_timeout() in THREAD %ld\n", pthread_self());
+  debug_trace("renew_subscription_timeout() in THREAD %ld\n", pthread_self());
 
   if (*subscription_id <= 0 || !renew_subscription (*subscription_id))
     *subscription_id = create_subscription ();
 
-  return (TRUE);
+  // Run again, with a new random deviation of the interval
+  g_timeout_add (jittered_msecs(notify_lease_duration / 2),
+		 renew_subscription_timeout, userdata);
+
+  return (FALSE);
 }
 
 
@@ -4309,7 +6116,7 @@ log_cluster(remote_printer_t *p)
 {
   remote_printer_t *q, *r;
   int i;
-  if (p == NULL || (!debug_stderr && !debug_logfile))
+  if (p == NULL || !debug_enabled(DEBUG_CATEGORY))
     return;
   if (p->slave_of)
     q = p->slave_of;
@@ -4333,11 +6140,19 @@ static void
 log_all_printers()
 {
   remote_printer_t *p, *q;
-  if (!debug_stderr && !debug_logfile)
+  size_t attrs_size = 0;
+  int num_attrs = 0;
+  if (!debug_trace_enabled(DEBUG_CATEGORY))
     return;
   debug_printf("=== Remote printer overview ===\n");
   for (p = (remote_printer_t *)cupsArrayFirst(remote_printers);
        p; p = (remote_printer_t *)cupsArrayNext(remote_printers))
+  {
+    if (p->prattrs)
+    {
+      attrs_size += p->prattrs_size;
+      num_attrs ++;
+    }
     debug_printf("Printer %s (%s, %s): Local queue %s, %s, Slave of %s%s\n",
 		 p->uri,
 		 p->host, (p->ip ? p->ip : "IP not determined"), p->queue_name,
@@ -4350,6 +6165,9 @@ log_all_printers()
 		    " (To be released from cups-browsed)" :
 		    (p->status == STATUS_TO_BE_CREATED ?
 		     " (To be created/updated)" : "")))));
+  }
+  debug_printf("Printer attributes of %d printers held in memory: %zu KBytes (limit: %u KBytes, 0 = unlimited)\n",
+	       num_attrs, attrs_size / 1024, AttributesMemoryLimit);
   debug_printf("===============================\n");
 }
 
@@ -4788,6 +6606,37 @@ loadPPD(http_t *http,
 }
 
 
+// Get the time of the last configuration change of a local CUPS queue,
+// 0 if CUPS does not tell it
+static int
+get_printer_config_time(http_t *http,
+			const char *printer)
+{
+  char uri[HTTP_MAX_URI], *resource;
+  ipp_t *request, *response;
+  ipp_attribute_t *attr;
+  int config_time = 0;
+
+  httpAssembleURIf(HTTP_URI_CODING_ALL, uri, sizeof(uri), "ipp", NULL,
+		   "localhost", 0, "/printers/%s", printer);
+  resource = uri + (strlen(uri) - strlen(printer) - 10);
+  request = ippNewRequest(IPP_OP_GET_PRINTER_ATTRIBUTES);
+  ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI, "printer-uri", NULL,
+	       uri);
+  ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_KEYWORD,
+	       "requested-attributes", NULL, "printer-config-change-time");
+  if ((response = cupsDoRequest(http, request, resource)) != NULL)
+  {
+    if ((attr = ippFindAttribute(response, "printer-config-change-time",
+				 IPP_TAG_INTEGER)) != NULL)
+      config_time = ippGetInteger(attr, 0);
+    ippDelete(response);
+  }
+
+  return (config_time);
+}
+
+
 static int
 record_printer_options(const char *printer)
 {
@@ -4795,7 +6644,7 @@ record_printer_options(const char *printer)
   char filename[1024];
   FILE *fp = NULL;
   char uri[HTTP_MAX_URI], *resource;
-  ipp_t *request, *response;
+  ipp_t *request, *response = NULL;
   ipp_attribute_t *attr;
   const char *key;
   char buf[65536], *c;
@@ -4804,9 +6653,13 @@ record_printer_options(const char *printer)
   ppd_option_t *ppd_opt;
   cups_option_t *option;
   int i;
-  // List of IPP attributes to get recorded
+  int config_time = 0;
+  // List of IPP attributes to get recorded, we request only these from
+  // CUPS, plus printer-config-change-time to see whether the PPD file
+  // can have changed
   static const char *attrs_to_record[] =
     {
+      "printer-config-change-time",
       //"*-default",
       "auth-info-required",
       //"device-uri",
@@ -4827,10 +6680,8 @@ record_printer_options(const char *printer)
       "printer-state-message",
       "printer-state-reasons",
       "requesting-user-name-allowed",
-      "requesting-user-name-denied",
-      NULL
+      "requesting-user-name-denied"
     };
-  const char **ptr;
   http_t *http = NULL;
 
   if (printer == NULL || strlen(printer) == 0)
@@ -4862,11 +6713,35 @@ record_printer_options(const char *printer)
   http = http_connect_local();
   if (http)
   {
+    httpAssembleURIf(HTTP_URI_CODING_ALL, uri, sizeof(uri), "ipp", NULL,
+		     "localhost", 0, "/printers/%s", printer);
+    resource = uri + (strlen(uri) - strlen(printer) - 10);
+    request = ippNewRequest(IPP_OP_GET_PRINTER_ATTRIBUTES);
+    ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI, "printer-uri", NULL,
+		 uri);
+    ippAddStrings(request, IPP_TAG_OPERATION, IPP_TAG_KEYWORD,
+		  "requested-attributes",
+		  (int)(sizeof(attrs_to_record) / sizeof(attrs_to_record[0])),
+		  NULL, attrs_to_record);
+    response = cupsDoRequest(http, request, resource);
+    if (response &&
+	(attr = ippFindAttribute(response, "printer-config-change-time",
+				 IPP_TAG_INTEGER)) != NULL)
+      config_time = ippGetInteger(attr, 0);
+
     // If there is a PPD file for this printer, we save the local
-    // settings for the PPD options.
+    // settings for the PPD options. The PPD file can only have changed
+    // with a configuration change of the queue, so we download and
+    // parse it only if the queue got changed since we have recorded
+    // the settings last time (or since we have created the queue).
     if (cups_notifier != NULL || (p && p->netprinter))
     {
-      if ((ppdname = loadPPD(http, printer)) == NULL)
+      if (config_time > 0 && config_time == p->ppd_options_time)
+      {
+	debug_printf("PPD file for %s not changed since the last recording of its option settings.\n",
+		     printer);
+      }
+      else if ((ppdname = loadPPD(http, printer)) == NULL)
       {
 	debug_printf("Unable to get PPD file for %s: %s\n",
 		     printer, cupsLastErrorString());
@@ -4894,63 +6769,40 @@ record_printer_options(const char *printer)
 	  }
 	ppdClose(ppd);
 	unlink(ppdname);
+	p->ppd_options_time = config_time;
       }
     }
 
-    httpAssembleURIf(HTTP_URI_CODING_ALL, uri, sizeof(uri), "ipp", NULL,
-		     "localhost", 0, "/printers/%s", printer);
-    resource = uri + (strlen(uri) - strlen(printer) - 10);
-    request = ippNewRequest(IPP_OP_GET_PRINTER_ATTRIBUTES);
-    ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI, "printer-uri", NULL,
-		 uri);
-    response = cupsDoRequest(http, request, resource);
-
-    // Write all supported printer attributes
+    // Write all requested printer attributes
     if (response)
     {
       debug_printf("Recording option settings from the IPP attributes for %s:\n",
 		   printer);
-      attr = ippFirstAttribute(response);
-      while (attr)
+      for (attr = ippFirstAttribute(response); attr;
+	   attr = ippNextAttribute(response))
       {
-	if (ippGetValueTag(attr) == IPP_TAG_NOVALUE)
-	{
-	  attr = ippNextAttribute(response);
+	if (ippGetValueTag(attr) == IPP_TAG_NOVALUE ||
+	    ippGetGroupTag(attr) != IPP_TAG_PRINTER ||
+	    (key = ippGetName(attr)) == NULL ||
+	    !strcmp(key, "printer-config-change-time"))
 	  continue;
-	}
 
-	key = ippGetName(attr);
-	for (ptr = attrs_to_record; *ptr; ptr++)
-	  if (strcasecmp(key, *ptr) == 0 ||
-	      (*ptr[0] == '*' &&
-	       strcasecmp(key + strlen(key) - strlen(*ptr) + 1, *ptr + 1) == 0))
-	    break;
-	if (*ptr != NULL)
+	ippAttributeString(attr, buf, sizeof(buf));
+	buf[sizeof(buf) - 1] = '\0';
+	c = buf;
+	while (*c)
 	{
-	  if (strcasecmp(key, CUPS_BROWSED_DEST_PRINTER "-default") != 0)
-	  {
-	    ippAttributeString(attr, buf, sizeof(buf));
-	    buf[sizeof(buf) - 1] = '\0';
-	    c = buf;
-	    while (*c)
-	    {
-	      if (*c == '\\')
-		memmove(c, c + 1, strlen(c));
-	      if (*c) c ++;
-	    }
+	  if (*c == '\\')
+	    memmove(c, c + 1, strlen(c));
+	  if (*c) c ++;
+	}
 
-	    if (strlen(buf) == 0)
-	    {
-	      attr = ippNextAttribute(response);
-	      continue;
-	    }
+	if (strlen(buf) == 0)
+	  continue;
 
-	    debug_printf("   %s=%s\n", key, buf);
-	    p->num_options = cupsAddOption(key, buf, p->num_options,
-					   &(p->options));
-	  }
-	}
-	attr = ippNextAttribute(response);
+	debug_printf("   %s=%s\n", key, buf);
+	p->num_options = cupsAddOption(key, buf, p->num_options,
+				       &(p->options));
       }
       ippDelete(response);
     }
@@ -5388,7 +7240,7 @@ join_cluster_if_needed(remote_printer_t *p,
 		 p->queue_name, q->host, q->port);
     // Update q
     q->status = STATUS_TO_BE_CREATED;
-    q->timeout = time(NULL) + TIMEOUT_IMMEDIATELY;
+    q->timeout = scheduler.now() + TIMEOUT_IMMEDIATELY;
     log_cluster(p);
   }
   else if (q)
@@ -5414,7 +7266,7 @@ on_printer_state_changed (CupsNotifier *object,
 {
   char *ptr, buf[2048];
 
-  debug_printf("on_printer_state_changed() in THREAD %ld\n", pthread_self());
+  debug_trace("on_printer_state_changed() in THREAD %ld\n", pthread_self());
 
   debug_printf("[CUPS Notification] Printer state change on printer %s: %s\n",
 	       printer, text);
@@ -5513,6 +7365,240 @@ on_printer_state_changed (CupsNotifier *object,
 }
 
 
+//
+// Assigning jobs on cluster queues to the members
+//
+
+#undef DEBUG_CATEGORY
+#define DEBUG_CATEGORY DEBUG_DISPATCH
+
+
+static void
+free_job_assignment(job_assignment_t *a)
+{
+  cupsArrayRemove(job_assignments, a);
+  free(a->queue_name);
+  free(a->dest_uri);
+  free(a);
+}
+
+
+static void
+release_job_assignment(const char *queue_name,
+		       int job_id)
+{
+  job_assignment_t *a;
+  time_t now = time(NULL);
+
+  // Drop the assignment of the given job and also all assignments which
+  // are too old to be valid any more, for the case that we have missed
+  // the notification about the end of the job
+  for (a = (job_assignment_t *)cupsArrayFirst(job_assignments);
+       a; a = (job_assignment_t *)cupsArrayNext(job_assignments))
+  {
+    if (a->job_id == job_id && !strcasecmp(a->queue_name, queue_name))
+    {
+      debug_printf("Releasing assignment of job %d of %s to %s.\n",
+		   job_id, queue_name, a->dest_uri);
+      free_job_assignment(a);
+    }
+    else if (now - a->assigned > TIMEOUT_ASSIGNMENT)
+    {
+      debug_printf("Assignment of job %d of %s to %s timed out.\n",
+		   a->job_id, a->queue_name, a->dest_uri);
+      free_job_assignment(a);
+    }
+  }
+}
+
+
+static void
+add_job_assignment(const char *queue_name,
+		   int job_id,
+		   const char *dest_uri)
+{
+  job_assignment_t *a;
+
+  if ((a = (job_assignment_t *)calloc(1, sizeof(job_assignment_t))) == NULL)
+    return;
+  a->queue_name = strdup(queue_name);
+  a->job_id = job_id;
+  a->dest_uri = strdup(dest_uri);
+  a->assigned = time(NULL);
+  cupsArrayAdd(job_assignments, a);
+}
+
+
+static int
+num_job_assignments(const char *dest_uri)
+{
+  job_assignment_t *a;
+  int n = 0;
+
+  for (a = (job_assignment_t *)cupsArrayFirst(job_assignments);
+       a; a = (job_assignment_t *)cupsArrayNext(job_assignments))
+    if (!strcmp(a->dest_uri, dest_uri))
+      n ++;
+
+  return (n);
+}
+
+
+// A member is on a directly attached network if we have seen its DNS-SD
+// advertisement (which is link-local) on one of our interfaces which is
+// up, or on the loopback interface
+static int
+member_is_local(remote_printer_t *p)
+{
+  ipp_discovery_t *d;
+  netif_path_t path;
+  int local = 0;
+
+  pthread_rwlock_rdlock(&netiflock);
+  for (d = (ipp_discovery_t *)cupsArrayFirst(p->ipp_discoveries);
+       d && !local; d = (ipp_discovery_t *)cupsArrayNext(p->ipp_discoveries))
+  {
+    if (!d->interface)
+      continue;
+    if (!strcmp(d->interface, "lo"))
+      local = 1;
+    else if (netif_paths)
+    {
+      memset(&path, 0, sizeof(path));
+      strncpy(path.name, d->interface, sizeof(path.name) - 1);
+      path.family = d->family;
+      if (cupsArrayFind(netif_paths, &path))
+	local = 1;
+    }
+  }
+  pthread_rwlock_unlock(&netiflock);
+
+  return (local);
+}
+
+
+// Feed the connection setup time of a state query into the smoothed
+// RTT of a member. Samples only come with new connections, so they are
+// kept for as long as the member exists
+static void
+member_update_rtt(remote_printer_t *p,
+		  gint64 usec)
+{
+  if (usec <= 0)
+    usec = 1;
+  if (p->rtt <= 0)
+    p->rtt = usec;
+  else
+    p->rtt = (7 * p->rtt + usec) / 8;
+}
+
+
+// RTTs which differ by less than a factor of 8 count as equal, so that
+// jitter and the load of the members do not override the tie-break,
+// only clearly farther away members go after the others. Below 4 msec
+// everything is on the same LAN anyway. Unmeasured members go after
+// the measured ones.
+static int
+member_rtt_class(remote_printer_t *p)
+{
+  gint64 msec;
+  int c;
+
+  if (p->rtt <= 0)
+    return (INT_MAX);
+  for (msec = p->rtt / 4000, c = 0; msec > 0; msec >>= 3, c ++);
+  return (c);
+}
+
+
+// Candidate member for a job, with its sort keys
+typedef struct member_candidate_s
+{
+  int index;      // Index in remote_printers
+  int remote;     // 0: on a directly attached network
+  int rtt_class;  // See member_rtt_class()
+  guint tie;      // Tie-break key
+} member_candidate_t;
+
+
+static int
+compare_member_candidates(const void *va,
+			  const void *vb)
+{
+  const member_candidate_t *a = (const member_candidate_t *)va;
+  const member_candidate_t *b = (const member_candidate_t *)vb;
+
+  if (a->remote != b->remote)
+    return (a->remote - b->remote);
+  if (a->rtt_class != b->rtt_class)
+    return (a->rtt_class < b->rtt_class ? -1 : 1);
+  if (a->tie != b->tie)
+    return (a->tie < b->tie ? -1 : 1);
+  return (a->index - b->index);
+}
+
+
+// Put the members of the cluster q (local queue name printer) into the
+// order in which we check them for a job. Round robin starts after the
+// member which got the last job, as cupsdFindAvailablePrinter() in the
+// scheduler/classes.c file of CUPS does.
+static member_candidate_t *
+get_member_candidates(remote_printer_t *q,
+		      const char *printer,
+		      int *num_candidates)
+{
+  member_candidate_t *c;
+  remote_printer_t *p;
+  int i, n, count = cupsArrayCount(remote_printers);
+
+  *num_candidates = 0;
+  if (count <= 0 ||
+      (c = (member_candidate_t *)calloc(count,
+					sizeof(member_candidate_t))) == NULL)
+    return (NULL);
+
+  for (i = 0, n = 0; i < count; i ++)
+  {
+    p = (remote_printer_t *)cupsArrayIndex(remote_printers, i);
+    if (strcasecmp(p->queue_name, printer) || p->status != STATUS_CONFIRMED)
+      continue;
+    c[n].index = i;
+    if (ClusterMemberPreference == MEMBER_PREFER_NEAREST)
+    {
+      c[n].remote = !member_is_local(p);
+      c[n].rtt_class = member_rtt_class(p);
+    }
+    switch (ClusterMemberTieBreak)
+    {
+      case MEMBER_TIE_ROUND_ROBIN:
+	  c[n].tie = (i - q->last_printer - 1 + count) % count;
+	  break;
+      case MEMBER_TIE_ORDER:
+	  c[n].tie = i;
+	  break;
+      case MEMBER_TIE_RANDOM:
+	  c[n].tie = g_random_int();
+	  break;
+    }
+    n ++;
+  }
+
+  qsort(c, n, sizeof(member_candidate_t), compare_member_candidates);
+
+  if (debug_enabled(DEBUG_CATEGORY))
+    for (i = 0; i < n; i ++)
+    {
+      p = (remote_printer_t *)cupsArrayIndex(remote_printers, c[i].index);
+      debug_printf("  Candidate %d: %s (%s, RTT %s%ld usec)\n", i + 1, p->uri,
+		   (c[i].remote ? "remote" : "directly attached"),
+		   (p->rtt > 0 ? "" : "not measured, "), (long)p->rtt);
+    }
+
+  *num_candidates = n;
+  return (c);
+}
+
+
 static void
 on_job_state (CupsNotifier *object,
 	      const gchar *text,
@@ -5528,9 +7614,12 @@ on_job_state (CupsNotifier *object,
 	      guint job_impressions_completed,
 	      gpointer user_data)
 {
-  int i, count;
+  int i, k, count;
   char buf[2048];
   remote_printer_t *p, *q, *r, *s=NULL;
+  member_candidate_t *candidates;
+  int num_candidates;
+  gint64 rtt;
   http_t *http_printer = NULL;
   ipp_t *request, *response, *printer_attributes = NULL;
   ipp_attribute_t *attr;
@@ -5538,6 +7627,7 @@ on_job_state (CupsNotifier *object,
   ipp_pstate_t pstate = IPP_PRINTER_IDLE;
   int paccept = 0;
   int num_jobs, min_jobs = 99999999;
+  int in_flight = 0;
   char destination_uri[1024];
   const char *dest_host = NULL;
   int dest_index = 0;
@@ -5562,7 +7652,7 @@ on_job_state (CupsNotifier *object,
     };
   http_t *http = NULL;
 
-  debug_printf("on_job_state() in THREAD %ld\n", pthread_self());
+  debug_trace("on_job_state() in THREAD %ld\n", pthread_self());
 
   debug_printf("[CUPS Notification] Job state changed on printer %s: %s\n",
 	       printer, text);
@@ -5575,6 +7665,8 @@ on_job_state (CupsNotifier *object,
   debug_printf("[CUPS Notification] Job is processing: %s\n",
 	       job_state == IPP_JOB_PROCESSING ? "Yes" : "No");
 
+  note_activity();
+
   if (terminating)
   {
     debug_printf("[CUPS Notification]: Ignoring because cups-browsed is terminating.\n");
@@ -5609,6 +7701,14 @@ on_job_state (CupsNotifier *object,
     }
   }
 
+  // A job which we have assigned to a cluster member has ended, or it
+  // got re-queued because we did not find a free destination for it,
+  // so the member it was assigned to is free for the next job again.
+  // If it starts processing (again) we drop the old assignment, too, as
+  // we will assign it anew below.
+  if (job_id != 0)
+    release_job_assignment(printer, job_id);
+
   if (job_id != 0 && job_state == IPP_JOB_PROCESSING)
   {
     // Printer started processing a job, check if it uses the implicitclass
@@ -5652,6 +7752,15 @@ on_job_state (CupsNotifier *object,
     //
     // Default is queuing the jobs on the client as this is what CUPS does
     // with classes.
+    //
+    // If several jobs start at the same moment, the member which we have
+    // chosen for the first job will still report being idle when we check
+    // for the second job, as its job did not arrive there yet. Therefore
+    // we keep a list of the jobs which we have assigned to members and
+    // which did not finish yet (job_assignments) and consider a member
+    // with such jobs busy, and with QUEUE_ON_SERVERS, count these jobs
+    // as waiting on the member. This way simultaneously starting jobs
+    // get immediately distributed over all members.
 
     debug_printf("[CUPS Notification] %s starts processing a job.\n", printer);
     http = http_connect_local();
@@ -5671,190 +7780,231 @@ on_job_state (CupsNotifier *object,
       // backend
       debug_printf("[CUPS Notification] %s is using the \"implicitclass\" CUPS backend, so let us search for a destination for this job.\n", printer);
 
-      // We keep track of the printer which we used last time and start
-      // checking with the next printer this time, to get a "round robin"
-      // type of printer usage instead of having most jobs going to the first
-      // printer in the list. Method taken from the cupsdFindAvailablePrinter()
-      // function of the scheduler/classes.c file of CUPS.
+      // We check the members which are on a directly attached network
+      // first, then the ones which answer fastest, to keep the transfer
+      // time of the job low (ClusterMemberPreference). Between equally
+      // near members we keep track of the printer which we used last time
+      // and start checking with the next printer this time, to get a
+      // "round robin" type of printer usage instead of having most jobs
+      // going to the first printer in the list (ClusterMemberTieBreak).
 
       if (q->last_printer < 0 ||
 	  q->last_printer >= cupsArrayCount(remote_printers))
 	q->last_printer = 0;
       log_cluster(q);
-      for (i = q->last_printer + 1; ; i++)
+      candidates = get_member_candidates(q, printer, &num_candidates);
+      for (k = 0; k < num_candidates; k ++)
       {
-	if (i >= cupsArrayCount(remote_printers))
-	  i = 0;
+	i = candidates[k].index;
 	p = (remote_printer_t *)cupsArrayIndex(remote_printers, i);
-	if (!strcasecmp(p->queue_name, printer) &&
-	    p->status == STATUS_CONFIRMED)
+	num_of_printers = 0;
+	for (r = (remote_printer_t *)cupsArrayFirst(remote_printers);
+	     r; r = (remote_printer_t *)cupsArrayNext(remote_printers))
 	{
-	  num_of_printers = 0;
-	  for (r = (remote_printer_t *)cupsArrayFirst(remote_printers);
-	       r; r = (remote_printer_t *)cupsArrayNext(remote_printers))
+	  if (!strcmp(r->queue_name, q->queue_name))
 	  {
-	    if (!strcmp(r->queue_name, q->queue_name))
-	    {
-	      if(r->status == STATUS_DISAPPEARED ||
-		 r->status == STATUS_UNCONFIRMED ||
-		 r->status == STATUS_TO_BE_RELEASED )
-		continue;
-	      num_of_printers ++;
-	    }
+	    if(r->status == STATUS_DISAPPEARED ||
+	       r->status == STATUS_UNCONFIRMED ||
+	       r->status == STATUS_TO_BE_RELEASED )
+	      continue;
+	    num_of_printers ++;
 	  }
+	}
 
-	  // If we are in a cluster, see whether the printer supports the 
-	  // requested job attributes
-	  if (num_of_printers > 1)
+	// If we are in a cluster, see whether the printer supports the 
+	// requested job attributes
+	if (num_of_printers > 1)
+	{
+	  if (!supports_job_attributes_requested(printer, i, job_id,
+						 &print_quality))
 	  {
-	    if (!supports_job_attributes_requested(printer, i, job_id,
-						   &print_quality))
-	    {
-	      debug_printf("Printer with uri %s in cluster %s doesn't support the requested job attributes\n",
-			   p->uri, p->queue_name);
-	      if (i == q->last_printer)
-		break;
-	      else
-		continue;
-	    }
+	    debug_printf("Printer with uri %s in cluster %s doesn't support the requested job attributes\n",
+			 p->uri, p->queue_name);
+	    continue;
 	  }
-	  debug_printf("Checking state of remote printer %s on host %s, IP %s, port %d.\n",
-		       p->uri, p->host, p->ip, p->port);
+	}
+	// Skip members which have still a job assigned which is not
+	// finished yet, so that simultaneously started jobs do not all
+	// land on the same, only seemingly idle printer
+	in_flight = num_job_assignments(p->uri);
+	if (in_flight > 0 && LoadBalancingType == QUEUE_ON_CLIENT)
+	{
+	  valid_dest_found = 1;
+	  debug_printf("Printer %s on host %s, port %d has %d job(s) assigned by us, skip it.\n",
+		       p->uri, p->host, p->port, in_flight);
+	  continue;
+	}
 
-	  // Check whether the printer is idle, processing, or disabled
-	  debug_printf("HTTP connection to %s:%d established.\n", p->host,
-		       p->port);
-	  response = cfGetPrinterAttributes(p->uri, pattrs,
-					    sizeof(pattrs) / sizeof(pattrs[0]),
-					    NULL, 0, 0);
-	  debug_log_out(cf_get_printer_attributes_log);
-	  if (response != NULL)
+	debug_printf("Checking state of remote printer %s on host %s, IP %s, port %d.\n",
+		     p->uri, p->host, p->ip, p->port);
+
+	// Check whether the printer is idle, processing, or disabled
+	debug_printf("HTTP connection to %s:%d established.\n", p->host,
+		     p->port);
+	response = get_remote_printer_attributes(p->uri, pattrs,
+						 sizeof(pattrs) /
+						 sizeof(pattrs[0]), 0, &rtt);
+	debug_log_out(cf_get_printer_attributes_log);
+	if (response != NULL)
+	{
+	  // Only requests on a new connection give a sample
+	  if (rtt > 0)
+	    member_update_rtt(p, rtt);
+	  debug_printf("IPP request to %s:%d successful (RTT %ld usec).\n",
+		       p->host, p->port, (long)p->rtt);
+	  pname = NULL;
+	  pstate = IPP_PRINTER_IDLE;
+	  paccept = 0;
+	  for (attr = ippFirstAttribute(response); attr != NULL;
+	       attr = ippNextAttribute(response))
 	  {
-	    debug_printf("IPP request to %s:%d successful.\n", p->host,
-			 p->port);
+	    while (attr != NULL && ippGetGroupTag(attr) != IPP_TAG_PRINTER)
+	      attr = ippNextAttribute(response);
+	    if (attr == NULL)
+	      break;
 	    pname = NULL;
 	    pstate = IPP_PRINTER_IDLE;
 	    paccept = 0;
-	    for (attr = ippFirstAttribute(response); attr != NULL;
-		 attr = ippNextAttribute(response))
+	    got_printer_info = 0;
+	    while (attr != NULL && ippGetGroupTag(attr) ==
+		   IPP_TAG_PRINTER)
 	    {
-	      while (attr != NULL && ippGetGroupTag(attr) != IPP_TAG_PRINTER)
-		attr = ippNextAttribute(response);
-	      if (attr == NULL)
-		break;
-	      pname = NULL;
-	      pstate = IPP_PRINTER_IDLE;
-	      paccept = 0;
-	      got_printer_info = 0;
-	      while (attr != NULL && ippGetGroupTag(attr) ==
-		     IPP_TAG_PRINTER)
-	      {
-		if (!strcmp(ippGetName(attr), "printer-name") &&
-		    ippGetValueTag(attr) == IPP_TAG_NAME)
-		  pname = ippGetString(attr, 0, NULL);
-		else if (!strcmp(ippGetName(attr), "printer-state") &&
-			 ippGetValueTag(attr) == IPP_TAG_ENUM)
-		  pstate = (ipp_pstate_t)ippGetInteger(attr, 0);
-		else if (!strcmp(ippGetName(attr),
-				 "printer-is-accepting-jobs") &&
-			 ippGetValueTag(attr) == IPP_TAG_BOOLEAN)
-		{
-		  paccept = ippGetBoolean(attr, 0);
-		  got_printer_info = 1;
-		}
-		attr = ippNextAttribute(response);
-	      }
-	      if (got_printer_info == 0)
+	      if (!strcmp(ippGetName(attr), "printer-name") &&
+		  ippGetValueTag(attr) == IPP_TAG_NAME)
+		pname = ippGetString(attr, 0, NULL);
+	      else if (!strcmp(ippGetName(attr), "printer-state") &&
+		       ippGetValueTag(attr) == IPP_TAG_ENUM)
+		pstate = (ipp_pstate_t)ippGetInteger(attr, 0);
+	      else if (!strcmp(ippGetName(attr),
+			       "printer-is-accepting-jobs") &&
+		       ippGetValueTag(attr) == IPP_TAG_BOOLEAN)
 	      {
-		if (attr == NULL)
-		  break;
-		else
-		  continue;
+		paccept = ippGetBoolean(attr, 0);
+		got_printer_info = 1;
 	      }
-	      debug_printf("IPP Response contains attributes values printer-name %s, accepting-job %d\n",
-			   (pname ? pname : "(Not reported)"), paccept);
-	      if (paccept)
+	      attr = ippNextAttribute(response);
+	    }
+	    if (got_printer_info == 0)
+	    {
+	      if (attr == NULL)
+		break;
+	      else
+		continue;
+	    }
+	    debug_printf("IPP Response contains attributes values printer-name %s, accepting-job %d\n",
+			 (pname ? pname : "(Not reported)"), paccept);
+	    if (paccept)
+	    {
+	      debug_printf("Printer %s on host %s, port %d is accepting jobs.\n",
+			   p->uri, p->host, p->port);
+	      switch (pstate)
 	      {
-		debug_printf("Printer %s on host %s, port %d is accepting jobs.\n",
-			     p->uri, p->host, p->port);
-		switch (pstate)
-		{
-		  case IPP_PRINTER_IDLE:
-		      valid_dest_found = 1;
-		      dest_host = p->ip ? p->ip : p->host;
-		      strncpy(destination_uri, p->uri,
-			      sizeof(destination_uri) - 1);
-		      printer_attributes = p->prattrs;
-		      pdl = p->pdl;
-		      s = p;
-		      dest_index = i;
-		      debug_printf("Printer %s on host %s, port %d is idle, take this as destination and stop searching.\n",
-				   p->uri, p->host, p->port);
+		case IPP_PRINTER_IDLE:
+		    valid_dest_found = 1;
+		    if (in_flight > 0)
+		    {
+		      // QUEUE_ON_SERVERS, our assigned jobs did not yet
+		      // arrive on the printer, so it is not really idle
+		      if (in_flight < min_jobs)
+		      {
+			min_jobs = in_flight;
+			dest_host = p->ip ? p->ip : p->host;
+			strncpy(destination_uri, p->uri,
+				sizeof(destination_uri) - 1);
+			pdl = p->pdl;
+			s = p;
+			dest_index = i;
+		      }
+		      debug_printf("Printer %s on host %s, port %d is idle but has %d job(s) assigned by us.\n",
+				   p->uri, p->host, p->port, in_flight);
 		      break;
-		  case IPP_PRINTER_PROCESSING:
-		      valid_dest_found = 1;
-		      if (LoadBalancingType == QUEUE_ON_SERVERS)
+		    }
+		    dest_host = p->ip ? p->ip : p->host;
+		    strncpy(destination_uri, p->uri,
+			    sizeof(destination_uri) - 1);
+		    pdl = p->pdl;
+		    s = p;
+		    dest_index = i;
+		    debug_printf("Printer %s on host %s, port %d is idle, take this as destination and stop searching.\n",
+				 p->uri, p->host, p->port);
+		    break;
+		case IPP_PRINTER_PROCESSING:
+		    valid_dest_found = 1;
+		    if (LoadBalancingType == QUEUE_ON_SERVERS)
+		    {
+		      num_jobs = 0;
+		      http_printer =
+			http_pool_get(p->ip ? p->ip : p->host, p->port,
+				      HTTP_ENCRYPT_IF_REQUESTED, NULL);
+		      if (http_printer)
 		      {
-			num_jobs = 0;
-			http_printer =
-			  httpConnectEncryptShortTimeout
-			    (p->ip ? p->ip : p->host, p->port,
-			     HTTP_ENCRYPT_IF_REQUESTED);
-			if (http_printer)
+			num_jobs = get_number_of_jobs(http_printer, p->uri, 0,
+						      CUPS_WHICHJOBS_ACTIVE);
+			// Jobs assigned by us may not have arrived yet
+			if (num_jobs >= 0)
+			  num_jobs += in_flight;
+			if (num_jobs >= 0 && num_jobs < min_jobs)
 			{
-			  num_jobs = get_number_of_jobs(http_printer, p->uri, 0,
-							CUPS_WHICHJOBS_ACTIVE);
-			  if (num_jobs >= 0 && num_jobs < min_jobs)
-			  {
-			    min_jobs = num_jobs;
-			    dest_host = p->ip ? p->ip : p->host;
-			    strncpy(destination_uri, p->uri,
-				    sizeof(destination_uri) - 1);
-			    printer_attributes = p->prattrs;
-			    pdl = p->pdl;
-			    s = p;
-			    dest_index = i;
-			  }
-			  debug_printf("Printer %s on host %s, port %d is printing and it has %d jobs.\n",
-				       p->uri, p->host, p->port,
-				       num_jobs);
-			  httpClose(http_printer);
-			  http_printer = NULL;
+			  min_jobs = num_jobs;
+			  dest_host = p->ip ? p->ip : p->host;
+			  strncpy(destination_uri, p->uri,
+				  sizeof(destination_uri) - 1);
+			  pdl = p->pdl;
+			  s = p;
+			  dest_index = i;
 			}
+			debug_printf("Printer %s on host %s, port %d is printing and it has %d jobs.\n",
+				     p->uri, p->host, p->port,
+				     num_jobs);
+			http_pool_put(http_printer, num_jobs >= 0);
+			http_printer = NULL;
 		      }
-		      else
-			debug_printf("Printer %s on host %s, port %d is printing.\n",
-				     p->uri, p->host, p->port);
-		      break;
-		  case IPP_PRINTER_STOPPED:
-		      debug_printf("Printer %s on host %s, port %d is disabled, skip it.\n",
+		    }
+		    else
+		      debug_printf("Printer %s on host %s, port %d is printing.\n",
 				   p->uri, p->host, p->port);
-		      break;
-		}
-	      }
-	      else
-	      {
-		debug_printf("Printer %s on host %s, port %d is not accepting jobs, skip it.\n",
-			     p->uri, p->host, p->port);
+		    break;
+		case IPP_PRINTER_STOPPED:
+		    debug_printf("Printer %s on host %s, port %d is disabled, skip it.\n",
+				 p->uri, p->host, p->port);
+		    break;
 	      }
-	      break;
 	    }
+	    else
+	    {
+	      debug_printf("Printer %s on host %s, port %d is not accepting jobs, skip it.\n",
+			   p->uri, p->host, p->port);
+	    }
+	    break;
+	  }
 
-	    ippDelete(response);
-	    response = NULL;
+	  ippDelete(response);
+	  response = NULL;
 
-	    if (pstate == IPP_PRINTER_IDLE && paccept)
-	    {
-	      q->last_printer = i;
-	      break;
-	    }
+	  if (pstate == IPP_PRINTER_IDLE && paccept && in_flight == 0)
+	  {
+	    q->last_printer = i;
+	    break;
 	  }
-	  else
-	    debug_printf("IPP request to %s:%d failed.\n", p->host,
-			 p->port);
 	}
-	if (i == q->last_printer)
-	  break;
+	else
+	  debug_printf("IPP request to %s:%d failed.\n", p->host,
+		       p->port);
+      }
+      free(candidates);
+
+      // The attributes of the destination could have been dropped to
+      // stay within AttributesMemoryLimit, also while we were querying
+      // the members. drop_printer_attributes() needs the write lock,
+      // so holding the read lock keeps them while we are using them
+      if (s)
+      {
+	pthread_rwlock_rdlock(&lock);
+	if (s->prattrs_evicted)
+	  get_full_printer_attributes(s);
+	else
+	  s->prattrs_used = time(NULL);
+	printer_attributes = s->prattrs;
       }
 
       // Write the selected destination host into an option of our implicit
@@ -5867,6 +8017,8 @@ on_job_state (CupsNotifier *object,
 				    (cups_afree_func_t)free)) == NULL)
       {
 	debug_printf("Could Not allocate memory for cups Array \n");
+	if (s)
+	  pthread_rwlock_unlock(&lock);
 	httpClose(http);
 	return;
       }
@@ -6020,6 +8172,9 @@ on_job_state (CupsNotifier *object,
 
       cfFreeResolution(max_res, NULL);
       cfFreeResolution(min_res, NULL);
+      printer_attributes = NULL;
+      if (s)
+	pthread_rwlock_unlock(&lock);
 
       request = ippNewRequest(CUPS_ADD_MODIFY_PRINTER);
       httpAssembleURIf(HTTP_URI_CODING_ALL, uri, sizeof(uri), "ipp", NULL,
@@ -6031,6 +8186,8 @@ on_job_state (CupsNotifier *object,
       if (dest_host)
       {
 	q->last_printer = dest_index;
+	add_job_assignment(printer, job_id, destination_uri);
+	flight_record(FLIGHT_DISPATCH, printer, destination_uri, job_id);
 	snprintf(buf, sizeof(buf), "\"%d %s %s %s\"", job_id, destination_uri,
 		 document_format, resolution);
 	debug_printf("Destination for job %d to %s: %s\n",
@@ -6039,12 +8196,14 @@ on_job_state (CupsNotifier *object,
       else if (valid_dest_found == 1)
       {
 	snprintf(buf, sizeof(buf), "\"%d ALL_DESTS_BUSY\"", job_id);
+	flight_record(FLIGHT_ALL_BUSY, printer, NULL, job_id);
 	debug_printf("All destinations busy for job %d to %s\n",
 		     job_id, printer);
       }
       else
       {
 	snprintf(buf, sizeof(buf), "\"%d NO_DEST_FOUND\"", job_id);
+	flight_record(FLIGHT_NO_DEST, printer, NULL, job_id);
 	debug_printf("No destination found for job %d to %s\n",
 		     job_id, printer);
       }
@@ -6071,6 +8230,14 @@ on_job_state (CupsNotifier *object,
 }
 
 
+//
+// Local CUPS queues and their handling
+//
+
+#undef DEBUG_CATEGORY
+#define DEBUG_CATEGORY DEBUG_QUEUE
+
+
 static void
 on_printer_deleted (CupsNotifier *object,
 		    const gchar *text,
@@ -6086,7 +8253,7 @@ on_printer_deleted (CupsNotifier *object,
   char *local_queue_name_lower = NULL;
   local_printer_t *local_printer = NULL;
 
-  debug_printf("on_printer_deleted() in THREAD %ld\n", pthread_self());
+  debug_trace("on_printer_deleted() in THREAD %ld\n", pthread_self());
 
   debug_printf("[CUPS Notification] Printer deleted: %s\n",
 	       text);
@@ -6147,7 +8314,7 @@ on_printer_deleted (CupsNotifier *object,
 	p->status != STATUS_TO_BE_RELEASED)
     {
       p->status = STATUS_TO_BE_CREATED;
-      p->timeout = time(NULL) + TIMEOUT_IMMEDIATELY;
+      p->timeout = scheduler.now() + TIMEOUT_IMMEDIATELY;
       if (in_shutdown == 0)
 	recheck_timer();
     }
@@ -6319,7 +8486,7 @@ on_printer_modified (CupsNotifier *object,
   char          local_queue_uri[1024];
   char          *resolved_uri = NULL;
 
-  debug_printf("on_printer_modified() in THREAD %ld\n", pthread_self());
+  debug_trace("on_printer_modified() in THREAD %ld\n", pthread_self());
 
   debug_printf("[CUPS Notification] Printer modified: %s\n",
 	       text);
@@ -6434,7 +8601,7 @@ on_printer_modified (CupsNotifier *object,
 	{
 	  p->overwritten = 0;
 	  p->status = STATUS_TO_BE_CREATED;
-	  p->timeout = time(NULL) + TIMEOUT_IMMEDIATELY;
+	  p->timeout = scheduler.now() + TIMEOUT_IMMEDIATELY;
 	  debug_printf("Released CUPS queue %s from the control of cups-browsed. Printer with URI %s renamed to %s.\n",
 		       printer, p->uri, p->queue_name);
 	}
@@ -6446,7 +8613,7 @@ on_printer_modified (CupsNotifier *object,
 	  // STATUS_TO_BE_RELEASED
 	  p->slave_of = NULL;
 	  p->status = STATUS_TO_BE_RELEASED;
-	  p->timeout = time(NULL) + TIMEOUT_IMMEDIATELY;
+	  p->timeout = scheduler.now() + TIMEOUT_IMMEDIATELY;
 	  debug_printf("Released CUPS queue %s from the control of cups-browsed. No local queue any more for printer with URI %s.\n",
 		       printer, p->uri);
 	}
@@ -6461,7 +8628,7 @@ on_printer_modified (CupsNotifier *object,
       // "implicitclass://...", so we have a totally broken queue
       // and simply re-create it under its original name
       p->status = STATUS_TO_BE_CREATED;
-      p->timeout = time(NULL) + TIMEOUT_IMMEDIATELY;
+      p->timeout = scheduler.now() + TIMEOUT_IMMEDIATELY;
       debug_printf("CUPS queue %s with URI %s got damaged (PPD overwritten). Re-create it.",
 		   printer, p->uri);
     }
@@ -6564,6 +8731,8 @@ ipp_discoveries_list(cups_array_t *a)
 {
   ipp_discovery_t *e;
 
+  if (!debug_trace_enabled(DEBUG_CATEGORY))
+    return;
   debug_printf("Printer discovered %d times:\n", cupsArrayCount(a));
   for (e = cupsArrayFirst(a); e; e = cupsArrayNext(a))
     debug_printf("    %s, %s, %s\n", e->interface, e->type,
@@ -6603,6 +8772,141 @@ ipp_discoveries_add(cups_array_t *a,
 }
 
 
+static int
+printer_alias_cmp(void *va, void *vb, void *data)
+{
+  printer_alias_t *a = (printer_alias_t *)va;
+  printer_alias_t *b = (printer_alias_t *)vb;
+  int cmp;
+
+  if ((cmp = strcasecmp(a->service_name, b->service_name)) != 0)
+    return (cmp);
+  if ((cmp = strcasecmp(a->type, b->type)) != 0)
+    return (cmp);
+  return (strcasecmp(a->domain, b->domain));
+}
+
+
+static void
+printer_alias_free(void *ve, void *data)
+{
+  printer_alias_t *e = (printer_alias_t *)ve;
+
+  if (e)
+  {
+    free(e->service_name);
+    free(e->type);
+    free(e->domain);
+    free(e);
+  }
+}
+
+
+static void
+printer_alias_add(remote_printer_t *p,
+		  const char *service_name,
+		  const char *type,
+		  const char *domain)
+{
+  printer_alias_t key, *e;
+
+  if (!service_name || !service_name[0] || !type || !type[0] || !domain)
+    return;
+  if (!p->aliases &&
+      (p->aliases = cupsArrayNew3(printer_alias_cmp, NULL, NULL, 0, NULL,
+				  printer_alias_free)) == NULL)
+    return;
+  key.service_name = (char *)service_name;
+  key.type = (char *)type;
+  key.domain = (char *)domain;
+  if (cupsArrayFind(p->aliases, &key))
+    return;
+  if ((e = (printer_alias_t *)calloc(1, sizeof(printer_alias_t))) == NULL)
+  {
+    debug_printf("ERROR: Unable to allocate memory.\n");
+    return;
+  }
+  e->service_name = strdup(service_name);
+  e->type = strdup(type);
+  e->domain = strdup(domain);
+  cupsArrayAdd(p->aliases, e);
+  debug_printf("Printer %s also available as service '%s' of type '%s' in domain '%s'.\n",
+	       p->queue_name, service_name, type, domain);
+}
+
+
+// Removes the alias, returns 1 if it was there
+static int
+printer_alias_remove(remote_printer_t *p,
+		     const char *service_name,
+		     const char *type,
+		     const char *domain)
+{
+  printer_alias_t key, *e;
+
+  if (!p->aliases)
+    return (0);
+  key.service_name = (char *)service_name;
+  key.type = (char *)type;
+  key.domain = (char *)domain;
+  if ((e = cupsArrayFind(p->aliases, &key)) == NULL)
+    return (0);
+  cupsArrayRemove(p->aliases, e); // Frees e
+  return (1);
+}
+
+
+// (Re-)register the printer in the identity index under the given
+// UUID, NULL removes it from the index. UUIDs compare case-insensitively,
+// so they are stored in lower case
+static void
+printer_set_uuid(remote_printer_t *p,
+		 const char *uuid)
+{
+  char *ptr;
+
+  if (p->uuid)
+  {
+    if (uuid && !strcasecmp(p->uuid, uuid))
+      return;
+    if (g_hash_table_lookup(printer_uuids, p->uuid) == p)
+      g_hash_table_remove(printer_uuids, p->uuid);
+    free(p->uuid);
+    p->uuid = NULL;
+  }
+  if (!uuid || !uuid[0] || (p->uuid = strdup(uuid)) == NULL)
+    return;
+  for (ptr = p->uuid; *ptr; ptr ++)
+    *ptr = tolower(*ptr);
+  g_hash_table_replace(printer_uuids, p->uuid, p);
+}
+
+
+// Look up the entry of an already discovered printer by its UUID
+static remote_printer_t *
+printer_find_by_uuid(const char *uuid)
+{
+  char key[64], *ptr;
+
+  if (!uuid || !uuid[0] || strlen(uuid) >= sizeof(key))
+    return (NULL);
+  for (ptr = key; *uuid; uuid ++, ptr ++)
+    *ptr = tolower(*uuid);
+  *ptr = '\0';
+  return ((remote_printer_t *)g_hash_table_lookup(printer_uuids, key));
+}
+
+
+// Frees the fields which identify the device of a printer entry
+static void
+printer_identity_free(remote_printer_t *p)
+{
+  printer_set_uuid(p, NULL);
+  cupsArrayDelete(p->aliases);
+  p->aliases = NULL;
+}
+
+
 static remote_printer_t *
 create_remote_printer_entry (const char *queue_name,
 			     const char *location,
@@ -6747,7 +9051,7 @@ create_remote_printer_entry (const char *queue_name,
 
   // Schedule for immediate creation of the CUPS queue
   p->status = STATUS_TO_BE_CREATED;
-  p->timeout = time(NULL) + TIMEOUT_IMMEDIATELY;
+  p->timeout = scheduler.now() + TIMEOUT_IMMEDIATELY;
 
   // Flag which can be set to inhibit automatic saving of option settings
   // by the on_printer_modified() notification handler function
@@ -6789,7 +9093,17 @@ create_remote_printer_entry (const char *queue_name,
     p->netprinter = 0;
     if (p->uri[0] != '\0')
     {
-      p->prattrs = cfGetPrinterAttributes(p->uri, NULL, 0, NULL, 0, 1);
+      // We run in a resolver thread holding the write lock on the
+      // printer list, so we cannot wait for a free slot of the host,
+      // resolve_callback() has waited for the host's request rate
+      host_request_start(p->host, 1);
+      set_printer_attributes(p,
+			     get_remote_printer_attributes(p->uri,
+							   classification_attrs,
+							   sizeof(classification_attrs) /
+							   sizeof(classification_attrs[0]),
+							   1, NULL), 0);
+      host_request_done(p->host);
       debug_log_out(cf_get_printer_attributes_log);
       if (p->prattrs == NULL)
       {
@@ -6867,7 +9181,16 @@ create_remote_printer_entry (const char *queue_name,
 
     p->slave_of = NULL;
     p->netprinter = 1;
-    p->prattrs = cfGetPrinterAttributes(p->uri, NULL, 0, NULL, 0, 1);
+    // Resolver thread with the printer list locked, cannot wait, the
+    // request rate got respected by resolve_callback()
+    host_request_start(p->host, 1);
+    set_printer_attributes(p,
+			   get_remote_printer_attributes(p->uri,
+							 classification_attrs,
+							 sizeof(classification_attrs) /
+							 sizeof(classification_attrs[0]),
+							 1, NULL), 0);
+    host_request_done(p->host);
     debug_log_out(cf_get_printer_attributes_log);
     if (p->prattrs == NULL)
     {
@@ -6889,14 +9212,14 @@ create_remote_printer_entry (const char *queue_name,
 				   "ipp-versions-supported",
 				   IPP_TAG_KEYWORD)) != NULL)
       {
-	debug_printf("  Attr: %s\n", ippGetName(attr));
+	debug_trace("  Attr: %s\n", ippGetName(attr));
 	for (i = 0; i < ippGetCount(attr); i ++)
 	{
 	  strncpy(valuebuffer, ippGetString(attr, i, NULL),
 		  sizeof(valuebuffer) - 1);
 	  if (strlen(ippGetString(attr, i, NULL)) > 65535)
 	    valuebuffer[65535] = '\0';
-	  debug_printf("  Keyword: %s\n", valuebuffer);
+	  debug_trace("  Keyword: %s\n", valuebuffer);
 	  if (valuebuffer[0] > '1')
 	    break;
 	}
@@ -6925,9 +9248,9 @@ create_remote_printer_entry (const char *queue_name,
 				   "pwg-raster-document-resolution-supported",
 				   IPP_TAG_RESOLUTION)) != NULL)
       {
-	debug_printf("  Attr: %s\n", ippGetName(attr));
+	debug_trace("  Attr: %s\n", ippGetName(attr));
 	ippAttributeString(attr, valuebuffer, sizeof(valuebuffer));
-	debug_printf("  Value: %s\n", valuebuffer);
+	debug_trace("  Value: %s\n", valuebuffer);
 	if (valuebuffer[0] == '\0')
 	{
 	  for (i = 0; i < ippGetCount(attr); i ++)
@@ -6936,7 +9259,7 @@ create_remote_printer_entry (const char *queue_name,
 		    sizeof(valuebuffer) - 1);
 	    if (strlen(ippGetString(attr, i, NULL)) > 65535)
 	      valuebuffer[65535] = '\0';
-	    debug_printf("  Keyword: %s\n", valuebuffer);
+	    debug_trace("  Keyword: %s\n", valuebuffer);
 	    if (valuebuffer[0] != '\0')
 	      break;
 	  }
@@ -6961,9 +9284,9 @@ create_remote_printer_entry (const char *queue_name,
 		   p->queue_name);
       if ((attr = ippFindAttribute(p->prattrs, "urf-supported", IPP_TAG_KEYWORD)) != NULL)
       {
-	debug_printf("  Attr: %s\n", ippGetName(attr));
+	debug_trace("  Attr: %s\n", ippGetName(attr));
 	ippAttributeString(attr, valuebuffer, sizeof(valuebuffer));
-	debug_printf("  Value: %s\n", valuebuffer);
+	debug_trace("  Value: %s\n", valuebuffer);
 	if (valuebuffer[0] == '\0')
 	{
 	  for (i = 0; i < ippGetCount(attr); i ++)
@@ -6972,7 +9295,7 @@ create_remote_printer_entry (const char *queue_name,
 		    sizeof(valuebuffer) - 1);
 	    if (strlen(ippGetString(attr, i, NULL)) > 65535)
 	      valuebuffer[65535] = '\0';
-	    debug_printf("  Keyword: %s\n", valuebuffer);
+	    debug_trace("  Keyword: %s\n", valuebuffer);
 	    if (valuebuffer[0] != '\0')
 	      break;
 	  }
@@ -6999,9 +9322,9 @@ create_remote_printer_entry (const char *queue_name,
 				   "pclm-compression-method-preferred",
 				   IPP_TAG_KEYWORD)) != NULL)
       {
-	debug_printf("  Attr: %s\n", ippGetName(attr));
+	debug_trace("  Attr: %s\n", ippGetName(attr));
 	ippAttributeString(attr, valuebuffer, sizeof(valuebuffer));
-	debug_printf("  Value: %s\n", p->queue_name, valuebuffer);
+	debug_trace("  Value: %s\n", valuebuffer);
 	if (valuebuffer[0] == '\0')
 	{
 	  for (i = 0; i < ippGetCount(attr); i ++)
@@ -7010,7 +9333,7 @@ create_remote_printer_entry (const char *queue_name,
 		    sizeof(valuebuffer) - 1);
 	    if (strlen(ippGetString(attr, i, NULL)) > 65535)
 	      valuebuffer[65535] = '\0';
-	    debug_printf("  Keyword: %s\n", valuebuffer);
+	    debug_trace("  Keyword: %s\n", valuebuffer);
 	    if (valuebuffer[0] != '\0')
 	      break;
 	  }
@@ -7100,6 +9423,8 @@ create_remote_printer_entry (const char *queue_name,
   log_all_printers();
   cupsArrayAdd(remote_printers, p);
   log_all_printers();
+  flight_record(FLIGHT_DISCOVERED, p->queue_name, p->uri, p->status);
+  p->recorded_status = p->status;
 
   // If auto shutdown is active we have perhaps scheduled a timer to shut down
   // due to not having queues any more to maintain, kill the timer now
@@ -7117,6 +9442,7 @@ create_remote_printer_entry (const char *queue_name,
  fail:
   debug_printf("ERROR: Unable to create print queue, ignoring printer.\n");
   if (p->prattrs) ippDelete(p->prattrs);
+  if (p->capabilities) ippDelete(p->capabilities);
   if (p->type) free (p->type);
   if (p->service_name) free (p->service_name);
   if (p->host) free (p->host);
@@ -7125,6 +9451,7 @@ create_remote_printer_entry (const char *queue_name,
   cupsArrayDelete(p->ipp_discoveries);
   if (p->ip) free (p->ip);
   cupsFreeOptions(p->num_options, p->options);
+  printer_identity_free(p);
   if (p->uri) free (p->uri);
   if (p->pdl) free (p->pdl);
   if (p->make_model) free (p->make_model);
@@ -7148,6 +9475,8 @@ remove_printer_entry(remote_printer_t *p)
     return;
   }
 
+  flight_record(FLIGHT_DISAPPEARED, p->queue_name, p->uri, p->status);
+
   if (!p->slave_of)
   {
     // Check whether this queue has a slave from another server and
@@ -7180,7 +9509,7 @@ remove_printer_entry(remote_printer_t *p)
     p->options = NULL;
     // Schedule this printer for updating the CUPS queue
     q->status = STATUS_TO_BE_CREATED;
-    q->timeout = time(NULL) + TIMEOUT_IMMEDIATELY;
+    q->timeout = scheduler.now() + TIMEOUT_IMMEDIATELY;
     debug_printf("Printer %s (%s) disappeared, replacing by backup on host %s, port %d with URI %s.\n",
 		 p->queue_name, p->uri, q->host, q->port, q->uri);
   }
@@ -7191,7 +9520,34 @@ remove_printer_entry(remote_printer_t *p)
   // Schedule entry and its CUPS queue for removal
   if (p->status != STATUS_TO_BE_RELEASED)
     p->status = STATUS_DISAPPEARED;
-  p->timeout = time(NULL) + TIMEOUT_REMOVE;
+  p->timeout = scheduler.now() + TIMEOUT_REMOVE;
+}
+
+
+// Is the queue which create_queue() prepared for p with
+// num_cluster_printers members still the right one? p must still wait
+// for its queue, be the master, and its cluster must be the same
+static int
+queue_still_wanted(remote_printer_t *p,
+		   int num_cluster_printers)
+{
+  remote_printer_t *s;
+  int n = 0;
+
+  if (p->status != STATUS_TO_BE_CREATED || p->slave_of)
+    return (0);
+  for (s = (remote_printer_t *)cupsArrayFirst(remote_printers);
+       s; s = (remote_printer_t *)cupsArrayNext(remote_printers))
+    if (!strcmp(s->queue_name, p->queue_name))
+    {
+      if (s->status == STATUS_DISAPPEARED ||
+	  s->status == STATUS_UNCONFIRMED ||
+	  s->status == STATUS_TO_BE_RELEASED)
+	return (0);
+      n ++;
+    }
+
+  return (n == num_cluster_printers);
 }
 
 
@@ -7218,6 +9574,7 @@ create_queue(void* arg)
   char          ppdgenerator_msg[1024];
   char          *ppdfile;
   char          ppdname[1024];
+  int           ppd_generated = 0;
   ipp_attribute_t *attr;
   const char    *loadedppd = NULL;
   ppd_file_t    *ppd = NULL;
@@ -7239,7 +9596,7 @@ create_queue(void* arg)
   char          *default_pagesize = NULL;
   const char    *default_color = NULL;
 
-  debug_printf("create_queue() in THREAD %ld\n", pthread_self());
+  debug_trace("create_queue() in THREAD %ld\n", pthread_self());
 
   for (p = (remote_printer_t *)cupsArrayFirst(remote_printers);
        p; p = (remote_printer_t *)cupsArrayNext(remote_printers))
@@ -7251,13 +9608,24 @@ create_queue(void* arg)
   pthread_rwlock_unlock(&lock);
 
   if (!p || (p && p->status!=STATUS_TO_BE_CREATED))
+  {
+    host_request_done(a->host);
     return;
+  }
 
   pthread_rwlock_wrlock(&lock);
 
   debug_printf("create_queue(): Creating a print queue: Name: %s; URI: %s\n", a->queue, a->uri);
 
-  current_time = time(NULL);
+  current_time = scheduler.now();
+
+  if (task_cancelled())
+  {
+    debug_printf("create_queue(): Cancelled, queue %s not created.\n",
+		 p->queue_name);
+    p->timeout = current_time + TIMEOUT_RETRY;
+    goto end;
+  }
 
   if (p->slave_of)
   {
@@ -7266,10 +9634,10 @@ create_queue(void* arg)
     {
       p->status = STATUS_CONFIRMED;
       master->status = STATUS_TO_BE_CREATED;
-      master->timeout = time(NULL) + TIMEOUT_IMMEDIATELY;
+      master->timeout = scheduler.now() + TIMEOUT_IMMEDIATELY;
       if (p->is_legacy)
       {
-        p->timeout = time(NULL) + BrowseTimeout;
+        p->timeout = scheduler.now() + BrowseTimeout;
         debug_printf("starting BrowseTimeout timer for %s (%ds)\n",
 		     p->queue_name, BrowseTimeout);
       }
@@ -7281,7 +9649,7 @@ create_queue(void* arg)
       debug_printf("Master for slave %s is invalid (deleted?)\n",
 		   p->queue_name);
       p->status = STATUS_DISAPPEARED;
-      p->timeout = time(NULL) + TIMEOUT_IMMEDIATELY;
+      p->timeout = scheduler.now() + TIMEOUT_IMMEDIATELY;
     }
     goto end;
   }
@@ -7306,7 +9674,7 @@ create_queue(void* arg)
   if ((http = http_connect_local()) == NULL)
   {
     debug_printf("Unable to connect to CUPS!\n");
-    current_time = time(NULL);
+    current_time = scheduler.now();
     p->timeout = current_time + TIMEOUT_RETRY;
     goto end;
   }
@@ -7464,7 +9832,7 @@ create_queue(void* arg)
 	  // Schedule the removal of the queue for later
 	  if (in_shutdown == 0)
 	  {
-	    current_time = time(NULL);
+	    current_time = scheduler.now();
 	    p->timeout = current_time + TIMEOUT_RETRY;
 	    p->no_autosave = 0;
 	  }
@@ -7484,7 +9852,7 @@ create_queue(void* arg)
 		       cupsLastErrorString());
 	  if (in_shutdown == 0)
 	  {
-	    current_time = time(NULL);
+	    current_time = scheduler.now();
 	    p->timeout = current_time + TIMEOUT_RETRY;
 	    p->no_autosave = 0;
 	    goto end;
@@ -7504,18 +9872,19 @@ create_queue(void* arg)
   // for our IPP network printer, we proceed here
   if (p->netprinter == 1)
   {
-    if (p->prattrs == NULL)
-    {
-      p->prattrs = cfGetPrinterAttributes(p->uri, NULL, 0, NULL, 0, 1);
-      debug_log_out(cf_get_printer_attributes_log);
-    }
-    if (p->prattrs == NULL)
+    if (!get_full_printer_attributes(p))
     {
       debug_printf("get-printer-attributes IPP call failed on printer %s (%s).\n",
 		   p->queue_name, p->uri);
-      p->status = STATUS_DISAPPEARED;
-      current_time = time(NULL);
-      p->timeout = current_time + TIMEOUT_IMMEDIATELY;
+      current_time = scheduler.now();
+      if (task_cancelled())
+	// Not the printer's fault, try again later
+	p->timeout = current_time + TIMEOUT_RETRY;
+      else
+      {
+	p->status = STATUS_DISAPPEARED;
+	p->timeout = current_time + TIMEOUT_IMMEDIATELY;
+      }
       free((char*)loadedppd);
       free(ppdfile);
       goto end;
@@ -7536,6 +9905,11 @@ create_queue(void* arg)
 	   free((char*)loadedppd);
 	  goto end;
 	}
+	// The capabilities of all members get merged
+	if (s != p && (s->prattrs || s->prattrs_evicted) &&
+	    !get_full_printer_attributes(s))
+	  debug_printf("Could not get all attributes of cluster member %s, using the ones from its discovery.\n",
+		       s->uri);
         num_cluster_printers ++;
       }
     }
@@ -7597,11 +9971,11 @@ create_queue(void* arg)
       // ourselves
       printer_ipp_response = (num_cluster_printers == 1) ? p->prattrs :
         printer_attributes;
-      if (!ppdCreatePPDFromIPP2(ppdname, sizeof(ppdname), printer_ipp_response,
-				make_model,
-				pdl, color, duplex, conflicts, sizes,
-				default_pagesize, default_color,
-				ppdgenerator_msg, sizeof(ppdgenerator_msg)))
+      if (!generate_ppd(ppdname, sizeof(ppdname), printer_ipp_response,
+			make_model,
+			pdl, color, duplex, conflicts, sizes,
+			default_pagesize, default_color,
+			ppdgenerator_msg, sizeof(ppdgenerator_msg)))
       {
         if (errno != 0)
 	  debug_printf("Unable to create PPD file: %s\n",
@@ -7610,7 +9984,7 @@ create_queue(void* arg)
 	  debug_printf("Unable to create PPD file: %s\n",
 		       ppdgenerator_msg);
         p->status = STATUS_DISAPPEARED;
-	current_time = time(NULL);
+	current_time = scheduler.now();
         p->timeout = current_time + TIMEOUT_IMMEDIATELY;
         goto end;
       }
@@ -7619,6 +9993,7 @@ create_queue(void* arg)
         debug_printf("PPD generation successful: %s\n", ppdgenerator_msg);
         debug_printf("Created temporary PPD file: %s\n", ppdname);
         ppdfile = strdup(ppdname);
+        ppd_generated = 1;
       }
     }
 
@@ -7650,6 +10025,17 @@ create_queue(void* arg)
 	sizes = NULL;
       }
     }
+
+    // generate_ppd() released the lock, meanwhile the printer could
+    // have gone or its cluster could have changed
+    if (ppd_generated && !queue_still_wanted(p, num_cluster_printers))
+    {
+      debug_printf("Printer %s changed while generating its PPD file, not creating its queue now.\n",
+		   p->queue_name);
+      unlink(ppdfile);
+      free(ppdfile);
+      goto end;
+    }
   }
 
   // Do we have default option settings in cups-browsed.conf?
@@ -7709,18 +10095,19 @@ create_queue(void* arg)
       // distribution's package installation/update infrastructure
       // is suppressed.
       // Generating the ppd file for the remote cups queue
-      if (p->prattrs == NULL)
-      {
-	p->prattrs = cfGetPrinterAttributes(p->uri, NULL, 0, NULL, 0, 1);
-	debug_log_out(cf_get_printer_attributes_log);
-      }
-      if (p->prattrs == NULL)
+      if (!get_full_printer_attributes(p))
       {
 	debug_printf("get-printer-attributes IPP call failed on printer %s (%s).\n",
 		     p->queue_name, p->uri);
-	p->status = STATUS_DISAPPEARED;
-	current_time = time(NULL);
-	p->timeout = current_time + TIMEOUT_IMMEDIATELY;
+	current_time = scheduler.now();
+	if (task_cancelled())
+	  // Not the printer's fault, try again later
+	  p->timeout = current_time + TIMEOUT_RETRY;
+	else
+	{
+	  p->status = STATUS_DISAPPEARED;
+	  p->timeout = current_time + TIMEOUT_IMMEDIATELY;
+	}
 	goto end;
       }
       num_cluster_printers = 0;
@@ -7733,6 +10120,11 @@ create_queue(void* arg)
 	      s->status == STATUS_UNCONFIRMED ||
 	      s->status == STATUS_TO_BE_RELEASED)
 	    goto end;
+	  // The capabilities of all members get merged
+	  if (s != p && (s->prattrs || s->prattrs_evicted) &&
+	      !get_full_printer_attributes(s))
+	    debug_printf("Could not get all attributes of cluster member %s, using the ones from its discovery.\n",
+			 s->uri);
 	  num_cluster_printers++;
 	}
       }
@@ -7791,11 +10183,11 @@ create_queue(void* arg)
 	// ourselves
 	printer_ipp_response = (num_cluster_printers == 1) ? p->prattrs :
 	  printer_attributes;
-	if (!ppdCreatePPDFromIPP2(ppdname, sizeof(ppdname),
-				  printer_ipp_response, make_model,
-				  pdl, color, duplex, conflicts, sizes,
-				  default_pagesize, default_color,
-				  ppdgenerator_msg, sizeof(ppdgenerator_msg)))
+	if (!generate_ppd(ppdname, sizeof(ppdname),
+			  printer_ipp_response, make_model,
+			  pdl, color, duplex, conflicts, sizes,
+			  default_pagesize, default_color,
+			  ppdgenerator_msg, sizeof(ppdgenerator_msg)))
 	{
 	  if (errno != 0)
 	    debug_printf("Unable to create PPD file: %s\n",
@@ -7803,7 +10195,7 @@ create_queue(void* arg)
 	  else
 	    debug_printf("Unable to create PPD file: %s\n", ppdgenerator_msg);
 	  p->status = STATUS_DISAPPEARED;
-	  current_time = time(NULL);
+	  current_time = scheduler.now();
 	  p->timeout = current_time + TIMEOUT_IMMEDIATELY;
 	  goto end;
 	}
@@ -7812,6 +10204,7 @@ create_queue(void* arg)
 	  debug_printf("PPD generation successful: %s\n", ppdgenerator_msg);
 	  debug_printf("Created temporary PPD file: %s\n", ppdname);
 	  ppdfile = strdup(ppdname);
+	  ppd_generated = 1;
 	}
       }
     }
@@ -7844,6 +10237,17 @@ create_queue(void* arg)
 	sizes = NULL;
       }
     }
+
+    // generate_ppd() released the lock, meanwhile the printer could
+    // have gone or its cluster could have changed
+    if (ppd_generated && !queue_still_wanted(p, num_cluster_printers))
+    {
+      debug_printf("Printer %s changed while generating its PPD file, not creating its queue now.\n",
+		   p->queue_name);
+      unlink(ppdfile);
+      free(ppdfile);
+      goto end;
+    }
   }
   else
   {
@@ -7871,7 +10275,7 @@ create_queue(void* arg)
       ppd_status_t status = ppdLastError(&linenum);
       debug_printf("Unable to open PPD \"%s\": %s on line %d.",
 		   loadedppd, ppdErrorString(status), linenum);
-      current_time = time(NULL);
+      current_time = scheduler.now();
       p->timeout = current_time + TIMEOUT_RETRY;
       p->no_autosave = 0;
       unlink(loadedppd);
@@ -7882,7 +10286,7 @@ create_queue(void* arg)
     if ((out = cupsTempFile2(buf, sizeof(buf))) == NULL)
     {
       debug_printf("Unable to create temporary file!\n");
-      current_time = time(NULL);
+      current_time = scheduler.now();
       p->timeout = current_time + TIMEOUT_RETRY;
       p->no_autosave = 0;
       ppdClose(ppd);
@@ -7893,7 +10297,7 @@ create_queue(void* arg)
     if ((in = cupsFileOpen(loadedppd, "r")) == NULL)
     {
       debug_printf("Unable to open the downloaded PPD file!\n");
-      current_time = time(NULL);
+      current_time = scheduler.now();
       p->timeout = current_time + TIMEOUT_RETRY;
       p->no_autosave = 0;
       cupsFileClose(out);
@@ -8137,7 +10541,9 @@ create_queue(void* arg)
   {
     debug_printf("Unable to create/modify CUPS queue (%s)!\n",
 		 cupsLastErrorString());
-    current_time = time(NULL);
+    flight_record(FLIGHT_QUEUE_FAILED, p->queue_name, p->uri,
+		  cupsLastError());
+    current_time = scheduler.now();
     p->timeout = current_time + TIMEOUT_RETRY;
     p->no_autosave = 0;
     goto end;
@@ -8237,73 +10643,520 @@ create_queue(void* arg)
 		   cupsLastErrorString());
   }
 
-  // If this queue was the default printer in its previous life, make
-  // it the default printer again.
-  queue_creation_handle_default(p->queue_name);
+  // If this queue was the default printer in its previous life, make
+  // it the default printer again.
+  queue_creation_handle_default(p->queue_name);
+
+  // If cups-browsed or a failed backend has disabled this
+  // queue, re-enable it.
+  if ((disabled_str = is_disabled(p->queue_name, "cups-browsed")) != NULL)
+  {
+    enable_printer(p->queue_name);
+    free(disabled_str);
+  }
+  else if ((disabled_str =
+	    is_disabled(p->queue_name,
+			"Printer stopped due to backend errors")) !=
+	   NULL)
+  {
+    enable_printer(p->queue_name);
+    free(disabled_str);
+  }
+
+  p->status = STATUS_CONFIRMED;
+  if (p->is_legacy)
+  {
+    p->timeout = scheduler.now() + BrowseTimeout;
+    debug_printf("starting BrowseTimeout timer for %s (%ds)\n",
+		 p->queue_name, BrowseTimeout);
+  }
+  else
+    p->timeout = (time_t) -1;
+
+  // Check if an HTTP timeout happened during the print queue creation
+  // If it does - increment p->timeouted and set status to TO_BE_CREATED
+  // because the creation can fall through the process, have state changed
+  // to STATUS_CONFIRMED and experience the timeout
+  // If no timeout has happened, clear p->timeouted
+  if (timeout_reached == 1)
+  {
+    fprintf(stderr, "Timeout happened during creation of the queue %s, turn on DebugLogging for more info.\n",
+	    p->queue_name);
+    p->timeouted ++;
+    debug_printf("The queue %s already timeouted %d times in a row.\n",
+		 p->queue_name, p->timeouted);
+    flight_record(FLIGHT_TIMEOUT, p->queue_name, p->uri, p->timeouted);
+    p->status = STATUS_TO_BE_CREATED;
+    p->timeout = current_time + TIMEOUT_RETRY;
+  }
+  else if (p->timeouted != 0)
+  {
+    debug_printf("Creating the queue %s went smoothly after %d timeouts.\n",
+		 p->queue_name, p->timeouted);
+    p->timeouted = 0;
+  }
+  if (p->status == STATUS_CONFIRMED)
+  {
+    flight_record(FLIGHT_QUEUE_CREATED, p->queue_name, p->uri, p->status);
+    startup_first_queue(p->queue_name);
+
+    // The PPD option settings of the queue are the ones we have just
+    // applied, so record_printer_options() does not need to download
+    // the PPD file unless the queue gets changed later on
+    if (cups_notifier != NULL || p->netprinter)
+      p->ppd_options_time = get_printer_config_time(http, p->queue_name);
+  }
+
+  p->no_autosave = 0;
+
+ end:
+  if (http)
+    httpClose(http);
+  p->called = 0;
+  // recheck_timer() skips the entries of queues which are being
+  // created, so schedule the retry or the BrowseTimeout of this one now
+  if (p->timeout != (time_t) -1 && !in_shutdown)
+    g_idle_add(recheck_timer_idle, NULL);
+  if (AttributesMemoryLimit > 0)
+    drop_printer_attributes((size_t)AttributesMemoryLimit * 1024);
+  pthread_rwlock_unlock(&lock);
+  host_request_done(a->host);
+  free(a->uri);
+  free(a->queue);
+  free(a->host);
+  free(a);
+
+  return;
+}
+
+
+//
+// D-Bus interface to query the printers which we have discovered
+//
+
+static const char *
+printer_status_string(printer_status_t status)
+{
+  switch (status)
+  {
+    case STATUS_UNCONFIRMED:
+      return ("unconfirmed");
+    case STATUS_CONFIRMED:
+      return ("confirmed");
+    case STATUS_TO_BE_CREATED:
+      return ("to-be-created");
+    case STATUS_DISAPPEARED:
+      return ("disappeared");
+    case STATUS_TO_BE_RELEASED:
+      return ("to-be-released");
+  }
+  return ("unknown");
+}
+
+
+// Add the values of a keyword/MIME type/name attribute of the cached
+// printer attributes as a string array
+static void
+dbus_add_string_attribute(GVariantBuilder *b,
+			  ipp_t *attrs,
+			  const char *name)
+{
+  ipp_attribute_t *attr;
+  GVariantBuilder values;
+  const char *value;
+  int i, count;
+
+  if ((attr = ippFindAttribute(attrs, name, IPP_TAG_ZERO)) == NULL)
+    return;
+  g_variant_builder_init(&values, G_VARIANT_TYPE("as"));
+  for (i = 0, count = ippGetCount(attr); i < count; i ++)
+    if ((value = ippGetString(attr, i, NULL)) != NULL)
+      g_variant_builder_add(&values, "s", value);
+  g_variant_builder_add(b, "{sv}", name, g_variant_builder_end(&values));
+}
+
+
+// Everything we know about a printer, from memory only. Must be called
+// with lock held
+static GVariant *
+dbus_printer_variant(remote_printer_t *p)
+{
+  GVariantBuilder b;
+  remote_printer_t *q;
+  ipp_t *caps;
+  int i;
+
+  g_variant_builder_init(&b, G_VARIANT_TYPE("a{sv}"));
+  g_variant_builder_add(&b, "{sv}", "printer-uri",
+			g_variant_new_string(p->uri ? p->uri : ""));
+  g_variant_builder_add(&b, "{sv}", "queue-name",
+			g_variant_new_string(p->queue_name ?
+					     p->queue_name : ""));
+  g_variant_builder_add(&b, "{sv}", "status",
+			g_variant_new_string(printer_status_string(p->status)));
+  if (p->host)
+    g_variant_builder_add(&b, "{sv}", "host", g_variant_new_string(p->host));
+  if (p->ip)
+    g_variant_builder_add(&b, "{sv}", "ip", g_variant_new_string(p->ip));
+  g_variant_builder_add(&b, "{sv}", "port", g_variant_new_int32(p->port));
+  if (p->service_name)
+    g_variant_builder_add(&b, "{sv}", "service-name",
+			  g_variant_new_string(p->service_name));
+  if (p->type)
+    g_variant_builder_add(&b, "{sv}", "service-type",
+			  g_variant_new_string(p->type));
+  if (p->domain)
+    g_variant_builder_add(&b, "{sv}", "domain",
+			  g_variant_new_string(p->domain));
+  if (p->uuid)
+    g_variant_builder_add(&b, "{sv}", "uuid", g_variant_new_string(p->uuid));
+  g_variant_builder_add(&b, "{sv}", "ipp-printer",
+			g_variant_new_boolean(p->netprinter));
+  g_variant_builder_add(&b, "{sv}", "legacy-browsing",
+			g_variant_new_boolean(p->is_legacy));
+  // Members of a cluster share the queue, the master is the one which
+  // has set it up
+  if ((q = p->slave_of) != NULL && q != deleted_master && q->uri)
+    g_variant_builder_add(&b, "{sv}", "cluster-master-uri",
+			  g_variant_new_string(q->uri));
+  if (p->make_model)
+    g_variant_builder_add(&b, "{sv}", "make-and-model",
+			  g_variant_new_string(p->make_model));
+  if (p->pdl)
+    g_variant_builder_add(&b, "{sv}", "pdl", g_variant_new_string(p->pdl));
+  g_variant_builder_add(&b, "{sv}", "color",
+			g_variant_new_boolean(p->color));
+  g_variant_builder_add(&b, "{sv}", "duplex",
+			g_variant_new_boolean(p->duplex));
+  // The capabilities are known once the full attributes got fetched
+  // for setting up the queue, before that only the document formats
+  // from the discovery
+  if ((caps = p->capabilities) == NULL)
+    caps = p->prattrs;
+  if (caps)
+    for (i = 0;
+	 i < (int)(sizeof(capability_attrs) / sizeof(capability_attrs[0]));
+	 i ++)
+      dbus_add_string_attribute(&b, caps, capability_attrs[i]);
+
+  return (g_variant_builder_end(&b));
+}
+
+
+static remote_printer_t *
+dbus_find_printer(const char *uri)
+{
+  remote_printer_t *p;
+
+  for (p = (remote_printer_t *)cupsArrayFirst(remote_printers);
+       p; p = (remote_printer_t *)cupsArrayNext(remote_printers))
+    if (p->uri && !strcmp(p->uri, uri))
+      break;
+
+  return (p);
+}
+
+
+static gboolean
+on_dbus_get_printers(CupsBrowsedPrinters *object,
+		     GDBusMethodInvocation *invocation,
+		     gpointer user_data)
+{
+  GVariantBuilder b;
+  remote_printer_t *p;
+
+  g_variant_builder_init(&b, G_VARIANT_TYPE("aa{sv}"));
+  pthread_rwlock_rdlock(&lock);
+  for (p = (remote_printer_t *)cupsArrayFirst(remote_printers);
+       p; p = (remote_printer_t *)cupsArrayNext(remote_printers))
+    g_variant_builder_add_value(&b, dbus_printer_variant(p));
+  pthread_rwlock_unlock(&lock);
+  cups_browsed_printers_complete_get_printers(object, invocation,
+					      g_variant_builder_end(&b));
+
+  return (TRUE);
+}
 
-  // If cups-browsed or a failed backend has disabled this
-  // queue, re-enable it.
-  if ((disabled_str = is_disabled(p->queue_name, "cups-browsed")) != NULL)
+
+static gboolean
+on_dbus_get_printer(CupsBrowsedPrinters *object,
+		    GDBusMethodInvocation *invocation,
+		    const gchar *printer_uri,
+		    gpointer user_data)
+{
+  remote_printer_t *p;
+  GVariant *printer = NULL;
+
+  pthread_rwlock_rdlock(&lock);
+  if ((p = dbus_find_printer(printer_uri)) != NULL)
+    printer = dbus_printer_variant(p);
+  pthread_rwlock_unlock(&lock);
+  if (printer)
+    cups_browsed_printers_complete_get_printer(object, invocation, printer);
+  else
+    g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR,
+					  G_DBUS_ERROR_INVALID_ARGS,
+					  "No printer with URI %s",
+					  printer_uri);
+
+  return (TRUE);
+}
+
+
+// Fetch the attributes of the printer again and update its queue, in
+// the same way as when the printer got re-discovered with changed
+// capabilities
+static gboolean
+on_dbus_refresh_printer(CupsBrowsedPrinters *object,
+			GDBusMethodInvocation *invocation,
+			const gchar *printer_uri,
+			gpointer user_data)
+{
+  remote_printer_t *p;
+  int refresh = 0;
+
+  pthread_rwlock_wrlock(&lock);
+  if ((p = dbus_find_printer(printer_uri)) != NULL &&
+      p->status == STATUS_CONFIRMED && p->slave_of == NULL && !p->called)
   {
-    enable_printer(p->queue_name);
-    free(disabled_str);
+    debug_printf("Refreshing printer %s (%s) on request via D-Bus.\n",
+		 p->queue_name, p->uri);
+    set_printer_attributes(p, NULL, 0);
+    p->status = STATUS_TO_BE_CREATED;
+    p->timeout = scheduler.now() + TIMEOUT_IMMEDIATELY;
+    refresh = 1;
   }
-  else if ((disabled_str =
-	    is_disabled(p->queue_name,
-			"Printer stopped due to backend errors")) !=
-	   NULL)
+  pthread_rwlock_unlock(&lock);
+  if (p == NULL)
   {
-    enable_printer(p->queue_name);
-    free(disabled_str);
+    g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR,
+					  G_DBUS_ERROR_INVALID_ARGS,
+					  "No printer with URI %s",
+					  printer_uri);
+    return (TRUE);
   }
+  if (refresh)
+    recheck_timer();
+  else
+    debug_printf("Printer %s (%s) is a cluster member or being updated already, not refreshing it.\n",
+		 p->queue_name, p->uri);
+  cups_browsed_printers_complete_refresh_printer(object, invocation);
 
-  p->status = STATUS_CONFIRMED;
-  if (p->is_legacy)
-  {
-    p->timeout = time(NULL) + BrowseTimeout;
-    debug_printf("starting BrowseTimeout timer for %s (%ds)\n",
-		 p->queue_name, BrowseTimeout);
+  return (TRUE);
+}
+
+
+static void
+dbus_emit_printer_changed(remote_printer_t *p)
+{
+  if (dbus_printers && p->uri)
+    cups_browsed_printers_emit_printer_changed(dbus_printers, p->uri,
+					       (p->queue_name ?
+						p->queue_name : ""),
+					       printer_status_string(p->status));
+}
+
+
+static void
+dbus_emit_printer_removed(remote_printer_t *p)
+{
+  if (dbus_printers && p->uri)
+    cups_browsed_printers_emit_printer_removed(dbus_printers, p->uri,
+					       (p->queue_name ?
+						p->queue_name : ""));
+}
+
+
+static void
+on_dbus_bus_acquired(GDBusConnection *connection,
+		     const gchar *name,
+		     gpointer user_data)
+{
+  GError *error = NULL;
+
+  dbus_printers = cups_browsed_printers_skeleton_new();
+  g_signal_connect(dbus_printers, "handle-get-printers",
+		   G_CALLBACK(on_dbus_get_printers), NULL);
+  g_signal_connect(dbus_printers, "handle-get-printer",
+		   G_CALLBACK(on_dbus_get_printer), NULL);
+  g_signal_connect(dbus_printers, "handle-refresh-printer",
+		   G_CALLBACK(on_dbus_refresh_printer), NULL);
+  if (!g_dbus_interface_skeleton_export(G_DBUS_INTERFACE_SKELETON(dbus_printers),
+					connection, CUPS_BROWSED_DBUS_PATH,
+					&error))
+  {
+    debug_printf("Could not export the D-Bus interface: %s\n",
+		 error->message);
+    g_error_free(error);
+    g_object_unref(dbus_printers);
+    dbus_printers = NULL;
   }
-  else
-    p->timeout = (time_t) -1;
+}
 
-  // Check if an HTTP timeout happened during the print queue creation
-  // If it does - increment p->timeouted and set status to TO_BE_CREATED
-  // because the creation can fall through the process, have state changed
-  // to STATUS_CONFIRMED and experience the timeout
-  // If no timeout has happened, clear p->timeouted
-  if (timeout_reached == 1)
+
+static void
+on_dbus_name_lost(GDBusConnection *connection,
+		  const gchar *name,
+		  gpointer user_data)
+{
+  debug_printf("Could not get the D-Bus name %s, the query interface is not available.\n",
+	       name);
+}
+
+
+static time_t
+scheduler_time(void)
+{
+  return (time(NULL));
+}
+
+
+// Start the creation of the CUPS queue for arg->queue in a worker thread
+static int
+create_queue_task(create_args_t *arg)
+{
+  return (task_start(arg->queue, create_queue, arg, TIMEOUT_TASK));
+}
+
+
+// Remove the CUPS queue of the entry p, which is not a slave. Returns 1
+// if the entry can get freed now, 0 if the removal got postponed to
+// p->timeout.
+static int
+remove_cups_queue(remote_printer_t *p)
+{
+  http_t        *http;
+  char          uri[HTTP_MAX_URI];
+  int           num_jobs;
+  cups_job_t    *jobs;
+  ipp_t         *request;
+  int           ret = 1;
+
+  if ((http = http_connect_local()) == NULL)
   {
-    fprintf(stderr, "Timeout happened during creation of the queue %s, turn on DebugLogging for more info.\n",
-	    p->queue_name);
-    p->timeouted ++;
-    debug_printf("The queue %s already timeouted %d times in a row.\n",
-		 p->queue_name, p->timeouted);
-    p->status = STATUS_TO_BE_CREATED;
-    p->timeout = current_time + TIMEOUT_RETRY;
+    debug_printf("Unable to connect to CUPS!\n");
+    if (in_shutdown == 0)
+      p->timeout = scheduler.now() + TIMEOUT_RETRY;
+    return (0);
   }
-  else if (p->timeouted != 0)
+
+  // Do not auto-save option settings due to the print queue removal
+  // process or release process
+  p->no_autosave = 1;
+
+  // Record the option settings to retrieve them when the remote
+  // queue re-appears later or when cups-browsed gets started again
+  // if we want to use local settings
+  if (method == NONE)
+    record_printer_options(p->queue_name);
+
+  if (p->status != STATUS_TO_BE_RELEASED &&
+      !queue_overwritten(p))
   {
-    debug_printf("Creating the queue %s went smoothly after %d timeouts.\n",
-		 p->queue_name, p->timeouted);
-    p->timeouted = 0;
-  }
+    // Remove the CUPS queue
 
-  p->no_autosave = 0;
+    // Check whether there are still jobs and do not remove the queue
+    // then
+    num_jobs = 0;
+    jobs = NULL;
+    num_jobs = cupsGetJobs2(http, &jobs, p->queue_name, 0,
+			    CUPS_WHICHJOBS_ACTIVE);
+    if (num_jobs > 0) // There are still jobs
+    {
+      debug_printf("Queue has still jobs or CUPS error!\n");
+      cupsFreeJobs(num_jobs, jobs);
+      // Disable the queue
+#ifdef HAVE_AVAHI
+      if (avahi_present || p->domain == NULL || p->domain[0] == '\0')
+	// If avahi has got shut down, do not disable queues
+	// which are, created based on DNS-SD broadcasts as
+	// the server has most probably not gone away
+#endif // HAVE_AVAHI
+	disable_printer(p->queue_name,
+			"Printer disappeared or cups-browsed shutdown");
+      // Schedule the removal of the queue for later
+      if (in_shutdown == 0)
+      {
+	p->timeout = scheduler.now() + TIMEOUT_RETRY;
+	p->no_autosave = 0;
+	ret = 0;
+      }
+      // On shutdown the list entry gets freed anyway
+      goto end;
+    }
 
- end:
-  if (http)
-    httpClose(http);
-  p->called = 0;
-  pthread_rwlock_unlock(&lock);
-  free(a->uri);
-  free(a->queue);
-  free(a);
+    // If this queue was the default printer, note that fact
+    // so that it gets the default printer again when it
+    // re-appears, also switch back to the last local
+    // default printer
+    queue_removal_handle_default(p->queue_name);
 
-  return;
+    // If we do not have a subscription to CUPS' D-Bus
+    // notifications and so no default printer management,
+    // we simply do not remove this CUPS queue if it is the
+    // default printer, to not cause a change of the default
+    // printer or the loss of the information that this
+    // printer is the default printer.
+    if (cups_notifier == NULL &&
+	is_cups_default_printer(p->queue_name))
+    {
+      // Schedule the removal of the queue for later
+      if (in_shutdown == 0)
+      {
+	p->timeout = scheduler.now() + TIMEOUT_RETRY;
+	p->no_autosave = 0;
+	ret = 0;
+      }
+      // On shutdown the list entry gets freed anyway
+      goto end;
+    }
+
+    // No jobs, remove the CUPS queue
+    debug_printf("Removing local CUPS queue %s (%s).\n",
+		 p->queue_name, p->uri);
+    request = ippNewRequest(CUPS_DELETE_PRINTER);
+    // Printer URI: ipp://localhost/printers/<queue name>
+    httpAssembleURIf(HTTP_URI_CODING_ALL, uri, sizeof(uri), "ipp",
+		     NULL, "localhost", 0, "/printers/%s",
+		     p->queue_name);
+    ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI,
+		 "printer-uri", NULL, uri);
+    // Default user
+    ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_NAME,
+		 "requesting-user-name", NULL, cupsUser());
+    // Do it
+    ippDelete(cupsDoRequest(http, request, "/admin/"));
+
+    cups_queues_updated ++;
+    debug_printf("Print queue update %d of this series: %s\n",
+		 cups_queues_updated, p->queue_name);
+
+    if (cupsLastError() > IPP_STATUS_OK_EVENTS_COMPLETE &&
+	cupsLastError() != IPP_STATUS_ERROR_NOT_FOUND)
+    {
+      debug_printf("Unable to remove CUPS queue! (%s)\n",
+		   cupsLastErrorString());
+      flight_record(FLIGHT_QUEUE_FAILED, p->queue_name, p->uri,
+		    cupsLastError());
+      if (in_shutdown == 0)
+      {
+	p->timeout = scheduler.now() + TIMEOUT_RETRY;
+	p->no_autosave = 0;
+	ret = 0;
+      }
+    }
+    else
+      flight_record(FLIGHT_QUEUE_REMOVED, p->queue_name, p->uri,
+		    p->status);
+  }
+
+ end:
+  httpClose(http);
+  return (ret);
 }
 
 
+
 static gboolean
 update_cups_queues(gpointer unused)
 {
@@ -8311,14 +11164,9 @@ update_cups_queues(gpointer unused)
   pthread_rwlock_wrlock(&update_lock);
 
   remote_printer_t *p, *q;
-  http_t        *http;
-  char          uri[HTTP_MAX_URI];
-  int           num_jobs;
-  cups_job_t    *jobs;
-  ipp_t         *request;
   time_t        current_time;
 
-  debug_printf("update_cups_queues() in THREAD %ld\n", pthread_self);
+  debug_trace("update_cups_queues() in THREAD %ld\n", pthread_self);
   update_count++;
 
   // Create dummy entry to point slaves at when their master is about to
@@ -8359,9 +11207,19 @@ update_cups_queues(gpointer unused)
   {
     // We need to get the current time as precise as possible for retries
     // and reset the timeout flag
-    current_time = time(NULL);
+    current_time = scheduler.now();
     timeout_reached = 0;
 
+    // Status transitions are recorded here, as there are many places
+    // which change the status, but all changes are acted on here
+    if (p->status != p->recorded_status)
+    {
+      flight_record(FLIGHT_STATUS, p->queue_name, p->uri, p->status);
+      p->recorded_status = p->status;
+      note_activity();
+      dbus_emit_printer_changed(p);
+    }
+
     // terminating means we have received a signal and should shut down.
     // in_shutdown means we have exited the main loop.
     // update_cups_queues() is called after having exited the main loop
@@ -8411,138 +11269,24 @@ update_cups_queues(gpointer unused)
 	  if (p->timeout > current_time)
 	    break;
 
+	  // The creation of its queue is still in progress and uses the
+	  // entry, it waits for a PPD generator process without holding
+	  // the lock
+	  if (p->called && !in_shutdown)
+	  {
+	    p->timeout = current_time + 1;
+	    break;
+	  }
+
 	  debug_printf("Removing entry %s (%s)%s.\n", p->queue_name, p->uri,
 		       (p->slave_of ||
 			p->status == STATUS_TO_BE_RELEASED ? "" :
 			" and its CUPS queue"));
 
 	  // Slaves do not have a CUPS queue
-	  if ((q = p->slave_of) == NULL)
-	  {
-	    if ((http = http_connect_local()) == NULL)
-	    {
-	      debug_printf("Unable to connect to CUPS!\n");
-	      if (in_shutdown == 0)
-	      {
-		current_time = time(NULL);
-		p->timeout = current_time + TIMEOUT_RETRY;
-	      }
-	      break;
-	    }
-
-	    // Do not auto-save option settings due to the print queue removal
-	    // process or release process
-	    p->no_autosave = 1;
-
-	    // Record the option settings to retrieve them when the remote
-	    // queue re-appears later or when cups-browsed gets started again
-	    // if we want to use local settings
-	    if (method == NONE)
-	      record_printer_options(p->queue_name);
-
-	    if (p->status != STATUS_TO_BE_RELEASED &&
-		!queue_overwritten(p))
-	    {
-	      // Remove the CUPS queue
-
-	      // Check whether there are still jobs and do not remove the queue
-	      // then
-	      num_jobs = 0;
-	      jobs = NULL;
-	      num_jobs = cupsGetJobs2(http, &jobs, p->queue_name, 0,
-				      CUPS_WHICHJOBS_ACTIVE);
-	      if (num_jobs > 0) // There are still jobs
-	      {
-		debug_printf("Queue has still jobs or CUPS error!\n");
-		cupsFreeJobs(num_jobs, jobs);
-		// Disable the queue
-#ifdef HAVE_AVAHI
-		if (avahi_present || p->domain == NULL || p->domain[0] == '\0')
-		  // If avahi has got shut down, do not disable queues
-		  // which are, created based on DNS-SD broadcasts as
-		  // the server has most probably not gone away
-#endif // HAVE_AVAHI
-		  disable_printer(p->queue_name,
-				  "Printer disappeared or cups-browsed shutdown");
-		// Schedule the removal of the queue for later
-		if (in_shutdown == 0)
-		{
-		  current_time = time(NULL);
-		  p->timeout = current_time + TIMEOUT_RETRY;
-		  p->no_autosave = 0;
-		  break;
-		}
-		else
-		  // Make sure queue's list entry gets freed
-		  goto keep_queue;
-	      }
-
-	      // If this queue was the default printer, note that fact
-	      // so that it gets the default printer again when it
-	      // re-appears, also switch back to the last local
-	      // default printer
-	      queue_removal_handle_default(p->queue_name);
-
-	      // If we do not have a subscription to CUPS' D-Bus
-	      // notifications and so no default printer management,
-	      // we simply do not remove this CUPS queue if it is the
-	      // default printer, to not cause a change of the default
-	      // printer or the loss of the information that this
-	      // printer is the default printer.
-	      if (cups_notifier == NULL &&
-		  is_cups_default_printer(p->queue_name))
-	      {
-		// Schedule the removal of the queue for later
-		if (in_shutdown == 0)
-		{
-		  current_time = time(NULL);
-		  p->timeout = current_time + TIMEOUT_RETRY;
-		  p->no_autosave = 0;
-		  break;
-		}
-		else
-		  // Make sure queue's list entry gets freed
-		  goto keep_queue;
-	      }
-
-	      // No jobs, remove the CUPS queue
-	      debug_printf("Removing local CUPS queue %s (%s).\n",
-			   p->queue_name, p->uri);
-	      request = ippNewRequest(CUPS_DELETE_PRINTER);
-	      // Printer URI: ipp://localhost/printers/<queue name>
-	      httpAssembleURIf(HTTP_URI_CODING_ALL, uri, sizeof(uri), "ipp",
-			       NULL, "localhost", 0, "/printers/%s",
-			       p->queue_name);
-	      ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI,
-			   "printer-uri", NULL, uri);
-	      // Default user
-	      ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_NAME,
-			   "requesting-user-name", NULL, cupsUser());
-	      // Do it
-	      ippDelete(cupsDoRequest(http, request, "/admin/"));
-
-	      cups_queues_updated ++;
-	      debug_printf("Print queue update %d of this series: %s\n",
-			   cups_queues_updated, p->queue_name);
-
-	      if (cupsLastError() > IPP_STATUS_OK_EVENTS_COMPLETE &&
-		  cupsLastError() != IPP_STATUS_ERROR_NOT_FOUND)
-	      {
-		debug_printf("Unable to remove CUPS queue! (%s)\n",
-			     cupsLastErrorString());
-		if (in_shutdown == 0)
-		{
-		  current_time = time(NULL);
-		  p->timeout = current_time + TIMEOUT_RETRY;
-		  p->no_autosave = 0;
-		  break;
-		}
-	      }
-	    }
-	    httpClose(http);
-	  }
+	  if (p->slave_of == NULL && !scheduler.remove_queue(p))
+	    break;
 
-    keep_queue:
 
 	  // CUPS queue removed or released from cups-browsed, remove the list
 	  // entry
@@ -8554,6 +11298,7 @@ update_cups_queues(gpointer unused)
 	  // the element right after the deleted element. So no skipping
 	  // of an element and especially no reading beyond the end of the
 	  // array.
+	  dbus_emit_printer_removed(p);
 	  cupsArrayRemove(remote_printers, p);
 	  if (p->queue_name) free (p->queue_name);
 	  if (p->location) free (p->location);
@@ -8569,7 +11314,9 @@ update_cups_queues(gpointer unused)
 	  if (p->type) free (p->type);
 	  if (p->domain) free (p->domain);
 	  cupsArrayDelete(p->ipp_discoveries);
+	  printer_identity_free(p);
 	  if (p->prattrs) ippDelete (p->prattrs);
+	  if (p->capabilities) ippDelete (p->capabilities);
 	  if (p->nickname) free (p->nickname);
 	  free(p);
 	  p = NULL;
@@ -8600,38 +11347,33 @@ update_cups_queues(gpointer unused)
 	  if (p->called)
 	    break;
 
+	  // Do not overload the remote server, queue creations beyond
+	  // the per-host limits wait for their turn
+	  if (!in_shutdown && !host_request_start(p->host, 0))
+	  {
+	    p->timeout = current_time + 1;
+	    break;
+	  }
+
 	  create_args_t* arg = (create_args_t*)malloc(sizeof(create_args_t));
 	  arg->queue = strdup(p->queue_name);
 	  arg->uri = strdup(p->uri);
+	  arg->host = strdup(p->host);
 
-	  pthread_t id;
+	  flight_record(FLIGHT_QUEUE_CREATE, p->queue_name, p->uri,
+			p->timeouted);
 	  p->called = 1;
-	  int err = 0;
-	  if ((err = pthread_create(&id, NULL, (void*)create_queue,
-				    (void*)arg)))
+	  if (!scheduler.create_queue(arg))
 	  {
-	    debug_printf("Unable to create a new thread, retrying!\n");
-
-	    int attempts = 0;
-	    while (attempts < 5)
-	    {
-	      if ((err = pthread_create(&id, NULL, (void*)create_queue,
-					(void*)arg)))
-		debug_printf("Unable to create a new thread, retrying!\n");
-	      else
-		break;
-	      attempts++;
-	    }
-	    if (attempts == 5)
-	    {
-	      debug_printf("Could not create new thread even after many attempts for queue %s\n",
-			   p->queue_name);
-	      free(arg);
-	      p->called = 0;
-	      break;
-	    }
+	    debug_printf("Could not start the creation of queue %s\n",
+			 p->queue_name);
+	    host_request_done(arg->host);
+	    free(arg->queue);
+	    free(arg->uri);
+	    free(arg->host);
+	    free(arg);
+	    p->called = 0;
 	  }
-	  pthread_detach(id);
 
 	  break;
 
@@ -8679,12 +11421,64 @@ update_cups_queues(gpointer unused)
 }
 
 
+// Printers from the previous session are marked unconfirmed on startup,
+// and get confirmed when they are discovered again. As soon as the
+// initial discovery is done, that is, all DNS-SD browsers have reported
+// ALL_FOR_NOW, all services found by them are resolved, and all
+// BrowsePoll servers are polled once, the printers which are still
+// unconfirmed are gone, so remove them all now instead of each one
+// waiting for its TIMEOUT_CONFIRM.
+static gboolean
+check_unconfirmed_printers(gpointer unused)
+{
+  remote_printer_t *p;
+  size_t index;
+  int num_confirmed = 0, num_removed = 0;
+  time_t now;
+
+  if (unconfirmed_checked || terminating || in_shutdown)
+    return (FALSE);
+#ifdef HAVE_AVAHI
+  if ((BrowseRemoteProtocols & BROWSE_DNSSD) &&
+      (!browsers_started || browsers_pending ||
+       __atomic_load_n(&resolves_pending, __ATOMIC_ACQUIRE) > 0))
+    return (FALSE);
+#endif // HAVE_AVAHI
+  for (index = 0; index < NumBrowsePoll; index ++)
+    if (!BrowsePoll[index]->polled)
+      return (FALSE);
+
+  unconfirmed_checked = 1;
+
+  pthread_rwlock_wrlock(&lock);
+  now = scheduler.now();
+  for (p = (remote_printer_t *)cupsArrayFirst(remote_printers);
+       p; p = (remote_printer_t *)cupsArrayNext(remote_printers))
+    if (p->status == STATUS_UNCONFIRMED)
+    {
+      if (p->timeout > now + TIMEOUT_IMMEDIATELY)
+	p->timeout = now + TIMEOUT_IMMEDIATELY;
+      num_removed ++;
+    }
+    else if (p->status == STATUS_CONFIRMED)
+      num_confirmed ++;
+  pthread_rwlock_unlock(&lock);
+
+  debug_printf("Initial printer discovery done, %d printers confirmed, %d unconfirmed printers from the previous session get removed.\n",
+	       num_confirmed, num_removed);
+  if (num_removed > 0)
+    recheck_timer();
+
+  return (FALSE);
+}
+
+
 static void
 recheck_timer(void)
 {
   remote_printer_t *p;
   time_t timeout = (time_t) -1;
-  time_t now = time(NULL);
+  time_t now = scheduler.now();
 
   if (!gmainloop)
     return;
@@ -8707,13 +11501,13 @@ recheck_timer(void)
   }
 
   if (queues_timer_id)
-    g_source_remove (queues_timer_id);
+    scheduler.source_remove (queues_timer_id);
 
   if (timeout != (time_t) -1)
   {
     debug_printf("checking queues in %ds\n", timeout);
     queues_timer_id =
-      g_timeout_add_seconds (timeout, update_cups_queues, NULL);
+      scheduler.timeout_add_seconds (timeout, update_cups_queues, NULL);
   }
   else
   {
@@ -8723,6 +11517,194 @@ recheck_timer(void)
 }
 
 
+// recheck_timer() for worker threads, from the main loop
+static gboolean
+recheck_timer_idle(gpointer unused)
+{
+  if (!terminating && !in_shutdown)
+    recheck_timer();
+
+  return (FALSE);
+}
+
+
+//
+// Discovery of remote printers via DNS-SD
+//
+
+#undef DEBUG_CATEGORY
+#define DEBUG_CATEGORY DEBUG_DISCOVERY
+
+
+#ifdef HAVE_AVAHI
+// A TXT record string is at most 255 bytes long
+#define TXT_VALUE_MAX 256
+
+// A field of a DNS-SD TXT record, pointing into the AvahiStringList
+// entry, so it is not NUL-terminated and only valid as long as the list
+typedef struct txt_field_s
+{
+  int present;       // Key is in the record
+  const char *value; // NULL if the entry is only "key" without "="
+  size_t len;
+} txt_field_t;
+
+// The TXT record fields which we evaluate, looked up in a single pass
+// through the record when the service got resolved, so that the
+// resolver, the filters and the printer classification do not search
+// (and copy) them each time again
+typedef struct txt_record_s
+{
+  AvahiStringList *list; // For BrowseFilter rules on other fields
+  txt_field_t ty,
+	      product,
+	      usb_MDL,
+	      usb_MFG,
+	      printer_type,
+	      pdl,
+	      color,
+	      duplex,
+	      note,
+	      rp,
+	      adminurl,
+	      uuid;
+} txt_record_t;
+
+static const struct
+{
+  const char *key;
+  size_t offset;
+} txt_record_keys[] =
+{
+  { "ty",           offsetof(txt_record_t, ty) },
+  { "product",      offsetof(txt_record_t, product) },
+  { "usb_MDL",      offsetof(txt_record_t, usb_MDL) },
+  { "usb_MFG",      offsetof(txt_record_t, usb_MFG) },
+  { "printer-type", offsetof(txt_record_t, printer_type) },
+  { "pdl",          offsetof(txt_record_t, pdl) },
+  { "Color",        offsetof(txt_record_t, color) },
+  { "Duplex",       offsetof(txt_record_t, duplex) },
+  { "note",         offsetof(txt_record_t, note) },
+  { "rp",           offsetof(txt_record_t, rp) },
+  { "adminurl",     offsetof(txt_record_t, adminurl) },
+  { "UUID",         offsetof(txt_record_t, uuid) }
+};
+
+
+// Split a TXT record entry into key and value, returns the key length
+static size_t
+txt_entry_split(AvahiStringList *entry,
+		const char **key,
+		txt_field_t *field)
+{
+  const char *text = (const char *)avahi_string_list_get_text(entry);
+  size_t size = avahi_string_list_get_size(entry);
+  const char *eq = memchr(text, '=', size);
+
+  *key = text;
+  field->present = 1;
+  if (eq)
+  {
+    field->value = eq + 1;
+    field->len = size - (eq - text) - 1;
+    return (eq - text);
+  }
+  field->value = NULL;
+  field->len = 0;
+  return (size);
+}
+
+
+// Keys are case-insensitive (RFC 6763, section 6.4), like in
+// avahi_string_list_find()
+static int
+txt_key_matches(const char *key,
+		size_t key_len,
+		const char *name)
+{
+  return (strlen(name) == key_len && !strncasecmp(key, name, key_len));
+}
+
+
+static void
+txt_record_parse(AvahiStringList *list,
+		 txt_record_t *txt)
+{
+  AvahiStringList *entry;
+  txt_field_t field, *dest;
+  const char *key;
+  size_t key_len;
+  int i;
+
+  memset(txt, 0, sizeof(txt_record_t));
+  txt->list = list;
+
+  for (entry = list; entry; entry = avahi_string_list_get_next(entry))
+  {
+    key_len = txt_entry_split(entry, &key, &field);
+    for (i = 0; i < sizeof(txt_record_keys) / sizeof(txt_record_keys[0]);
+	 i ++)
+      if (txt_key_matches(key, key_len, txt_record_keys[i].key))
+      {
+	// Like with avahi_string_list_find() the first entry wins
+	dest = (txt_field_t *)((char *)txt + txt_record_keys[i].offset);
+	if (!dest->present)
+	  *dest = field;
+	break;
+      }
+  }
+}
+
+
+// Look up an arbitrary field, for the ones not pre-parsed
+static int
+txt_record_find(txt_record_t *txt,
+		const char *name,
+		txt_field_t *field)
+{
+  AvahiStringList *entry;
+  const char *key;
+  size_t key_len;
+
+  for (entry = txt->list; entry; entry = avahi_string_list_get_next(entry))
+  {
+    key_len = txt_entry_split(entry, &key, field);
+    if (txt_key_matches(key, key_len, name))
+      return (1);
+  }
+  field->present = 0;
+  return (0);
+}
+
+
+// Copy the value of a field into buf as a C string, NULL if the field is
+// missing or has no value
+static char *
+txt_field_string(const txt_field_t *field,
+		 char *buf,
+		 size_t bufsize)
+{
+  size_t len;
+
+  if (!field->present || !field->value)
+    return (NULL);
+  len = (field->len < bufsize - 1 ? field->len : bufsize - 1);
+  memcpy(buf, field->value, len);
+  buf[len] = '\0';
+  return (buf);
+}
+
+
+static int
+txt_field_equals(const txt_field_t *field,
+		 const char *str)
+{
+  return (field->present && field->value && strlen(str) == field->len &&
+	  !strncasecmp(field->value, str, field->len));
+}
+#endif // HAVE_AVAHI
+
+
 static gboolean
 matched_filters(const char *queue_name,
 		const char *host,
@@ -8735,8 +11717,8 @@ matched_filters(const char *queue_name,
   const char *property = NULL;
   char buf[10];
 #ifdef HAVE_AVAHI
-  AvahiStringList *entry = NULL;
-  char *key = NULL, *value = NULL;
+  txt_field_t field;
+  char valbuf[TXT_VALUE_MAX], *value;
 #endif // HAVE_AVAHI
 
   debug_printf("Matching printer \"%s\" with properties Host = \"%s\", Port = %d, Service Name = \"%s\", Domain = \"%s\" with the BrowseFilter lines in cups-browsed.conf\n",
@@ -8754,69 +11736,44 @@ matched_filters(const char *queue_name,
 #ifdef HAVE_AVAHI
     // Go through the TXT record to see whether this rule applies to a field
     // in there
-    if (txt)
+    if (txt && txt_record_find((txt_record_t *)txt, filter->field, &field))
     {
-      entry = avahi_string_list_find((AvahiStringList *)txt, filter->field);
-      if (entry)
+      value = txt_field_string(&field, valbuf, sizeof(valbuf));
+      debug_printf(", TXT record entry: %s = %s",
+		   filter->field, (value ? value : ""));
+      if (filter->regexp)
       {
-	avahi_string_list_get_pair(entry, &key, &value, NULL);
-	if (key)
+	// match regexp
+	if (!value)
+	  value = "";
+	if ((filter->cregexp &&
+	     regexec(filter->cregexp, value, 0, NULL, 0) == 0) ||
+	    (!filter->cregexp && !strcasecmp(filter->regexp, value)))
 	{
-	  debug_printf(", TXT record entry: %s = %s",
-		       key, (value ? value : ""));
-	  if (filter->regexp)
-	  {
-	    // match regexp
-	    if (!value)
-	      value = strdup("");
-	    if ((filter->cregexp &&
-		 regexec(filter->cregexp, value, 0, NULL, 0) == 0) ||
-		(!filter->cregexp && !strcasecmp(filter->regexp, value)))
-	    {
-	      if (filter->sense == FILTER_NOT_MATCH)
-	      {
-		avahi_free(key);
-		avahi_free(value);
-		goto filter_failed;
-	      }
-	    }
-	    else
-	    {
-	      if (filter->sense == FILTER_MATCH)
-	      {
-		avahi_free(key);
-		avahi_free(value);
-		goto filter_failed;
-	      }
-	    }
-	  }
-	  else
-	  {
-	    // match boolean value
-	    if (filter->sense == FILTER_MATCH)
-	    {
-	      if (!value || strcasecmp(value, "T"))
-	      {
-		avahi_free(key);
-		avahi_free(value);
-		goto filter_failed;
-	      }
-	    }
-	    else
-	    {
-	      if (value && !strcasecmp(value, "T"))
-	      {
-		avahi_free(key);
-		avahi_free(value);
-		goto filter_failed;
-	      }
-	    }
-	  }
+	  if (filter->sense == FILTER_NOT_MATCH)
+	    goto filter_failed;
+	}
+	else
+	{
+	  if (filter->sense == FILTER_MATCH)
+	    goto filter_failed;
+	}
+      }
+      else
+      {
+	// match boolean value
+	if (filter->sense == FILTER_MATCH)
+	{
+	  if (!value || strcasecmp(value, "T"))
+	    goto filter_failed;
+	}
+	else
+	{
+	  if (value && !strcasecmp(value, "T"))
+	    goto filter_failed;
 	}
-	avahi_free(key);
-	avahi_free(value);
-	goto filter_matched;
       }
+      goto filter_matched;
     }
 #endif // HAVE_AVAHI
 
@@ -8862,11 +11819,12 @@ matched_filters(const char *queue_name,
       property = NULL;
     if (property)
     {
-      if (!filter->regexp)
-	filter->regexp = "";
+      // Do not modify the filter itself, so that it can get freed when
+      // re-reading the configuration
       if ((filter->cregexp &&
 	   regexec(filter->cregexp, property, 0, NULL, 0) == 0) ||
-	  (!filter->cregexp && !strcasecmp(filter->regexp, property)))
+	  (!filter->cregexp &&
+	   !strcasecmp(filter->regexp ? filter->regexp : "", property)))
       {
 	if (filter->sense == FILTER_NOT_MATCH)
 	  goto filter_failed;
@@ -8899,6 +11857,19 @@ matched_filters(const char *queue_name,
 }
 
 
+static int
+netif_path_cmp(void *va, void *vb, void *data)
+{
+  netif_path_t *a = (netif_path_t *)va;
+  netif_path_t *b = (netif_path_t *)vb;
+  int cmp;
+
+  if ((cmp = strcmp(a->name, b->name)) != 0)
+    return (cmp);
+  return (a->family - b->family);
+}
+
+
 static gboolean
 update_netifs (gpointer data)
 {
@@ -8906,10 +11877,12 @@ update_netifs (gpointer data)
 
   struct ifaddrs *ifaddr, *ifa;
   netif_t *iface, *iface2;
+  netif_path_t *path;
+  cups_array_t *paths;
   int i, add_to_netifs, addr_size, dupe, if_found, addr_found;
   char *host, buf[HTTP_MAX_HOST], *p, list[65536], *l;
 
-  debug_printf("update_netifs() in THREAD %ld\n", pthread_self());
+  debug_trace("update_netifs() in THREAD %ld\n", pthread_self());
 
   update_netifs_sourceid = 0;
   if (getifaddrs (&ifaddr) == -1)
@@ -8932,6 +11905,9 @@ update_netifs (gpointer data)
     free (host);
   }
 
+  paths = cupsArrayNew3(netif_path_cmp, NULL, NULL, 0, NULL,
+			(cups_afree_func_t)free);
+
   memset(list, 0, sizeof(list));
   snprintf(list, sizeof(list) - 1, "Network interfaces: ");
   l = list + strlen(list);
@@ -8963,6 +11939,22 @@ update_netifs (gpointer data)
       addr_size = sizeof (struct sockaddr_in6);
     else
       addr_size = 0;
+
+    // Note the interface and address family as network path if the
+    // interface is up
+    if (addr_size && paths &&
+	(ifa->ifa_flags & IFF_UP) && (ifa->ifa_flags & IFF_RUNNING) &&
+	!(ifa->ifa_flags & IFF_LOOPBACK) &&
+	(path = calloc(1, sizeof(netif_path_t))) != NULL)
+    {
+      strncpy(path->name, ifa->ifa_name, sizeof(path->name) - 1);
+      path->family = ifa->ifa_addr->sa_family;
+      if (cupsArrayFind(paths, path))
+	free(path);
+      else
+	cupsArrayAdd(paths, path);
+    }
+
     if (addr_size)
     {
       if (strlen(list) + strlen(ifa->ifa_name) + 1 <=
@@ -9161,6 +12153,53 @@ update_netifs (gpointer data)
   debug_printf("%s\n", list);
 
   freeifaddrs (ifaddr);
+
+  // Find the network paths which went away, the printers discovered
+  // through them get treated in the main thread, as we can get called
+  // with the printer list locked.
+  if (paths)
+  {
+    if (netif_paths)
+    {
+      for (path = (netif_path_t *)cupsArrayFirst(netif_paths); path;
+	   path = (netif_path_t *)cupsArrayNext(netif_paths))
+	if (!cupsArrayFind(paths, path))
+	{
+	  debug_printf("Network interface %s lost its %s connection.\n",
+		       path->name,
+		       (path->family == AF_INET ? "IPv4" : "IPv6"));
+	  if (!netif_paths_lost)
+	    netif_paths_lost = cupsArrayNew3(netif_path_cmp, NULL, NULL, 0,
+					     NULL, (cups_afree_func_t)free);
+	  if (netif_paths_lost && !cupsArrayFind(netif_paths_lost, path))
+	  {
+	    netif_path_t *lost = malloc(sizeof(netif_path_t));
+	    if (lost)
+	    {
+	      memcpy(lost, path, sizeof(netif_path_t));
+	      cupsArrayAdd(netif_paths_lost, lost);
+	    }
+	  }
+	}
+#ifdef HAVE_AVAHI
+      // A network interface on which we browse came up
+      if (BrowseInterfaces)
+	for (path = (netif_path_t *)cupsArrayFirst(paths); path;
+	     path = (netif_path_t *)cupsArrayNext(paths))
+	  if (!cupsArrayFind(netif_paths, path) &&
+	      cupsArrayFind(BrowseInterfaces, path->name))
+	  {
+	    g_idle_add(avahi_browser_update, NULL);
+	    break;
+	  }
+#endif // HAVE_AVAHI
+      cupsArrayDelete(netif_paths);
+    }
+    netif_paths = paths;
+    if (netif_paths_lost && !netif_paths_lost_sourceid)
+      netif_paths_lost_sourceid = g_idle_add(reconcile_lost_netifs, NULL);
+  }
+
   pthread_rwlock_unlock(&netiflock);
 
   // If run as a timeout, don't run it again.
@@ -9168,6 +12207,39 @@ update_netifs (gpointer data)
 }
 
 
+// Check whether one of the network paths which we have noted in
+// update_netifs() is not up any more
+static int
+netif_paths_gone (void)
+{
+  struct ifaddrs *ifaddr, *ifa;
+  netif_path_t *path;
+  int gone = 0;
+
+  if (getifaddrs (&ifaddr) == -1)
+    return (0);
+
+  pthread_rwlock_rdlock(&netiflock);
+  if (netif_paths)
+    for (path = (netif_path_t *)cupsArrayFirst(netif_paths);
+	 path && !gone;
+	 path = (netif_path_t *)cupsArrayNext(netif_paths))
+    {
+      for (ifa = ifaddr; ifa; ifa = ifa->ifa_next)
+	if (ifa->ifa_addr && ifa->ifa_addr->sa_family == path->family &&
+	    (ifa->ifa_flags & IFF_UP) && (ifa->ifa_flags & IFF_RUNNING) &&
+	    !strcmp(ifa->ifa_name, path->name))
+	  break;
+      if (ifa == NULL)
+	gone = 1;
+    }
+  pthread_rwlock_unlock(&netiflock);
+
+  freeifaddrs (ifaddr);
+  return (gone);
+}
+
+
 static int
 is_local_hostname(const char *host_name)
 {
@@ -9202,6 +12274,7 @@ examine_discovered_printer_record(const char *host,
 				  const char *domain,
 				  const char *interface,
 				  int family,
+				  const char *uuid,
 				  void *txt)
 {
   char uri[HTTP_MAX_URI];
@@ -9209,15 +12282,15 @@ examine_discovered_printer_record(const char *host,
        *make_model = NULL;
   int color = 1, duplex = 1;
 #ifdef HAVE_AVAHI
-  AvahiStringList *entry = NULL;
-  char *key = NULL, *value = NULL;
-  char *note_value = NULL;
+  txt_record_t *txtrec = (txt_record_t *)txt;
+  char value[TXT_VALUE_MAX], note_value[TXT_VALUE_MAX];
   char service_host_name[1024];
 #endif // HAVE_AVAHI
-  remote_printer_t *p = NULL, key_rec;
+  remote_printer_t *p = NULL, *q, key_rec;
   char *local_queue_name = NULL;
   int is_cups_queue;
   int raw_queue = 0;
+  int alias = 0;
   char *ptr;
 
   if (!host || !resource || !service_name || !location || !info || !type ||
@@ -9258,68 +12331,38 @@ examine_discovered_printer_record(const char *host,
   if (txt)
   {
     // Find make and model by the TXT record
-    if ((entry = avahi_string_list_find((AvahiStringList *)txt, "ty")) != NULL)
-    {
-      avahi_string_list_get_pair(entry, &key, &value, NULL);
-      if (key && value && !strcasecmp(key, "ty") && strlen(value) >= 3)
-	make_model = strdup(value);
-      avahi_free(key);
-      avahi_free(value);
-    }
-    else if ((entry =
-	      avahi_string_list_find((AvahiStringList *)txt,
-				     "product")) != NULL)
-    {
-      avahi_string_list_get_pair(entry, &key, &value, NULL);
-      if (key && value && !strcasecmp(key, "product") && strlen(value) >= 3)
-      {
-	make_model = strdup(value + 1);
-	make_model[strlen(make_model) - 1] = '\0';
-      }
-      avahi_free(key);
-      avahi_free(value);
-    }
-    else if ((entry =
-	      avahi_string_list_find((AvahiStringList *)txt,
-				     "usb_MDL")) != NULL)
-    {
-      avahi_string_list_get_pair(entry, &key, &value, NULL);
-      if (key && value && !strcasecmp(key, "usb_MDL") && strlen(value) >= 3)
-	make_model = strdup(value);
-      avahi_free(key);
-      avahi_free(value);
-      if (make_model &&
-	  (entry =
-	   avahi_string_list_find((AvahiStringList *)txt,
-				  "usb_MFG")) != NULL)
-      {
-	avahi_string_list_get_pair(entry, &key, &value, NULL);
-	if (key && value && !strcasecmp(key, "usb_MFG") && strlen(value) >= 3)
-	{
-	  make_model =
-	    realloc(make_model, strlen(value) + strlen(make_model) + 2);
-	  memmove(make_model + strlen(value) + 1, make_model,
-		  strlen(make_model) + 1);
-	  strcpy(make_model, value);
-	  make_model[strlen(value)] = ' ';
-	}
-	avahi_free(key);
-	avahi_free(value);
+    if (txtrec->ty.present)
+    {
+      if (txtrec->ty.value && txtrec->ty.len >= 3)
+	make_model = strndup(txtrec->ty.value, txtrec->ty.len);
+    }
+    else if (txtrec->product.present)
+    {
+      if (txtrec->product.value && txtrec->product.len >= 3)
+	make_model = strndup(txtrec->product.value + 1,
+			     txtrec->product.len - 2);
+    }
+    else if (txtrec->usb_MDL.present)
+    {
+      if (txtrec->usb_MDL.value && txtrec->usb_MDL.len >= 3)
+	make_model = strndup(txtrec->usb_MDL.value, txtrec->usb_MDL.len);
+      if (make_model && txtrec->usb_MFG.value && txtrec->usb_MFG.len >= 3)
+      {
+	size_t mfg_len = txtrec->usb_MFG.len;
+	make_model =
+	  realloc(make_model, mfg_len + strlen(make_model) + 2);
+	memmove(make_model + mfg_len + 1, make_model,
+		strlen(make_model) + 1);
+	memcpy(make_model, txtrec->usb_MFG.value, mfg_len);
+	make_model[mfg_len] = ' ';
       }
     }
     // Check by the printer-type TXT field whether the discovered printer is a
     // CUPS queue
-    entry = avahi_string_list_find((AvahiStringList *)txt, "printer-type");
-    if (entry)
-    {
-      avahi_string_list_get_pair(entry, &key, &value, NULL);
-      if (key && value && strlen(value) > 1 &&
-	  !strcasecmp(key, "printer-type") && value[0] == '0' &&
-	  value[1] == 'x')
-	is_cups_queue = 1;
-      avahi_free(key);
-      avahi_free(value);
-    }
+    if (txtrec->printer_type.value && txtrec->printer_type.len > 1 &&
+	txtrec->printer_type.value[0] == '0' &&
+	txtrec->printer_type.value[1] == 'x')
+      is_cups_queue = 1;
   }
 #else
   // Check by the resource whether the discovered printer is a CUPS queue
@@ -9345,17 +12388,9 @@ examine_discovered_printer_record(const char *host,
     // behind it for auto-creating a local queue pointing to it.
     if (txt)
     {
-      entry = avahi_string_list_find((AvahiStringList *)txt, "product");
-      if (entry)
-      {
-	avahi_string_list_get_pair(entry, &key, &value, NULL);
-	if (!key || !value || strcasecmp(key, "product") || value[0] != '(' ||
-	    value[strlen(value) - 1] != ')')
-	  raw_queue = 1;
-	avahi_free(key);
-	avahi_free(value);
-      }
-      else
+      if (!txtrec->product.value || txtrec->product.len < 2 ||
+	  txtrec->product.value[0] != '(' ||
+	  txtrec->product.value[txtrec->product.len - 1] != ')')
 	raw_queue = 1;
     }
     else if (domain && domain[0] != '\0')
@@ -9376,61 +12411,26 @@ examine_discovered_printer_record(const char *host,
     if (txt)
     {
       // Find out which PDLs the printer understands
-      entry = avahi_string_list_find((AvahiStringList *)txt, "pdl");
-      if (entry)
-      {
-	avahi_string_list_get_pair(entry, &key, &value, NULL);
-	if (key && value && !strcasecmp(key, "pdl") && strlen(value) >= 3)
-	  pdl = remove_bad_chars(value, 1);
-	avahi_free(key);
-	avahi_free(value);
-      }
+      if (txtrec->pdl.len >= 3 &&
+	  txt_field_string(&txtrec->pdl, value, sizeof(value)))
+	pdl = remove_bad_chars(value, 1);
       // Find out if we have a color printer
-      entry = avahi_string_list_find((AvahiStringList *)txt, "Color");
-      if (entry)
-      {
-	avahi_string_list_get_pair(entry, &key, &value, NULL);
-	if (key && value && !strcasecmp(key, "Color"))
-	{
-	  if (!strcasecmp(value, "T")) color = 1;
-	  if (!strcasecmp(value, "F")) color = 0;
-	}
-	avahi_free(key);
-	avahi_free(value);
-      }
+      if (txt_field_equals(&txtrec->color, "T")) color = 1;
+      if (txt_field_equals(&txtrec->color, "F")) color = 0;
       // Find out if we have a duplex printer
-      entry = avahi_string_list_find((AvahiStringList *)txt, "Duplex");
-      if (entry)
-      {
-	avahi_string_list_get_pair(entry, &key, &value, NULL);
-	if (key && value && !strcasecmp(key, "Duplex"))
-	{
-	  if (!strcasecmp(value, "T")) duplex = 1;
-	  if (!strcasecmp(value, "F")) duplex = 0;
-	}
-	avahi_free(key);
-	avahi_free(value);
-      }
+      if (txt_field_equals(&txtrec->duplex, "T")) duplex = 1;
+      if (txt_field_equals(&txtrec->duplex, "F")) duplex = 0;
     }
   }
   // Extract location from DNS-SD TXT record's "note" field
   if (location[0] == '\0')
   {
-    if (txt)
+    if (txt &&
+	txt_field_string(&txtrec->note, note_value, sizeof(note_value)))
     {
-      entry = avahi_string_list_find((AvahiStringList *)txt, "note");
-      if (entry)
-      {
-	avahi_string_list_get_pair(entry, &key, &note_value, NULL);
-	if (key && note_value && !strcasecmp(key, "note"))
-	{
-	  debug_printf("examine_discovered_printer_record: TXT.note: |%s|\n",
-		       note_value); // !!
-	  location = note_value;
-	}
-        avahi_free(key);
-        // don't avahi_free(note_value) here!
-      }
+      debug_printf("examine_discovered_printer_record: TXT.note: |%s|\n",
+		   note_value); // !!
+      location = note_value;
     }
   }
   // A NULL location is only passed in from resolve_callback(), which is
@@ -9502,6 +12502,26 @@ examine_discovered_printer_record(const char *host,
 			resource))))))
       break;
 
+  // Is this printer already known under another queue name, through
+  // another service or host? Then it is the same device, do not create
+  // a second queue for it but use this discovery as another path to the
+  // existing entry
+  if (!p && (q = printer_find_by_uuid(uuid)) != NULL &&
+      q->slave_of == NULL && q->status != STATUS_TO_BE_RELEASED)
+  {
+    debug_printf("Printer %s (Host: %s, Port: %d) has the same UUID %s as the already discovered printer %s, merging the entries.\n",
+		 local_queue_name, remote_host, port, uuid, q->queue_name);
+    p = q;
+    free(local_queue_name);
+    local_queue_name = strdup(p->queue_name);
+    if (strcasecmp(p->service_name, service_name) ||
+	strcasecmp(p->domain, domain))
+    {
+      alias = 1;
+      printer_alias_add(p, service_name, type, domain);
+    }
+  }
+
   // Is there a local queue with the same URI as the remote queue?
   if (!p)
   {
@@ -9530,6 +12550,8 @@ examine_discovered_printer_record(const char *host,
 				    service_name ? service_name : "", type,
 				    domain, interface, family, pdl, color,
 				    duplex, make_model, is_cups_queue);
+    if (p)
+      printer_set_uuid(p, uuid);
   }
   else
   {
@@ -9620,6 +12642,35 @@ examine_discovered_printer_record(const char *host,
       }
     }
 
+    // The network path which we used for this printer went away and
+    // the printer got resolved again through one of the remaining
+    // ones, switch over to it even if it is less preferred
+    if (p->path_lost)
+    {
+      p->path_lost = 0;
+      if (upgrade == 0 && strcasecmp(p->uri, uri))
+      {
+	downgrade = 0;
+	upgrade = 1;
+	debug_printf("Printer %s lost its network path, switching over to URI %s.\n",
+		     p->queue_name, uri);
+      }
+    }
+
+    // The configuration got re-read and this printer got re-discovered,
+    // so it is still wanted. Switch over if the new settings give a
+    // different device URI
+    if (p->reevaluate)
+    {
+      p->reevaluate = 0;
+      if (downgrade == 0 && upgrade == 0 && strcasecmp(p->uri, uri))
+      {
+	upgrade = 1;
+	debug_printf("Printer %s gets new URI %s after re-reading the configuration.\n",
+		     p->queue_name, uri);
+      }
+    }
+
     // Switch local queue over to this newly discovered service
     if (upgrade == 1)
     {
@@ -9632,6 +12683,16 @@ examine_discovered_printer_record(const char *host,
 	if (p->status == STATUS_CONFIRMED)
 	  p->timeout = (time_t) -1;
       }
+      // Switching over to another service of the same device, keep the
+      // current one as alternative if it is still there
+      if (alias)
+      {
+	if (p->status != STATUS_DISAPPEARED)
+	  printer_alias_add(p, p->service_name, p->type, p->domain);
+	printer_alias_remove(p, service_name, type, domain);
+	cupsArrayClear(p->ipp_discoveries);
+	alias = 0;
+      }
       free(p->queue_name);
       free(p->location);
       free(p->info);
@@ -9653,7 +12714,7 @@ examine_discovered_printer_record(const char *host,
       p->duplex = duplex;
       p->uri = strdup(uri);
       p->status = STATUS_TO_BE_CREATED;
-      p->timeout = time(NULL) + TIMEOUT_IMMEDIATELY;
+      p->timeout = scheduler.now() + TIMEOUT_IMMEDIATELY;
       p->host = strdup(remote_host);
       p->ip = (ip != NULL ? strdup(ip) : NULL);
       p->port = port;
@@ -9663,23 +12724,31 @@ examine_discovered_printer_record(const char *host,
       p->domain = strdup(domain);
       debug_printf("Switched over to newly discovered entry for this printer.\n");
     }
-    else if (method == DYNAMIC)
+    else if (alias)
+    {
+      // Another service of the same device which we do not switch to,
+      // it is recorded as alias now, its capabilities and TXT data are
+      // not the ones of our entry
+      debug_printf("Staying with previously discovered entry for this printer, service %s is an alias of it.\n",
+		   service_name);
+      goto fail;
+    }
+    else if (method == DYNAMIC && !reevaluating_config)
     {
       // in the end we can skip most free+strdup and use the same pointers for
       // option update, but we need to free:
       // - prattrs
       // - options
       // - nickname
-      free(p->prattrs);
+      set_printer_attributes(p, NULL, 0);
       cupsFreeOptions(p->num_options, p->options);
       free(p->nickname);
 
-      p->prattrs = NULL;
       p->nickname = NULL;
       p->options = NULL;
       p->num_options = 0;
       p->status = STATUS_TO_BE_CREATED;
-      p->timeout = time(NULL) + TIMEOUT_IMMEDIATELY;
+      p->timeout = scheduler.now() + TIMEOUT_IMMEDIATELY;
       debug_printf("Updating printer capabilities for printer %s.\n", p->queue_name);
     }
     else
@@ -9695,7 +12764,7 @@ examine_discovered_printer_record(const char *host,
       p->status = STATUS_CONFIRMED;
       if (p->is_legacy)
       {
-	p->timeout = time(NULL) + BrowseTimeout;
+	p->timeout = scheduler.now() + BrowseTimeout;
 	debug_printf("starting BrowseTimeout timer for %s (%ds)\n",
 		     p->queue_name, BrowseTimeout);
       }
@@ -9773,9 +12842,12 @@ examine_discovered_printer_record(const char *host,
       free (p->domain);
       p->domain = strdup(domain);
     }
-    if (domain != NULL && domain[0] != '\0' &&
+    // Discoveries of an alias service are not ours
+    if (!alias && domain != NULL && domain[0] != '\0' &&
 	type != NULL && type[0] != '\0')
       ipp_discoveries_add(p->ipp_discoveries, interface, type, family);
+    if (!alias && uuid && uuid[0])
+      printer_set_uuid(p, uuid);
     p->netprinter = is_cups_queue ? 0 : 1;
   }
 
@@ -9784,9 +12856,6 @@ examine_discovered_printer_record(const char *host,
   free (pdl);
   free (make_model);
   free (local_queue_name);
-#ifdef HAVE_AVAHI
-  if (note_value) avahi_free(note_value);
-#endif // HAVE_AVAHI
 
   if (p)
     debug_printf("DNS-SD IDs: Service name: \"%s\", "
@@ -9919,6 +12988,18 @@ allowed (struct sockaddr *srcaddr)
 
 
 #ifdef HAVE_AVAHI
+// A DNS-SD service got resolved and examined (or resolving it failed),
+// can be called from any thread
+static void
+resolve_done(void)
+{
+  if (__atomic_sub_fetch(&resolves_pending, 1, __ATOMIC_ACQ_REL) <= 0 &&
+      !unconfirmed_checked)
+    // Check in the main thread
+    g_idle_add(check_unconfirmed_printers, NULL);
+}
+
+
 static void
 resolve_callback(void* arg)
 {
@@ -9936,13 +13017,21 @@ resolve_callback(void* arg)
   AVAHI_GCC_UNUSED void* userdata = a->userdata;
 
   char ifname[IF_NAMESIZE];
-  AvahiStringList *uuid_entry = NULL, *printer_type_entry;
-  char *uuid_key, *uuid_value;
+  txt_record_t txtrec;
+  char uuid_buf[TXT_VALUE_MAX], *uuid_value;
 
-  debug_printf("resolve_callback() in THREAD %ld\n", pthread_self());
+  debug_trace("resolve_callback() in THREAD %ld\n", pthread_self());
 
   if (name == NULL || type == NULL || domain == NULL)
+  {
+    resolve_done();
     return;
+  }
+
+  // Parse the TXT record once, all steps below (and the filters in
+  // examine_discovered_printer_record()) work on the result
+  txt_record_parse(txt, &txtrec);
+  uuid_value = txt_field_string(&txtrec.uuid, uuid_buf, sizeof(uuid_buf));
 
   // Get the interface name
   if (!if_indextoname(interface, ifname))
@@ -9956,6 +13045,17 @@ resolve_callback(void* arg)
   // via UUID
 
   pthread_rwlock_wrlock(&resolvelock);
+  // The resolves are done one after the other, so do not count the
+  // time waiting for the others against our time limit, otherwise on
+  // large networks the last ones would get dropped without being
+  // retried. Only shutdown cancels us here.
+  task_restart_deadline();
+  if (task_cancelled())
+  {
+    debug_printf("Avahi Resolver: Service '%s' of type '%s' in domain '%s' not processed, cancelled.\n",
+		 name, type, domain);
+    goto clean_up;
+  }
   if (FrequentNetifUpdate)
     update_netifs(NULL);
 
@@ -9963,9 +13063,6 @@ resolve_callback(void* arg)
       is_local_hostname(host_name))
   {
     update_local_printers ();
-    uuid_value = NULL;
-    if (txt && (uuid_entry = avahi_string_list_find(txt, "UUID")))
-      avahi_string_list_get_pair(uuid_entry, &uuid_key, &uuid_value, NULL);
     if (uuid_value && g_hash_table_find (local_printers,
 					 local_printer_has_uuid,
 					 uuid_value))
@@ -9979,9 +13076,7 @@ resolve_callback(void* arg)
 		    "IPv4/IPv6 Unknown"), uuid_value);
       goto ignore;
     }
-    if (txt &&
-	(printer_type_entry = avahi_string_list_find(txt, "printer-type")) &&
-	strcasestr(type, "_ipps"))
+    if (txtrec.printer_type.present && strcasestr(type, "_ipps"))
     {
       debug_printf("Avahi Resolver: Service '%s' of type '%s' in domain '%s' with host name '%s' and port %d on interface '%s' (%s) with UUID %s is from another CUPS instance on the local system and uses IPPS, the local CUPS has problems to print on this printer, so we ignore it (Avahi lookup result or host name of local machine).\n",
 		   name, type, domain, host_name, port, ifname,
@@ -9998,8 +13093,7 @@ resolve_callback(void* arg)
   // Called whenever a service has been resolved successfully
 
   // New remote printer found
-  AvahiStringList *rp_entry = NULL, *adminurl_entry = NULL;
-  char *rp_key, *rp_value, *adminurl_key, *adminurl_value;
+  char rp_buf[TXT_VALUE_MAX], *rp_value;
 
   debug_printf("Avahi Resolver: Service '%s' of type '%s' in domain '%s' with host name '%s' and port %d on interface '%s' (%s).\n",
 	       name, type, domain, host_name, port, ifname,
@@ -10016,25 +13110,10 @@ resolve_callback(void* arg)
     goto ignore;
   }
 
-  if (txt && (rp_entry = avahi_string_list_find(txt, "rp")))
-    avahi_string_list_get_pair(rp_entry, &rp_key, &rp_value, NULL);
-  else
-  {
-    rp_key = strdup("rp");
-    rp_value = strdup("");
-  }
-  if (txt && (adminurl_entry = avahi_string_list_find(txt, "adminurl")))
-    avahi_string_list_get_pair(adminurl_entry, &adminurl_key,
-			       &adminurl_value, NULL);
+  if (txtrec.rp.present)
+    rp_value = txt_field_string(&txtrec.rp, rp_buf, sizeof(rp_buf));
   else
-  {
-    adminurl_key = strdup("adminurl");
-    if (host_name &&
-	(adminurl_value = malloc(strlen(host_name) + 8)) != NULL)
-      sprintf(adminurl_value, "http://%s", host_name);
-    else
-      adminurl_value = strdup("");
-  }
+    rp_value = "";
 
   // If we create queues only for local IPP printers (like IPP-over-USB
   // with ippusbxd) check whether the entry is local and skip if not.
@@ -10042,16 +13121,34 @@ resolve_callback(void* arg)
   // option is only for IPP network printers
   if (CreateIPPPrinterQueues == IPP_PRINTERS_LOCAL_ONLY &&
       strcasecmp(ifname, "lo") &&
-      (!txt || avahi_string_list_find(txt, "printer-type") == NULL))
+      !txtrec.printer_type.present)
   {
     debug_printf("Avahi Resolver: Service '%s' of type '%s' in domain '%s' skipped, not a local service.\n",
 		 name, type, domain);
     goto clean_up;
   }
 
-  if (txt && rp_key && rp_value && adminurl_key && adminurl_value &&
-      !strcasecmp(rp_key, "rp") &&
-      !strcasecmp(adminurl_key, "adminurl"))
+  // A new printer gets its attributes fetched while we hold the write
+  // lock on the printer list, where we cannot wait for the host's
+  // request rate (HttpRequestRatePerHost), so we wait for it before
+  // taking the lock
+  if (host_name)
+  {
+    char *slot_host = remove_bad_chars(strcasecmp(ifname, "lo") ?
+				       host_name : "localhost", 1);
+    int waited = host_request_wait(slot_host);
+    free(slot_host);
+    if (!waited)
+    {
+      debug_printf("Avahi Resolver: Service '%s' of type '%s' in domain '%s' not processed, cancelled.\n",
+		   name, type, domain);
+      goto clean_up;
+    }
+  }
+
+  // "rp" or "adminurl" without value make the record invalid
+  if (txt && rp_value &&
+      (!txtrec.adminurl.present || txtrec.adminurl.value))
   {
     char *p, instance[64];
     // Extract instance from DNSSD service name (to serve as info field)
@@ -10141,7 +13238,8 @@ resolve_callback(void* arg)
 					    addrstr, port, rp_value,
 					    name, "", instance, type,
 					    domain, ifname,
-					    addr->sa_family, txt);
+					    addr->sa_family, uuid_value,
+					    &txtrec);
 	  pthread_rwlock_unlock(&lock);
 	}
 	else
@@ -10152,7 +13250,8 @@ resolve_callback(void* arg)
 					    NULL, port, rp_value,
 					    name, "", instance, type,
 					    domain, ifname,
-					    addr->sa_family, txt);
+					    addr->sa_family, uuid_value,
+					    &txtrec);
 	  pthread_rwlock_unlock(&lock);
 	}
       }
@@ -10175,49 +13274,22 @@ resolve_callback(void* arg)
 					  domain, ifname,
 					  (address->proto ==
 					   AVAHI_PROTO_INET ? AF_INET :
-					   (address->proto ==
-					    AVAHI_PROTO_INET6 ?
-					    AF_INET6 : 0)),
-					  txt);
-	pthread_rwlock_unlock(&lock);
-      }
-      else
-	debug_printf("Avahi Resolver: Service '%s' of type '%s' in domain '%s' skipped, host name not supplied.\n",
-		     name, type, domain);
-    }
-  }
-
- clean_up:
-
-  // Clean up
-
-  if (rp_entry)
-  {
-    avahi_free(rp_key);
-    avahi_free(rp_value);
-  }
-  else
-  {
-    free(rp_key);
-    free(rp_value);
-  }
-  if (adminurl_entry)
-  {
-    avahi_free(adminurl_key);
-    avahi_free(adminurl_value);
-  }
-  else
-  {
-    free(adminurl_key);
-    free(adminurl_value);
+					   (address->proto ==
+					    AVAHI_PROTO_INET6 ?
+					    AF_INET6 : 0)),
+					  uuid_value, &txtrec);
+	pthread_rwlock_unlock(&lock);
+      }
+      else
+	debug_printf("Avahi Resolver: Service '%s' of type '%s' in domain '%s' skipped, host name not supplied.\n",
+		     name, type, domain);
+    }
   }
 
+ clean_up:
  ignore:
-  if (uuid_entry)
-  {
-    avahi_free(uuid_key);
-    avahi_free(uuid_value);
-  }
+
+  // Clean up
 
   if (a->name) free((char*)a->name);
   if (a->type) free((char*)a->type);
@@ -10228,6 +13300,8 @@ resolve_callback(void* arg)
   free(a);
   pthread_rwlock_unlock(&resolvelock);
 
+  resolve_done();
+
   if (in_shutdown == 0)
     recheck_timer ();
 }
@@ -10248,7 +13322,7 @@ resolver_wrapper(AvahiServiceResolver *r,
 		 AvahiLookupResultFlags flags,
 		 AVAHI_GCC_UNUSED void* userdata)
 {
-  debug_printf("resolver_wrapper() in THREAD %ld\n", pthread_self());
+  debug_trace("resolver_wrapper() in THREAD %ld\n", pthread_self());
 
   // Do not launch a new thread on a resolver failure
   if (event != AVAHI_RESOLVER_FOUND)
@@ -10269,6 +13343,7 @@ resolver_wrapper(AvahiServiceResolver *r,
 		   "IPv4/IPv6 Unknown") :
 		  "IPv4/IPv6 Unknown"),
 		 avahi_strerror(avahi_client_errno(avahi_service_resolver_get_client(r))));
+    resolve_done();
     return;
   }
 
@@ -10301,36 +13376,53 @@ resolver_wrapper(AvahiServiceResolver *r,
   arg->flags = flags;
   arg->userdata = userdata;
 
-  pthread_t id;
-  int err;
-
-  if ((err = pthread_create(&id, NULL, (void*)resolve_callback, (void*)arg)))
+  if (!task_start(name, resolve_callback, arg, TIMEOUT_TASK))
   {
-    debug_printf("Unable to create a new thread, retrying!\n");
-    int attempts = 0;
-    while (attempts < 5)
-    {
-      if ((err = pthread_create(&id, NULL, (void*)resolve_callback,
-				(void*)arg)))
-        debug_printf("Unable to create a new thread, retrying!\n");
-      else
-	break;
-      attempts ++;
-    }
-    if (attempts == 5)
-    {
-      debug_printf("Could not create new thread even after many attempts, ignoring this entry.\n");
-      if (arg->name) free((char*)arg->name);
-      if (arg->type) free((char*)arg->type);
-      if (arg->domain) free((char*)arg->domain);
-      if (arg->host_name) free((char*)arg->host_name);
-      if (arg->txt) avahi_string_list_free(arg->txt);
-      if (arg->address) free((AvahiAddress*)arg->address);
-      free(arg);
-      return;
+    debug_printf("Ignoring service '%s' of type '%s' in domain '%s'.\n",
+		 name, type, domain);
+    if (arg->name) free((char*)arg->name);
+    if (arg->type) free((char*)arg->type);
+    if (arg->domain) free((char*)arg->domain);
+    if (arg->host_name) free((char*)arg->host_name);
+    if (arg->txt) avahi_string_list_free(arg->txt);
+    if (arg->address) free((AvahiAddress*)arg->address);
+    free(arg);
+    resolve_done();
+  }
+}
+
+
+// All discovered instances of the service of a printer are gone, but
+// the same device is also advertised under another service name (see
+// printer_alias_add()), resolve that one, the result switches the
+// (disappeared) entry over to it
+static int
+resolve_printer_alias(remote_printer_t *p)
+{
+  printer_alias_t *alias;
+
+  if (!client || !avahi_present || !p->aliases)
+    return (0);
+  while ((alias = cupsArrayFirst(p->aliases)) != NULL)
+  {
+    debug_printf("Printer %s: Resolving alternative service '%s' of type '%s' in domain '%s'.\n",
+		 p->queue_name, alias->service_name, alias->type,
+		 alias->domain);
+    if (avahi_service_resolver_new(client, AVAHI_IF_UNSPEC,
+				   AVAHI_PROTO_UNSPEC, alias->service_name,
+				   alias->type, alias->domain,
+				   AVAHI_PROTO_UNSPEC, 0, resolver_wrapper,
+				   client))
+    {
+      __atomic_add_fetch(&resolves_pending, 1, __ATOMIC_RELEASE);
+      return (1);
     }
+    debug_printf("Failed to resolve service '%s': %s\n",
+		 alias->service_name,
+		 avahi_strerror(avahi_client_errno(client)));
+    cupsArrayRemove(p->aliases, alias);
   }
-  pthread_detach(id);
+  return (0);
 }
 
 
@@ -10348,7 +13440,7 @@ browse_callback(AvahiServiceBrowser *b,
   AvahiClient *c = userdata;
   char ifname[IF_NAMESIZE];
 
-  debug_printf("browse_callback() in THREAD %ld\n", pthread_self());
+  debug_trace("browse_callback() in THREAD %ld\n", pthread_self());
 
   if (b == NULL)
     return;
@@ -10404,6 +13496,8 @@ browse_callback(AvahiServiceBrowser *b,
 					 resolver_wrapper, c)))
 	  debug_printf("Failed to resolve service '%s': %s\n",
 		       name, avahi_strerror(avahi_client_errno(c)));
+	else
+	  __atomic_add_fetch(&resolves_pending, 1, __ATOMIC_RELEASE);
 	break;
 
     // A service (remote printer) has disappeared
@@ -10442,6 +13536,19 @@ browse_callback(AvahiServiceBrowser *b,
 		!strcasecmp(p->service_name, name) &&
 		!strcasecmp(p->domain, domain))
 	      break;
+	  // It could also be an alternative service of a printer which we
+	  // access through another service
+	  if (!p)
+	    for (p = (remote_printer_t *)cupsArrayFirst(remote_printers);
+		 p; p = (remote_printer_t *)cupsArrayNext(remote_printers))
+	      if (p->status != STATUS_TO_BE_RELEASED &&
+		  printer_alias_remove(p, name, type, domain))
+	      {
+		debug_printf("Alternative service '%s' of printer %s unregistered.\n",
+			     name, p->queue_name);
+		p = NULL;
+		break;
+	      }
 	  if (p)
 	  {
 	    int family =
@@ -10471,6 +13578,7 @@ browse_callback(AvahiServiceBrowser *b,
 		debug_printf("Removing printer with Service name \"%s\", Domain \"%s\", all discovered instances disappeared.\n",
 			     p->service_name, p->domain);
 		remove_printer_entry(p);
+		resolve_printer_alias(p);
 	      }
 	    }
 
@@ -10486,6 +13594,24 @@ browse_callback(AvahiServiceBrowser *b,
         debug_printf("Avahi Browser: %s\n",
 		     event == AVAHI_BROWSER_CACHE_EXHAUSTED ?
 		     "CACHE_EXHAUSTED" : "ALL_FOR_NOW");
+	// ALL_FOR_NOW comes after CACHE_EXHAUSTED, when the initial
+	// responses from the network are in, too
+	if (event == AVAHI_BROWSER_ALL_FOR_NOW)
+	{
+	  avahi_browser_t *browser;
+	  for (browser = cupsArrayFirst(browsers); browser;
+	       browser = cupsArrayNext(browsers))
+	    if (browser->sb == b)
+	    {
+	      if (browser->pending)
+	      {
+		browser->pending = 0;
+		browsers_pending --;
+	      }
+	      break;
+	    }
+	  check_unconfirmed_printers(NULL);
+	}
 	break;
   }
 }
@@ -10512,14 +13638,14 @@ avahi_browser_shutdown()
 	      p->status != STATUS_DISAPPEARED)
 	  {
 	    p->status = STATUS_UNCONFIRMED;
-	    p->timeout = time(NULL) + TIMEOUT_CONFIRM;
+	    p->timeout = scheduler.now() + TIMEOUT_CONFIRM;
 	  }
 	}
 	else
 	{
 	  if (p->status != STATUS_TO_BE_RELEASED)
 	    p->status = STATUS_DISAPPEARED;
-	  p->timeout = time(NULL) + TIMEOUT_IMMEDIATELY;
+	  p->timeout = scheduler.now() + TIMEOUT_IMMEDIATELY;
 	}
       }
     }
@@ -10530,16 +13656,7 @@ avahi_browser_shutdown()
   }
 
   // Free the data structures for DNS-SD browsing
-  if (sb1)
-  {
-    avahi_service_browser_free(sb1);
-    sb1 = NULL;
-  }
-  if (sb2)
-  {
-    avahi_service_browser_free(sb2);
-    sb2 = NULL;
-  }
+  avahi_browser_free_all();
 
   // Switch on auto shutdown mode
   if (autoshutdown_avahi && in_shutdown == 0)
@@ -10578,6 +13695,175 @@ avahi_shutdown()
 }
 
 
+static void
+avahi_browser_free(avahi_browser_t *browser)
+{
+  if (browser->sb)
+    avahi_service_browser_free(browser->sb);
+  if (browser->pending)
+    browsers_pending --;
+  free(browser->interface);
+  free(browser);
+}
+
+
+static void
+avahi_browser_free_all(void)
+{
+  avahi_browser_t *browser;
+
+  while ((browser = cupsArrayFirst(browsers)) != NULL)
+  {
+    cupsArrayRemove(browsers, browser);
+    avahi_browser_free(browser);
+  }
+  browsers_pending = 0;
+}
+
+
+// Create a service browser for the given service type, interface (NULL
+// for all), and protocol, if we do not have it already. Returns 1 if a
+// new browser got created
+static int
+avahi_browser_add(AvahiClient *c,
+		  const char *interface,
+		  const char *type,
+		  AvahiProtocol protocol)
+{
+  avahi_browser_t *browser;
+  AvahiIfIndex ifindex = AVAHI_IF_UNSPEC;
+
+  if (interface && (ifindex = if_nametoindex(interface)) == 0)
+  {
+    debug_printf("Interface %s not present, not browsing for %s on it for now.\n",
+		 interface, type);
+    return (0);
+  }
+
+  for (browser = cupsArrayFirst(browsers); browser;
+       browser = cupsArrayNext(browsers))
+    if (browser->type == type && browser->protocol == protocol &&
+	((!interface && !browser->interface) ||
+	 (interface && browser->interface &&
+	  !strcmp(interface, browser->interface))))
+    {
+      if (browser->ifindex == ifindex)
+	return (0);
+      // The interface got re-created with a new index, replace the
+      // browser
+      cupsArrayRemove(browsers, browser);
+      avahi_browser_free(browser);
+      break;
+    }
+
+  if ((browser = calloc(1, sizeof(avahi_browser_t))) == NULL)
+  {
+    debug_printf("ERROR: Unable to allocate memory.\n");
+    return (0);
+  }
+  if (!(browser->sb =
+	avahi_service_browser_new(c, ifindex, protocol, type, NULL, 0,
+				  browse_callback, c)))
+  {
+    debug_printf("ERROR: Failed to create service browser for %s%s%s: %s\n",
+		 type, (interface ? " on interface " : ""),
+		 (interface ? interface : ""),
+		 avahi_strerror(avahi_client_errno(c)));
+    free(browser);
+    return (0);
+  }
+  browser->interface = (interface ? strdup(interface) : NULL);
+  browser->ifindex = ifindex;
+  browser->protocol = protocol;
+  browser->type = type;
+  browser->pending = 1;
+  browsers_pending ++;
+  cupsArrayAdd(browsers, browser);
+  debug_printf("Browsing for %s on %s (%s).\n", type,
+	       (interface ? interface : "all interfaces"),
+	       (protocol == AVAHI_PROTO_INET ? "IPv4" :
+		(protocol == AVAHI_PROTO_INET6 ? "IPv6" : "IPv4 and IPv6")));
+
+  return (1);
+}
+
+
+static void
+avahi_browser_start(AvahiClient *c)
+{
+  static const char * const types[] =
+    {
+      "_ipp._tcp",
+      "_ipps._tcp"
+    };
+  AvahiProtocol protocols[2];
+  int num_protocols = 0, num_created = 0;
+  int i, j;
+  char *interface;
+
+  if (!browsers)
+    browsers = cupsArrayNew(NULL, NULL);
+
+  // Browse only on the selected address families, with one browser
+  // for both if both are selected
+  if ((BrowseAddressFamilies & BROWSE_IPV4) &&
+      (BrowseAddressFamilies & BROWSE_IPV6))
+    protocols[num_protocols ++] = AVAHI_PROTO_UNSPEC;
+  else if (BrowseAddressFamilies & BROWSE_IPV4)
+    protocols[num_protocols ++] = AVAHI_PROTO_INET;
+  else if (BrowseAddressFamilies & BROWSE_IPV6)
+    protocols[num_protocols ++] = AVAHI_PROTO_INET6;
+
+  // Create the service browsers, on all interfaces or only on the
+  // selected ones
+  for (i = 0; i < sizeof(types) / sizeof(types[0]); i ++)
+    for (j = 0; j < num_protocols; j ++)
+    {
+      if (BrowseInterfaces == NULL)
+	num_created += avahi_browser_add(c, NULL, types[i], protocols[j]);
+      else
+	for (interface = cupsArrayFirst(BrowseInterfaces); interface;
+	     interface = cupsArrayNext(BrowseInterfaces))
+	  num_created += avahi_browser_add(c, interface, types[i],
+					   protocols[j]);
+    }
+
+  // Printers marked unconfirmed when Avahi went away get treated as
+  // soon as the new browsers have reported their initial results
+  if (num_created > 0)
+  {
+    browsers_started = 1;
+    unconfirmed_checked = 0;
+  }
+}
+
+
+// A network interface selected with BrowseInterfaces came up, start
+// browsing on it
+static gboolean
+avahi_browser_update(gpointer unused)
+{
+  if (client && avahi_present && !terminating)
+    avahi_browser_start(client);
+
+  return (FALSE);
+}
+
+
+static void
+avahi_browser_restart()
+{
+  // Replace the service browsers by new ones, without touching our
+  // printer list, so that all printers get reported again
+  if (!client || !avahi_present)
+    return;
+
+  debug_printf("Restarting DNS-SD service browsers.\n");
+  avahi_browser_free_all();
+  avahi_browser_start(client);
+}
+
+
 static void
 client_callback(AvahiClient *c,
 		AvahiClientState state,
@@ -10599,28 +13885,7 @@ client_callback(AvahiClient *c,
 
         debug_printf("Avahi server connection got available, setting up service browsers.\n");
 
-	// Create the service browsers
-	if (!sb1)
-	  if (!(sb1 =
-		avahi_service_browser_new(c, AVAHI_IF_UNSPEC,
-					  AVAHI_PROTO_UNSPEC,
-					  "_ipp._tcp", NULL, 0, browse_callback,
-					  c)))
-	  {
-	    debug_printf("ERROR: Failed to create service browser for IPP: %s\n",
-			 avahi_strerror(avahi_client_errno(c)));
-	  }
-	if (!sb2)
-	  if (!(sb2 =
-		avahi_service_browser_new(c, AVAHI_IF_UNSPEC,
-					  AVAHI_PROTO_UNSPEC,
-					  "_ipps._tcp", NULL, 0,
-					  browse_callback,
-					  c)))
-	  {
-	    debug_printf("ERROR: Failed to create service browser for IPPS: %s\n",
-			 avahi_strerror(avahi_client_errno(c)));
-	  }
+	avahi_browser_start(c);
 
 	avahi_present = 1;
     
@@ -10714,6 +13979,161 @@ avahi_init()
 #endif // HAVE_AVAHI
 
 
+// Some network interfaces lost their IPv4 or IPv6 connection (found by
+// update_netifs()). Printers which were discovered only through these
+// get removed right away, without waiting for Avahi to report them
+// gone, and printers which we used through one of these get resolved
+// again on one of their remaining paths, to switch their queues over.
+// Printers discovered on other paths are not touched.
+static gboolean
+reconcile_lost_netifs(gpointer unused)
+{
+  cups_array_t *lost, *to_remove;
+  netif_path_t key;
+  remote_printer_t *p;
+  ipp_discovery_t *ippdis, *first, *survivor;
+  int num_lost, num_removed = 0, num_moved = 0;
+
+  pthread_rwlock_wrlock(&netiflock);
+  lost = netif_paths_lost;
+  netif_paths_lost = NULL;
+  netif_paths_lost_sourceid = 0;
+  pthread_rwlock_unlock(&netiflock);
+
+  if (lost == NULL)
+    return (FALSE);
+  if (terminating)
+  {
+    cupsArrayDelete(lost);
+    return (FALSE);
+  }
+
+  // remove_printer_entry() walks through the printer list, so we
+  // collect the printers to remove first
+  to_remove = cupsArrayNew(NULL, NULL);
+
+  pthread_rwlock_wrlock(&lock);
+  for (p = (remote_printer_t *)cupsArrayFirst(remote_printers);
+       p; p = (remote_printer_t *)cupsArrayNext(remote_printers))
+  {
+    if (p->status == STATUS_DISAPPEARED ||
+	p->status == STATUS_TO_BE_RELEASED ||
+	p->ipp_discoveries == NULL ||
+	(first = cupsArrayFirst(p->ipp_discoveries)) == NULL)
+      continue;
+
+    num_lost = 0;
+    survivor = NULL;
+    for (ippdis = first; ippdis;
+	 ippdis = cupsArrayNext(p->ipp_discoveries))
+    {
+      memset(&key, 0, sizeof(key));
+      strncpy(key.name, ippdis->interface, sizeof(key.name) - 1);
+      key.family = ippdis->family;
+      if (cupsArrayFind(lost, &key))
+      {
+	if (num_lost == 0 && ippdis != first)
+	  // Do not touch anything if the path in use is not lost
+	  first = NULL;
+	num_lost ++;
+	continue;
+      }
+      if (!survivor ||
+	  (strcasestr(ippdis->type, "_ipps") &&
+	   !strcasestr(survivor->type, "_ipps")))
+	survivor = ippdis;
+    }
+    if (num_lost == 0)
+      continue;
+
+    debug_printf("Printer %s (URI: %s): %d of its %d discovered instances are on lost network paths.\n",
+		 p->queue_name, p->uri, num_lost,
+		 cupsArrayCount(p->ipp_discoveries));
+    if (survivor == NULL)
+    {
+      debug_printf("No network path left for printer %s, removing it.\n",
+		   p->queue_name);
+      cupsArrayAdd(to_remove, p);
+      num_removed ++;
+      continue;
+    }
+
+    // Remove the discoveries on the lost paths
+    for (ippdis = cupsArrayFirst(p->ipp_discoveries); ippdis;
+	 ippdis = cupsArrayNext(p->ipp_discoveries))
+    {
+      memset(&key, 0, sizeof(key));
+      strncpy(key.name, ippdis->interface, sizeof(key.name) - 1);
+      key.family = ippdis->family;
+      if (cupsArrayFind(lost, &key))
+	cupsArrayRemove(p->ipp_discoveries, ippdis);
+    }
+    ipp_discoveries_list(p->ipp_discoveries);
+
+#ifdef HAVE_AVAHI
+    // The first discovery is the one we use (see ipp_discovery_cmp()), if
+    // it is lost, resolve the service on the best remaining one, the
+    // resolver result switches the queue over
+    if (first && client && avahi_present && p->service_name && p->domain)
+    {
+      debug_printf("Network path of printer %s lost, resolving it again via interface %s (%s, %s).\n",
+		   p->queue_name, survivor->interface, survivor->type,
+		   (survivor->family == AF_INET ? "IPv4" : "IPv6"));
+      p->path_lost = 1;
+      if (avahi_service_resolver_new(client,
+				     if_nametoindex(survivor->interface),
+				     (survivor->family == AF_INET ?
+				      AVAHI_PROTO_INET :
+				      (survivor->family == AF_INET6 ?
+				       AVAHI_PROTO_INET6 :
+				       AVAHI_PROTO_UNSPEC)),
+				     p->service_name, survivor->type,
+				     p->domain, AVAHI_PROTO_UNSPEC, 0,
+				     resolver_wrapper, client))
+      {
+	__atomic_add_fetch(&resolves_pending, 1, __ATOMIC_RELEASE);
+	num_moved ++;
+      }
+      else
+      {
+	debug_printf("Failed to resolve service '%s': %s\n",
+		     p->service_name,
+		     avahi_strerror(avahi_client_errno(client)));
+	p->path_lost = 0;
+      }
+    }
+#endif // HAVE_AVAHI
+  }
+  for (p = (remote_printer_t *)cupsArrayFirst(to_remove);
+       p; p = (remote_printer_t *)cupsArrayNext(to_remove))
+  {
+    remove_printer_entry(p);
+#ifdef HAVE_AVAHI
+    resolve_printer_alias(p);
+#endif // HAVE_AVAHI
+  }
+  cupsArrayDelete(to_remove);
+  pthread_rwlock_unlock(&lock);
+
+  debug_printf("Network change: %d printers removed, %d printers switching to another network path.\n",
+	       num_removed, num_moved);
+  cupsArrayDelete(lost);
+
+  if (num_removed > 0 && in_shutdown == 0)
+    recheck_timer();
+
+  return (FALSE);
+}
+
+
+//
+// Discovery of remote CUPS printers via BrowsePoll
+//
+
+#undef DEBUG_CATEGORY
+#define DEBUG_CATEGORY DEBUG_POLL
+
+
 //
 // A CUPS printer has been discovered via BrowsePoll
 // or with BrowsePoll
@@ -10723,7 +14143,8 @@ static void
 found_cups_printer(const char *remote_host,
 		   const char *uri,
 		   const char *location,
-		   const char *info)
+		   const char *info,
+		   const char *uuid)
 {
   char scheme[32];
   char username[64];
@@ -10797,7 +14218,7 @@ found_cups_printer(const char *remote_host,
 					      service_name,
 					      location ? location : "",
 					      info ? info : "", "", "", "", 0,
-					      NULL);
+					      uuid, NULL);
   pthread_rwlock_unlock(&lock);
 
   if (printer &&
@@ -10808,7 +14229,7 @@ found_cups_printer(const char *remote_host,
 
     if (printer->status != STATUS_TO_BE_CREATED)
     {
-      printer->timeout = time(NULL) + BrowseTimeout;
+      printer->timeout = scheduler.now() + BrowseTimeout;
       debug_printf("starting BrowseTimeout timer for %s (%ds)\n",
 		   printer->queue_name, BrowseTimeout);
     }
@@ -10839,7 +14260,7 @@ static void
 browsepoll_printer_free (gpointer data)
 {
   browsepoll_printer_t *printer = data;
-  debug_printf("browsepoll_printer_free() in THREAD %ld\n", pthread_self());
+  debug_trace("browsepoll_printer_free() in THREAD %ld\n", pthread_self());
   free (printer->uri_supported);
   free (printer->location);
   free (printer->info);
@@ -10853,7 +14274,8 @@ browse_poll_get_printers (browsepoll_t *context,
 {
   static const char * const rattrs[] = { "printer-uri-supported",
 					 "printer-location",
-					 "printer-info"};
+					 "printer-info",
+					 "printer-uuid"};
   ipp_t *request, *response = NULL;
   ipp_attribute_t *attr;
   GList *printers = NULL;
@@ -10888,6 +14310,7 @@ browse_poll_get_printers (browsepoll_t *context,
 		"requesting-user-name", NULL, cupsUser ());
 
   response = cupsDoRequest(http, request, "/");
+  http_account_response(http, response);
   if (cupsLastError() > IPP_STATUS_OK_EVENTS_COMPLETE)
   {
     debug_printf("cups-browsed [BrowsePoll %s:%d]: failed: %s\n",
@@ -10899,7 +14322,7 @@ browse_poll_get_printers (browsepoll_t *context,
        attr = ippNextAttribute(response))
   {
     browsepoll_printer_t *printer;
-    const char *uri, *location, *info;
+    const char *uri, *location, *info, *uuid;
 
     while (attr && ippGetGroupTag(attr) != IPP_TAG_PRINTER)
       attr = ippNextAttribute(response);
@@ -10910,6 +14333,7 @@ browse_poll_get_printers (browsepoll_t *context,
     uri = NULL;
     info = NULL;
     location = NULL;
+    uuid = NULL;
     while (attr && ippGetGroupTag(attr) == IPP_TAG_PRINTER)
     {
       if (!strcasecmp (ippGetName(attr), "printer-uri-supported") &&
@@ -10921,12 +14345,16 @@ browse_poll_get_printers (browsepoll_t *context,
       else if (!strcasecmp (ippGetName(attr), "printer-info") &&
 	       ippGetValueTag(attr) == IPP_TAG_TEXT)
 	info = ippGetString(attr, 0, NULL);
+      else if (!strcasecmp (ippGetName(attr), "printer-uuid") &&
+	       ippGetValueTag(attr) == IPP_TAG_URI &&
+	       !strncasecmp(ippGetString(attr, 0, NULL), "urn:uuid:", 9))
+	uuid = ippGetString(attr, 0, NULL) + 9;
       attr = ippNextAttribute(response);
     }
 
     if (uri)
     {
-      found_cups_printer (context->server, uri, location, info);
+      found_cups_printer (context->server, uri, location, info, uuid);
       printer = new_browsepoll_printer (uri, location, info);
       printers = g_list_insert (printers, printer, 0);
     }
@@ -11176,10 +14604,10 @@ browsepoll_printer_keepalive (gpointer data,
 {
   browsepoll_printer_t *printer = data;
   const char *server = user_data;
-  debug_printf("browsepoll_printer_keepalive() in THREAD %ld\n",
-	       pthread_self());
+  debug_trace("browsepoll_printer_keepalive() in THREAD %ld\n",
+	      pthread_self());
   found_cups_printer (server, printer->uri_supported, printer->location,
-		      printer->info);
+		      printer->info, NULL);
 }
 
 
@@ -11190,7 +14618,7 @@ browse_poll (gpointer data)
   http_t *http = NULL;
   gboolean get_printers = FALSE;
 
-  debug_printf("browse_poll() in THREAD %ld\n", pthread_self());
+  debug_trace("browse_poll() in THREAD %ld\n", pthread_self());
 
   debug_printf("browse polling %s:%d\n",
 	       context->server, context->port);
@@ -11243,14 +14671,31 @@ browse_poll (gpointer data)
   if (http)
     httpClose (http);
 
-  // Call a new timeout handler so that we run again
-  g_timeout_add_seconds (BrowseInterval, browse_poll, data);
+  // Also a failed first poll counts, the printers of this server
+  // cannot get confirmed then
+  if (!context->polled)
+  {
+    context->polled = TRUE;
+    check_unconfirmed_printers(NULL);
+  }
+
+  // Call a new timeout handler so that we run again, with a new random
+  // deviation of the interval
+  g_timeout_add (jittered_msecs(BrowseInterval), browse_poll, data);
 
   // Stop this timeout handler, we called a new one
   return (FALSE);
 }
 
 
+//
+// Signal handling, configuration, and main program
+//
+
+#undef DEBUG_CATEGORY
+#define DEBUG_CATEGORY DEBUG_GENERAL
+
+
 static void
 sigterm_handler(int sig)
 {
@@ -11269,6 +14714,28 @@ sigterm_handler(int sig)
 }
 
 
+// Dump the flight recorder on request (SIGQUIT), the daemon continues
+// running
+static void
+sigquit_handler(int sig)
+{
+  (void)sig;    // remove compiler warnings...
+
+  flight_recorder_dump_file();
+}
+
+
+// Dump the flight recorder when we crash and then let the signal do its
+// default action (core dump)
+static void
+sigcrash_handler(int sig)
+{
+  flight_recorder_dump_file();
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+
 static void
 sigusr1_handler(int sig)
 {
@@ -11392,6 +14859,14 @@ fail:
 }
 
 
+// Interface names are case-sensitive
+static int
+browse_interface_cmp(void *va, void *vb, void *data)
+{
+  return (strcmp((const char *)va, (const char *)vb));
+}
+
+
 static void
 read_configuration (const char *filename)
 {
@@ -11460,10 +14935,7 @@ read_configuration (const char *filename)
 	if (!strcasecmp(p, "file"))
 	{
 	  if (debug_logfile == 0)
-	  {
-	    debug_logfile = 1;
 	    start_debug_logging();
-	  }
 	}
 	else if (!strcasecmp(p, "stderr"))
 	  debug_stderr = 1;
@@ -11473,6 +14945,49 @@ read_configuration (const char *filename)
 	p = strtok_r (NULL, delim, &saveptr);
       }
     }
+    else if (!strcasecmp(line, "DebugLogCategories") && value)
+    {
+      unsigned int categories = 0;
+      char *p, *saveptr;
+      p = strtok_r (value, delim, &saveptr);
+      while (p)
+      {
+	if (!strcasecmp(p, "all"))
+	  categories |= DEBUG_ALL;
+	else if (!strcasecmp(p, "general"))
+	  categories |= DEBUG_GENERAL;
+	else if (!strcasecmp(p, "discovery"))
+	  categories |= DEBUG_DISCOVERY;
+	else if (!strcasecmp(p, "queue"))
+	  categories |= DEBUG_QUEUE;
+	else if (!strcasecmp(p, "cluster"))
+	  categories |= DEBUG_CLUSTER;
+	else if (!strcasecmp(p, "dispatch"))
+	  categories |= DEBUG_DISPATCH;
+	else if (!strcasecmp(p, "poll"))
+	  categories |= DEBUG_POLL;
+	else
+	  debug_printf("Unknown debug logging category '%s'\n", p);
+
+	p = strtok_r (NULL, delim, &saveptr);
+      }
+      if (categories)
+	debug_categories = categories;
+    }
+    else if (!strcasecmp(line, "DebugLogLevel") && value)
+    {
+      if (!strcasecmp(value, "trace"))
+      {
+	debug_trace_level = 1;
+#ifndef DEBUG_TRACE
+	debug_printf("Trace messages are not compiled in, DebugLogLevel Trace has no effect.\n");
+#endif // !DEBUG_TRACE
+      }
+      else if (!strcasecmp(value, "debug"))
+	debug_trace_level = 0;
+      else
+	debug_printf("Unknown debug logging level '%s'\n", value);
+    }
     else if (!strcasecmp(line, "CacheDir") && value)
     {
       if (value[0] != '\0')
@@ -11487,25 +15002,81 @@ read_configuration (const char *filename)
 	      !strcasecmp(line, "BrowseLocalProtocols") ||
 	      !strcasecmp(line, "BrowseRemoteProtocols")) && value)
     {
-      int protocols = 0;
+      int protocols = 0;
+      char *p, *saveptr;
+      p = strtok_r (value, delim, &saveptr);
+      while (p)
+      {
+	if (!strcasecmp(p, "dnssd"))
+	  protocols |= BROWSE_DNSSD;
+	else if (strcasecmp(p, "none"))
+	  debug_printf("Unknown protocol '%s'\n", p);
+
+	p = strtok_r (NULL, delim, &saveptr);
+      }
+
+      if (!strcasecmp(line, "BrowseLocalProtocols"))
+	BrowseLocalProtocols = protocols;
+      else if (!strcasecmp(line, "BrowseRemoteProtocols"))
+	BrowseRemoteProtocols = protocols;
+      else
+	BrowseLocalProtocols = BrowseRemoteProtocols = protocols;
+    }
+    else if (!strcasecmp(line, "BrowseInterfaces") && value)
+    {
+      cups_array_t *interfaces;
+      int all = 0;
+      char *p, *saveptr;
+      interfaces = cupsArrayNew3(browse_interface_cmp, NULL, NULL, 0,
+				 (cups_acopy_func_t)strdup,
+				 (cups_afree_func_t)free);
+      p = strtok_r (value, delim, &saveptr);
+      while (p)
+      {
+	if (!strcasecmp(p, "all"))
+	  all = 1;
+	else if (!cupsArrayFind(interfaces, p))
+	  cupsArrayAdd(interfaces, p);
+
+	p = strtok_r (NULL, delim, &saveptr);
+      }
+      cupsArrayDelete(BrowseInterfaces);
+      if (all || cupsArrayCount(interfaces) == 0)
+      {
+	cupsArrayDelete(interfaces);
+	BrowseInterfaces = NULL;
+      }
+      else
+      {
+	// Always browse on the loopback interface, for IPP-over-USB
+	// devices
+	if (!cupsArrayFind(interfaces, "lo"))
+	  cupsArrayAdd(interfaces, "lo");
+	BrowseInterfaces = interfaces;
+      }
+    }
+    else if (!strcasecmp(line, "BrowseAddressFamilies") && value)
+    {
+      unsigned int families = 0;
       char *p, *saveptr;
       p = strtok_r (value, delim, &saveptr);
       while (p)
       {
-	if (!strcasecmp(p, "dnssd"))
-	  protocols |= BROWSE_DNSSD;
-	else if (strcasecmp(p, "none"))
-	  debug_printf("Unknown protocol '%s'\n", p);
+	if (!strcasecmp(p, "ipv4"))
+	  families |= BROWSE_IPV4;
+	else if (!strcasecmp(p, "ipv6"))
+	  families |= BROWSE_IPV6;
+	else if (!strcasecmp(p, "all"))
+	  families |= BROWSE_IPV4 | BROWSE_IPV6;
+	else
+	  debug_printf("Unknown address family '%s'\n", p);
 
 	p = strtok_r (NULL, delim, &saveptr);
       }
-
-      if (!strcasecmp(line, "BrowseLocalProtocols"))
-	BrowseLocalProtocols = protocols;
-      else if (!strcasecmp(line, "BrowseRemoteProtocols"))
-	BrowseRemoteProtocols = protocols;
+      if (families)
+	BrowseAddressFamilies = families;
       else
-	BrowseLocalProtocols = BrowseRemoteProtocols = protocols;
+	debug_printf("No valid address family given with BrowseAddressFamilies, ignored\n");
     }
     else if (!strcasecmp(line, "BrowsePoll") && value)
     {
@@ -11741,6 +15312,19 @@ read_configuration (const char *filename)
 	debug_printf("Invalid %s value: %d\n",
 		     line, t);
     }
+    else if (!strcasecmp(line, "BrowseJitter") && value)
+    {
+      int t = atoi(value);
+      if (t >= 0 && t <= 50)
+      {
+	BrowseJitter = t;
+	debug_printf("Set %s to %d%%.\n",
+		     line, t);
+      }
+      else
+	debug_printf("Invalid %s value: %d\n",
+		     line, t);
+    }
     else if (!strcasecmp(line, "DomainSocket") && value)
     {
       if (value[0] != '\0')
@@ -11795,6 +15379,32 @@ read_configuration (const char *filename)
 	debug_printf("Invalid %s value: %d\n",
 		     line, t);
     }
+    else if (!strcasecmp(line, "HttpMaxRequestsPerHost") && value)
+    {
+      int t = atoi(value);
+      if (t >= 0)
+      {
+	HttpMaxRequestsPerHost = t;
+	debug_printf("Set %s to %d requests%s.\n",
+		     line, t, (t == 0 ? " (unlimited)" : ""));
+      }
+      else
+	debug_printf("Invalid %s value: %d\n",
+		     line, t);
+    }
+    else if (!strcasecmp(line, "HttpRequestRatePerHost") && value)
+    {
+      int t = atoi(value);
+      if (t >= 0)
+      {
+	HttpRequestRatePerHost = t;
+	debug_printf("Set %s to %d requests per second%s.\n",
+		     line, t, (t == 0 ? " (unlimited)" : ""));
+      }
+      else
+	debug_printf("Invalid %s value: %d\n",
+		     line, t);
+    }
     else if (!strcasecmp(line, "DNSSDBasedDeviceURIs") && value)
     {
       if (!strcasecmp(value, "yes") || !strcasecmp(value, "true") ||
@@ -11804,6 +15414,15 @@ read_configuration (const char *filename)
 	       !strcasecmp(value, "off") || !strcasecmp(value, "0"))
 	DNSSDBasedDeviceURIs = 0;
     }
+    else if (!strcasecmp(line, "HttpCompression") && value)
+    {
+      if (!strcasecmp(value, "yes") || !strcasecmp(value, "true") ||
+	  !strcasecmp(value, "on") || !strcasecmp(value, "1"))
+	HttpCompression = 1;
+      else if (!strcasecmp(value, "no") || !strcasecmp(value, "false") ||
+	       !strcasecmp(value, "off") || !strcasecmp(value, "0"))
+	HttpCompression = 0;
+    }
     else if (!strcasecmp(line, "IPBasedDeviceURIs") && value)
     {
       if (!strcasecmp(value, "IPv4") || !strcasecmp(value, "IPv4Only"))
@@ -11910,6 +15529,48 @@ read_configuration (const char *filename)
       else
 	DebugLogFileSize = val;
     }
+    else if (!strcasecmp(line, "AttributesMemoryLimit") && value)
+    {
+      int val = atoi(value);
+      if (val <= 0)
+	AttributesMemoryLimit = 0;
+      else
+	AttributesMemoryLimit = val;
+      debug_printf("Set %s to %d KBytes%s.\n",
+		   line, AttributesMemoryLimit,
+		   (AttributesMemoryLimit == 0 ? " (unlimited)" : ""));
+    }
+    else if (!strcasecmp(line, "IdleMemoryTrimTimeout") && value)
+    {
+      int t = atoi(value);
+      if (t >= 0)
+      {
+	IdleMemoryTrimTimeout = t;
+	debug_printf("Set %s to %d sec%s.\n",
+		     line, t, (t == 0 ? " (never trim)" : ""));
+      }
+      else
+	debug_printf("Invalid %s value: %d\n",
+		     line, t);
+    }
+    else if (!strcasecmp(line, "PPDGeneratorWorkers") && value)
+    {
+      int t = atoi(value);
+      if (!strcasecmp(value, "auto"))
+      {
+	PPDGeneratorWorkers = -1;
+	debug_printf("Set %s to one process per CPU.\n", line);
+      }
+      else if (t >= 0 && (t > 0 || value[0] == '0'))
+      {
+	PPDGeneratorWorkers = t;
+	debug_printf("Set %s to %d%s.\n",
+		     line, t, (t == 0 ? " (generate PPDs in the daemon)" : ""));
+      }
+      else
+	debug_printf("Invalid %s value: %s\n",
+		     line, value);
+    }
     else if (!strcasecmp(line, "AllowResharingRemoteCUPSPrinters") && value)
     {
       if (!strcasecmp(value, "yes") || !strcasecmp(value, "true") ||
@@ -12066,6 +15727,26 @@ read_configuration (const char *filename)
       else if (!strncasecmp(value, "QueueOnServers", 14))
 	LoadBalancingType = QUEUE_ON_SERVERS;
     }
+    else if (!strcasecmp(line, "ClusterMemberPreference") && value)
+    {
+      if (!strcasecmp(value, "None"))
+	ClusterMemberPreference = MEMBER_PREFER_NONE;
+      else if (!strcasecmp(value, "Nearest"))
+	ClusterMemberPreference = MEMBER_PREFER_NEAREST;
+      else
+	debug_printf("Invalid value for ClusterMemberPreference: %s\n", value);
+    }
+    else if (!strcasecmp(line, "ClusterMemberTieBreak") && value)
+    {
+      if (!strcasecmp(value, "RoundRobin"))
+	ClusterMemberTieBreak = MEMBER_TIE_ROUND_ROBIN;
+      else if (!strcasecmp(value, "Order"))
+	ClusterMemberTieBreak = MEMBER_TIE_ORDER;
+      else if (!strcasecmp(value, "Random"))
+	ClusterMemberTieBreak = MEMBER_TIE_RANDOM;
+      else
+	debug_printf("Invalid value for ClusterMemberTieBreak: %s\n", value);
+    }
     else if (!strcasecmp(line, "DefaultOptions") && value)
     {
       if (DefaultOptions == NULL && strlen(value) > 0)
@@ -12140,72 +15821,596 @@ read_configuration (const char *filename)
       int n = atoi(value);
       if (n >= 0)
       {
-	update_cups_queues_max_per_call = n;
-	if (n > 0)
-	  debug_printf("Set maximum of CUPS queue updates per call of update_cups_queues() to %d.\n",
-		       n);
-	else
-	  debug_printf("Do not limit the number of CUPS queue updates per call of update_cups_queues().\n");
+	update_cups_queues_max_per_call = n;
+	if (n > 0)
+	  debug_printf("Set maximum of CUPS queue updates per call of update_cups_queues() to %d.\n",
+		       n);
+	else
+	  debug_printf("Do not limit the number of CUPS queue updates per call of update_cups_queues().\n");
+      }
+      else
+	debug_printf("Invalid value for maximum number of CUPS queue updates per call of update_cups_queues(): %d\n",
+		     n);
+    }
+    else if (!strcasecmp(line, "PauseBetweenCUPSQueueUpdates") && value)
+    {
+      int t = atoi(value);
+      if (t >= 0)
+      {
+	pause_between_cups_queue_updates = t;
+	debug_printf("Set pause between calls of update_cups_queues() to %d sec.\n",
+		     t);
+      }
+      else
+	debug_printf("Invalid value for pause between calls of update_cups_queues(): %d\n",
+		     t);
+    }
+    else if (!strcasecmp(line, "BrowseOptionsUpdate") && value)
+    {
+      if (!strcasecmp(value, "None"))
+        method = NONE;
+      else if (!strcasecmp(value, "Static"))
+        method = STATIC;
+      else if (!strcasecmp(value, "Dynamic"))
+        method = DYNAMIC;
+    }
+  }
+
+  if (browse_line_found == 0)
+  {
+    // No "Browse..." lines at all
+    browseallow_all = 1;
+    browse_order = ORDER_DENY_ALLOW;
+    debug_printf("No \"Browse...\" line at all, accept all servers (\"BrowseOrder Deny,Allow\").\n");
+  }
+  else if (browse_order_line_found == 0)
+  {
+    // No "BrowseOrder" line
+    if (browse_allow_line_found == 0)
+    {
+      // Only "BrowseDeny" lines
+      browse_order = ORDER_DENY_ALLOW;
+      debug_printf("No \"BrowseOrder\" line and only \"BrowseDeny\" lines, accept all except what matches the \"BrowseDeny\" lines  (\"BrowseOrder Deny,Allow\").\n");
+    }
+    else if (browse_deny_line_found == 0)
+    {
+      // Only "BrowseAllow" lines
+      browse_order = ORDER_ALLOW_DENY;
+      debug_printf("No \"BrowseOrder\" line and only \"BrowseAllow\" lines, deny all except what matches the \"BrowseAllow\" lines  (\"BrowseOrder Allow,Deny\").\n");
+    }
+    else
+    {
+      // Default for "BrowseOrder"
+      browse_order = ORDER_DENY_ALLOW;
+      debug_printf("No \"BrowseOrder\" line, use \"BrowseOrder Deny,Allow\" as default.\n");
+    }
+  }
+
+  cupsFileClose(fp);
+}
+
+
+static void
+save_configuration (config_t *c)
+{
+  c->browseallow = browseallow;
+  c->browseallow_all = browseallow_all;
+  c->browsedeny_all = browsedeny_all;
+  c->browse_order = browse_order;
+  c->browsefilter = browsefilter;
+  c->clusters = clusters;
+  c->AutoClustering = AutoClustering;
+  c->DNSSDBasedDeviceURIs = DNSSDBasedDeviceURIs;
+  c->HttpCompression = HttpCompression;
+  c->IPBasedDeviceURIs = IPBasedDeviceURIs;
+  c->LocalQueueNamingRemoteCUPS = LocalQueueNamingRemoteCUPS;
+  c->LocalQueueNamingIPPPrinter = LocalQueueNamingIPPPrinter;
+  c->OnlyUnsupportedByCUPS = OnlyUnsupportedByCUPS;
+  c->CreateRemoteRawPrinterQueues = CreateRemoteRawPrinterQueues;
+  c->CreateRemoteCUPSPrinterQueues = CreateRemoteCUPSPrinterQueues;
+  c->CreateIPPPrinterQueues = CreateIPPPrinterQueues;
+  c->BrowseInterval = BrowseInterval;
+  c->BrowseJitter = BrowseJitter;
+  c->BrowseTimeout = BrowseTimeout;
+  c->HttpLocalTimeout = HttpLocalTimeout;
+  c->HttpRemoteTimeout = HttpRemoteTimeout;
+  c->HttpMaxRetries = HttpMaxRetries;
+  c->HttpMaxRequestsPerHost = HttpMaxRequestsPerHost;
+  c->HttpRequestRatePerHost = HttpRequestRatePerHost;
+  c->DebugLogFileSize = DebugLogFileSize;
+  c->debug_stderr = debug_stderr;
+  c->debug_logfile = debug_logfile;
+  c->debug_categories = debug_categories;
+  c->debug_trace_level = debug_trace_level;
+  c->AttributesMemoryLimit = AttributesMemoryLimit;
+  c->IdleMemoryTrimTimeout = IdleMemoryTrimTimeout;
+  c->PPDGeneratorWorkers = PPDGeneratorWorkers;
+  c->UseCUPSGeneratedPPDs = UseCUPSGeneratedPPDs;
+  c->NewBrowsePollQueuesShared = NewBrowsePollQueuesShared;
+  c->AllowResharingRemoteCUPSPrinters = AllowResharingRemoteCUPSPrinters;
+  c->KeepGeneratedQueuesOnShutdown = KeepGeneratedQueuesOnShutdown;
+  c->NewIPPPrinterQueuesShared = NewIPPPrinterQueuesShared;
+  c->LoadBalancingType = LoadBalancingType;
+  c->ClusterMemberPreference = ClusterMemberPreference;
+  c->ClusterMemberTieBreak = ClusterMemberTieBreak;
+  c->update_cups_queues_max_per_call = update_cups_queues_max_per_call;
+  c->pause_between_cups_queue_updates = pause_between_cups_queue_updates;
+  c->notify_lease_duration = notify_lease_duration;
+  c->FrequentNetifUpdate = FrequentNetifUpdate;
+  c->method = method;
+  c->autoshutdown_timeout = autoshutdown_timeout;
+  c->autoshutdown_on = autoshutdown_on;
+}
+
+
+static void
+restore_configuration (const config_t *c)
+{
+  browseallow = c->browseallow;
+  browseallow_all = c->browseallow_all;
+  browsedeny_all = c->browsedeny_all;
+  browse_order = c->browse_order;
+  browsefilter = c->browsefilter;
+  clusters = c->clusters;
+  AutoClustering = c->AutoClustering;
+  DNSSDBasedDeviceURIs = c->DNSSDBasedDeviceURIs;
+  HttpCompression = c->HttpCompression;
+  IPBasedDeviceURIs = c->IPBasedDeviceURIs;
+  LocalQueueNamingRemoteCUPS = c->LocalQueueNamingRemoteCUPS;
+  LocalQueueNamingIPPPrinter = c->LocalQueueNamingIPPPrinter;
+  OnlyUnsupportedByCUPS = c->OnlyUnsupportedByCUPS;
+  CreateRemoteRawPrinterQueues = c->CreateRemoteRawPrinterQueues;
+  CreateRemoteCUPSPrinterQueues = c->CreateRemoteCUPSPrinterQueues;
+  CreateIPPPrinterQueues = c->CreateIPPPrinterQueues;
+  BrowseInterval = c->BrowseInterval;
+  BrowseJitter = c->BrowseJitter;
+  BrowseTimeout = c->BrowseTimeout;
+  HttpLocalTimeout = c->HttpLocalTimeout;
+  HttpRemoteTimeout = c->HttpRemoteTimeout;
+  HttpMaxRetries = c->HttpMaxRetries;
+  HttpMaxRequestsPerHost = c->HttpMaxRequestsPerHost;
+  HttpRequestRatePerHost = c->HttpRequestRatePerHost;
+  DebugLogFileSize = c->DebugLogFileSize;
+  pthread_rwlock_wrlock(&loglock);
+  debug_stderr = c->debug_stderr;
+  debug_logfile = c->debug_logfile;
+  pthread_rwlock_unlock(&loglock);
+  debug_categories = c->debug_categories;
+  debug_trace_level = c->debug_trace_level;
+  AttributesMemoryLimit = c->AttributesMemoryLimit;
+  IdleMemoryTrimTimeout = c->IdleMemoryTrimTimeout;
+  PPDGeneratorWorkers = c->PPDGeneratorWorkers;
+  UseCUPSGeneratedPPDs = c->UseCUPSGeneratedPPDs;
+  NewBrowsePollQueuesShared = c->NewBrowsePollQueuesShared;
+  AllowResharingRemoteCUPSPrinters = c->AllowResharingRemoteCUPSPrinters;
+  KeepGeneratedQueuesOnShutdown = c->KeepGeneratedQueuesOnShutdown;
+  NewIPPPrinterQueuesShared = c->NewIPPPrinterQueuesShared;
+  LoadBalancingType = c->LoadBalancingType;
+  ClusterMemberPreference = c->ClusterMemberPreference;
+  ClusterMemberTieBreak = c->ClusterMemberTieBreak;
+  update_cups_queues_max_per_call = c->update_cups_queues_max_per_call;
+  pause_between_cups_queue_updates = c->pause_between_cups_queue_updates;
+  notify_lease_duration = c->notify_lease_duration;
+  FrequentNetifUpdate = c->FrequentNetifUpdate;
+  method = c->method;
+  autoshutdown_timeout = c->autoshutdown_timeout;
+  autoshutdown_on = c->autoshutdown_on;
+}
+
+
+static void
+free_configuration_rules (config_t *c)
+{
+  allow_t *allow;
+  browse_filter_t *filter;
+  cluster_t *cluster;
+  char *member;
+
+  while ((allow = cupsArrayFirst(c->browseallow)) != NULL)
+  {
+    cupsArrayRemove(c->browseallow, allow);
+    free(allow);
+  }
+  cupsArrayDelete(c->browseallow);
+  c->browseallow = NULL;
+
+  while ((filter = cupsArrayFirst(c->browsefilter)) != NULL)
+  {
+    cupsArrayRemove(c->browsefilter, filter);
+    free(filter->field);
+    free(filter->regexp);
+    if (filter->cregexp)
+    {
+      regfree(filter->cregexp);
+      free(filter->cregexp);
+    }
+    free(filter);
+  }
+  cupsArrayDelete(c->browsefilter);
+  c->browsefilter = NULL;
+
+  while ((cluster = cupsArrayFirst(c->clusters)) != NULL)
+  {
+    cupsArrayRemove(c->clusters, cluster);
+    free(cluster->local_queue_name);
+    while ((member = cupsArrayFirst(cluster->members)) != NULL)
+    {
+      cupsArrayRemove(cluster->members, member);
+      free(member);
+    }
+    cupsArrayDelete(cluster->members);
+    free(cluster);
+  }
+  cupsArrayDelete(c->clusters);
+  c->clusters = NULL;
+}
+
+
+static int
+browse_allow_rules_equal (cups_array_t *a,
+			  cups_array_t *b)
+{
+  allow_t *aa, *ba;
+
+  if (cupsArrayCount(a) != cupsArrayCount(b))
+    return (0);
+  // The entries are allocated with calloc(), so we can compare them as
+  // a whole
+  for (aa = cupsArrayFirst(a), ba = cupsArrayFirst(b);
+       aa && ba;
+       aa = cupsArrayNext(a), ba = cupsArrayNext(b))
+    if (memcmp(aa, ba, sizeof(allow_t)))
+      return (0);
+  return (1);
+}
+
+
+static int
+browse_filter_rules_equal (cups_array_t *a,
+			   cups_array_t *b)
+{
+  browse_filter_t *af, *bf;
+
+  if (cupsArrayCount(a) != cupsArrayCount(b))
+    return (0);
+  for (af = cupsArrayFirst(a), bf = cupsArrayFirst(b);
+       af && bf;
+       af = cupsArrayNext(a), bf = cupsArrayNext(b))
+    if (af->sense != bf->sense ||
+	strcmp(af->field, bf->field) ||
+	(af->regexp == NULL) != (bf->regexp == NULL) ||
+	(af->regexp && strcmp(af->regexp, bf->regexp)) ||
+	(af->cregexp == NULL) != (bf->cregexp == NULL))
+      return (0);
+  return (1);
+}
+
+
+static int
+cluster_rules_equal (cups_array_t *a,
+		     cups_array_t *b)
+{
+  cluster_t *ac, *bc;
+  char *am, *bm;
+
+  if (cupsArrayCount(a) != cupsArrayCount(b))
+    return (0);
+  for (ac = cupsArrayFirst(a), bc = cupsArrayFirst(b);
+       ac && bc;
+       ac = cupsArrayNext(a), bc = cupsArrayNext(b))
+  {
+    if (strcmp(ac->local_queue_name, bc->local_queue_name) ||
+	cupsArrayCount(ac->members) != cupsArrayCount(bc->members))
+      return (0);
+    for (am = cupsArrayFirst(ac->members), bm = cupsArrayFirst(bc->members);
+	 am && bm;
+	 am = cupsArrayNext(ac->members), bm = cupsArrayNext(bc->members))
+      if (strcmp(am, bm))
+	return (0);
+  }
+  return (1);
+}
+
+
+static int
+browse_filter_uses_txt (cups_array_t *filters)
+{
+  browse_filter_t *filter;
+
+  // Are there BrowseFilter lines on fields which are not known to
+  // matched_filters() without the DNS-SD TXT record?
+  for (filter = cupsArrayFirst(filters);
+       filter;
+       filter = cupsArrayNext(filters))
+    if (strcasecmp(filter->field, "Name") &&
+	strcasecmp(filter->field, "Printer") &&
+	strcasecmp(filter->field, "PrinterName") &&
+	strcasecmp(filter->field, "Queue") &&
+	strcasecmp(filter->field, "QueueName") &&
+	strcasecmp(filter->field, "Host") &&
+	strcasecmp(filter->field, "HostName") &&
+	strcasecmp(filter->field, "RemoteHost") &&
+	strcasecmp(filter->field, "RemoteHostName") &&
+	strcasecmp(filter->field, "Server") &&
+	strcasecmp(filter->field, "ServerName") &&
+	strcasecmp(filter->field, "Port") &&
+	strcasecmp(filter->field, "Service") &&
+	strcasecmp(filter->field, "ServiceName") &&
+	strcasecmp(filter->field, "Domain"))
+      return (1);
+  return (0);
+}
+
+
+static gboolean
+reevaluation_timeout (gpointer data)
+{
+  remote_printer_t *p;
+
+  debug_trace("reevaluation_timeout() in THREAD %ld\n", pthread_self());
+
+  // All printers which are still wanted with the new configuration got
+  // re-discovered in the meantime, remove the rest
+  pthread_rwlock_wrlock(&lock);
+  for (p = (remote_printer_t *)cupsArrayFirst(remote_printers);
+       p; p = (remote_printer_t *)cupsArrayNext(remote_printers))
+    if (p->reevaluate)
+    {
+      p->reevaluate = 0;
+      if (p->status == STATUS_CONFIRMED ||
+	  p->status == STATUS_TO_BE_CREATED)
+      {
+	debug_printf("Printer %s (URI: %s) not re-discovered with new configuration, removing it.\n",
+		     p->queue_name, p->uri);
+	p->status = STATUS_DISAPPEARED;
+	p->timeout = scheduler.now() + TIMEOUT_IMMEDIATELY;
+      }
+    }
+  reevaluating_config = 0;
+  reevaluate_timer_id = 0;
+  pthread_rwlock_unlock(&lock);
+
+  if (in_shutdown == 0)
+    recheck_timer();
+
+  return (FALSE);
+}
+
+
+static void
+reload_configuration (void)
+{
+  config_t old_config;
+  size_t old_num_browse_poll = NumBrowsePoll;
+  size_t index;
+  unsigned int old_local_protocols = BrowseLocalProtocols,
+	       old_remote_protocols = BrowseRemoteProtocols,
+	       old_address_families = BrowseAddressFamilies;
+  cups_array_t *old_interfaces = BrowseInterfaces;
+  char *interface;
+  int old_autoshutdown = autoshutdown,
+      old_autoshutdown_avahi = autoshutdown_avahi;
+  char old_cachedir[sizeof(cachedir)], old_logdir[sizeof(logdir)];
+  int allow_changed, filter_changed, cluster_changed, txt_filters;
+  int cups_queues_changed, ipp_printers_changed, uris_changed;
+  int num_removed = 0, num_reevaluate = 0;
+  remote_printer_t *p;
+  http_addr_t addr;
+
+  debug_printf("Re-reading configuration ...\n");
+
+  pthread_rwlock_wrlock(&resolvelock);
+  pthread_rwlock_wrlock(&lock);
+
+  // Read the configuration file into freshly initialized settings, so
+  // that removed lines get back to their defaults
+  memcpy(old_cachedir, cachedir, sizeof(cachedir));
+  memcpy(old_logdir, logdir, sizeof(logdir));
+  cachedir[0] = '\0';
+  logdir[0] = '\0';
+  save_configuration(&old_config);
+  restore_configuration(&default_config);
+  browseallow = cupsArrayNew(NULL, NULL);
+  browsefilter = cupsArrayNew(NULL, NULL);
+  clusters = cupsArrayNew(NULL, NULL);
+  if (DefaultOptions != NULL)
+  {
+    free(DefaultOptions);
+    DefaultOptions = NULL;
+  }
+  BrowseInterfaces = NULL;
+
+  read_configuration(alt_config_file);
+
+  // DebugLogging got removed or set to not log into the file any more
+  if (old_config.debug_logfile && !debug_logfile)
+    stop_debug_logging();
+
+  // Settings which need a restart of cups-browsed
+  if (NumBrowsePoll != 2 * old_num_browse_poll)
+    debug_printf("BrowsePoll lines changed, cups-browsed needs to be restarted to apply this.\n");
+  for (index = old_num_browse_poll; index < NumBrowsePoll; index ++)
+  {
+    if (index < 2 * old_num_browse_poll &&
+	(strcasecmp(BrowsePoll[index]->server,
+		    BrowsePoll[index - old_num_browse_poll]->server) ||
+	 BrowsePoll[index]->port !=
+	 BrowsePoll[index - old_num_browse_poll]->port))
+      debug_printf("BrowsePoll lines changed, cups-browsed needs to be restarted to apply this.\n");
+    free(BrowsePoll[index]->server);
+    free(BrowsePoll[index]);
+  }
+  NumBrowsePoll = old_num_browse_poll;
+  if (BrowseLocalProtocols != old_local_protocols ||
+      BrowseRemoteProtocols != old_remote_protocols)
+  {
+    debug_printf("Browse protocols changed, cups-browsed needs to be restarted to apply this.\n");
+    BrowseLocalProtocols = old_local_protocols;
+    BrowseRemoteProtocols = old_remote_protocols;
+  }
+  if (cupsArrayCount(BrowseInterfaces) != cupsArrayCount(old_interfaces) ||
+      BrowseAddressFamilies != old_address_families)
+    interface = "";
+  else
+    for (interface = cupsArrayFirst(BrowseInterfaces); interface;
+	 interface = cupsArrayNext(BrowseInterfaces))
+      if (!cupsArrayFind(old_interfaces, interface))
+	break;
+  if (interface)
+    debug_printf("Browse interfaces or address families changed, cups-browsed needs to be restarted to apply this.\n");
+  cupsArrayDelete(BrowseInterfaces);
+  BrowseInterfaces = old_interfaces;
+  BrowseAddressFamilies = old_address_families;
+  autoshutdown = old_autoshutdown;
+  autoshutdown_avahi = old_autoshutdown_avahi;
+  // The paths of the cache and log files are set at startup
+  if (strcmp(cachedir[0] ? cachedir : DEFAULT_CACHEDIR, old_cachedir))
+    debug_printf("CacheDir changed, cups-browsed needs to be restarted to apply this.\n");
+  if (strcmp(logdir[0] ? logdir : DEFAULT_LOGDIR, old_logdir))
+    debug_printf("LogDir changed, cups-browsed needs to be restarted to apply this.\n");
+  memcpy(cachedir, old_cachedir, sizeof(cachedir));
+  memcpy(logdir, old_logdir, sizeof(logdir));
+  if (PPDGeneratorWorkers != old_config.PPDGeneratorWorkers)
+  {
+    debug_printf("PPDGeneratorWorkers changed, cups-browsed needs to be restarted to apply this.\n");
+    PPDGeneratorWorkers = old_config.PPDGeneratorWorkers;
+  }
+
+  // Find out which of the changes can have an effect on the printers
+  // which we have already
+  allow_changed = browseallow_all != old_config.browseallow_all ||
+		  browsedeny_all != old_config.browsedeny_all ||
+		  browse_order != old_config.browse_order ||
+		  !browse_allow_rules_equal(browseallow,
+					    old_config.browseallow);
+  filter_changed = !browse_filter_rules_equal(browsefilter,
+					      old_config.browsefilter);
+  txt_filters = filter_changed && browse_filter_uses_txt(browsefilter);
+  cluster_changed = AutoClustering != old_config.AutoClustering ||
+		    !cluster_rules_equal(clusters, old_config.clusters);
+  uris_changed =
+    DNSSDBasedDeviceURIs != old_config.DNSSDBasedDeviceURIs ||
+    IPBasedDeviceURIs != old_config.IPBasedDeviceURIs;
+  cups_queues_changed =
+    LocalQueueNamingRemoteCUPS != old_config.LocalQueueNamingRemoteCUPS ||
+    CreateRemoteRawPrinterQueues != old_config.CreateRemoteRawPrinterQueues ||
+    CreateRemoteCUPSPrinterQueues != old_config.CreateRemoteCUPSPrinterQueues ||
+    OnlyUnsupportedByCUPS != old_config.OnlyUnsupportedByCUPS;
+  ipp_printers_changed =
+    LocalQueueNamingIPPPrinter != old_config.LocalQueueNamingIPPPrinter ||
+    CreateIPPPrinterQueues != old_config.CreateIPPPrinterQueues;
+
+  debug_printf("Configuration changes: BrowseAllow/Deny/Order: %s, BrowseFilter: %s, Clusters: %s, Device URIs: %s, Remote CUPS queues: %s, IPP printers: %s\n",
+	       allow_changed ? "yes" : "no", filter_changed ? "yes" : "no",
+	       cluster_changed ? "yes" : "no", uris_changed ? "yes" : "no",
+	       cups_queues_changed ? "yes" : "no",
+	       ipp_printers_changed ? "yes" : "no");
+
+  // Go through our printers and remove the ones which are excluded by the
+  // new rules. Printers for which we cannot decide without the data from
+  // their discovery get marked and have to get re-discovered, the others
+  // stay untouched.
+  for (p = (remote_printer_t *)cupsArrayFirst(remote_printers);
+       p; p = (remote_printer_t *)cupsArrayNext(remote_printers))
+  {
+    if (p->status != STATUS_CONFIRMED &&
+	p->status != STATUS_TO_BE_CREATED)
+      continue;
+
+    if (allow_changed)
+    {
+      memset(&addr, 0, sizeof(addr));
+      if (p->ip && inet_pton(AF_INET, p->ip, &addr.ipv4.sin_addr) == 1)
+	addr.ipv4.sin_family = AF_INET;
+      else if (p->ip &&
+	       inet_pton(AF_INET6, p->ip, &addr.ipv6.sin6_addr) == 1)
+	addr.ipv6.sin6_family = AF_INET6;
+      if (addr.addr.sa_family == 0)
+	p->reevaluate = 1;
+      else if (!allowed((struct sockaddr *)&addr))
+      {
+	debug_printf("Printer %s (URI: %s) not allowed any more by BrowseAllow/BrowseDeny lines, removing it.\n",
+		     p->queue_name, p->uri);
+	p->status = STATUS_DISAPPEARED;
+	p->timeout = scheduler.now() + TIMEOUT_IMMEDIATELY;
+	num_removed ++;
+	continue;
       }
-      else
-	debug_printf("Invalid value for maximum number of CUPS queue updates per call of update_cups_queues(): %d\n",
-		     n);
     }
-    else if (!strcasecmp(line, "PauseBetweenCUPSQueueUpdates") && value)
+
+    if (filter_changed)
     {
-      int t = atoi(value);
-      if (t >= 0)
+      if (!matched_filters(p->queue_name, p->host, p->port, p->service_name,
+			   p->domain, NULL))
       {
-	pause_between_cups_queue_updates = t;
-	debug_printf("Set pause between calls of update_cups_queues() to %d sec.\n",
-		     t);
+	debug_printf("Printer %s (URI: %s) not matching BrowseFilter lines any more, removing it.\n",
+		     p->queue_name, p->uri);
+	p->status = STATUS_DISAPPEARED;
+	p->timeout = scheduler.now() + TIMEOUT_IMMEDIATELY;
+	num_removed ++;
+	continue;
       }
-      else
-	debug_printf("Invalid value for pause between calls of update_cups_queues(): %d\n",
-		     t);
-    }
-    else if (!strcasecmp(line, "BrowseOptionsUpdate") && value)
-    {
-      if (!strcasecmp(value, "None"))
-        method = NONE;
-      else if (!strcasecmp(value, "Static"))
-        method = STATIC;
-      else if (!strcasecmp(value, "Dynamic"))
-        method = DYNAMIC;
+      if (txt_filters && p->type && p->type[0])
+	p->reevaluate = 1;
     }
-  }
 
-  if (browse_line_found == 0)
-  {
-    // No "Browse..." lines at all
-    browseallow_all = 1;
-    browse_order = ORDER_DENY_ALLOW;
-    debug_printf("No \"Browse...\" line at all, accept all servers (\"BrowseOrder Deny,Allow\").\n");
+    if (cluster_changed || uris_changed ||
+	(cups_queues_changed && p->netprinter == 0) ||
+	(ipp_printers_changed && p->netprinter == 1))
+      p->reevaluate = 1;
+
+    if (p->reevaluate)
+      num_reevaluate ++;
   }
-  else if (browse_order_line_found == 0)
+
+  free_configuration_rules(&old_config);
+
+  if (num_reevaluate > 0 || allow_changed || filter_changed ||
+      cluster_changed || uris_changed || cups_queues_changed ||
+      ipp_printers_changed)
+    reevaluating_config = 1;
+
+  pthread_rwlock_unlock(&lock);
+  pthread_rwlock_unlock(&resolvelock);
+
+  debug_printf("Configuration re-read, %d printers removed, %d printers to be re-discovered.\n",
+	       num_removed, num_reevaluate);
+  flight_record(FLIGHT_CONFIG_RELOAD, NULL, NULL, num_removed);
+
+  if (reevaluating_config)
   {
-    // No "BrowseOrder" line
-    if (browse_allow_line_found == 0)
-    {
-      // Only "BrowseDeny" lines
-      browse_order = ORDER_DENY_ALLOW;
-      debug_printf("No \"BrowseOrder\" line and only \"BrowseDeny\" lines, accept all except what matches the \"BrowseDeny\" lines  (\"BrowseOrder Deny,Allow\").\n");
-    }
-    else if (browse_deny_line_found == 0)
-    {
-      // Only "BrowseAllow" lines
-      browse_order = ORDER_ALLOW_DENY;
-      debug_printf("No \"BrowseOrder\" line and only \"BrowseAllow\" lines, deny all except what matches the \"BrowseAllow\" lines  (\"BrowseOrder Allow,Deny\").\n");
-    }
-    else
-    {
-      // Default for "BrowseOrder"
-      browse_order = ORDER_DENY_ALLOW;
-      debug_printf("No \"BrowseOrder\" line, use \"BrowseOrder Deny,Allow\" as default.\n");
-    }
+    // Let all printers get reported again, so that the ones which got
+    // allowed by the new rules get added and the marked ones get
+    // confirmed or removed
+#ifdef HAVE_AVAHI
+    avahi_browser_restart();
+#endif // HAVE_AVAHI
+    for (index = 0; index < NumBrowsePoll; index ++)
+      g_list_foreach(BrowsePoll[index]->printers,
+		     browsepoll_printer_keepalive, BrowsePoll[index]->server);
+
+    if (reevaluate_timer_id)
+      g_source_remove(reevaluate_timer_id);
+    reevaluate_timer_id = g_timeout_add_seconds(TIMEOUT_REEVALUATE,
+						reevaluation_timeout, NULL);
   }
 
-  cupsFileClose(fp);
+  if (in_shutdown == 0)
+    recheck_timer();
+}
+
+
+static gboolean
+sighup_handler (gpointer user_data)
+{
+  (void)user_data;
+
+  debug_printf("Caught signal SIGHUP, re-reading configuration ...\n");
+  if (!terminating)
+    reload_configuration();
+
+  // Keep the handler installed
+  return (TRUE);
 }
 
 
@@ -12215,6 +16420,21 @@ defer_update_netifs (void)
   if (update_netifs_sourceid)
     g_source_remove (update_netifs_sourceid);
 
+  // Network paths which went away do not need time to settle, update
+  // right now so that the printers on them get reconciled without
+  // delay. New interfaces and addresses get picked up by the deferred
+  // update.
+  if (netif_paths_gone())
+  {
+    debug_printf("Network interface went away, updating interfaces now.\n");
+    update_netifs (NULL);
+    if (netif_paths_lost_sourceid)
+    {
+      g_source_remove (netif_paths_lost_sourceid);
+      reconcile_lost_netifs (NULL);
+    }
+  }
+
   update_netifs_sourceid = g_timeout_add_seconds (10, update_netifs, NULL);
 }
 
@@ -12227,7 +16447,7 @@ nm_properties_changed (GDBusProxy *proxy,
   GVariantIter *iter;
   const gchar *key;
   GVariant *value;
-  debug_printf("nm_properties_changed() in THREAD %ld\n", pthread_self());
+  debug_trace("nm_properties_changed() in THREAD %ld\n", pthread_self());
   g_variant_get (changed_properties, "a{sv}", &iter);
   while (g_variant_iter_loop (iter, "{&sv}", &key, &value))
   {
@@ -12242,6 +16462,110 @@ nm_properties_changed (GDBusProxy *proxy,
   g_variant_iter_free (iter);
 }
 
+//
+// Timing the startup
+//
+
+static int
+startup_phase_begin(const char *name,
+		    int background)
+{
+  int phase = -1;
+
+  pthread_mutex_lock(&startup_lock);
+  if (num_startup_phases < STARTUP_MAX_PHASES)
+  {
+    phase = num_startup_phases ++;
+    startup_phases[phase].name = name;
+    startup_phases[phase].start = g_get_monotonic_time() - startup_time;
+    startup_phases[phase].end = 0;
+    startup_phases[phase].background = background;
+  }
+  pthread_mutex_unlock(&startup_lock);
+
+  return (phase);
+}
+
+
+static void
+startup_phase_end(int phase)
+{
+  startup_phase_t *s;
+  int msec;
+
+  if (phase < 0)
+    return;
+  pthread_mutex_lock(&startup_lock);
+  s = &startup_phases[phase];
+  s->end = g_get_monotonic_time() - startup_time;
+  msec = (int)((s->end - s->start) / 1000);
+  pthread_mutex_unlock(&startup_lock);
+
+  debug_printf("Startup: %s done in %d msec.\n", s->name, msec);
+  flight_record(FLIGHT_STARTUP, s->name, NULL, msec);
+}
+
+
+// Log how long the phases of the startup took, when entering the main
+// loop
+static void
+startup_report(void)
+{
+  int i;
+  startup_phase_t *s;
+
+  pthread_mutex_lock(&startup_lock);
+  debug_printf("Startup took %.1f msec until entering the main loop:\n",
+	       (g_get_monotonic_time() - startup_time) / 1000.0);
+  for (i = 0; i < num_startup_phases; i ++)
+  {
+    s = &startup_phases[i];
+    debug_printf("  %8.1f - %8.1f msec (%8.1f msec): %s%s\n",
+		 s->start / 1000.0, s->end / 1000.0,
+		 (s->end - s->start) / 1000.0, s->name,
+		 (s->background ? " (in background)" : ""));
+  }
+  pthread_mutex_unlock(&startup_lock);
+}
+
+
+// Log when the first queue got created, the time the user waits to see
+// a printer after the startup
+static void
+startup_first_queue(const char *queue_name)
+{
+  gint64 expected = 0, now = g_get_monotonic_time();
+
+  if (__atomic_compare_exchange_n(&first_queue_time, &expected, now, 0,
+				  __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    debug_printf("Startup: First queue %s ready %.1f msec after start.\n",
+		 queue_name, (now - startup_time) / 1000.0);
+}
+
+
+// Read the list of CUPS queues and the default printer, in a thread
+// during startup
+static void *
+startup_local_printers(void *data)
+{
+  int phase = startup_phase_begin("Reading local CUPS queues",
+				  data != NULL);
+  char *val;
+
+  debug_trace("startup_local_printers() in THREAD %ld\n", pthread_self());
+
+  update_local_printers ();
+  if ((val = get_cups_default_printer()) != NULL)
+  {
+    default_printer = strdup(val);
+    free(val);
+  }
+  startup_phase_end(phase);
+
+  return (NULL);
+}
+
+
 static void
 find_previous_queue (gpointer key,
 		     gpointer value,
@@ -12250,7 +16574,7 @@ find_previous_queue (gpointer key,
   const char *name = key;
   const local_printer_t *printer = value;
   remote_printer_t *p;
-  debug_printf("find_previous_queue() in THREAD %ld\n", pthread_self());
+  debug_trace("find_previous_queue() in THREAD %ld\n", pthread_self());
   if (printer->cups_browsed_controlled)
   {
     // Queue found, add to our list
@@ -12263,7 +16587,7 @@ find_previous_queue (gpointer key,
       // in a certain time frame, we will remove the queue
       p->status = STATUS_UNCONFIRMED;
 
-      p->timeout = time(NULL) + TIMEOUT_CONFIRM;
+      p->timeout = scheduler.now() + TIMEOUT_CONFIRM;
 
       p->slave_of = NULL;
       debug_printf("Found CUPS queue %s (URI: %s) from previous session.\n",
@@ -12287,6 +16611,16 @@ main(int argc, char*argv[])
   GDBusProxy *proxy = NULL;
   GError *error = NULL;
   int subscription_id = 0;
+  int phase;
+  pthread_t local_printers_thread;
+  int local_printers_thread_started;
+
+  // We are a PPD generator process started by the daemon, see
+  // ppd_workers_start()
+  if (argc == 3 && !strcmp(argv[1], "--ppd-worker"))
+    return (ppd_worker_main(atoi(argv[2])));
+
+  startup_time = g_get_monotonic_time();
 
   // Initialise the command_line_config array
   command_line_config = cupsArrayNew(NULL, NULL);
@@ -12300,6 +16634,9 @@ main(int argc, char*argv[])
   // Initialise the clusters array
   clusters = cupsArrayNew(NULL, NULL);
 
+  // Initialise the array of jobs assigned to cluster members
+  job_assignments = cupsArrayNew(NULL, NULL);
+
   // Read command line options
   if (argc >= 2)
   {
@@ -12318,7 +16655,6 @@ main(int argc, char*argv[])
 	// Turn on debug log file mode if requested
 	if (debug_logfile == 0)
 	{
-	  debug_logfile = 1;
 	  start_debug_logging();
 	  debug_printf("Reading command line option %s, turning on debug mode (Log into log file %s).\n",
 		       argv[i], debug_log_file);
@@ -12497,9 +16833,14 @@ main(int argc, char*argv[])
   }
 
   debug_printf("cups-browsed version "VERSION" starting.\n");
-  
+
+  // Remember the built-in defaults for re-reading the configuration
+  save_configuration (&default_config);
+
   // Read in cups-browsed.conf
+  phase = startup_phase_begin("Reading configuration", 0);
   read_configuration (alt_config_file);
+  startup_phase_end(phase);
 
   // Set the paths of the auxiliary files
   if (cachedir[0] == '\0')
@@ -12533,10 +16874,19 @@ main(int argc, char*argv[])
 	  DEBUG_LOG_FILE_2,
 	  sizeof(debug_log_file_bckp) - strlen(logdir) - 1);
   
+  strncpy(flight_recorder_file, logdir,
+	  sizeof(flight_recorder_file) - 1);
+  strncpy(flight_recorder_file + strlen(logdir),
+	  FLIGHT_RECORDER_FILE,
+	  sizeof(flight_recorder_file) - strlen(logdir) - 1);
+  
   if (debug_logfile == 1)
     start_debug_logging();
 
-  debug_printf("main() in THREAD %ld\n", pthread_self());
+  debug_trace("main() in THREAD %ld\n", pthread_self());
+
+  // Start the helper processes for generating PPD files
+  ppd_workers_start(argv[0]);
 
   // If a port is selected via the IPP_PORT environment variable,
   // set this first
@@ -12607,14 +16957,18 @@ main(int argc, char*argv[])
 #endif // HAVE_AVAHI
 
   // Wait for CUPS daemon to start
+  phase = startup_phase_begin("Waiting for CUPS", 0);
   while ((http = http_connect_local()) == NULL)
     sleep(1);
   httpClose(http);
+  startup_phase_end(phase);
 
   // Initialise the array of network interfaces
+  phase = startup_phase_begin("Network interfaces", 0);
   netifs = cupsArrayNew(NULL, NULL);
   local_hostnames = cupsArrayNew(NULL, NULL);
   update_netifs (NULL);
+  startup_phase_end(phase);
 
   local_printers = g_hash_table_new_full (g_str_hash,
 					  g_str_equal,
@@ -12625,26 +16979,35 @@ main(int argc, char*argv[])
 							  g_free,
 							  free_local_printer);
 
-  // Read out the currently defined CUPS queues and find the ones which we
-  // have added in an earlier session
-  update_local_printers ();
-  if ((val = get_cups_default_printer()) != NULL)
-  {
-    default_printer = strdup(val);
-    free(val);
-  }
   remote_printers = cupsArrayNew(NULL, NULL);
-  g_hash_table_foreach (local_printers, find_previous_queue, NULL);
+  printer_uuids = g_hash_table_new(g_str_hash, g_str_equal);
+
+  // Read out the currently defined CUPS queues, with many queues this
+  // takes a while, so we connect to Avahi and D-Bus meanwhile. Only this
+  // thread touches the list of local queues until we join it below
+  local_printers_thread_started =
+    !pthread_create(&local_printers_thread, NULL, startup_local_printers,
+		    (void *)1);
+  if (!local_printers_thread_started)
+    startup_local_printers(NULL);
 
   // Redirect SIGINT and SIGTERM so that we do a proper shutdown, removing
   // the CUPS queues which we have created
   // Use SIGUSR1 and SIGUSR2 to turn off and turn on auto shutdown mode
   // resp.
+  // Use SIGQUIT to dump the flight recorder, and dump it also when we
+  // crash
 #ifdef HAVE_SIGSET // Use System V signals over POSIX to avoid bugs
   sigset(SIGTERM, sigterm_handler);
   sigset(SIGINT, sigterm_handler);
   sigset(SIGUSR1, sigusr1_handler);
   sigset(SIGUSR2, sigusr2_handler);
+  sigset(SIGQUIT, sigquit_handler);
+  sigset(SIGSEGV, sigcrash_handler);
+  sigset(SIGBUS, sigcrash_handler);
+  sigset(SIGFPE, sigcrash_handler);
+  sigset(SIGILL, sigcrash_handler);
+  sigset(SIGABRT, sigcrash_handler);
   debug_printf("Using signal handler SIGSET\n");
 #elif defined(HAVE_SIGACTION)
   struct sigaction action; // Actions for POSIX signals
@@ -12665,50 +17028,50 @@ main(int argc, char*argv[])
   sigaddset(&action.sa_mask, SIGUSR2);
   action.sa_handler = sigusr2_handler;
   sigaction(SIGUSR2, &action, NULL);
+  sigemptyset(&action.sa_mask);
+  sigaddset(&action.sa_mask, SIGQUIT);
+  action.sa_handler = sigquit_handler;
+  sigaction(SIGQUIT, &action, NULL);
+  sigemptyset(&action.sa_mask);
+  action.sa_handler = sigcrash_handler;
+  sigaction(SIGSEGV, &action, NULL);
+  sigaction(SIGBUS, &action, NULL);
+  sigaction(SIGFPE, &action, NULL);
+  sigaction(SIGILL, &action, NULL);
+  sigaction(SIGABRT, &action, NULL);
   debug_printf("Using signal handler SIGACTION\n");
 #else
   signal(SIGTERM, sigterm_handler);
   signal(SIGINT, sigterm_handler);
   signal(SIGUSR1, sigusr1_handler);
   signal(SIGUSR2, sigusr2_handler);
+  signal(SIGQUIT, sigquit_handler);
+  signal(SIGSEGV, sigcrash_handler);
+  signal(SIGBUS, sigcrash_handler);
+  signal(SIGFPE, sigcrash_handler);
+  signal(SIGILL, sigcrash_handler);
+  signal(SIGABRT, sigcrash_handler);
   debug_printf("Using signal handler SIGNAL\n");
 #endif // HAVE_SIGSET
 
+  // Re-read cups-browsed.conf on SIGHUP, done in the main loop, as it
+  // changes data structures used everywhere
+  g_unix_signal_add (SIGHUP, sighup_handler, NULL);
+
 #ifdef HAVE_AVAHI
   if (autoshutdown_avahi)
     autoshutdown = 1;
+  phase = startup_phase_begin("Connecting to Avahi", 0);
   avahi_init();
+  startup_phase_end(phase);
 #endif // HAVE_AVAHI
 
-  if (autoshutdown == 1)
-  {
-    // If there are no printers or no jobs schedule the shutdown in
-    // autoshutdown_timeout seconds
-    if (!autoshutdown_exec_id &&
-	(cupsArrayCount(remote_printers) == 0 ||
-	 (autoshutdown_on == NO_JOBS && check_jobs() == 0)))
-    {
-      debug_printf ("We set auto shutdown mode and no printers are there to make available or no jobs on them, shutting down in %d sec...\n", autoshutdown_timeout);
-      autoshutdown_exec_id =
-	g_timeout_add_seconds (autoshutdown_timeout, autoshutdown_execute,
-			       NULL);
-    }
-  }
-  
-  if (BrowseLocalProtocols == 0 &&
-      BrowseRemoteProtocols == 0 &&
-      !BrowsePoll)
-  {
-    debug_printf("nothing left to do\n");
-    ret = 0;
-    goto fail;
-  }
-
   // Override the default password callback so we don't end up
   // prompting for it.
   cupsSetPasswordCB2 (password_callback, NULL);
 
   // Watch NetworkManager for network interface changes
+  phase = startup_phase_begin("Connecting to NetworkManager", 0);
   proxy = g_dbus_proxy_new_for_bus_sync (G_BUS_TYPE_SYSTEM,
 					 G_DBUS_PROXY_FLAGS_DO_NOT_AUTO_START,
 					 NULL, // GDBusInterfaceInfo
@@ -12723,30 +17086,15 @@ main(int argc, char*argv[])
 		      "g-properties-changed",
 		      G_CALLBACK (nm_properties_changed),
 		      NULL);
-
-  // Run the main loop
-  gmainloop = g_main_loop_new (NULL, FALSE);
-  recheck_timer ();
-
-  if (BrowsePoll)
-  {
-    size_t index;
-    for (index = 0;
-	 index < NumBrowsePoll;
-	 index++)
-    {
-      debug_printf ("will browse poll %s every %ds\n",
-		    BrowsePoll[index]->server, BrowseInterval);
-      g_idle_add (browse_poll, BrowsePoll[index]);
-    }
-  }
+  startup_phase_end(phase);
 
   // Subscribe to CUPS' D-Bus notifications and create a proxy to receive
   // the notifications
+  phase = startup_phase_begin("Subscribing to CUPS notifications", 0);
   subscription_id = create_subscription ();
-  g_timeout_add_seconds (notify_lease_duration / 2,
-			 renew_subscription_timeout,
-			 &subscription_id);
+  g_timeout_add (jittered_msecs(notify_lease_duration / 2),
+		 renew_subscription_timeout,
+		 &subscription_id);
   cups_notifier = cups_notifier_proxy_new_for_bus_sync (G_BUS_TYPE_SYSTEM,
 							0,
 							NULL,
@@ -12770,6 +17118,66 @@ main(int argc, char*argv[])
     g_signal_connect (cups_notifier, "printer-modified",
 		      G_CALLBACK (on_printer_modified), NULL);
   }
+  startup_phase_end(phase);
+
+  // Now we need the CUPS queues, find the ones which we have added in an
+  // earlier session. Callbacks of Avahi and D-Bus only run in the main
+  // loop, so they see them complete
+  if (local_printers_thread_started)
+  {
+    phase = startup_phase_begin("Waiting for the local CUPS queues", 0);
+    pthread_join(local_printers_thread, NULL);
+    startup_phase_end(phase);
+  }
+  phase = startup_phase_begin("Finding queues of previous session", 0);
+  g_hash_table_foreach (local_printers, find_previous_queue, NULL);
+  startup_phase_end(phase);
+
+  if (autoshutdown == 1)
+  {
+    // If there are no printers or no jobs schedule the shutdown in
+    // autoshutdown_timeout seconds
+    if (!autoshutdown_exec_id &&
+	(cupsArrayCount(remote_printers) == 0 ||
+	 (autoshutdown_on == NO_JOBS && check_jobs() == 0)))
+    {
+      debug_printf ("We set auto shutdown mode and no printers are there to make available or no jobs on them, shutting down in %d sec...\n", autoshutdown_timeout);
+      autoshutdown_exec_id =
+	g_timeout_add_seconds (autoshutdown_timeout, autoshutdown_execute,
+			       NULL);
+    }
+  }
+  
+  if (BrowseLocalProtocols == 0 &&
+      BrowseRemoteProtocols == 0 &&
+      !BrowsePoll)
+  {
+    debug_printf("nothing left to do\n");
+    ret = 0;
+    goto fail;
+  }
+
+  // Run the main loop
+  gmainloop = g_main_loop_new (NULL, FALSE);
+  recheck_timer ();
+
+  if (BrowsePoll)
+  {
+    size_t index;
+    for (index = 0;
+	 index < NumBrowsePoll;
+	 index++)
+    {
+      guint offset = jittered_offset_msecs(BrowseInterval);
+      debug_printf ("will browse poll %s every %ds (+/- %d%%), starting in %d msec\n",
+		    BrowsePoll[index]->server, BrowseInterval, BrowseJitter,
+		    offset);
+      if (offset)
+	g_timeout_add (offset, browse_poll, BrowsePoll[index]);
+      else
+	g_idle_add (browse_poll, BrowsePoll[index]);
+    }
+  }
 
   // If auto shutdown is active and we do not find any printers initially,
   // schedule the shutdown in autoshutdown_timeout seconds
@@ -12782,6 +17190,17 @@ main(int argc, char*argv[])
       g_timeout_add_seconds (autoshutdown_timeout, autoshutdown_execute, NULL);
   }
 
+  // Export our D-Bus interface for querying the discovered printers
+  dbus_owner_id = g_bus_own_name(G_BUS_TYPE_SYSTEM, CUPS_BROWSED_DBUS_NAME,
+				 G_BUS_NAME_OWNER_FLAGS_NONE,
+				 on_dbus_bus_acquired, NULL, on_dbus_name_lost,
+				 NULL, NULL);
+
+  // Release memory when there is nothing to do for some time
+  note_activity();
+  g_timeout_add_seconds (IDLE_CHECK_INTERVAL, idle_check, NULL);
+
+  startup_report();
   g_main_loop_run (gmainloop);
 
   debug_printf("main loop exited\n");
@@ -12794,6 +17213,19 @@ fail:
   // Clean up things
 
   in_shutdown = 1;
+  flight_record(FLIGHT_SHUTDOWN, NULL, NULL, 0);
+
+  // Stop the queue creations and DNS-SD resolves in progress, do not
+  // wait for them longer than TIMEOUT_SHUTDOWN seconds. Connections
+  // still used by tasks which did not finish in time stay open
+  if (tasks_stop(TIMEOUT_SHUTDOWN) == 0)
+    http_pool_close_all();
+  else
+    http_pool_close_unused();
+  ppd_workers_stop();
+  debug_printf("HTTP compression: %zu of %zu IPP responses compressed, %zu bytes received for %zu bytes of IPP data.\n",
+	       http_responses_compressed, http_responses, http_bytes_received,
+	       http_bytes_decoded);
   
   if (proxy)
     g_object_unref (proxy);
@@ -12805,10 +17237,19 @@ fail:
     {
       if (p->status != STATUS_TO_BE_RELEASED)
 	p->status = STATUS_DISAPPEARED;
-      p->timeout = time(NULL) + TIMEOUT_IMMEDIATELY;
+      p->timeout = scheduler.now() + TIMEOUT_IMMEDIATELY;
     }
   update_cups_queues(NULL);
 
+  if (dbus_owner_id)
+    g_bus_unown_name(dbus_owner_id);
+  if (dbus_printers)
+  {
+    g_dbus_interface_skeleton_unexport(G_DBUS_INTERFACE_SKELETON(dbus_printers));
+    g_object_unref(dbus_printers);
+    dbus_printers = NULL;
+  }
+
   cancel_subscription (subscription_id);
   if (cups_notifier)
     g_object_unref (cups_notifier);
@@ -12858,6 +17299,13 @@ fail:
   
   if (deleted_master != NULL)
     free(deleted_master);
+  if (job_assignments != NULL)
+  {
+    job_assignment_t *a;
+    while ((a = (job_assignment_t *)cupsArrayFirst(job_assignments)) != NULL)
+      free_job_assignment(a);
+    cupsArrayDelete(job_assignments);
+  }
   if (DefaultOptions != NULL)
     free(DefaultOptions);
   if (DomainSocket != NULL)
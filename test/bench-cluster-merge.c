@@ -0,0 +1,558 @@
+//
+// Benchmark for merging the capabilities of the members of a cluster
+// in cups-browsed
+//
+// Copyright 2024 OpenPrinting
+//
+// Licensed under Apache License v2.0.  See the file "LICENSE" for more
+// information.
+//
+// Usage:
+//
+//   bench-cluster-merge [-n ITERATIONS] [FILE.ipp ...]
+//   bench-cluster-merge --record PRINTER-URI FILE.ipp
+//
+// Runs each of the cluster merge functions of cups-browsed on clusters
+// of 2, 10, and 50 members and reports time and number of memory
+// allocations per call. The members' attributes are read from the given
+// files, which are cycled through to fill the clusters. Without files
+// heterogeneous members are generated, with differing media, media
+// sources and types, resolutions, and document formats. --record saves
+// the get-printer-attributes response of a real printer into a file
+// for use as a member.
+//
+
+// The merge functions are static, so we build the daemon's source into
+// this program, with its main() renamed
+#define main cups_browsed_main
+#include "../daemon/cups-browsed.c"
+#undef main
+
+
+//
+// Count the memory allocations, glibc lets us replace malloc() and
+// friends with wrappers around its own implementation
+//
+
+static size_t bench_allocs = 0;
+
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+void *
+malloc(size_t size)
+{
+  __atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+  return (__libc_malloc(size));
+}
+
+void *
+calloc(size_t nmemb,
+       size_t size)
+{
+  __atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+  return (__libc_calloc(nmemb, size));
+}
+
+void *
+realloc(void *ptr,
+	size_t size)
+{
+  __atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+  return (__libc_realloc(ptr, size));
+}
+
+void
+free(void *ptr)
+{
+  __libc_free(ptr);
+}
+#endif // __GLIBC__
+
+
+#define BENCH_CLUSTER "bench"
+
+typedef struct bench_size_s
+{
+  const char *name;
+  int x, y;
+} bench_size_t;
+
+static const bench_size_t bench_sizes[] =
+{
+  { "iso_a4_210x297mm", 21000, 29700 },
+  { "na_letter_8.5x11in", 21590, 27940 },
+  { "na_legal_8.5x14in", 21590, 35560 },
+  { "iso_a5_148x210mm", 14800, 21000 },
+  { "iso_a3_297x420mm", 29700, 42000 },
+  { "iso_b5_176x250mm", 17600, 25000 },
+  { "jis_b5_182x257mm", 18200, 25700 },
+  { "na_executive_7.25x10.5in", 18415, 26670 },
+  { "na_index-4x6_4x6in", 10160, 15240 },
+  { "na_5x7_5x7in", 12700, 17780 },
+  { "iso_dl_110x220mm", 11000, 22000 },
+  { "na_number-10_4.125x9.5in", 10477, 24130 },
+  { "iso_c5_162x229mm", 16200, 22900 },
+  { "na_monarch_3.875x7.5in", 9843, 19050 },
+  { "iso_a6_105x148mm", 10500, 14800 },
+  { "na_ledger_11x17in", 27940, 43180 },
+  { "jpn_hagaki_100x148mm", 10000, 14800 },
+  { "om_small-photo_100x150mm", 10000, 15000 },
+  { "roc_16k_7.75x10.75in", 19685, 27305 },
+  { "na_govt-letter_8x10in", 20320, 25400 }
+};
+
+static const char * const bench_types[] =
+{
+  "stationery", "stationery-heavyweight", "stationery-letterhead",
+  "stationery-recycled", "photographic-glossy", "photographic-matte",
+  "envelope", "labels", "transparency", "cardstock"
+};
+
+static const char * const bench_sources[] =
+{
+  "auto", "main", "manual", "tray-1", "tray-2", "tray-3", "by-pass-tray",
+  "envelope"
+};
+
+static const char * const bench_formats[] =
+{
+  "application/octet-stream", "application/pdf", "application/postscript",
+  "image/pwg-raster", "image/urf", "application/PCLm",
+  "application/vnd.hp-pcl", "image/jpeg"
+};
+
+#define BENCH_COUNT(a) (int)(sizeof(a) / sizeof(a[0]))
+
+
+static void
+bench_add_keywords(ipp_t *attrs,
+		   ipp_tag_t tag,
+		   const char *name,
+		   const char * const *values,
+		   int num_values,
+		   int first,
+		   int count)
+{
+  const char *v[64];
+  int i;
+
+  if (count > num_values)
+    count = num_values;
+  for (i = 0; i < count; i ++)
+    v[i] = values[(first + i) % num_values];
+  ippAddStrings(attrs, IPP_TAG_PRINTER, tag, name, count, NULL, v);
+}
+
+
+// Attributes of a generated cluster member, the members differ in
+// their features depending on n
+static ipp_t *
+bench_member(int n)
+{
+  ipp_t *attrs = ippNew(), *col;
+  ipp_attribute_t *attr;
+  const char *names[BENCH_COUNT(bench_sizes)];
+  int i, j, k, num_sizes, num_types, num_sources, num_cols, color, duplex;
+  int xres[3] = { 300, 600, 1200 }, yres[3] = { 300, 600, 1200 };
+  int finishings[] = { 3, 4, 20, 21, 22, 50, 74 };
+  int qualities[] = { 3, 4, 5 };
+  char model[64];
+
+  color = (n % 2 == 0);
+  duplex = (n % 3 != 0);
+  num_sizes = 8 + n % 13;
+  num_types = 2 + n % 8;
+  num_sources = 2 + n % 6;
+
+  snprintf(model, sizeof(model), "Bench Printer Model %d", n % 7);
+  ippAddString(attrs, IPP_TAG_PRINTER, IPP_TAG_TEXT, "printer-make-and-model",
+	       NULL, model);
+  ippAddBoolean(attrs, IPP_TAG_PRINTER, "color-supported", color);
+  ippAddInteger(attrs, IPP_TAG_PRINTER, IPP_TAG_INTEGER, "pages-per-minute",
+		20 + (n * 7) % 40);
+
+  bench_add_keywords(attrs, IPP_TAG_MIMETYPE, "document-format-supported",
+		     bench_formats, BENCH_COUNT(bench_formats), n % 3,
+		     4 + n % 5);
+  bench_add_keywords(attrs, IPP_TAG_KEYWORD, "media-type-supported",
+		     bench_types, BENCH_COUNT(bench_types), n, num_types);
+  bench_add_keywords(attrs, IPP_TAG_KEYWORD, "media-source-supported",
+		     bench_sources, BENCH_COUNT(bench_sources), n, num_sources);
+  if (color)
+    ippAddStrings(attrs, IPP_TAG_PRINTER, IPP_TAG_KEYWORD,
+		  "print-color-mode-supported", 3, NULL,
+		  (const char *[]){ "auto", "monochrome", "color" });
+  else
+    ippAddStrings(attrs, IPP_TAG_PRINTER, IPP_TAG_KEYWORD,
+		  "print-color-mode-supported", 2, NULL,
+		  (const char *[]){ "auto", "monochrome" });
+  if (duplex)
+    ippAddStrings(attrs, IPP_TAG_PRINTER, IPP_TAG_KEYWORD, "sides-supported",
+		  3, NULL,
+		  (const char *[]){ "one-sided", "two-sided-long-edge",
+				    "two-sided-short-edge" });
+  else
+    ippAddString(attrs, IPP_TAG_PRINTER, IPP_TAG_KEYWORD, "sides-supported",
+		 NULL, "one-sided");
+  ippAddStrings(attrs, IPP_TAG_PRINTER, IPP_TAG_KEYWORD, "urf-supported",
+		4, NULL,
+		(const char *[]){ "V1.4", "CP1", (color ? "SRGB24" : "W8"),
+				  (n % 2 ? "RS300-600" : "RS600") });
+  ippAddStrings(attrs, IPP_TAG_PRINTER, IPP_TAG_KEYWORD,
+		"pwg-raster-document-type-supported", 2, NULL,
+		(const char *[]){ "sgray_8", (color ? "srgb_8" : "black_1") });
+  ippAddStrings(attrs, IPP_TAG_PRINTER, IPP_TAG_KEYWORD,
+		"output-bin-supported", 1 + n % 3, NULL,
+		(const char *[]){ "face-down", "face-up", "stacker-1" });
+
+  for (i = 0; i < num_sizes; i ++)
+    names[i] = bench_sizes[(n + i) % BENCH_COUNT(bench_sizes)].name;
+  ippAddStrings(attrs, IPP_TAG_PRINTER, IPP_TAG_KEYWORD, "media-supported",
+		num_sizes, NULL, names);
+  ippAddString(attrs, IPP_TAG_PRINTER, IPP_TAG_KEYWORD, "media-default",
+	       NULL, names[0]);
+
+  attr = ippAddCollections(attrs, IPP_TAG_PRINTER, "media-size-supported",
+			   num_sizes + (n % 4 == 0), NULL);
+  for (i = 0; i < num_sizes; i ++)
+  {
+    j = (n + i) % BENCH_COUNT(bench_sizes);
+    col = create_media_size(bench_sizes[j].x, bench_sizes[j].y);
+    ippSetCollection(attrs, &attr, i, col);
+    ippDelete(col);
+  }
+  if (n % 4 == 0)
+  {
+    // Custom page sizes
+    col = create_media_range(7620, 21590 + n * 10, 12700, 35560 + n * 10);
+    ippSetCollection(attrs, &attr, i, col);
+    ippDelete(col);
+  }
+
+  // media-col-database: every size in every media type, borderless
+  // sizes for the photo printers, makes several hundred entries for the
+  // bigger members like on real MFPs
+  num_cols = num_sizes * num_types * (1 + (color && n % 4 == 2));
+  attr = ippAddCollections(attrs, IPP_TAG_PRINTER, "media-col-database",
+			   num_cols, NULL);
+  for (i = 0, k = 0; i < num_sizes; i ++)
+    for (j = 0; j < num_types; j ++)
+    {
+      const bench_size_t *size =
+	&bench_sizes[(n + i) % BENCH_COUNT(bench_sizes)];
+      col = create_media_col(size->x, size->y, 423, 423, 423, 423,
+			     (char *)bench_sources[(n + j) %
+						   BENCH_COUNT(bench_sources)],
+			     (char *)bench_types[(n + j) %
+						 BENCH_COUNT(bench_types)]);
+      ippSetCollection(attrs, &attr, k ++, col);
+      ippDelete(col);
+      if (color && n % 4 == 2)
+      {
+	col = create_media_col(size->x, size->y, 0, 0, 0, 0,
+			       (char *)bench_sources[(n + j) %
+						     BENCH_COUNT(bench_sources)],
+			       (char *)bench_types[(n + j) %
+						   BENCH_COUNT(bench_types)]);
+	ippSetCollection(attrs, &attr, k ++, col);
+	ippDelete(col);
+      }
+    }
+  col = create_media_col(bench_sizes[n % BENCH_COUNT(bench_sizes)].x,
+			 bench_sizes[n % BENCH_COUNT(bench_sizes)].y,
+			 423, 423, 423, 423, "auto", "stationery");
+  ippAddCollection(attrs, IPP_TAG_PRINTER, "media-col-default", col);
+  ippDelete(col);
+
+  ippAddIntegers(attrs, IPP_TAG_PRINTER, IPP_TAG_INTEGER,
+		 "media-bottom-margin-supported", 2, (int[]){ 0, 423 + n % 3 });
+  ippAddIntegers(attrs, IPP_TAG_PRINTER, IPP_TAG_INTEGER,
+		 "media-left-margin-supported", 2, (int[]){ 0, 423 + n % 3 });
+  ippAddIntegers(attrs, IPP_TAG_PRINTER, IPP_TAG_INTEGER,
+		 "media-right-margin-supported", 2, (int[]){ 0, 423 + n % 3 });
+  ippAddIntegers(attrs, IPP_TAG_PRINTER, IPP_TAG_INTEGER,
+		 "media-top-margin-supported", 2, (int[]){ 0, 423 + n % 3 });
+
+  ippAddResolutions(attrs, IPP_TAG_PRINTER, "printer-resolution-supported",
+		    1 + n % 3, IPP_RES_PER_INCH, xres, yres);
+  ippAddResolution(attrs, IPP_TAG_PRINTER, "printer-resolution-default",
+		   IPP_RES_PER_INCH, xres[n % 2], yres[n % 2]);
+  ippAddResolutions(attrs, IPP_TAG_PRINTER,
+		    "pwg-raster-document-resolution-supported",
+		    1 + n % 2, IPP_RES_PER_INCH, xres, yres);
+  ippAddIntegers(attrs, IPP_TAG_PRINTER, IPP_TAG_ENUM, "finishings-supported",
+		 1 + n % BENCH_COUNT(finishings), finishings);
+  ippAddIntegers(attrs, IPP_TAG_PRINTER, IPP_TAG_ENUM,
+		 "print-quality-supported", 1 + n % 3, qualities);
+  ippAddString(attrs, IPP_TAG_PRINTER, IPP_TAG_KEYWORD,
+	       "print-color-mode-default", NULL,
+	       (color ? "color" : "monochrome"));
+  ippAddString(attrs, IPP_TAG_PRINTER, IPP_TAG_KEYWORD, "sides-default",
+	       NULL, "one-sided");
+  ippAddString(attrs, IPP_TAG_PRINTER, IPP_TAG_KEYWORD, "output-bin-default",
+	       NULL, "face-down");
+
+  return (attrs);
+}
+
+
+static ipp_t *
+bench_read_file(const char *filename)
+{
+  cups_file_t *fp;
+  ipp_t *attrs;
+
+  if ((fp = cupsFileOpen(filename, "r")) == NULL)
+  {
+    fprintf(stderr, "bench-cluster-merge: Unable to open %s: %s\n", filename,
+	    strerror(errno));
+    return (NULL);
+  }
+  attrs = ippNew();
+  if (ippReadIO(fp, (ipp_iocb_t)cupsFileRead, 1, NULL, attrs) != IPP_STATE_DATA)
+  {
+    fprintf(stderr, "bench-cluster-merge: %s is not an IPP message\n",
+	    filename);
+    ippDelete(attrs);
+    attrs = NULL;
+  }
+  cupsFileClose(fp);
+
+  return (attrs);
+}
+
+
+static int
+bench_record(const char *uri,
+	     const char *filename)
+{
+  cups_file_t *fp;
+  ipp_t *attrs;
+  int ret = 0;
+
+  if ((attrs = cfGetPrinterAttributes(uri, NULL, 0, NULL, 0, 0)) == NULL)
+  {
+    fprintf(stderr, "bench-cluster-merge: Unable to get the attributes of %s\n",
+	    uri);
+    return (1);
+  }
+  if ((fp = cupsFileOpen(filename, "w")) == NULL)
+  {
+    fprintf(stderr, "bench-cluster-merge: Unable to create %s: %s\n",
+	    filename, strerror(errno));
+    ippDelete(attrs);
+    return (1);
+  }
+  ippSetState(attrs, IPP_STATE_IDLE);
+  if (ippWriteIO(fp, (ipp_iocb_t)cupsFileWrite, 1, NULL, attrs) !=
+      IPP_STATE_DATA)
+  {
+    fprintf(stderr, "bench-cluster-merge: Unable to write %s\n", filename);
+    ret = 1;
+  }
+  cupsFileClose(fp);
+  ippDelete(attrs);
+
+  return (ret);
+}
+
+
+// Set up the cluster from the first num_members of the member
+// attributes, cycling through them if there are less
+static void
+bench_setup_cluster(ipp_t **members,
+		    int num_attrs,
+		    int num_members)
+{
+  remote_printer_t *p;
+  char uri[256];
+  int i;
+
+  remote_printers = cupsArrayNew(NULL, NULL);
+  for (i = 0; i < num_members; i ++)
+  {
+    p = (remote_printer_t *)calloc(1, sizeof(remote_printer_t));
+    snprintf(uri, sizeof(uri), "ipp://bench-%d.local:631/ipp/print", i);
+    p->uri = strdup(uri);
+    p->queue_name = strdup(BENCH_CLUSTER);
+    p->status = STATUS_CONFIRMED;
+    p->prattrs = members[i % num_attrs];
+    p->prattrs_full = 1;
+    cupsArrayAdd(remote_printers, p);
+  }
+}
+
+
+static void
+bench_free_cluster(void)
+{
+  remote_printer_t *p;
+
+  for (p = (remote_printer_t *)cupsArrayFirst(remote_printers);
+       p; p = (remote_printer_t *)cupsArrayNext(remote_printers))
+  {
+    free(p->uri);
+    free(p->queue_name);
+    free(p);
+  }
+  cupsArrayDelete(remote_printers);
+  remote_printers = NULL;
+}
+
+
+typedef enum bench_func_e
+{
+  BENCH_KEYWORD,
+  BENCH_MEDIASIZE,
+  BENCH_MEDIADATABASE,
+  BENCH_RESOLUTION,
+  BENCH_MERGE_ALL,
+  BENCH_CONFLICTS,
+  BENCH_DEFAULTS,
+  BENCH_NUM_FUNCS
+} bench_func_t;
+
+static const char * const bench_func_names[] =
+{
+  "add_keyword_attributes",
+  "add_mediasize_attributes",
+  "add_mediadatabase_attributes",
+  "add_resolution_attributes",
+  "get_cluster_attributes",
+  "generate_cluster_conflicts",
+  "get_cluster_default_attributes"
+};
+
+
+static void
+bench_run(bench_func_t func,
+	  int num_members,
+	  int iterations)
+{
+  ipp_t *merged = NULL, *work;
+  cups_array_t *conflicts;
+  char default_pagesize[32];
+  const char *default_color;
+  struct timespec start, end;
+  double elapsed = 0.0;
+  size_t allocs = 0, before;
+  int i;
+
+  if (func == BENCH_CONFLICTS || func == BENCH_DEFAULTS)
+    merged = get_cluster_attributes(BENCH_CLUSTER);
+
+  for (i = 0; i < iterations; i ++)
+  {
+    // The input for the functions which modify the merged attributes
+    // gets prepared outside of the measurement
+    work = ippNew();
+    if (func == BENCH_DEFAULTS)
+      ippCopyAttributes(work, merged, 0, NULL, NULL);
+
+    before = __atomic_load_n(&bench_allocs, __ATOMIC_RELAXED);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    switch (func)
+    {
+      case BENCH_KEYWORD:
+	  add_keyword_attributes(BENCH_CLUSTER, &work);
+	  break;
+      case BENCH_MEDIASIZE:
+	  add_mediasize_attributes(BENCH_CLUSTER, &work);
+	  break;
+      case BENCH_MEDIADATABASE:
+	  add_mediadatabase_attributes(BENCH_CLUSTER, &work);
+	  break;
+      case BENCH_RESOLUTION:
+	  add_resolution_attributes(BENCH_CLUSTER, &work);
+	  break;
+      case BENCH_MERGE_ALL:
+	  ippDelete(work);
+	  work = get_cluster_attributes(BENCH_CLUSTER);
+	  break;
+      case BENCH_CONFLICTS:
+	  conflicts = generate_cluster_conflicts(BENCH_CLUSTER, merged);
+	  cupsArrayDelete(conflicts);
+	  break;
+      case BENCH_DEFAULTS:
+	  default_pagesize[0] = '\0';
+	  default_color = NULL;
+	  get_cluster_default_attributes(&work, BENCH_CLUSTER,
+					 default_pagesize, &default_color);
+	  break;
+      default:
+	  break;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    allocs += __atomic_load_n(&bench_allocs, __ATOMIC_RELAXED) - before;
+    elapsed += (end.tv_sec - start.tv_sec) * 1e6 +
+      (end.tv_nsec - start.tv_nsec) / 1e3;
+    ippDelete(work);
+  }
+
+  ippDelete(merged);
+
+  printf("%-32s %7d %12.1f %12.1f\n", bench_func_names[func], num_members,
+	 elapsed / iterations, (double)allocs / iterations);
+}
+
+
+int
+main(int argc,
+     char *argv[])
+{
+  ipp_t **members;
+  int num_attrs = 0, iterations = 100, recorded, i;
+  bench_func_t func;
+  static const int cluster_sizes[] = { 2, 10, 50 };
+  int max_members = cluster_sizes[BENCH_COUNT(cluster_sizes) - 1];
+
+  if (argc == 4 && !strcmp(argv[1], "--record"))
+    return (bench_record(argv[2], argv[3]));
+
+  members = (ipp_t **)calloc(argc + max_members, sizeof(ipp_t *));
+  for (i = 1; i < argc; i ++)
+  {
+    if (!strcmp(argv[i], "-n") && i + 1 < argc)
+    {
+      if ((iterations = atoi(argv[++ i])) <= 0)
+	iterations = 1;
+    }
+    else if (argv[i][0] == '-')
+    {
+      fprintf(stderr,
+	      "Usage: bench-cluster-merge [-n ITERATIONS] [FILE.ipp ...]\n"
+	      "       bench-cluster-merge --record PRINTER-URI FILE.ipp\n");
+      return (1);
+    }
+    else if ((members[num_attrs] = bench_read_file(argv[i])) != NULL)
+      num_attrs ++;
+    else
+      return (1);
+  }
+  if ((recorded = num_attrs) == 0)
+    for (; num_attrs < max_members; num_attrs ++)
+      members[num_attrs] = bench_member(num_attrs);
+
+  printf("Cluster merge benchmark, %d iterations, %d %s member attribute sets\n\n",
+	 iterations, num_attrs, (recorded ? "recorded" : "generated"));
+  printf("%-32s %7s %12s %12s\n", "Function", "Members", "usec/call",
+	 "allocs/call");
+  for (i = 0; i < BENCH_COUNT(cluster_sizes); i ++)
+  {
+    bench_setup_cluster(members, num_attrs, cluster_sizes[i]);
+    for (func = 0; func < BENCH_NUM_FUNCS; func ++)
+      bench_run(func, cluster_sizes[i], iterations);
+    bench_free_cluster();
+    printf("\n");
+  }
+
+  for (i = 0; i < num_attrs; i ++)
+    ippDelete(members[i]);
+  free(members);
+
+  return (0);
+}
@@ -0,0 +1,425 @@
+//
+// Simulation of the queue scheduler of cups-browsed on a virtual clock
+//
+// Copyright 2024 OpenPrinting
+//
+// Licensed under Apache License v2.0.  See the file "LICENSE" for more
+// information.
+//
+// Usage:
+//
+//   sim-queue-scheduler [-p PRINTERS] [-H HOSTS] [-l LEGACY-PERCENT]
+//                       [-c CREATION-SECONDS] [-m MAX-PER-CALL]
+//                       [-w PAUSE-SECONDS] [-t BROWSE-TIMEOUT]
+//
+// Runs update_cups_queues() and recheck_timer() of cups-browsed on a
+// synthetic fleet of remote printers, with a virtual clock and virtual
+// timers in place of time() and the GLib main loop. Creating and
+// removing the CUPS queues is only counted, a creation takes
+// CREATION-SECONDS of virtual time. As virtual time jumps from one
+// timer to the next, hours of scheduling run in milliseconds, and the
+// results are the same on every run.
+//
+// Three phases are simulated: all printers appear, every second one
+// disappears, and the legacy CUPS browsing printers among the rest
+// are not broadcast any more so that their BrowseTimeout expires. For
+// each phase we report the virtual time until the queues converged,
+// the timers set and removed by the scheduler, the calls of
+// update_cups_queues() (slices) with the queue updates started per
+// slice, and the real time taken.
+//
+
+// The scheduler is static, so we build the daemon's source into this
+// program, with its main() renamed
+#define main cups_browsed_main
+#include "../daemon/cups-browsed.c"
+#undef main
+
+
+// Give up on a phase which did not converge after a week
+#define SIM_HORIZON (7 * 24 * 60 * 60)
+
+typedef struct sim_timer_s
+{
+  guint id;
+  time_t due;
+  GSourceFunc func;
+  gpointer data;
+} sim_timer_t;
+
+typedef struct sim_stats_s
+{
+  int timers_added;    // By the scheduler
+  int timers_removed;  // By the scheduler
+  int slices;          // Calls of update_cups_queues()
+  int updates;         // Queue creations and removals started
+  int max_per_slice;
+  int slice_updates;   // In the current slice
+} sim_stats_t;
+
+typedef enum sim_phase_e
+{
+  SIM_APPEAR,
+  SIM_DISAPPEAR,
+  SIM_BROWSE_TIMEOUT
+} sim_phase_t;
+
+static const char * const sim_phase_names[] =
+{
+  "appear",
+  "disappear",
+  "browse-timeout"
+};
+
+static time_t sim_clock = 1700000000; // Any fixed start will do
+static cups_array_t *sim_timers = NULL;
+static guint sim_next_id = 1;
+static int sim_creation_time = 0;
+static sim_stats_t sim_stats;
+
+
+static int
+sim_timer_cmp(void *va,
+	      void *vb,
+	      void *data)
+{
+  sim_timer_t *a = (sim_timer_t *)va;
+  sim_timer_t *b = (sim_timer_t *)vb;
+
+  if (a->due != b->due)
+    return (a->due < b->due ? -1 : 1);
+  return (a->id < b->id ? -1 : (a->id > b->id ? 1 : 0));
+}
+
+
+static guint
+sim_timer_add(time_t due,
+	      GSourceFunc func,
+	      gpointer data)
+{
+  sim_timer_t *t;
+
+  if ((t = (sim_timer_t *)calloc(1, sizeof(sim_timer_t))) == NULL)
+    return (0);
+  t->id = sim_next_id ++;
+  t->due = due;
+  t->func = func;
+  t->data = data;
+  cupsArrayAdd(sim_timers, t);
+
+  return (t->id);
+}
+
+
+static sim_timer_t *
+sim_timer_find(guint id)
+{
+  sim_timer_t *t;
+
+  for (t = (sim_timer_t *)cupsArrayFirst(sim_timers); t;
+       t = (sim_timer_t *)cupsArrayNext(sim_timers))
+    if (t->id == id)
+      return (t);
+
+  return (NULL);
+}
+
+
+//
+// The clock, timers, and queue operations handed to the scheduler
+//
+
+static time_t
+sim_now(void)
+{
+  return (sim_clock);
+}
+
+
+static guint
+sim_timeout_add_seconds(guint interval,
+			GSourceFunc func,
+			gpointer data)
+{
+  sim_stats.timers_added ++;
+  return (sim_timer_add(sim_clock + interval, func, data));
+}
+
+
+static gboolean
+sim_source_remove(guint id)
+{
+  sim_timer_t *t;
+
+  if ((t = sim_timer_find(id)) == NULL)
+    return (FALSE);
+  cupsArrayRemove(sim_timers, t);
+  free(t);
+  sim_stats.timers_removed ++;
+
+  return (TRUE);
+}
+
+
+// What create_queue() does to the entry when it is done, sim_clock is
+// the time when the worker thread finishes
+static gboolean
+sim_create_done(gpointer data)
+{
+  create_args_t *arg = (create_args_t *)data;
+  remote_printer_t *p;
+
+  for (p = (remote_printer_t *)cupsArrayFirst(remote_printers); p;
+       p = (remote_printer_t *)cupsArrayNext(remote_printers))
+    if (p->called && !strcmp(p->queue_name, arg->queue))
+      break;
+
+  if (p)
+  {
+    if (p->status == STATUS_TO_BE_CREATED)
+    {
+      cups_queues_updated ++;
+      p->status = STATUS_CONFIRMED;
+      p->timeout = (p->is_legacy ? sim_clock + BrowseTimeout : (time_t) -1);
+    }
+    p->called = 0;
+    // create_queue() defers this to the main loop
+    if (p->timeout != (time_t) -1)
+      recheck_timer();
+  }
+
+  host_request_done(arg->host);
+  free(arg->uri);
+  free(arg->queue);
+  free(arg->host);
+  free(arg);
+
+  return (FALSE);
+}
+
+
+static int
+sim_create_queue(create_args_t *arg)
+{
+  sim_stats.updates ++;
+  sim_stats.slice_updates ++;
+  sim_timer_add(sim_clock + sim_creation_time, sim_create_done, arg);
+
+  return (1);
+}
+
+
+static int
+sim_remove_queue(remote_printer_t *p)
+{
+  sim_stats.updates ++;
+  sim_stats.slice_updates ++;
+  cups_queues_updated ++;
+
+  return (1);
+}
+
+
+//
+// The fleet
+//
+
+static void
+sim_add_printers(int num_printers,
+		 int num_hosts,
+		 int legacy_percent)
+{
+  remote_printer_t *p;
+  char buf[256];
+  int i;
+
+  for (i = 0; i < num_printers; i ++)
+  {
+    p = (remote_printer_t *)calloc(1, sizeof(remote_printer_t));
+    snprintf(buf, sizeof(buf), "sim-printer-%d", i);
+    p->queue_name = strdup(buf);
+    snprintf(buf, sizeof(buf), "sim-host-%d.local", i % num_hosts);
+    p->host = strdup(buf);
+    snprintf(buf, sizeof(buf), "ipp://sim-host-%d.local:631/printers/sim-printer-%d",
+	     i % num_hosts, i);
+    p->uri = strdup(buf);
+    p->port = 631;
+    p->is_legacy = (i % 100 < legacy_percent);
+    p->status = STATUS_TO_BE_CREATED;
+    p->timeout = sim_clock + TIMEOUT_IMMEDIATELY;
+    cupsArrayAdd(remote_printers, p);
+  }
+}
+
+
+// Mark every second printer as gone, as the DNS-SD browser does
+static void
+sim_remove_printers(void)
+{
+  remote_printer_t *p;
+  int i;
+
+  for (p = (remote_printer_t *)cupsArrayFirst(remote_printers), i = 0; p;
+       p = (remote_printer_t *)cupsArrayNext(remote_printers), i ++)
+    if (i % 2)
+    {
+      p->status = STATUS_DISAPPEARED;
+      p->timeout = sim_clock + TIMEOUT_IMMEDIATELY;
+    }
+}
+
+
+static int
+sim_converged(sim_phase_t phase)
+{
+  remote_printer_t *p;
+
+  for (p = (remote_printer_t *)cupsArrayFirst(remote_printers); p;
+       p = (remote_printer_t *)cupsArrayNext(remote_printers))
+    if (p->called || p->status != STATUS_CONFIRMED ||
+	(phase == SIM_BROWSE_TIMEOUT && p->is_legacy))
+      return (0);
+
+  return (1);
+}
+
+
+// Let the timers fire until the phase has converged
+static void
+sim_run(sim_phase_t phase)
+{
+  sim_timer_t *t;
+  guint id;
+  time_t start = sim_clock;
+  struct timespec real_start, real_end;
+  int converged, pending = 0;
+  remote_printer_t *p;
+
+  memset(&sim_stats, 0, sizeof(sim_stats));
+  clock_gettime(CLOCK_MONOTONIC, &real_start);
+
+  // Discovery calls recheck_timer() after changing the entries
+  recheck_timer();
+  while (!(converged = sim_converged(phase)) &&
+	 (t = (sim_timer_t *)cupsArrayFirst(sim_timers)) != NULL &&
+	 t->due - start <= SIM_HORIZON)
+  {
+    if (t->due > sim_clock)
+      sim_clock = t->due;
+    id = t->id;
+    if (t->func == update_cups_queues)
+    {
+      sim_stats.slices ++;
+      sim_stats.slice_updates = 0;
+      t->func(t->data);
+      if (sim_stats.slice_updates > sim_stats.max_per_slice)
+	sim_stats.max_per_slice = sim_stats.slice_updates;
+    }
+    else
+      t->func(t->data);
+    // A one-shot GLib source goes away after its callback, unless the
+    // callback removed it already
+    if ((t = sim_timer_find(id)) != NULL)
+    {
+      cupsArrayRemove(sim_timers, t);
+      free(t);
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &real_end);
+
+  if (!converged)
+    for (p = (remote_printer_t *)cupsArrayFirst(remote_printers); p;
+	 p = (remote_printer_t *)cupsArrayNext(remote_printers))
+      if (p->called || p->status != STATUS_CONFIRMED ||
+	  (phase == SIM_BROWSE_TIMEOUT && p->is_legacy))
+	pending ++;
+
+  printf("%-16s %10ld %7d %7d %7d %8d %9.2f %9d %10.1f%s\n",
+	 sim_phase_names[phase], (long)(sim_clock - start),
+	 sim_stats.timers_added, sim_stats.timers_removed, sim_stats.slices,
+	 sim_stats.updates,
+	 (sim_stats.slices ? (double)sim_stats.updates / sim_stats.slices : 0.0),
+	 sim_stats.max_per_slice,
+	 (real_end.tv_sec - real_start.tv_sec) * 1e3 +
+	 (real_end.tv_nsec - real_start.tv_nsec) / 1e6,
+	 (converged ? "" : " (not converged)"));
+  if (pending)
+    printf("  %d printers still pending, %d timers set\n", pending,
+	   cupsArrayCount(sim_timers));
+}
+
+
+int
+main(int argc,
+     char *argv[])
+{
+  int num_printers = 1000, num_hosts = 100, legacy_percent = 10, i;
+
+  for (i = 1; i < argc; i ++)
+  {
+    if (!strcmp(argv[i], "-p") && i + 1 < argc)
+      num_printers = atoi(argv[++ i]);
+    else if (!strcmp(argv[i], "-H") && i + 1 < argc)
+      num_hosts = atoi(argv[++ i]);
+    else if (!strcmp(argv[i], "-l") && i + 1 < argc)
+      legacy_percent = atoi(argv[++ i]);
+    else if (!strcmp(argv[i], "-c") && i + 1 < argc)
+      sim_creation_time = atoi(argv[++ i]);
+    else if (!strcmp(argv[i], "-m") && i + 1 < argc)
+      update_cups_queues_max_per_call = atoi(argv[++ i]);
+    else if (!strcmp(argv[i], "-w") && i + 1 < argc)
+      pause_between_cups_queue_updates = atoi(argv[++ i]);
+    else if (!strcmp(argv[i], "-t") && i + 1 < argc)
+      BrowseTimeout = atoi(argv[++ i]);
+    else
+    {
+      fprintf(stderr,
+	      "Usage: sim-queue-scheduler [-p PRINTERS] [-H HOSTS] [-l LEGACY-PERCENT]\n"
+	      "                           [-c CREATION-SECONDS] [-m MAX-PER-CALL]\n"
+	      "                           [-w PAUSE-SECONDS] [-t BROWSE-TIMEOUT]\n");
+      return (1);
+    }
+  }
+  if (num_printers < 1)
+    num_printers = 1;
+  if (num_hosts < 1)
+    num_hosts = 1;
+  if (sim_creation_time < 0)
+    sim_creation_time = 0;
+
+  scheduler.now = sim_now;
+  scheduler.timeout_add_seconds = sim_timeout_add_seconds;
+  scheduler.source_remove = sim_source_remove;
+  scheduler.create_queue = sim_create_queue;
+  scheduler.remove_queue = sim_remove_queue;
+
+  // The rate limit per host runs on the real monotonic clock, only the
+  // limit of requests in progress is deterministic
+  HttpRequestRatePerHost = 0;
+
+  // recheck_timer() only sets timers when there is a main loop, it
+  // never runs, the timers are ours
+  gmainloop = g_main_loop_new(NULL, FALSE);
+  sim_timers = cupsArrayNew3(sim_timer_cmp, NULL, NULL, 0, NULL, NULL);
+  remote_printers = cupsArrayNew(NULL, NULL);
+
+  printf("Queue scheduler simulation, %d printers on %d hosts, %d%% legacy, creation %d sec,\n"
+	 "%d updates per call, %d sec pause, BrowseTimeout %d sec, %d requests per host\n\n",
+	 num_printers, num_hosts, legacy_percent, sim_creation_time,
+	 update_cups_queues_max_per_call, pause_between_cups_queue_updates,
+	 BrowseTimeout, HttpMaxRequestsPerHost);
+  printf("%-16s %10s %7s %7s %7s %8s %9s %9s %10s\n", "Phase", "Virtual s",
+	 "Timers+", "Timers-", "Slices", "Updates", "Avg/slice", "Max/slice",
+	 "Real ms");
+
+  sim_add_printers(num_printers, num_hosts, legacy_percent);
+  sim_run(SIM_APPEAR);
+  sim_remove_printers();
+  sim_run(SIM_DISAPPEAR);
+  sim_run(SIM_BROWSE_TIMEOUT);
+
+  g_main_loop_unref(gmainloop);
+
+  return (0);
+}
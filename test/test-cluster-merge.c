@@ -0,0 +1,133 @@
+//
+// Unit tests for merging the capabilities of the members of a cluster
+// in cups-browsed
+//
+// Copyright 2024 OpenPrinting
+//
+// Licensed under Apache License v2.0.  See the file "LICENSE" for more
+// information.
+//
+// Usage:
+//
+//   test-cluster-merge
+//
+// Runs the cluster merge functions of cups-browsed on small clusters
+// with known attributes and checks the merged result, without network
+// or CUPS daemon. Run by "make check".
+//
+
+// The merge functions are static, so we build the daemon's source into
+// this program, with its main() renamed
+#define main cups_browsed_main
+#include "../daemon/cups-browsed.c"
+#undef main
+
+
+#define TEST_CLUSTER "test"
+
+
+// Set up the cluster from the given member attributes
+static void
+test_setup_cluster(ipp_t **members,
+		   int num_members)
+{
+  remote_printer_t *p;
+  char uri[256];
+  int i;
+
+  remote_printers = cupsArrayNew(NULL, NULL);
+  for (i = 0; i < num_members; i ++)
+  {
+    p = (remote_printer_t *)calloc(1, sizeof(remote_printer_t));
+    snprintf(uri, sizeof(uri), "ipp://test-%d.local:631/ipp/print", i);
+    p->uri = strdup(uri);
+    p->queue_name = strdup(TEST_CLUSTER);
+    p->status = STATUS_CONFIRMED;
+    p->prattrs = members[i];
+    p->prattrs_full = 1;
+    cupsArrayAdd(remote_printers, p);
+  }
+}
+
+
+static void
+test_free_cluster(void)
+{
+  remote_printer_t *p;
+
+  for (p = (remote_printer_t *)cupsArrayFirst(remote_printers);
+       p; p = (remote_printer_t *)cupsArrayNext(remote_printers))
+  {
+    ippDelete(p->prattrs);
+    free(p->uri);
+    free(p->queue_name);
+    free(p);
+  }
+  cupsArrayDelete(remote_printers);
+  remote_printers = NULL;
+}
+
+
+// Members can report their resolutions in dots per cm, the merged ones
+// must all be in DPI, and resolutions of 0 must not show up
+static int
+test_resolutions(void)
+{
+  ipp_t *members[2], *merged = ippNew();
+  ipp_attribute_t *attr;
+  ipp_res_t units;
+  int dpcm[2] = { 118, 236 }; // 300 and 600 DPI
+  int dpi[2] = { 600, 0 };
+  int i, x, y, ok = 1;
+
+  members[0] = ippNew();
+  ippAddResolutions(members[0], IPP_TAG_PRINTER,
+		    "printer-resolution-supported", 2, IPP_RES_PER_CM,
+		    dpcm, dpcm);
+  members[1] = ippNew();
+  ippAddResolutions(members[1], IPP_TAG_PRINTER,
+		    "printer-resolution-supported", 2, IPP_RES_PER_INCH,
+		    dpi, dpi);
+  test_setup_cluster(members, 2);
+
+  add_resolution_attributes(TEST_CLUSTER, &merged);
+  if ((attr = ippFindAttribute(merged, "printer-resolution-supported",
+			       IPP_TAG_RESOLUTION)) == NULL)
+    ok = 0;
+  else
+    for (i = 0; i < ippGetCount(attr); i ++)
+    {
+      x = ippGetResolution(attr, i, &y, &units);
+      if (units != IPP_RES_PER_INCH || x < 299 || y < 299)
+      {
+	fprintf(stderr, "test-cluster-merge: Merged resolution %dx%d%s\n",
+		x, y, (units == IPP_RES_PER_INCH ? "dpi" : "dpcm"));
+	ok = 0;
+      }
+    }
+
+  test_free_cluster();
+  ippDelete(merged);
+
+  return (ok);
+}
+
+
+int
+main(int argc,
+     char *argv[])
+{
+  int status = 0;
+
+  printf("add_resolution_attributes (dots per cm, zero values): ");
+  fflush(stdout);
+  if (test_resolutions())
+    puts("PASS");
+  else
+  {
+    puts("FAIL");
+    status = 1;
+  }
+
+  return (status);
+}